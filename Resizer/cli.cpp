@@ -0,0 +1,800 @@
+﻿// cli.cpp
+// resizer-cli: the window's transcode without the window.  Takes the same
+// settings the Start button collects, writes the output next to the input
+// (or into --out-dir) with the same <name>_<suffix>[-N].mp4 naming, and
+// reports on stdout as JSON lines:
+//
+//   {"event":"start", ...}        resolved settings
+//   {"event":"progress", ...}     at most every 1% or 500 ms
+//   {"event":"done", ...}         result and encode statistics
+//
+// --also adds outputs at other sizes, encoded in the same pass as the first
+// (one decode, one tone map, one subtitle render; a done line each).  --range
+// exports several stretches of the input in one forward pass, joined into the
+// one output or, with --split, each to a file of its own.
+// Given several inputs it runs them as a batch through the encode queue,
+// several at a time, and every event carries the job id.  With --watch it
+// becomes an ingestion service instead: every video that lands in the folder
+// is queued, once it has finished arriving, under the first --rule that
+// matches its name, until Ctrl+C.
+//
+// Diagnostics (the engine's debug log) go to stderr.  Ctrl+C cancels the
+// encode and removes the partial output.  Exit status is 0 on success, 1 if
+// the transcode failed, 2 for bad arguments or input and 130 if interrupted
+// (0 for --watch, for which Ctrl+C is the normal way to stop).
+//
+// Everything goes through the C API in resizer.h, as any other front end would.
+
+#include "platform.h"
+#include "resizer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <shellapi.h>
+#else
+#include <unistd.h>
+#endif
+
+extern "C" {
+#include <libavutil/log.h>
+}
+
+// ------------------------------ Options ------------------------------
+// An --also output.
+struct CliRendition {
+    double targetMB = 0.0;
+    int    scale    = 1;
+};
+
+// A --range.
+struct CliRange {
+    double start    = 0.0;
+    double end      = -1.0;              // < 0 = to the end of the file
+    double targetMB = 0.0;               // --split only; 0 = --size
+};
+
+struct CliOptions {
+    std::vector<const char*> inputs;
+    const char* output      = nullptr;   // explicit path; overrides suffix/out-dir
+    const char* outDir      = nullptr;
+    const char* suffix      = "RESIZED";
+    const char* extSubs     = nullptr;
+    double      targetMB    = 0.0;
+    int         scale       = 1;
+    std::vector<CliRendition> also;      // further outputs from the same pass
+    double      start       = 0.0;
+    double      end         = -1.0;      // < 0 = to the end of the file
+    std::vector<CliRange> ranges;        // replace --start/--end when given
+    bool        split       = false;     // a file per --range
+    int         audio       = -1;        // stream index; -1 = first audio stream
+    int         subs        = -1;        // stream index to burn in; -1 = none
+    bool        hdrToSdr    = false;
+    int         layout      = RZ_LAYOUT_RESERVE_MOOV;
+    bool        unbuffered  = false;
+    bool        hwaccel     = true;
+    bool        probeOnly   = false;
+    int         priority    = 0;
+    int         jobs        = 0;         // libx264 slots; 0 = the queue's default
+    const char* watchDir    = nullptr;
+    std::vector<const char*> rules;      // --rule specs, in order
+    double      stableSecs  = 5.0;
+    bool        existing    = false;
+    const char* statePath   = nullptr;
+};
+
+static void PrintUsage(FILE* f) {
+    fputs(
+        "usage: resizer-cli [options] --size MB <input>...\n"
+        "       resizer-cli [options] --watch DIR [--rule SPEC]... [--size MB]\n"
+        "\n"
+        "  -s, --size MB          target output size in megabytes (required)\n"
+        "      --scale 1|2|4      divide the resolution by this factor (default 1)\n"
+        "      --also MB[:SCALE]  another output at this size (and scale; default --scale),\n"
+        "                         encoded in the same pass; named <name>_<suffix>_<MB>MB.mp4.\n"
+        "                         Repeatable; single input only\n"
+        "      --start SECS       start of the range to encode (default 0)\n"
+        "      --end SECS         end of the range (default: end of file)\n"
+        "      --range S-E[@MB]   a stretch to export (E may be left out: end of file).\n"
+        "                         Repeatable, in place of --start/--end; the ranges are\n"
+        "                         read in one pass and joined, in time order, into the\n"
+        "                         output.  Single input only\n"
+        "      --split            write each --range to <name>_<suffix>_clipN.mp4, at its\n"
+        "                         own @MB (default --size), instead of joining them\n"
+        "      --audio N          audio stream index (default: first audio stream)\n"
+        "      --subs N           subtitle stream index to burn in\n"
+        "      --ext-subs PATH    external .srt/.ass/.ssa file to burn in\n"
+        "      --hdr-to-sdr       tone-map PQ/HLG sources to SDR BT.709\n"
+        "  -o, --output PATH      output file (overrides --suffix and --out-dir)\n"
+        "      --suffix TEXT      output name suffix (default RESIZED)\n"
+        "      --out-dir DIR      output folder (default: the input's folder)\n"
+        "      --layout L         faststart, reserve (default) or fragmented\n"
+        "      --unbuffered       bypass the OS cache for aligned output writes\n"
+        "      --no-hwaccel       decode in software even if NVDEC is present\n"
+        "      --probe            print the input's streams as JSON and exit\n"
+        "      --priority N       batch order for these inputs (higher first; default 0)\n"
+        "      --jobs N           libx264 encodes at once, besides the one on NVENC\n"
+        "                         (default: cores / 4)\n"
+        "\n"
+        "  -w, --watch DIR        queue every video that lands in DIR until Ctrl+C\n"
+        "      --rule SPEC        a preset for --watch: comma-separated match=GLOB, size=MB,\n"
+        "                         scale=N, suffix=TEXT, out-dir=DIR, priority=N,\n"
+        "                         hdr-to-sdr; unset keys come from the options above.\n"
+        "                         The first rule whose glob matches is used; --size adds\n"
+        "                         a catch-all rule after them\n"
+        "      --stable SECS      a file is complete once unchanged this long (default 5)\n"
+        "      --existing         also queue the videos already in DIR\n"
+        "      --state FILE       keep the watch queue in FILE across restarts\n"
+        "  -h, --help             show this help\n", f);
+}
+
+static bool ParseDouble(const char* s, double& out) {
+    char* e = nullptr;
+    out = strtod(s, &e);
+    return e != s && *e == 0;
+}
+static bool ParseInt(const char* s, int& out) {
+    char* e = nullptr;
+    long v = strtol(s, &e, 10);
+    out = (int)v;
+    return e != s && *e == 0;
+}
+// "MB" or "MB:SCALE"; the scale defaults to --scale, resolved after parsing.
+static bool ParseRendition(const char* s, CliRendition& out) {
+    char* e = nullptr;
+    out.targetMB = strtod(s, &e);
+    out.scale    = 0;
+    if (e == s || out.targetMB <= 0.0) return false;
+    if (*e == ':') return ParseInt(e + 1, out.scale);
+    return *e == 0;
+}
+// "START-END", "START-" or either with "@MB".
+static bool ParseRange(const char* s, CliRange& out) {
+    char* e = nullptr;
+    out.start = strtod(s, &e);
+    if (e == s || *e != '-' || out.start < 0.0) return false;
+    const char* p = e + 1;
+    if (*p && *p != '@') {
+        out.end = strtod(p, &e);
+        if (e == p || out.end <= out.start) return false;
+        p = e;
+    }
+    if (*p == '@') return ParseDouble(p + 1, out.targetMB) && out.targetMB > 0.0;
+    return *p == 0;
+}
+
+// Returns false (after printing why) on a bad command line.
+static bool ParseArgs(int argc, char** argv, CliOptions& o) {
+    for (int i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        const char* v = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        bool ok = true, usedValue = true;
+        if      (!strcmp(a, "-s") || !strcmp(a, "--size"))   ok = v && ParseDouble(v, o.targetMB);
+        else if (!strcmp(a, "--scale"))                      ok = v && ParseInt(v, o.scale);
+        else if (!strcmp(a, "--also"))                       { CliRendition r; ok = v && ParseRendition(v, r); if (ok) o.also.push_back(r); }
+        else if (!strcmp(a, "--start"))                      ok = v && ParseDouble(v, o.start);
+        else if (!strcmp(a, "--end"))                        ok = v && ParseDouble(v, o.end);
+        else if (!strcmp(a, "--range"))                      { CliRange r; ok = v && ParseRange(v, r); if (ok) o.ranges.push_back(r); }
+        else if (!strcmp(a, "--audio"))                      ok = v && ParseInt(v, o.audio);
+        else if (!strcmp(a, "--subs"))                       ok = v && ParseInt(v, o.subs);
+        else if (!strcmp(a, "--priority"))                   ok = v && ParseInt(v, o.priority);
+        else if (!strcmp(a, "--jobs"))                       ok = v && ParseInt(v, o.jobs) && o.jobs > 0;
+        else if (!strcmp(a, "-w") || !strcmp(a, "--watch"))  ok = (o.watchDir = v) != nullptr;
+        else if (!strcmp(a, "--rule"))                       { ok = v != nullptr; if (ok) o.rules.push_back(v); }
+        else if (!strcmp(a, "--stable"))                     ok = v && ParseDouble(v, o.stableSecs) && o.stableSecs > 0.0;
+        else if (!strcmp(a, "--state"))                      ok = (o.statePath = v) != nullptr;
+        else if (!strcmp(a, "--ext-subs"))                   ok = (o.extSubs = v) != nullptr;
+        else if (!strcmp(a, "-o") || !strcmp(a, "--output")) ok = (o.output = v) != nullptr;
+        else if (!strcmp(a, "--suffix"))                     ok = v && *(o.suffix = v);
+        else if (!strcmp(a, "--out-dir"))                    ok = (o.outDir = v) != nullptr;
+        else if (!strcmp(a, "--layout")) {
+            if      (v && !strcmp(v, "faststart"))  o.layout = RZ_LAYOUT_FASTSTART;
+            else if (v && !strcmp(v, "reserve"))    o.layout = RZ_LAYOUT_RESERVE_MOOV;
+            else if (v && !strcmp(v, "fragmented")) o.layout = RZ_LAYOUT_FRAGMENTED;
+            else ok = false;
+        } else {
+            usedValue = false;
+            if      (!strcmp(a, "--hdr-to-sdr"))  o.hdrToSdr   = true;
+            else if (!strcmp(a, "--unbuffered"))  o.unbuffered = true;
+            else if (!strcmp(a, "--no-hwaccel"))  o.hwaccel    = false;
+            else if (!strcmp(a, "--probe"))       o.probeOnly  = true;
+            else if (!strcmp(a, "--existing"))    o.existing   = true;
+            else if (!strcmp(a, "--split"))       o.split      = true;
+            else if (!strcmp(a, "-h") || !strcmp(a, "--help")) { PrintUsage(stdout); exit(0); }
+            else if (a[0] == '-' && a[1])         ok = false;
+            else                                  o.inputs.push_back(a);
+        }
+        if (!ok) { fprintf(stderr, "resizer-cli: bad or missing value for %s\n", a); return false; }
+        if (usedValue) i++;
+    }
+    if (o.watchDir) {
+        if (!o.inputs.empty() || o.probeOnly || o.output || !o.also.empty() || !o.ranges.empty()) {
+            fprintf(stderr, "resizer-cli: --watch takes no inputs, --probe, --output, --also or --range\n");
+            return false;
+        }
+        if (o.rules.empty() && o.targetMB <= 0.0) {
+            fprintf(stderr, "resizer-cli: --watch needs --size or at least one --rule\n");
+            return false;
+        }
+        return true;
+    }
+    if (!o.rules.empty() || o.existing || o.statePath) {
+        fprintf(stderr, "resizer-cli: --rule, --existing and --state need --watch\n");
+        return false;
+    }
+    if (o.inputs.empty()) { PrintUsage(stderr); return false; }
+    if (o.inputs.size() > 1 && (o.probeOnly || o.output || !o.also.empty() || !o.ranges.empty())) {
+        fprintf(stderr, "resizer-cli: --probe, --output, --also and --range take a single input\n");
+        return false;
+    }
+    if (o.split && o.ranges.empty()) { fprintf(stderr, "resizer-cli: --split needs --range\n"); return false; }
+    if (!o.ranges.empty()) {
+        if (o.start != 0.0 || o.end >= 0.0 || !o.also.empty()) {
+            fprintf(stderr, "resizer-cli: --range takes no --start, --end or --also\n");
+            return false;
+        }
+        for (const CliRange& r : o.ranges)
+            if (r.targetMB > 0.0 && !o.split) { fprintf(stderr, "resizer-cli: a --range @MB needs --split\n"); return false; }
+    }
+    if (o.probeOnly) return true;
+    if (o.targetMB <= 0.0) { fprintf(stderr, "resizer-cli: --size must be a positive number of MB\n"); return false; }
+    if (o.scale != 1 && o.scale != 2 && o.scale != 4) { fprintf(stderr, "resizer-cli: --scale must be 1, 2 or 4\n"); return false; }
+    for (CliRendition& r : o.also) {
+        if (r.scale == 0) r.scale = o.scale;
+        if (r.scale != 1 && r.scale != 2 && r.scale != 4) { fprintf(stderr, "resizer-cli: --also scale must be 1, 2 or 4\n"); return false; }
+    }
+    return true;
+}
+
+// ------------------------------ JSON Output ------------------------------
+static std::string JsonStr(const char* s) {
+    std::string out = "\"";
+    for (; s && *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if      (c == '"')  out += "\\\"";
+        else if (c == '\\') out += "\\\\";
+        else if (c == '\n') out += "\\n";
+        else if (c == '\r') out += "\\r";
+        else if (c == '\t') out += "\\t";
+        else if (c < 0x20)  { char u[8]; snprintf(u, sizeof(u), "\\u%04x", c); out += u; }
+        else                out += (char)c;
+    }
+    return out + "\"";
+}
+
+// Set by SIGINT; the next progress callback turns it into a cancel.
+static volatile sig_atomic_t g_interrupted = 0;
+
+static void OnInterrupt(int) {
+    g_interrupted = 1;
+}
+
+// Progress lines are throttled; the encoder calls back once per frame.
+struct ProgressState {
+    double  lastFraction = -1.0;
+    int64_t lastQpc      = 0;
+    int64_t startQpc     = 0;
+};
+
+static int OnProgress(void* opaque, double fraction) {
+    ProgressState* ps = (ProgressState*)opaque;
+    if (g_interrupted) return 0;
+    int64_t now = QpcNow();
+    if (fraction - ps->lastFraction < 0.01 && (now - ps->lastQpc) * 2 < QpcFreq()) return 1;
+    ps->lastFraction = fraction;
+    ps->lastQpc      = now;
+    printf("{\"event\":\"progress\",\"fraction\":%.4f,\"elapsed\":%.2f}\n",
+           max(0.0, min(1.0, fraction)), (now - ps->startQpc) / (double)QpcFreq());
+    fflush(stdout);
+    return 1;
+}
+
+// ------------------------------ Input Probe ------------------------------
+// The input's streams as one JSON line, so callers can pick --audio / --subs
+// indices.
+static void PrintProbe(const char* path, const rz_media* media, const rz_media_info& info) {
+    static const char* kTypeNames[] = { "unknown", "video", "audio", "subtitle" };
+    std::string streams;
+    for (int i = 0; i < info.stream_count; i++) {
+        rz_stream_info si;
+        if (rz_stream_info_get(media, i, &si) != RZ_OK) continue;
+        char buf[160];
+        snprintf(buf, sizeof(buf), "%s{\"index\":%d,\"type\":\"%s\",\"codec\":%s", streams.empty() ? "" : ",",
+                 si.index, kTypeNames[si.type], JsonStr(si.codec).c_str());
+        streams += buf;
+        if (si.type == RZ_STREAM_VIDEO) {
+            snprintf(buf, sizeof(buf), ",\"width\":%d,\"height\":%d", si.width, si.height);
+            streams += buf;
+        } else if (si.type == RZ_STREAM_AUDIO) {
+            snprintf(buf, sizeof(buf), ",\"channels\":%d,\"sample_rate\":%d", si.channels, si.sample_rate);
+            streams += buf;
+        }
+        if (*si.language) streams += ",\"language\":" + JsonStr(si.language);
+        if (*si.title)    streams += ",\"title\":"    + JsonStr(si.title);
+        streams += "}";
+    }
+    printf("{\"event\":\"probe\",\"input\":%s,\"duration\":%.3f,\"hdr\":%s,\"streams\":[%s]}\n",
+           JsonStr(path).c_str(), info.duration, info.is_hdr ? "true" : "false", streams.c_str());
+}
+
+// <dir><name>_<suffix>.mp4, or <name>_<suffix>-N.mp4 if that exists (or is
+// already taken by this batch), as the Start button names its output.
+static std::string OutputPathFor(const CliOptions& o, const char* input, const std::string& suffix,
+                                 const std::vector<std::string>& taken) {
+    std::string in = input;
+    size_t sep  = in.find_last_of("/\\");
+    size_t base = (sep == std::string::npos) ? 0 : sep + 1;
+    size_t dot  = in.find_last_of('.');
+    std::string name = in.substr(base, (dot != std::string::npos && dot > base) ? dot - base : std::string::npos);
+    std::string dir  = o.outDir ? o.outDir : in.substr(0, base);
+    if (!dir.empty() && dir.back() != '/' && dir.back() != '\\') dir += '/';
+    std::string stem = dir + name + "_" + suffix;
+    std::string candidate = stem + ".mp4";
+    auto inUse = [&](const std::string& p) {
+        for (const std::string& t : taken) if (t == p) return true;
+#ifdef _WIN32
+        return GetFileAttributesW(Utf8ToWide(p.c_str()).c_str()) != INVALID_FILE_ATTRIBUTES;
+#else
+        return access(p.c_str(), F_OK) == 0;
+#endif
+    };
+    for (int i = 1; inUse(candidate); i++)
+        candidate = stem + "-" + std::to_string(i) + ".mp4";
+    return candidate;
+}
+
+// A further output of the one job: <output stem><tag>.mp4 beside --output,
+// else <name>_<suffix><tag>.mp4.
+static std::string ExtraOutputPathFor(const CliOptions& o, const char* input, const char* tag,
+                                      const std::vector<std::string>& taken) {
+    if (!o.output) return OutputPathFor(o, input, std::string(o.suffix) + tag, taken);
+    std::string stem = o.output;
+    size_t dot = stem.find_last_of('.');
+    if (dot != std::string::npos && stem.find_first_of("/\\", dot) == std::string::npos) stem.erase(dot);
+    std::string path = stem + tag + ".mp4";
+    for (int i = 1; std::find(taken.begin(), taken.end(), path) != taken.end(); i++)
+        path = stem + tag + "-" + std::to_string(i) + ".mp4";
+    return path;
+}
+
+// ------------------------------ Jobs ------------------------------
+// One input, opened and checked, with its output path and resolved range.
+struct CliJob {
+    std::string         input;
+    rz_media*           media  = nullptr;
+    rz_media_info       info   = {};
+    std::string         output;             // empty when the ranges are split
+    std::vector<std::string> alsoOutputs;   // one per --also
+    std::vector<rz_range>    ranges;        // one per --range, ends resolved
+    std::vector<std::string> rangeOutputs;  // one per --range with --split
+    rz_transcode_params params = {};
+    int                 id     = -1;      // queue job id (batch mode)
+    bool                reported = false;
+    double              lastFraction = -1.0;
+};
+
+// Opens the input and resolves the settings for it.  A batch clamps --end to
+// each file's length instead of rejecting the shorter files.
+static bool PrepareJob(const CliOptions& o, CliJob& job, bool batch, std::vector<std::string>& taken) {
+    if (rz_open(job.input.c_str(), &job.media) != RZ_OK || rz_probe(job.media, &job.info) != RZ_OK) {
+        fprintf(stderr, "resizer-cli: %s: not a readable video file\n", job.input.c_str());
+        return false;
+    }
+    const rz_media_info& info = job.info;
+    double start = o.start;
+    double end = (o.end < 0.0) ? info.duration : o.end;
+    if (batch && info.duration > 0.0 && end > info.duration) end = info.duration;
+    if (o.start < 0.0 || end <= o.start || (info.duration > 0.0 && end > info.duration + 0.001)) {
+        fprintf(stderr, "resizer-cli: %s: range %.3f-%.3f is not within the %.3f s duration\n",
+                job.input.c_str(), o.start, end, info.duration);
+        return false;
+    }
+    for (const CliRange& r : o.ranges) {
+        rz_range rr = {};
+        rr.start     = r.start;
+        rr.end       = (r.end < 0.0) ? info.duration : r.end;
+        rr.target_mb = r.targetMB > 0.0 ? r.targetMB : o.targetMB;
+        if (rr.end <= rr.start || (info.duration > 0.0 && rr.end > info.duration + 0.001)) {
+            fprintf(stderr, "resizer-cli: %s: range %.3f-%.3f is not within the %.3f s duration\n",
+                    job.input.c_str(), rr.start, rr.end, info.duration);
+            return false;
+        }
+        // The start line reports the stretch of the input the pass covers.
+        start = (job.ranges.empty() || rr.start < start) ? rr.start : start;
+        end   = (job.ranges.empty() || rr.end   > end)   ? rr.end   : end;
+        job.ranges.push_back(rr);
+    }
+    bool hdrToSdr = o.hdrToSdr;
+    if (hdrToSdr && !info.is_hdr) {
+        fprintf(stderr, "resizer-cli: %s: input is not HDR; ignoring --hdr-to-sdr\n", job.input.c_str());
+        hdrToSdr = false;
+    }
+    if (!o.split) {
+        job.output = o.output ? std::string(o.output) : OutputPathFor(o, job.input.c_str(), o.suffix, taken);
+        taken.push_back(job.output);
+    }
+    for (const CliRendition& r : o.also) {
+        char mb[32];
+        snprintf(mb, sizeof(mb), "_%gMB", r.targetMB);
+        job.alsoOutputs.push_back(ExtraOutputPathFor(o, job.input.c_str(), mb, taken));
+        taken.push_back(job.alsoOutputs.back());
+    }
+    for (size_t i = 0; o.split && i < job.ranges.size(); i++) {
+        char clip[32];
+        snprintf(clip, sizeof(clip), "_clip%d", (int)i + 1);
+        job.rangeOutputs.push_back(ExtraOutputPathFor(o, job.input.c_str(), clip, taken));
+        taken.push_back(job.rangeOutputs.back());
+    }
+    for (size_t i = 0; i < job.rangeOutputs.size(); i++)
+        job.ranges[i].out_path = job.rangeOutputs[i].c_str();
+
+    rz_transcode_params& params = job.params;
+    rz_transcode_params_default(&params);
+    params.target_mb       = o.targetMB;
+    params.scale           = o.scale;
+    params.start           = start;
+    params.end             = end;
+    params.audio_stream    = o.audio;
+    params.subtitle_stream = o.subs;
+    params.ext_subtitles   = o.extSubs;
+    params.hdr_to_sdr      = hdrToSdr;
+    params.layout          = o.layout;
+    params.unbuffered      = o.unbuffered;
+    return true;
+}
+
+// ",\"job\":N" in batch mode, nothing for a single input.
+static std::string JobField(int id) {
+    return id < 0 ? std::string() : ",\"job\":" + std::to_string(id);
+}
+
+static void PrintStart(const CliJob& job) {
+    static const char* kLayoutNames[] = { "faststart", "reserve", "fragmented" };
+    const rz_transcode_params& p = job.params;
+    printf("{\"event\":\"start\"%s,\"input\":%s,\"output\":%s,\"size_mb\":%.3f,\"scale\":%d,"
+           "\"width\":%d,\"height\":%d,\"start\":%.3f,\"end\":%.3f,\"audio\":%d,\"subs\":%d,"
+           "\"ext_subs\":%s,\"hdr_to_sdr\":%s,\"layout\":\"%s\",\"unbuffered\":%s}\n",
+           JobField(job.id).c_str(), JsonStr(job.input.c_str()).c_str(),
+           job.output.empty() ? "null" : JsonStr(job.output.c_str()).c_str(),
+           p.target_mb, p.scale, job.info.width / p.scale, job.info.height / p.scale, p.start, p.end,
+           p.audio_stream, p.subtitle_stream, p.ext_subtitles ? JsonStr(p.ext_subtitles).c_str() : "null",
+           p.hdr_to_sdr ? "true" : "false", kLayoutNames[p.layout], p.unbuffered ? "true" : "false");
+    fflush(stdout);
+}
+
+// The --also outputs, one line each, after the job's own start line.
+static void PrintAlsoStart(const CliOptions& o, const CliJob& job) {
+    for (size_t i = 0; i < job.alsoOutputs.size(); i++) {
+        const CliRendition& r = o.also[i];
+        printf("{\"event\":\"start\",\"rendition\":%d,\"output\":%s,\"size_mb\":%.3f,\"scale\":%d,"
+               "\"width\":%d,\"height\":%d}\n", (int)i + 1, JsonStr(job.alsoOutputs[i].c_str()).c_str(),
+               r.targetMB, r.scale, job.info.width / r.scale, job.info.height / r.scale);
+    }
+    fflush(stdout);
+}
+
+// The --range stretches, one line each, after the job's own start line; with
+// --split each has its output and size.
+static void PrintRangeStart(const CliJob& job) {
+    for (size_t i = 0; i < job.ranges.size(); i++) {
+        const rz_range& r = job.ranges[i];
+        if (job.rangeOutputs.empty())
+            printf("{\"event\":\"start\",\"range\":%d,\"start\":%.3f,\"end\":%.3f}\n", (int)i + 1, r.start, r.end);
+        else
+            printf("{\"event\":\"start\",\"range\":%d,\"start\":%.3f,\"end\":%.3f,\"output\":%s,\"size_mb\":%.3f}\n",
+                   (int)i + 1, r.start, r.end, JsonStr(r.out_path).c_str(), r.target_mb);
+    }
+    fflush(stdout);
+}
+
+// rendition is 0 for the job's own output, n for its n-th --also; range is
+// n for the n-th --split output.
+static void PrintDone(const CliJob& job, int err, const rz_transcode_stats& st, int rendition = 0, int range = 0) {
+    const std::string& output = range > 0     ? job.rangeOutputs[range - 1]
+                              : rendition > 0 ? job.alsoOutputs[rendition - 1] : job.output;
+    std::string field = JobField(job.id);
+    if (rendition > 0) field += ",\"rendition\":" + std::to_string(rendition);
+    if (range > 0)     field += ",\"range\":" + std::to_string(range);
+    printf("{\"event\":\"done\"%s,\"ok\":%s,\"cancelled\":%s,\"output\":%s,\"bytes\":%lld,\"size_mb\":%.3f,"
+           "\"frames\":%lld,\"duration\":%.3f,\"elapsed\":%.3f,\"fps\":%.2f,\"speed\":%.3f,"
+           "\"video_bitrate\":%lld,\"decoder\":%s,\"encoder\":%s,\"hw_decode\":%s,"
+           "\"hdr_to_sdr\":%s,\"subtitles\":%s,\"write_mbps\":%.1f,\"write_blocked\":%lld,"
+           "\"write_blocked_ms\":%.0f,\"write_peak_queue\":%d,\"read_mbps\":%.1f,\"read_stalls\":%lld,"
+           "\"read_stall_ms\":%.0f}\n",
+           field.c_str(), err == RZ_OK ? "true" : "false", err == RZ_ERR_CANCELLED ? "true" : "false",
+           JsonStr(output.c_str()).c_str(), (long long)st.output_bytes,
+           st.output_bytes / (1024.0 * 1024.0), (long long)st.frames, st.duration, st.elapsed,
+           st.elapsed > 0.0 ? st.frames / st.elapsed : 0.0,
+           st.elapsed > 0.0 ? st.duration / st.elapsed : 0.0, (long long)st.video_bitrate,
+           JsonStr(st.decoder).c_str(), JsonStr(st.encoder).c_str(), st.hw_decode ? "true" : "false",
+           st.hdr_to_sdr ? "true" : "false", st.subtitles ? "true" : "false", st.write_mb_per_s,
+           (long long)st.write_blocked, st.write_blocked_ms, st.write_peak_queue, st.read_mb_per_s,
+           (long long)st.read_stalls, st.read_stall_ms);
+    fflush(stdout);
+}
+
+// One pass over the queued jobs: a progress line for each running one that
+// has moved 1%, a done line for each that finished.  Returns how many are
+// still queued or running.
+static size_t PollJobs(rz_queue* queue, std::vector<CliJob>& jobs, int64_t startQpc, bool& anyFailed) {
+    size_t left = 0;
+    for (CliJob& job : jobs) {
+        rz_job_info ji;
+        if (job.reported || job.id < 0 || rz_queue_get_job(queue, job.id, &ji) != RZ_OK) continue;
+        if (ji.state == RZ_JOB_QUEUED || ji.state == RZ_JOB_RUNNING) {
+            left++;
+            if (ji.state == RZ_JOB_RUNNING && ji.progress - job.lastFraction >= 0.01) {
+                job.lastFraction = ji.progress;
+                printf("{\"event\":\"progress\",\"job\":%d,\"fraction\":%.4f,\"elapsed\":%.2f}\n",
+                       job.id, ji.progress, (QpcNow() - startQpc) / (double)QpcFreq());
+                fflush(stdout);
+            }
+            continue;
+        }
+        int err = ji.state == RZ_JOB_DONE      ? RZ_OK
+                : ji.state == RZ_JOB_CANCELLED ? RZ_ERR_CANCELLED : RZ_ERR_TRANSCODE;
+        if (err == RZ_ERR_TRANSCODE) anyFailed = true;
+        PrintDone(job, err, ji.stats);
+        job.reported = true;
+    }
+    return left;
+}
+
+// Every input through the encode queue.  Progress is polled twice a second;
+// Ctrl+C cancels whatever is still queued or running.
+static int RunBatch(const CliOptions& o, std::vector<CliJob>& jobs) {
+    rz_queue* queue = nullptr;
+    if (rz_queue_create(nullptr, &queue) != RZ_OK) return 1;
+    if (o.jobs > 0) rz_queue_set_slots(queue, -1, o.jobs);
+    for (CliJob& job : jobs) {
+        if (rz_queue_add(queue, job.media, job.output.c_str(), &job.params, o.priority, &job.id) != RZ_OK) {
+            fprintf(stderr, "resizer-cli: %s: could not queue\n", job.input.c_str());
+            continue;
+        }
+        PrintStart(job);
+    }
+
+    int64_t startQpc    = QpcNow();
+    bool    interrupted = false, anyFailed = false;
+    for (size_t left = jobs.size(); left > 0;) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        if (g_interrupted && !interrupted) {
+            interrupted = true;
+            for (CliJob& job : jobs) if (job.id >= 0) rz_queue_cancel(queue, job.id);
+        }
+        left = PollJobs(queue, jobs, startQpc, anyFailed);
+    }
+    rz_queue_destroy(queue);
+    if (interrupted) return 130;
+    return anyFailed ? 1 : 0;
+}
+
+// ------------------------------ Watch Folder ------------------------------
+// A --rule and the strings its rz_watch_rule points at.
+struct CliRule {
+    std::string   match = "*";
+    std::string   suffix;
+    std::string   outDir;
+    rz_watch_rule rule  = {};
+};
+
+// "match=*.mov,size=50,scale=2,..."; keys left out take the command line's
+// values, so "" is the command line's own rule.
+static bool ParseRule(const CliOptions& o, const char* spec, CliRule& r) {
+    rz_watch_rule& w = r.rule;
+    r.suffix     = o.suffix;
+    r.outDir     = o.outDir ? o.outDir : "";
+    w.target_mb  = o.targetMB;
+    w.scale      = o.scale;
+    w.hdr_to_sdr = o.hdrToSdr;
+    w.layout     = o.layout;
+    w.priority   = o.priority;
+
+    std::string s = spec;
+    for (size_t pos = 0; pos < s.size();) {
+        size_t comma = s.find(',', pos);
+        if (comma == std::string::npos) comma = s.size();
+        std::string item = s.substr(pos, comma - pos);
+        pos = comma + 1;
+        if (item.empty()) continue;
+        size_t      eq = item.find('=');
+        std::string k  = item.substr(0, eq);
+        std::string v  = (eq == std::string::npos) ? std::string() : item.substr(eq + 1);
+        bool ok = true;
+        if      (k == "match")      ok = !(r.match = v).empty();
+        else if (k == "size")       ok = ParseDouble(v.c_str(), w.target_mb);
+        else if (k == "scale")      ok = ParseInt(v.c_str(), w.scale);
+        else if (k == "suffix")     ok = !(r.suffix = v).empty();
+        else if (k == "out-dir")    r.outDir = v;
+        else if (k == "priority")   ok = ParseInt(v.c_str(), w.priority);
+        else if (k == "hdr-to-sdr") w.hdr_to_sdr = (v.empty() || v == "1" || v == "yes") ? 1 : 0;
+        else                        ok = false;
+        if (!ok) { fprintf(stderr, "resizer-cli: bad --rule entry \"%s\"\n", item.c_str()); return false; }
+    }
+    if (w.target_mb <= 0.0 || (w.scale != 1 && w.scale != 2 && w.scale != 4)) {
+        fprintf(stderr, "resizer-cli: --rule \"%s\" needs size > 0 and scale 1, 2 or 4\n", spec);
+        return false;
+    }
+    return true;
+}
+
+// Jobs the watcher queued, handed over from its thread.
+static std::mutex          g_watchMutex;
+static std::vector<CliJob> g_watchQueued;
+
+static void OnWatchQueued(void*, const char* input, const char* output, int jobId) {
+    CliJob job;
+    job.input  = input;
+    job.output = output;
+    job.id     = jobId;
+    std::lock_guard<std::mutex> lock(g_watchMutex);
+    g_watchQueued.push_back(job);
+}
+
+// Runs until Ctrl+C.  Encodes still running then are cancelled; with --state
+// they, and whatever was still waiting, are picked up on the next start.
+static int RunWatch(const CliOptions& o) {
+    std::vector<CliRule> rules;
+    for (const char* spec : o.rules) {
+        CliRule r;
+        if (!ParseRule(o, spec, r)) return 2;
+        rules.push_back(r);
+    }
+    if (o.targetMB > 0.0) {
+        CliRule r;
+        if (!ParseRule(o, "", r)) return 2;
+        rules.push_back(r);
+    }
+    std::vector<rz_watch_rule> wr;
+    for (CliRule& r : rules) {
+        r.rule.match   = r.match.c_str();
+        r.rule.suffix  = r.suffix.c_str();
+        r.rule.out_dir = r.outDir.empty() ? nullptr : r.outDir.c_str();
+        wr.push_back(r.rule);
+    }
+
+    rz_queue* queue = nullptr;
+    if (rz_queue_create(o.statePath, &queue) != RZ_OK) return 1;
+    if (o.jobs > 0) rz_queue_set_slots(queue, -1, o.jobs);
+    rz_watch_options wo = {};
+    wo.stable_seconds   = o.stableSecs;
+    wo.include_existing = o.existing;
+    wo.on_queued        = OnWatchQueued;
+    rz_watch* watch = nullptr;
+    if (rz_watch_start(queue, o.watchDir, wr.data(), (int)wr.size(), &wo, &watch) != RZ_OK) {
+        fprintf(stderr, "resizer-cli: %s: cannot watch this folder\n", o.watchDir);
+        rz_queue_destroy(queue);
+        return 2;
+    }
+    printf("{\"event\":\"watching\",\"dir\":%s,\"rules\":%d,\"stable\":%.1f}\n",
+           JsonStr(o.watchDir).c_str(), (int)wr.size(), o.stableSecs);
+    fflush(stdout);
+
+    std::vector<CliJob> jobs;
+    int64_t startQpc  = QpcNow();
+    bool    anyFailed = false;
+    while (!g_interrupted) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        {
+            std::lock_guard<std::mutex> lock(g_watchMutex);
+            for (CliJob& job : g_watchQueued) {
+                printf("{\"event\":\"queued\",\"job\":%d,\"input\":%s,\"output\":%s}\n", job.id,
+                       JsonStr(job.input.c_str()).c_str(), JsonStr(job.output.c_str()).c_str());
+                jobs.push_back(job);
+            }
+            g_watchQueued.clear();
+        }
+        fflush(stdout);
+        PollJobs(queue, jobs, startQpc, anyFailed);
+        // Reported jobs leave the queue too, or a service that runs for
+        // weeks would keep (and rewrite to --state) every job it ever ran.
+        for (const CliJob& job : jobs)
+            if (job.reported) rz_queue_remove(queue, job.id);
+        jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [](const CliJob& j) { return j.reported; }),
+                   jobs.end());
+    }
+    rz_watch_stop(watch);
+    rz_queue_destroy(queue);
+    return 0;
+}
+
+// ------------------------------ Entry ------------------------------
+int main(int argc, char** argv) {
+#ifdef _WIN32
+    // The engine takes UTF-8 paths; argv is in the ANSI code page, which
+    // cannot name every file.  Rebuild it from the wide command line.
+    std::vector<std::string> args;
+    std::vector<char*>       argp;
+    int                      wargc = 0;
+    if (LPWSTR* wargv = CommandLineToArgvW(GetCommandLineW(), &wargc)) {
+        for (int i = 0; i < wargc; i++) args.push_back(WideToUtf8(wargv[i]));
+        LocalFree(wargv);
+        for (std::string& a : args) argp.push_back(&a[0]);
+        argp.push_back(nullptr);
+        argc = wargc;
+        argv = argp.data();
+    }
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+    CliOptions o;
+    if (!ParseArgs(argc, argv, o)) return 2;
+    av_log_set_level(AV_LOG_ERROR);
+
+    if (o.watchDir) {
+        rz_init(o.hwaccel ? RZ_INIT_HWACCEL : 0);
+        signal(SIGINT, OnInterrupt);
+        int rc = RunWatch(o);
+        rz_shutdown();
+        return rc;
+    }
+
+    if (o.probeOnly) {
+        rz_media*     media = nullptr;
+        rz_media_info info;
+        if (rz_open(o.inputs[0], &media) != RZ_OK || rz_probe(media, &info) != RZ_OK) {
+            fprintf(stderr, "resizer-cli: %s: not a readable video file\n", o.inputs[0]);
+            rz_close(media);
+            return 2;
+        }
+        PrintProbe(o.inputs[0], media, info);
+        rz_close(media);
+        return 0;
+    }
+
+    bool batch = o.inputs.size() > 1;
+    std::vector<CliJob>      jobs(o.inputs.size());
+    std::vector<std::string> taken;
+    bool prepared = true;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        jobs[i].input = o.inputs[i];
+        if (!PrepareJob(o, jobs[i], batch, taken)) { prepared = false; break; }
+    }
+    if (!prepared) {
+        for (CliJob& job : jobs) rz_close(job.media);
+        return 2;
+    }
+
+    rz_init(o.hwaccel ? RZ_INIT_HWACCEL : 0);
+    signal(SIGINT, OnInterrupt);
+    int rc;
+    if (batch) {
+        rc = RunBatch(o, jobs);
+    } else {
+        CliJob& job = jobs[0];
+        PrintStart(job);
+        PrintAlsoStart(o, job);
+        PrintRangeStart(job);
+        ProgressState ps;
+        ps.startQpc = ps.lastQpc = QpcNow();
+        job.params.progress = OnProgress;
+        job.params.opaque   = &ps;
+        int err;
+        if (!job.ranges.empty()) {
+            int mode = o.split ? RZ_RANGES_SPLIT : RZ_RANGES_JOIN;
+            std::vector<rz_transcode_stats> st(o.split ? job.ranges.size() : 1);
+            err = rz_transcode_ranges(job.media, job.output.c_str(), job.ranges.data(), (int)job.ranges.size(),
+                                      mode, &job.params, st.data());
+            if (o.split) for (size_t i = 0; i < st.size(); i++) PrintDone(job, err, st[i], 0, (int)i + 1);
+            else         PrintDone(job, err, st[0]);
+        } else {
+            std::vector<rz_rendition> rs(1 + job.alsoOutputs.size());
+            rs[0] = { job.output.c_str(), job.params.target_mb, job.params.scale };
+            for (size_t i = 0; i < job.alsoOutputs.size(); i++)
+                rs[i + 1] = { job.alsoOutputs[i].c_str(), o.also[i].targetMB, o.also[i].scale };
+            std::vector<rz_transcode_stats> st(rs.size());
+            err = rz_transcode_renditions(job.media, rs.data(), (int)rs.size(), &job.params, st.data());
+            for (size_t i = 0; i < rs.size(); i++) PrintDone(job, err, st[i], (int)i);
+        }
+        rc = (err == RZ_ERR_CANCELLED) ? 130 : (err == RZ_OK ? 0 : 1);
+    }
+    for (CliJob& job : jobs) rz_close(job.media);
+    rz_shutdown();
+    return rc;
+}
@@ -0,0 +1,581 @@
+﻿// fileio.cpp
+// Read-ahead input and async output AVIOContexts for the transcode.  Both
+// run a worker thread doing positional, block-sized file I/O so disk and
+// network latency overlaps with decoding and encoding.
+
+#include "fileio.h"
+#include "platform.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#endif
+
+// ------------------------------ Positional File I/O ------------------------------
+// The few file calls the two workers need.  "Direct" handles bypass the OS
+// cache (FILE_FLAG_NO_BUFFERING / O_DIRECT) and so need sector-aligned
+// offsets, lengths and buffers; every caller falls back to a cached handle
+// when the file system refuses them.
+
+#ifdef _WIN32
+typedef HANDLE FileHandle;
+static const FileHandle kNoFile = INVALID_HANDLE_VALUE;
+
+static FileHandle FileOpenRead(const char* path, bool direct) {
+    return CreateFileW(Utf8ToWide(path).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                       OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | (direct ? FILE_FLAG_NO_BUFFERING : 0), nullptr);
+}
+// Shares write access so FileOpenDirectWrite can open a second, unbuffered
+// handle on the file while this one is still open.
+static FileHandle FileCreate(const char* path) {
+    return CreateFileW(Utf8ToWide(path).c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                       CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+}
+static FileHandle FileOpenDirectWrite(const char* path) {
+    return CreateFileW(Utf8ToWide(path).c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                       OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, nullptr);
+}
+static int64_t FileSize(FileHandle h) {
+    LARGE_INTEGER sz = {};
+    return GetFileSizeEx(h, &sz) ? sz.QuadPart : -1;
+}
+static bool FileReadAt(FileHandle h, void* buf, int len, int64_t off, int* got) {
+    OVERLAPPED ov = {};
+    ov.Offset     = (DWORD)((uint64_t)off & 0xFFFFFFFFu);
+    ov.OffsetHigh = (DWORD)((uint64_t)off >> 32);
+    DWORD n = 0;
+    BOOL ok = ReadFile(h, buf, (DWORD)len, &n, &ov);
+    *got = (int)n;
+    return ok || GetLastError() == ERROR_HANDLE_EOF;
+}
+static bool FileWriteAt(FileHandle h, const void* buf, int len, int64_t off, int* put) {
+    OVERLAPPED ov = {};
+    ov.Offset     = (DWORD)((uint64_t)off & 0xFFFFFFFFu);
+    ov.OffsetHigh = (DWORD)((uint64_t)off >> 32);
+    DWORD n = 0;
+    BOOL ok = WriteFile(h, buf, (DWORD)len, &n, &ov);
+    *put = (int)n;
+    return ok != 0;
+}
+static void FileClose(FileHandle h) { CloseHandle(h); }
+static uint8_t* BlockAlloc(size_t size) {
+    return (uint8_t*)VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+static void BlockFree(uint8_t* p) { if (p) VirtualFree(p, 0, MEM_RELEASE); }
+#else
+typedef int FileHandle;
+static const FileHandle kNoFile = -1;
+
+static FileHandle FileOpenRead(const char* path, bool direct) {
+#ifdef O_DIRECT
+    if (direct) return open(path, O_RDONLY | O_DIRECT);
+#else
+    if (direct) return -1;
+#endif
+    int fd = open(path, O_RDONLY);
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (fd >= 0) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return fd;
+}
+static FileHandle FileCreate(const char* path) {
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+static FileHandle FileOpenDirectWrite(const char* path) {
+#ifdef O_DIRECT
+    return open(path, O_WRONLY | O_DIRECT);
+#else
+    (void)path;
+    return -1;
+#endif
+}
+static int64_t FileSize(FileHandle h) {
+    struct stat st;
+    return fstat(h, &st) == 0 ? (int64_t)st.st_size : -1;
+}
+static bool FileReadAt(FileHandle h, void* buf, int len, int64_t off, int* got) {
+    *got = 0;
+    while (*got < len) {
+        ssize_t n = pread(h, (uint8_t*)buf + *got, len - *got, off + *got);
+        if (n < 0) return false;
+        if (n == 0) break;                    // end of file
+        *got += (int)n;
+    }
+    return true;
+}
+static bool FileWriteAt(FileHandle h, const void* buf, int len, int64_t off, int* put) {
+    *put = 0;
+    while (*put < len) {
+        ssize_t n = pwrite(h, (const uint8_t*)buf + *put, len - *put, off + *put);
+        if (n <= 0) return false;
+        *put += (int)n;
+    }
+    return true;
+}
+static void FileClose(FileHandle h) { close(h); }
+static uint8_t* BlockAlloc(size_t size) {
+    void* p = nullptr;
+    return posix_memalign(&p, 4096, size) == 0 ? (uint8_t*)p : nullptr;
+}
+static void BlockFree(uint8_t* p) { free(p); }
+#endif
+
+static const char* BaseName(const char* path) {
+    const char* name = path;
+    for (const char* p = path; *p; p++)
+        if (*p == '\\' || *p == '/') name = p + 1;
+    return name;
+}
+
+// ------------------------------ Read-Ahead Input ------------------------------
+// A custom AVIOContext for long sequential demuxes (the transcode and the PGS
+// preload).  A prefetch thread keeps a window of kRaBlocks blocks of
+// kRaBlockSize bytes filled ahead of the demuxer with positional, block-aligned
+// reads on an unbuffered handle, so the demuxer's small reads are memcpys and
+// disk/NAS latency overlaps with decoding.
+//
+// Block b lives in slot b % kRaBlocks.  The window starts one block behind the
+// reader so short backward seeks (index lookups, resyncs) stay in memory; a
+// seek outside the window drops every slot and refills from the new position.
+
+static const int    kRaBlockSize = 4 << 20;
+static const int    kRaBlocks    = 8;
+static const int    kRaIoBuf     = 256 << 10;   // AVIOContext buffer
+
+struct ReadAheadStats {
+    int64_t  diskBytes   = 0;    // bytes read from the file
+    int64_t  diskQpc     = 0;    // time spent inside the read call
+    int64_t  stallQpc    = 0;    // time the demuxer waited for a block
+    uint32_t diskReads   = 0;
+    uint32_t stalls      = 0;
+    uint32_t refills     = 0;    // seeks that landed outside the window
+};
+
+struct ReadAhead {
+    FileHandle file = kNoFile;
+    int64_t  size   = 0;
+    std::atomic<int64_t> pos{0};              // demuxer position; written by the reader only
+    uint8_t* buf[kRaBlocks]   = {};           // page aligned
+    int64_t  blk[kRaBlocks]   = {};           // block held by each slot; -1 = none
+    int      len[kRaBlocks]   = {};           // valid bytes once ready
+    bool     ready[kRaBlocks] = {};
+    int64_t  base   = 0;                      // first block of the window
+    bool     failed = false;                  // a read error; the demuxer sees EIO
+    bool     stop   = false;
+    std::mutex              mtx;              // guards blk/len/ready/base/failed/stop/stats
+    std::condition_variable wake;             // window moved or stop set
+    std::condition_variable filled;           // a block became ready
+    std::thread             thread;
+    ReadAheadStats stats;
+    char     name[64] = {};                   // file name for the stats line
+};
+
+// Picks the missing block nearest the reader and reads it into its slot.
+static void ReadAheadThreadProc(ReadAhead* ra) {
+    const int64_t lastBlk = (ra->size + kRaBlockSize - 1) / kRaBlockSize;
+    std::unique_lock<std::mutex> lock(ra->mtx);
+    while (!ra->stop) {
+        int64_t cur  = ra->pos / kRaBlockSize;
+        int64_t want = -1;
+        for (int64_t b = max(ra->base, cur); b < min(ra->base + kRaBlocks, lastBlk) && want < 0; b++)
+            if (ra->blk[b % kRaBlocks] != b) want = b;
+        for (int64_t b = ra->base; b < cur && want < 0; b++)
+            if (ra->blk[b % kRaBlocks] != b) want = b;
+        if (want < 0 || ra->failed) {
+            ra->wake.wait(lock);
+            continue;
+        }
+        int slot = (int)(want % kRaBlocks);
+        ra->blk[slot]   = want;
+        ra->ready[slot] = false;
+        lock.unlock();
+
+        int got = 0;
+        int64_t t0 = QpcNow();
+        bool ok = FileReadAt(ra->file, ra->buf[slot], kRaBlockSize, want * kRaBlockSize, &got);
+        int64_t dt = QpcNow() - t0;
+
+        lock.lock();
+        ra->stats.diskQpc   += dt;
+        ra->stats.diskBytes += got;
+        ra->stats.diskReads++;
+        if (!ok) ra->failed = true;
+        if (ra->blk[slot] == want) {          // not dropped by a seek meanwhile
+            ra->len[slot]   = got;
+            ra->ready[slot] = true;
+        }
+        ra->filled.notify_one();
+    }
+}
+
+static int ReadAheadRead(void* opaque, uint8_t* dst, int size) {
+    ReadAhead* ra = (ReadAhead*)opaque;
+    int64_t pos = ra->pos;
+    if (pos >= ra->size) return AVERROR_EOF;
+    int64_t b = pos / kRaBlockSize;
+    int slot  = (int)(b % kRaBlocks);
+
+    std::unique_lock<std::mutex> lock(ra->mtx);
+    if (b < ra->base || b >= ra->base + kRaBlocks) {
+        for (int i = 0; i < kRaBlocks; i++) { ra->blk[i] = -1; ra->ready[i] = false; }
+        ra->base = b;
+        ra->stats.refills++;
+        ra->wake.notify_one();
+    } else if (b > ra->base + 1) {
+        ra->base = b - 1;                     // frees the slots behind for blocks ahead
+        ra->wake.notify_one();
+    }
+    if (!(ra->blk[slot] == b && ra->ready[slot]) && !ra->failed) {
+        int64_t stallFrom = QpcNow();
+        ra->stats.stalls++;
+        ra->filled.wait(lock, [&] { return (ra->blk[slot] == b && ra->ready[slot]) || ra->failed; });
+        ra->stats.stallQpc += QpcNow() - stallFrom;
+    }
+    int n = 0;
+    if (ra->blk[slot] == b && ra->ready[slot]) {
+        int off = (int)(pos - b * kRaBlockSize);
+        n = max(0, min(size, ra->len[slot] - off));
+        memcpy(dst, ra->buf[slot] + off, n);
+    }
+    bool failed = ra->failed;
+    lock.unlock();
+
+    if (n == 0) return failed ? AVERROR(EIO) : AVERROR_EOF;
+    ra->pos = pos + n;
+    return n;
+}
+
+static int64_t ReadAheadSeek(void* opaque, int64_t offset, int whence) {
+    ReadAhead* ra = (ReadAhead*)opaque;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE: return ra->size;
+    case SEEK_SET:    break;
+    case SEEK_CUR:    offset += ra->pos;  break;
+    case SEEK_END:    offset += ra->size; break;
+    default:          return AVERROR(EINVAL);
+    }
+    if (offset < 0) return AVERROR(EINVAL);
+    ra->pos = offset;                         // the next read moves the window if needed
+    return offset;
+}
+
+// Stops the prefetch thread, logs its stats (and copies them to io if given)
+// and frees ra.
+static void ReadAheadFree(ReadAhead* ra, InputIoStats* io = nullptr) {
+    if (!ra) return;
+    if (ra->thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(ra->mtx);
+            ra->stop = true;
+        }
+        ra->wake.notify_one();
+        ra->thread.join();
+    }
+    const ReadAheadStats& s = ra->stats;
+    double freq = (double)QpcFreq();
+    double mb   = s.diskBytes / (1024.0 * 1024.0);
+    char dbg[256];
+    StringCchPrintfA(dbg, sizeof(dbg),
+        "ReadAhead %s: %.1f MB in %u reads, %.1f MB/s from disk, %u stalls (%.0f ms), %u refills\n",
+        ra->name, mb, s.diskReads, s.diskQpc > 0 ? mb / (s.diskQpc / freq) : 0.0,
+        s.stalls, s.stallQpc * 1000.0 / freq, s.refills);
+    EngineLog(dbg);
+    if (io) {
+        io->bytes         = s.diskBytes;
+        io->read_seconds  = s.diskQpc / freq;
+        io->stall_seconds = s.stallQpc / freq;
+        io->reads         = s.diskReads;
+        io->stalls        = s.stalls;
+        io->refills       = s.refills;
+    }
+
+    for (int i = 0; i < kRaBlocks; i++) BlockFree(ra->buf[i]);
+    if (ra->file != kNoFile) FileClose(ra->file);
+    delete ra;
+}
+
+// Unbuffered handles need sector-aligned offsets, sizes and buffers, which
+// the block layout guarantees; shares that refuse them get a buffered handle.
+static ReadAhead* ReadAheadOpen(const char* path) {
+    FileHandle h = FileOpenRead(path, true);
+    if (h == kNoFile) h = FileOpenRead(path, false);
+    if (h == kNoFile) return nullptr;
+
+    ReadAhead* ra = new ReadAhead();
+    ra->file = h;
+    StringCchCopyA(ra->name, sizeof(ra->name), BaseName(path));
+    ra->size = FileSize(h);
+    bool ok = ra->size >= 0;
+    for (int i = 0; i < kRaBlocks && ok; i++) {
+        ra->blk[i] = -1;
+        ra->buf[i] = BlockAlloc(kRaBlockSize);
+        ok = ra->buf[i] != nullptr;
+    }
+    if (!ok) { ReadAheadFree(ra); return nullptr; }
+    ra->thread = std::thread(ReadAheadThreadProc, ra);
+    return ra;
+}
+
+int OpenInputReadAhead(AVFormatContext** fmt, const char* path) {
+    ReadAhead* ra = ReadAheadOpen(path);
+    if (!ra) return avformat_open_input(fmt, path, nullptr, nullptr);
+    uint8_t*     iobuf = (uint8_t*)av_malloc(kRaIoBuf);
+    AVIOContext* pb    = iobuf ? avio_alloc_context(iobuf, kRaIoBuf, 0, ra, ReadAheadRead, nullptr, ReadAheadSeek)
+                               : nullptr;
+    *fmt = pb ? avformat_alloc_context() : nullptr;
+    if (!*fmt) {
+        if (pb) avio_context_free(&pb);
+        av_free(iobuf);
+        ReadAheadFree(ra);
+        return AVERROR(ENOMEM);
+    }
+    (*fmt)->pb = pb;
+    int ret = avformat_open_input(fmt, path, nullptr, nullptr);
+    if (ret < 0) {                            // *fmt is already freed; the pb is ours
+        av_freep(&pb->buffer);
+        avio_context_free(&pb);
+        ReadAheadFree(ra);
+    }
+    return ret;
+}
+
+void CloseInput(AVFormatContext** fmt, InputIoStats* io) {
+    if (io) *io = InputIoStats();
+    if (!*fmt) return;
+    AVIOContext* pb = ((*fmt)->flags & AVFMT_FLAG_CUSTOM_IO) ? (*fmt)->pb : nullptr;
+    avformat_close_input(fmt);
+    if (pb) {
+        ReadAhead* ra = (ReadAhead*)pb->opaque;
+        av_freep(&pb->buffer);
+        avio_context_free(&pb);
+        ReadAheadFree(ra, io);
+    }
+}
+
+// ------------------------------ Async Output ------------------------------
+// A write-only AVIOContext for the transcode output.  The muxer's writes are
+// gathered into kAwBlockSize blocks and handed to a writer thread through a
+// queue at most kAwQueueDepth deep, so a slow destination (USB stick, SMB
+// share) only stalls the encode once that much is already in flight.
+//
+// Each block carries its file offset, so muxer seeks (mdat size patches, the
+// reserved moov) just start a new block.  In unbuffered mode blocks that are
+// sector aligned in offset and length go through the direct handle; the
+// odd-sized tail and the small patches use the buffered one.  Faststart
+// rereads the output by name in the trailer, so it keeps avio_open.
+
+static const int kAwBlockSize  = 4 << 20;
+static const int kAwQueueDepth = 8;
+static const int kAwAlign      = 4096;
+
+struct AsyncWriterStats {
+    int64_t  bytes        = 0;
+    int64_t  writeQpc     = 0;    // time spent inside the write call
+    int64_t  blockedQpc   = 0;    // time the muxer waited for a free queue slot
+    uint32_t writes       = 0;
+    uint32_t directWrites = 0;    // of which went through the unbuffered handle
+    uint32_t blocked      = 0;    // submits that hit a full queue
+    int      peakDepth    = 0;
+};
+
+struct AwBlock {
+    uint8_t* buf = nullptr;
+    int64_t  off = 0;
+    int      len = 0;
+};
+
+struct AsyncWriter {
+    FileHandle file   = kNoFile;
+    FileHandle direct = kNoFile;              // unbuffered handle, or kNoFile when disabled
+    int64_t  pos    = 0;                      // muxer position; encode thread only
+    int64_t  size   = 0;                      // furthest byte written so far
+    AwBlock  cur;                             // block being filled; encode thread only
+    std::deque<AwBlock>   queue;              // handed to the writer thread
+    std::vector<uint8_t*> spare;              // recycled block buffers
+    bool     done   = false;
+    std::atomic<bool> failed{false};
+    std::mutex              mtx;              // guards queue/spare/done/stats
+    std::condition_variable queued;           // a block was queued or done set
+    std::condition_variable drained;          // a queue slot freed up
+    std::thread             thread;
+    AsyncWriterStats stats;
+    char     name[64] = {};
+};
+
+static void AsyncWriterThreadProc(AsyncWriter* aw) {
+    std::unique_lock<std::mutex> lock(aw->mtx);
+    for (;;) {
+        aw->queued.wait(lock, [&] { return !aw->queue.empty() || aw->done; });
+        if (aw->queue.empty()) break;
+        AwBlock b = aw->queue.front();
+        lock.unlock();
+
+        bool useDirect = aw->direct != kNoFile && b.off % kAwAlign == 0 && b.len % kAwAlign == 0;
+        int put = 0;
+        int64_t t0 = QpcNow();
+        bool ok = FileWriteAt(useDirect ? aw->direct : aw->file, b.buf, b.len, b.off, &put);
+        int64_t dt = QpcNow() - t0;
+
+        lock.lock();
+        aw->queue.pop_front();
+        aw->spare.push_back(b.buf);
+        aw->stats.writeQpc += dt;
+        aw->stats.bytes    += put;
+        aw->stats.writes++;
+        if (useDirect) aw->stats.directWrites++;
+        if (!ok || put != b.len) aw->failed = true;
+        aw->drained.notify_one();
+    }
+}
+
+// Queues the current block (if any), waiting while the queue is full.
+static void AsyncWriterSubmit(AsyncWriter* aw) {
+    if (!aw->cur.buf || aw->cur.len == 0) return;
+    std::unique_lock<std::mutex> lock(aw->mtx);
+    if ((int)aw->queue.size() >= kAwQueueDepth && !aw->failed) {
+        int64_t stallFrom = QpcNow();
+        aw->stats.blocked++;
+        aw->drained.wait(lock, [&] { return (int)aw->queue.size() < kAwQueueDepth || aw->failed; });
+        aw->stats.blockedQpc += QpcNow() - stallFrom;
+    }
+    aw->queue.push_back(aw->cur);
+    aw->stats.peakDepth = max(aw->stats.peakDepth, (int)aw->queue.size());
+    lock.unlock();
+    aw->queued.notify_one();
+    aw->cur = AwBlock();
+}
+
+static int AsyncWriterWrite(void* opaque, const uint8_t* src, int size) {
+    AsyncWriter* aw = (AsyncWriter*)opaque;
+    if (aw->failed) return AVERROR(EIO);
+    int done = 0;
+    while (done < size) {
+        if (aw->cur.buf && (aw->cur.off + aw->cur.len != aw->pos || aw->cur.len == kAwBlockSize))
+            AsyncWriterSubmit(aw);
+        if (!aw->cur.buf) {
+            {
+                std::lock_guard<std::mutex> lock(aw->mtx);
+                if (!aw->spare.empty()) { aw->cur.buf = aw->spare.back(); aw->spare.pop_back(); }
+            }
+            if (!aw->cur.buf) aw->cur.buf = BlockAlloc(kAwBlockSize);
+            if (!aw->cur.buf) return AVERROR(ENOMEM);
+            aw->cur.off = aw->pos;
+            aw->cur.len = 0;
+        }
+        int n = min(size - done, kAwBlockSize - aw->cur.len);
+        memcpy(aw->cur.buf + aw->cur.len, src + done, n);
+        aw->cur.len += n;
+        aw->pos     += n;
+        done        += n;
+    }
+    aw->size = max(aw->size, aw->pos);
+    return size;
+}
+
+static int64_t AsyncWriterSeek(void* opaque, int64_t offset, int whence) {
+    AsyncWriter* aw = (AsyncWriter*)opaque;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE: return aw->size;
+    case SEEK_SET:    break;
+    case SEEK_CUR:    offset += aw->pos;  break;
+    case SEEK_END:    offset += aw->size; break;
+    default:          return AVERROR(EINVAL);
+    }
+    if (offset < 0) return AVERROR(EINVAL);
+    aw->pos = offset;                         // the next write starts a new block if needed
+    return offset;
+}
+
+// Drains the queue, stops the thread and logs throughput and backpressure,
+// which also go to io if given.  Returns false if any write failed.
+static bool AsyncWriterFree(AsyncWriter* aw, OutputIoStats* io = nullptr) {
+    if (!aw) return true;
+    if (aw->thread.joinable()) {
+        AsyncWriterSubmit(aw);
+        {
+            std::lock_guard<std::mutex> lock(aw->mtx);
+            aw->done = true;
+        }
+        aw->queued.notify_one();
+        aw->thread.join();
+    }
+    bool ok = !aw->failed;
+    const AsyncWriterStats& s = aw->stats;
+    double freq = (double)QpcFreq();
+    double mb   = s.bytes / (1024.0 * 1024.0);
+    char dbg[256];
+    StringCchPrintfA(dbg, sizeof(dbg),
+        "AsyncWriter %s: %.1f MB in %u writes (%u unbuffered), %.1f MB/s to disk, "
+        "%u blocked submits (%.0f ms), peak queue %d/%d%s\n",
+        aw->name, mb, s.writes, s.directWrites, s.writeQpc > 0 ? mb / (s.writeQpc / freq) : 0.0,
+        s.blocked, s.blockedQpc * 1000.0 / freq, s.peakDepth, kAwQueueDepth, ok ? "" : ", FAILED");
+    EngineLog(dbg);
+    if (io) {
+        io->bytes           = s.bytes;
+        io->write_seconds   = s.writeQpc / freq;
+        io->blocked_seconds = s.blockedQpc / freq;
+        io->writes          = s.writes;
+        io->blocked         = s.blocked;
+        io->peak_depth      = s.peakDepth;
+    }
+
+    BlockFree(aw->cur.buf);
+    for (uint8_t* b : aw->spare) BlockFree(b);
+    for (const AwBlock& b : aw->queue) BlockFree(b.buf);
+    if (aw->direct != kNoFile) FileClose(aw->direct);
+    if (aw->file   != kNoFile) FileClose(aw->file);
+    delete aw;
+    return ok;
+}
+
+int OpenOutputAsync(AVIOContext** pb, const char* path, bool unbuffered) {
+    *pb = nullptr;
+    FileHandle h = FileCreate(path);
+    if (h == kNoFile) return AVERROR(EIO);
+
+    AsyncWriter* aw = new AsyncWriter();
+    aw->file = h;
+    StringCchCopyA(aw->name, sizeof(aw->name), BaseName(path));
+    if (unbuffered) {
+        aw->direct = FileOpenDirectWrite(path);
+        if (aw->direct == kNoFile) {
+            char dbg[160];
+            StringCchPrintfA(dbg, sizeof(dbg),
+                "AsyncWriter %s: no unbuffered handle; writing through the cache.\n", aw->name);
+            EngineLog(dbg);
+        }
+    }
+    aw->thread = std::thread(AsyncWriterThreadProc, aw);
+
+    uint8_t* iobuf = (uint8_t*)av_malloc(kRaIoBuf);
+    *pb = iobuf ? avio_alloc_context(iobuf, kRaIoBuf, 1, aw, nullptr, AsyncWriterWrite, AsyncWriterSeek)
+                : nullptr;
+    if (!*pb) {
+        av_free(iobuf);
+        AsyncWriterFree(aw);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+bool CloseOutput(AVIOContext** pb, OutputIoStats* io) {
+    if (io) *io = OutputIoStats();
+    if (!*pb) return true;
+    if ((*pb)->write_packet != AsyncWriterWrite) {
+        avio_closep(pb);
+        return true;
+    }
+    avio_flush(*pb);
+    AsyncWriter* aw = (AsyncWriter*)(*pb)->opaque;
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+    return AsyncWriterFree(aw, io);
+}
@@ -0,0 +1,44 @@
+﻿// fileio.h
+// AVIOContexts for the transcode's own file I/O: a read-ahead input and an
+// asynchronous, block-gathering output.
+
+#pragma once
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// Throughput and stalls of one read-ahead input, reported by CloseInput.
+struct InputIoStats {
+    int64_t  bytes         = 0;       // read from the file
+    double   read_seconds  = 0.0;     // inside the read calls
+    double   stall_seconds = 0.0;     // the demuxer waiting for a block
+    uint32_t reads         = 0;
+    uint32_t stalls        = 0;
+    uint32_t refills       = 0;       // seeks that landed outside the window
+};
+
+// avformat_open_input through a ReadAhead, falling back to FFmpeg's own file
+// protocol when the path cannot be opened directly.  Pair with CloseInput,
+// which fills io (optional) with the read-ahead's stats, or zeros without one.
+int  OpenInputReadAhead(AVFormatContext** fmt, const char* path);
+void CloseInput(AVFormatContext** fmt, InputIoStats* io = nullptr);
+
+// Creates path and wraps it in an AVIOContext backed by an AsyncWriter.
+// Pair with CloseOutput.
+int  OpenOutputAsync(AVIOContext** pb, const char* path, bool unbuffered);
+
+// Throughput and backpressure of one async output, reported by CloseOutput.
+struct OutputIoStats {
+    int64_t  bytes           = 0;
+    double   write_seconds   = 0.0;   // inside the write calls
+    double   blocked_seconds = 0.0;   // the muxer waiting for a free queue slot
+    uint32_t writes          = 0;
+    uint32_t blocked         = 0;     // submits that hit a full queue
+    int      peak_depth      = 0;     // deepest the queue got, in blocks
+};
+
+// Closes an output pb from either OpenOutputAsync or avio_open.  Returns
+// false if the async writer saw a failed write.  io (optional) gets the
+// writer's stats; it is left zero for an avio_open output.
+bool CloseOutput(AVIOContext** pb, OutputIoStats* io = nullptr);
@@ -0,0 +1,244 @@
+﻿// hdr.cpp
+// PQ/HLG → SDR tone mapping shared by the preview, thumbnails and the
+// transcode: transfer functions, the LUTs built from them, the SSE2 Stage 2
+// kernel and the per-frame display conversion around it.
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/mem.h>
+#include <libswscale/swscale.h>
+}
+
+#include "hdr.h"
+#include "platform.h"
+
+#include <atomic>
+#include <cmath>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#endif
+
+// PQ (SMPTE ST 2084) EOTF: normalised [0,1] → linear light [0,1] (1.0 = 10 000 nits)
+static double pq_eotf(double N) {
+    if (N <= 0.0) return 0.0;
+    const double m1 = 0.1593017578125, m2 = 78.84375;
+    const double c1 = 0.8359375,       c2 = 18.8515625, c3 = 18.6875;
+    double p   = pow(N, 1.0 / m2);
+    double num = p - c1; if (num < 0.0) num = 0.0;
+    double den = c2 - c3 * p;
+    return den > 0.0 ? pow(num / den, 1.0 / m1) : 0.0;
+}
+// HLG (ARIB STD-B67) OETF inverse: normalised [0,1] → scene-linear [0,1]
+static double hlg_eotf(double E) {
+    if (E < 0.0) return 0.0;
+    if (E <= 0.5) return (E * E) / 3.0;
+    const double a = 0.17883277, b = 0.28466892, c = 0.55991073;
+    return (exp((E - c) / a) + b) / 12.0;
+}
+// Reinhard tone mapping in linear light; white = reference white level.
+// Maps v=0→0, v=white→1.0, v>white→clamped. Uses 2v/(white+v) so the
+// slope at the origin is 2/white (linear), avoiding the quadratic collapse
+// of the "extended" formula when v << white (common with PQ linear values).
+static inline double reinhard_tm(double v, double white) {
+    return 2.0 * v / (white + v);
+}
+// sRGB OETF: linear [0,1] → gamma-encoded uint8
+static inline uint8_t srgb_pack(double v) {
+    double g = (v <= 0.0031308) ? 12.92 * v : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+    int i = (int)(g * 255.0 + 0.5);
+    return (uint8_t)(i < 0 ? 0 : i > 255 ? 255 : i);
+}
+// BT.2020 → BT.709 primaries matrix (linear RGB)
+static const double k_bt2020_to_bt709[3][3] = {
+    { 1.6605, -0.5876, -0.0728 },
+    {-0.1246,  1.1329, -0.0083 },
+    {-0.0182, -0.1006,  1.1187 }
+};
+// Float copy for vectorisable inner loops
+static const float k_bt2020_to_bt709f[3][3] = {
+    { 1.6605f, -0.5876f, -0.0728f },
+    {-0.1246f,  1.1329f, -0.0083f },
+    {-0.0182f, -0.1006f,  1.1187f }
+};
+
+// ----- Tone-mapping LUTs shared by display and transcode (one immutable set per transfer function) -----
+// eotf[i] = EOTF(i/65535) — eliminates all pow() calls in Stage 2.  Built
+// once on first use and never written again, so any number of sessions and
+// display threads read them without locking, whatever mix of PQ and HLG
+// sources they are converting.
+struct ToneMapLuts {
+    float eotf[65536];
+    float refW;          // Reinhard reference white for this transfer function
+};
+// s_srgb_lut16[i] = sRGB_encode(i/65535) as uint8 — eliminates sRGB pow() calls.
+static uint8_t        s_srgb_lut16[65536] = {};
+static std::once_flag s_srgbOnce;
+static ToneMapLuts    s_lutsPQ, s_lutsHLG;
+static std::once_flag s_pqOnce, s_hlgOnce;
+
+static void BuildToneMappingLuts(ToneMapLuts& luts, bool isPQ) {
+    for (int i = 0; i < 65536; i++) {
+        double v = i / 65535.0;
+        luts.eotf[i] = isPQ ? (float)pq_eotf(v) : (float)hlg_eotf(v);
+    }
+    luts.refW = isPQ ? 0.0203f : 0.25f;
+}
+
+const ToneMapLuts* GetToneMapLuts(bool isPQ) {
+    std::call_once(s_srgbOnce, [] {
+        for (int i = 0; i < 65536; i++)
+            s_srgb_lut16[i] = srgb_pack(i / 65535.0);
+    });
+    if (isPQ) std::call_once(s_pqOnce,  [] { BuildToneMappingLuts(s_lutsPQ,  true);  });
+    else      std::call_once(s_hlgOnce, [] { BuildToneMappingLuts(s_lutsHLG, false); });
+    return isPQ ? &s_lutsPQ : &s_lutsHLG;
+}
+
+// Stage 2 kernel: RGB48 (PQ/HLG-encoded BT.2020) → BGR24 sRGB.
+// EOTF (LUT) → BT.2020→BT.709 → Reinhard → sRGB (LUT).  SSE2 does the matrix,
+// clamp, tone curve and quantisation four pixels at a time; the LUT lookups
+// themselves stay scalar since SSE2 has no gather.
+static void HdrRowsToBgr(const uint8_t* srcBuf, int srcStride, uint8_t* dstBuf, int dstStride,
+                         int w, int rStart, int rEnd, const ToneMapLuts* luts) {
+    const float (*k)[3] = k_bt2020_to_bt709f;
+    const float* eotf = luts->eotf;
+    const float  refW = luts->refW;
+    for (int row = rStart; row < rEnd; row++) {
+        const uint16_t* s = (const uint16_t*)(srcBuf + (size_t)row * srcStride);
+        uint8_t*        d = dstBuf + (size_t)row * dstStride;
+        int x = 0;
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+        const __m128 m00 = _mm_set1_ps(k[0][0]), m01 = _mm_set1_ps(k[0][1]), m02 = _mm_set1_ps(k[0][2]);
+        const __m128 m10 = _mm_set1_ps(k[1][0]), m11 = _mm_set1_ps(k[1][1]), m12 = _mm_set1_ps(k[1][2]);
+        const __m128 m20 = _mm_set1_ps(k[2][0]), m21 = _mm_set1_ps(k[2][1]), m22 = _mm_set1_ps(k[2][2]);
+        const __m128 zero = _mm_setzero_ps(), two = _mm_set1_ps(2.0f), white = _mm_set1_ps(refW);
+        const __m128 scale = _mm_set1_ps(65535.0f), half = _mm_set1_ps(0.5f);
+        alignas(16) int32_t ir[4], ig[4], ib[4];
+        for (; x + 4 <= w; x += 4) {
+            const uint16_t* p = s + x * 3;
+            __m128 R = _mm_setr_ps(eotf[p[0]], eotf[p[3]], eotf[p[6]], eotf[p[9]]);
+            __m128 G = _mm_setr_ps(eotf[p[1]], eotf[p[4]], eotf[p[7]], eotf[p[10]]);
+            __m128 B = _mm_setr_ps(eotf[p[2]], eotf[p[5]], eotf[p[8]], eotf[p[11]]);
+            __m128 Ro = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, R), _mm_mul_ps(m01, G)), _mm_mul_ps(m02, B));
+            __m128 Go = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m10, R), _mm_mul_ps(m11, G)), _mm_mul_ps(m12, B));
+            __m128 Bo = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m20, R), _mm_mul_ps(m21, G)), _mm_mul_ps(m22, B));
+            Ro = _mm_max_ps(Ro, zero); Go = _mm_max_ps(Go, zero); Bo = _mm_max_ps(Bo, zero);
+            Ro = _mm_div_ps(_mm_mul_ps(two, Ro), _mm_add_ps(white, Ro));
+            Go = _mm_div_ps(_mm_mul_ps(two, Go), _mm_add_ps(white, Go));
+            Bo = _mm_div_ps(_mm_mul_ps(two, Bo), _mm_add_ps(white, Bo));
+            Ro = _mm_min_ps(_mm_add_ps(_mm_mul_ps(Ro, scale), half), scale);
+            Go = _mm_min_ps(_mm_add_ps(_mm_mul_ps(Go, scale), half), scale);
+            Bo = _mm_min_ps(_mm_add_ps(_mm_mul_ps(Bo, scale), half), scale);
+            _mm_store_si128((__m128i*)ir, _mm_cvttps_epi32(Ro));
+            _mm_store_si128((__m128i*)ig, _mm_cvttps_epi32(Go));
+            _mm_store_si128((__m128i*)ib, _mm_cvttps_epi32(Bo));
+            uint8_t* o = d + x * 3;
+            for (int i = 0; i < 4; i++) {
+                o[i*3+0] = s_srgb_lut16[ib[i]];
+                o[i*3+1] = s_srgb_lut16[ig[i]];
+                o[i*3+2] = s_srgb_lut16[ir[i]];
+            }
+        }
+#endif
+        for (; x < w; x++) {
+            float R = eotf[s[x*3+0]];
+            float G = eotf[s[x*3+1]];
+            float B = eotf[s[x*3+2]];
+            float Ro = k[0][0]*R + k[0][1]*G + k[0][2]*B;
+            float Go = k[1][0]*R + k[1][1]*G + k[1][2]*B;
+            float Bo = k[2][0]*R + k[2][1]*G + k[2][2]*B;
+            if (Ro < 0.0f) Ro = 0.0f;
+            if (Go < 0.0f) Go = 0.0f;
+            if (Bo < 0.0f) Bo = 0.0f;
+            Ro = 2.0f * Ro / (refW + Ro);
+            Go = 2.0f * Go / (refW + Go);
+            Bo = 2.0f * Bo / (refW + Bo);
+            int r = (int)(Ro * 65535.0f + 0.5f); if (r > 65535) r = 65535;
+            int g = (int)(Go * 65535.0f + 0.5f); if (g > 65535) g = 65535;
+            int b = (int)(Bo * 65535.0f + 0.5f); if (b > 65535) b = 65535;
+            d[x*3+0] = s_srgb_lut16[b];
+            d[x*3+1] = s_srgb_lut16[g];
+            d[x*3+2] = s_srgb_lut16[r];
+        }
+    }
+}
+
+// Images currently being split across workers, process-wide.  Each caller
+// takes its share of the cores, so concurrent transcodes and the preview
+// don't each start a full set of threads per frame.
+static std::atomic<int> s_activeSplits{0};
+
+// Runs the Stage 2 kernel over a whole image, split across up to 8 threads
+// for frame-sized images.  Thumbnails stay on the calling thread.
+void HdrRgb48ToBgr(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride,
+                   int w, int h, const ToneMapLuts* luts) {
+    static const int nCores = max(1, min(8, (int)std::thread::hardware_concurrency()));
+    if (nCores > 1 && h >= nCores * 32) {
+        int active   = ++s_activeSplits;
+        int nWorkers = max(1, nCores / active);
+        int rowsEach = (h + nWorkers - 1) / nWorkers;
+        std::vector<std::future<void>> futures;
+        futures.reserve(nWorkers);
+        // The calling thread does the first band itself.
+        for (int t = 1; t < nWorkers; t++) {
+            int r0 = t * rowsEach;
+            int r1 = min(r0 + rowsEach, h);
+            if (r0 >= h) break;
+            futures.push_back(std::async(std::launch::async, HdrRowsToBgr,
+                src, srcStride, dst, dstStride, w, r0, r1, luts));
+        }
+        HdrRowsToBgr(src, srcStride, dst, dstStride, w, 0, min(rowsEach, h), luts);
+        for (auto& f : futures) f.get();
+        --s_activeSplits;
+    } else {
+        HdrRowsToBgr(src, srcStride, dst, dstStride, w, 0, h, luts);
+    }
+}
+
+// ------------------------------ Display Conversion ------------------------------
+int HdrTrcOf(const AVFrame* f, bool srcIsHdr, int srcTrc) {
+    if (f->color_trc == AVCOL_TRC_SMPTE2084 || f->color_trc == AVCOL_TRC_ARIB_STD_B67)
+        return f->color_trc;
+    if (!srcIsHdr) return 0;
+    return (srcTrc == AVCOL_TRC_SMPTE2084) ? AVCOL_TRC_SMPTE2084 : AVCOL_TRC_ARIB_STD_B67;
+}
+
+void HdrDisplayConvFree(HdrDisplayConv& conv) {
+    if (conv.sws)   sws_freeContext(conv.sws);
+    if (conv.rgb48) av_free(conv.rgb48);
+    conv = HdrDisplayConv();
+}
+
+bool HdrFrameToBgr(HdrDisplayConv& conv, const AVFrame* f, int trc,
+                   int dstW, int dstH, uint8_t* dst, int dstStride) {
+    SwsContext* prev = conv.sws;
+    conv.sws = sws_getCachedContext(conv.sws, f->width, f->height, (AVPixelFormat)f->format,
+        dstW, dstH, AV_PIX_FMT_RGB48LE, SWS_BILINEAR, nullptr, nullptr, nullptr);
+    if (!conv.sws) return false;
+    int srcCs    = (f->colorspace == AVCOL_SPC_BT2020_NCL || f->colorspace == AVCOL_SPC_BT2020_CL)
+                   ? SWS_CS_BT2020 : SWS_CS_ITU709;
+    int srcRange = (f->color_range == AVCOL_RANGE_JPEG) ? 1 : 0;
+    if (conv.sws != prev || conv.cs != srcCs || conv.range != srcRange) {
+        sws_setColorspaceDetails(conv.sws,
+            sws_getCoefficients(srcCs),         srcRange,
+            sws_getCoefficients(SWS_CS_ITU709), 1, 0, 1 << 16, 1 << 16);
+        conv.cs = srcCs; conv.range = srcRange;
+    }
+    int    stride48 = dstW * 6;
+    size_t need     = (size_t)stride48 * dstH;
+    if (need > conv.rgb48Cap) {
+        av_free(conv.rgb48);
+        conv.rgb48    = (uint8_t*)av_malloc(need);
+        conv.rgb48Cap = conv.rgb48 ? need : 0;
+        if (!conv.rgb48) return false;
+    }
+    uint8_t* d[1] = { conv.rgb48 }; int s[1] = { stride48 };
+    sws_scale(conv.sws, f->data, f->linesize, 0, f->height, d, s);
+    HdrRgb48ToBgr(conv.rgb48, stride48, dst, dstStride, dstW, dstH,
+                  GetToneMapLuts(trc == AVCOL_TRC_SMPTE2084));
+    return true;
+}
@@ -0,0 +1,47 @@
+﻿// hdr.h
+// PQ/HLG → SDR tone mapping shared by the preview, thumbnails and the transcode.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct AVFrame;
+struct SwsContext;
+
+// Guard for older FFmpeg builds that don't define SWS_CS_BT2020
+#ifndef SWS_CS_BT2020
+#define SWS_CS_BT2020 9
+#endif
+
+// EOTF + sRGB tables for one transfer function.  Built on the first request
+// and read-only from then on; the pointer stays valid for the process.
+struct ToneMapLuts;
+const ToneMapLuts* GetToneMapLuts(bool isPQ);
+
+// Stage 2: RGB48 (PQ/HLG-encoded BT.2020) → BGR24 sRGB over a whole image,
+// split across threads for frame-sized images.
+void HdrRgb48ToBgr(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride,
+                   int w, int h, const ToneMapLuts* luts);
+
+// Transfer characteristic to tone-map a decoded frame with: the frame's own
+// PQ/HLG tag, else the container's (srcIsHdr/srcTrc from probing; BT.2020
+// files without a TRC tag are treated as HLG).  0 = SDR, convert normally.
+int HdrTrcOf(const AVFrame* f, bool srcIsHdr, int srcTrc);
+
+// Display-side HDR conversion state: a cached native→RGB48 scaler at the
+// destination size plus its scratch buffer.  One per consumer thread.
+struct HdrDisplayConv {
+    SwsContext* sws      = nullptr;
+    int         cs       = -1, range = -1;   // colourspace details applied to sws
+    uint8_t*    rgb48    = nullptr;
+    size_t      rgb48Cap = 0;
+};
+
+void HdrDisplayConvFree(HdrDisplayConv& conv);
+
+// Converts a PQ/HLG frame (trc from HdrTrcOf) to BGR24 at dstW x dstH.
+// Scaling happens in the RGB48 stage so the tone-mapping kernel only touches
+// destination pixels.
+bool HdrFrameToBgr(HdrDisplayConv& conv, const AVFrame* f, int trc,
+                   int dstW, int dstH, uint8_t* dst, int dstStride);
@@ -0,0 +1,91 @@
+﻿// hwaccel.cpp
+// NVDEC device and decoder selection, shared by every decode path, and the
+// NVENC probe the encode queue schedules by.
+
+#include "hwaccel.h"
+
+#include <mutex>
+
+static AVBufferRef* g_hwDeviceCtx    = nullptr;  // CUDA device; null = no NVDEC available
+static bool         g_nvdecAvailable = false;
+
+static const char* get_cuvid_name(AVCodecID id) {
+    switch (id) {
+        case AV_CODEC_ID_H264:       return "h264_cuvid";
+        case AV_CODEC_ID_HEVC:       return "hevc_cuvid";
+        case AV_CODEC_ID_AV1:        return "av1_cuvid";
+        case AV_CODEC_ID_VP9:        return "vp9_cuvid";
+        case AV_CODEC_ID_VP8:        return "vp8_cuvid";
+        case AV_CODEC_ID_MPEG2VIDEO: return "mpeg2_cuvid";
+        case AV_CODEC_ID_MPEG4:      return "mpeg4_cuvid";
+        case AV_CODEC_ID_VC1:        return "vc1_cuvid";
+        default: return nullptr;
+    }
+}
+
+static AVPixelFormat get_hw_format(AVCodecContext*, const AVPixelFormat* pix_fmts) {
+    for (const AVPixelFormat* p = pix_fmts; *p != AV_PIX_FMT_NONE; p++)
+        if (*p == AV_PIX_FMT_CUDA) return AV_PIX_FMT_CUDA;
+    return pix_fmts[0];
+}
+
+void TryInitHWDevice() {
+    if (g_hwDeviceCtx) return;
+    if (av_hwdevice_ctx_create(&g_hwDeviceCtx, AV_HWDEVICE_TYPE_CUDA,
+                               nullptr, nullptr, 0) >= 0)
+        g_nvdecAvailable = true;
+}
+
+// Returns best decoder for codec_id: cuvid (NVDEC) if available, else software.
+// Sets using_hw=true when a hardware decoder was found.
+const AVCodec* find_best_decoder(AVCodecID id, bool& using_hw) {
+    using_hw = false;
+    if (g_nvdecAvailable) {
+        const char* name = get_cuvid_name(id);
+        if (name) {
+            const AVCodec* hw = avcodec_find_decoder_by_name(name);
+            if (hw) { using_hw = true; return hw; }
+        }
+    }
+    return avcodec_find_decoder(id);
+}
+
+void ReleaseHWDevice() {
+    if (g_hwDeviceCtx) av_buffer_unref(&g_hwDeviceCtx);
+    g_nvdecAvailable = false;
+}
+
+void AttachHwDevice(AVCodecContext* dec_ctx) {
+    if (!g_hwDeviceCtx) return;
+    dec_ctx->hw_device_ctx = av_buffer_ref(g_hwDeviceCtx);
+    dec_ctx->get_format    = get_hw_format;
+}
+
+AVFrame* HwFrameToCpu(AVFrame* frame, AVFrame** cpu) {
+    if (frame->format != AV_PIX_FMT_CUDA) return frame;
+    if (!*cpu) *cpu = av_frame_alloc();
+    if (!*cpu || av_hwframe_transfer_data(*cpu, frame, 0) < 0) return frame;
+    av_frame_copy_props(*cpu, frame);
+    return *cpu;
+}
+
+// Opening a small h264_nvenc context is the only reliable test: the encoder
+// is compiled into most FFmpeg builds whether or not an NVIDIA GPU (and a
+// free encode session) is present.
+bool HwEncodeAvailable() {
+    static std::once_flag once;
+    static bool           available = false;
+    std::call_once(once, [] {
+        const AVCodec* enc = avcodec_find_encoder_by_name("h264_nvenc");
+        if (!enc) return;
+        AVCodecContext* ctx = avcodec_alloc_context3(enc);
+        if (!ctx) return;
+        ctx->width     = 256;
+        ctx->height    = 256;
+        ctx->pix_fmt   = AV_PIX_FMT_YUV420P;
+        ctx->time_base = { 1, 30 };
+        available = avcodec_open2(ctx, enc, nullptr) >= 0;
+        avcodec_free_context(&ctx);
+    });
+    return available;
+}
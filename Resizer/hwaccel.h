@@ -0,0 +1,29 @@
+﻿// hwaccel.h
+// NVIDIA hardware decode (NVDEC via cuvid decoders and a CUDA device).  The
+// device is process-wide: created once by TryInitHWDevice and shared by
+// every decoder that picks a cuvid codec.
+
+#pragma once
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/hwcontext.h>
+}
+
+// Creates the CUDA device; failure just leaves NVDEC off.
+void TryInitHWDevice();
+void ReleaseHWDevice();
+
+// Returns best decoder for codec_id: cuvid (NVDEC) if available, else software.
+// Sets using_hw=true when a hardware decoder was found.
+const AVCodec* find_best_decoder(AVCodecID id, bool& using_hw);
+
+// Gives a cuvid decoder context the CUDA device; call before avcodec_open2.
+void AttachHwDevice(AVCodecContext* dec_ctx);
+
+// Returns frame itself, or for a CUDA frame its CPU copy in *cpu (allocated
+// on first use, reused after) with the frame's properties.
+AVFrame* HwFrameToCpu(AVFrame* frame, AVFrame** cpu);
+
+// True if an h264_nvenc encoder can actually be opened here (tested once).
+bool HwEncodeAvailable();
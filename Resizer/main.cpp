@@ -13,6 +13,7 @@
 #include <vector>
 #include <algorithm>
 #include <cmath>
+#include <cfloat>
 #include <future>
 #include <thread>
 #include <gdiplus.h>
@@ -31,6 +32,9 @@
 #include <mmsystem.h>
 #pragma comment(lib, "winmm.lib")
 #include <deque>
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#endif
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -48,6 +52,14 @@ extern "C" {
 #include <libavfilter/buffersrc.h>
 }
 
+#include "platform.h"
+#include "hdr.h"
+#include "hwaccel.h"
+#include "media.h"
+#include "thumbnail.h"
+#include "transcode.h"
+#include "queue.h"
+
 // ------------------------------ Resource IDs ------------------------------
 #define IDI_APPICON                  101
 
@@ -63,6 +75,11 @@ extern "C" {
 #define IDC_START_EDIT            1013
 #define IDC_END_STATIC            1014
 #define IDC_END_EDIT              1015
+#define IDC_QUEUE_BUTTON          1016
+#define IDC_RANGE_ADD_BUTTON      1017
+#define IDC_RANGE_CLEAR_BUTTON    1018
+#define IDC_RANGE_LIST_STATIC     1019
+#define IDC_RANGE_SPLIT_CHECK     1020
 #define IDC_SCALE_FULL_RADIO      1004
 #define IDC_SCALE_HALF_RADIO      1005
 #define IDC_SCALE_QUARTER_RADIO   1006
@@ -77,15 +94,26 @@ extern "C" {
 #define IDC_BTN_GOTO_MARKIN       2007
 #define IDC_BTN_GOTO_MARKOUT      2008
 #define IDC_BTN_ZOOM              2009
+#define IDC_BTN_RATE              2010
+#define IDC_BTN_LOOP              2011
 
 #define IDT_UI_REFRESH            3001
 #define IDT_ENCODE_PROGRESS       3002
+#define IDT_PREVIEW_RESIZE        3003
+#define IDT_SCRUB_SETTLE          3004
+#define IDT_QUEUE_REFRESH         3005
 
 #define IDM_ABOUT                 9001
+#define IDM_MP4_FASTSTART         9002
+#define IDM_MP4_RESERVE_MOOV      9003
+#define IDM_MP4_FRAGMENTED        9004
+#define IDM_UNBUFFERED_OUTPUT     9005
+#define IDM_ENCODE_QUEUE          9006
 #define APP_VERSION               L"1.9"
 
 #define WM_APP_THUMBS_READY  (WM_APP + 3)
 #define WM_APP_ENCODE_DONE   (WM_APP + 4)
+#define WM_APP_QUEUE_CHANGED (WM_APP + 5)
 
 #define IDC_GRP_SETTINGS          2010
 #define IDC_GRP_RANGE             2011
@@ -106,6 +134,16 @@ extern "C" {
 #define IDC_GRP_COLOR             2026
 #define IDC_COLOR_DROP            2027
 
+// Encode queue window
+#define IDC_QUEUE_LIST            2030
+#define IDC_QUEUE_PAUSE           2031
+#define IDC_QUEUE_UP              2032
+#define IDC_QUEUE_DOWN            2033
+#define IDC_QUEUE_CANCEL          2034
+#define IDC_QUEUE_RETRY           2035
+#define IDC_QUEUE_REMOVE          2036
+#define IDC_QUEUE_CLEAR           2037
+
 // ------------------------------ Globals ------------------------------
 #define WM_APP_FRAME_READY (WM_APP + 1)
 static HWND     g_mainHwnd = nullptr;
@@ -128,6 +166,11 @@ static HWND     g_hStartStatic = nullptr;
 static HWND     g_hStartEdit = nullptr;
 static HWND     g_hEndStatic = nullptr;
 static HWND     g_hEndEdit = nullptr;
+static HWND     g_hRangeAddBtn = nullptr;
+static HWND     g_hRangeClearBtn = nullptr;
+static HWND     g_hRangeListStatic = nullptr;
+static HWND     g_hRangeSplitCheck = nullptr;
+static std::vector<TranscodeRange> g_ranges;   // "Add Range" list; when set, Start exports these in one pass
 static HWND     g_hFullRadio = nullptr;
 static HWND     g_hHalfRadio = nullptr;
 static HWND     g_hQuarterRadio = nullptr;
@@ -139,9 +182,13 @@ static int      g_tlMax     = 1000;      // duration in ms
 static bool     g_tlEnabled = false;
 
 static HBITMAP  g_thumbs[21] = {};       // filmstrip thumbnails (0%..100% in 5% steps)
-static int      g_thumbW = 0, g_thumbH = 0;
+static const int kThumbH = 90;           // filmstrip thumbnail height
+static int      g_thumbW = 0, g_thumbH = 0;   // set on the UI thread before the workers start
 static HANDLE   g_thumbThread   = nullptr;
 static volatile bool g_thumbThreadStop = false;
+static CRITICAL_SECTION g_csThumbs;      // guards g_thumbs[] slot swaps from the refinement pass
+static bool     g_thumbFastMode = true;  // keyframe-only (and lowres) first pass
+static bool     g_thumbRefine   = true;  // then replace coarse thumbs with exact-time frames
 static HWND     g_hBtnPlayPause = nullptr;
 static HWND     g_hBtnFwd = nullptr;
 static HWND     g_hBtnBack = nullptr;
@@ -151,17 +198,30 @@ static HWND     g_hBtnGotoMarkIn  = nullptr;
 static HWND     g_hBtnGotoMarkOut = nullptr;
 static int64_t  g_markInMs  = -1;   // -1 = not set
 static int64_t  g_markOutMs = -1;
+static volatile bool g_loopAB = false;   // play Mark In..Mark Out round and round
 
 static HWND     g_hBtnZoom         = nullptr;
+static HWND     g_hBtnRate         = nullptr;
+static HWND     g_hBtnLoop         = nullptr;
 static bool     g_isZoomed         = false;
 static int64_t  g_zoomCenterMs     = 0;
 static int64_t  g_zoomStartMs      = 0;
 static int64_t  g_zoomEndMs        = 0;
-static HANDLE   g_zoomThumbThread  = nullptr;
-static volatile bool g_zoomThumbStop = false;
-static HBITMAP  g_zoomThumbs[21]   = {};
 static double   g_thumbTimes[21]   = {};      // absolute time (seconds) for each normal thumbnail
-static double   g_zoomThumbTimes[21] = {};    // absolute time (seconds) for each zoom thumbnail
+static double   g_zoomThumbTimes[21] = {};    // absolute time (seconds) for each zoom slot
+
+// Thumbnail atlas (zoomed timeline + hover preview)
+static CRITICAL_SECTION g_csAtlas;           // guards g_atlas[] tables and the focus window
+static HANDLE   g_atlasThread      = nullptr;
+static HANDLE   g_atlasWake        = nullptr; // auto-reset; signalled when the focus moves
+static volatile bool g_atlasStop   = false;
+static HWND     g_hHoverWnd        = nullptr; // popup preview above the timeline
+static double   g_hoverSec         = 0.0;
+static bool     g_hoverTracking    = false;   // TrackMouseEvent(TME_LEAVE) armed
+
+// Audio peak index (timeline waveform)
+static CRITICAL_SECTION g_csPeaks;           // guards g_peaks and each index's ready/finished flags
+static HANDLE   g_peaksThread      = nullptr;
 
 static HWND     g_hGrpSettings   = nullptr;
 static HWND     g_hGrpRange      = nullptr;
@@ -194,18 +254,22 @@ static HWND     g_hGrpColor        = nullptr;
 static HWND     g_hColorDrop       = nullptr;
 static bool     g_isHdr            = false;
 static int      g_hdrTrc           = 0;   // AVColorTransferCharacteristic of source
-static uint8_t  g_hdrDisplay8Lut[256] = {};
-static bool     g_hdrLutValid      = false;
-
-// Hardware acceleration (NVDEC/NVENC)
-static AVBufferRef* g_hwDeviceCtx   = nullptr;  // CUDA device; null = no NVDEC available
-static bool         g_nvdecAvailable = false;
-
-// Encode progress (background thread)
-static volatile float  g_encodeProgress = 0.0f;  // 0.0..1.0
-static volatile bool   g_encodeRunning  = false;
-static HANDLE          g_encodeThread   = nullptr;
-static char            g_encodeOutPath[MAX_PATH] = {};
+
+// Media session for the loaded file (pool of open demuxer+decoder readers)
+struct MediaSession;
+static MediaSession* g_session      = nullptr;
+
+// The Start button's encode; progress, cancel and stats live in the session.
+static TranscodeSession* g_encode       = nullptr;
+static int             g_mp4Layout      = MP4_RESERVE_MOOV;
+static HMENU           g_hMp4Menu       = nullptr;  // "Output" submenu of the system menu
+static bool            g_unbufferedOutput = false;  // bypass the file cache for aligned output blocks
+// Batch encodes from "Add to Queue"; the queue window lists and steers them.
+static EncodeQueue*    g_queue          = nullptr;
+static HWND            g_hQueueButton   = nullptr;
+static HWND            g_hQueueWnd      = nullptr;
+static HWND            g_hQueueList     = nullptr;
+static HWND            g_hQueuePauseBtn = nullptr;
 static int             g_videoTop       = 0;   // client-y where video preview starts (below start button)
 
 // ------------------------------ Theme ------------------------------
@@ -227,21 +291,26 @@ static HBRUSH   g_hEditBrush = nullptr;  // edit control background brush
 static HBITMAP  g_hFrameBitmap = nullptr;
 static int      g_frameWidth = 0;
 static int      g_frameHeight = 0;
+// Box the preview is painted into; decode threads convert frames straight to
+// the size that fits it (PreviewTargetSize) instead of full source resolution.
+static volatile LONG g_previewW = 0;
+static volatile LONG g_previewH = 0;
+static volatile bool g_previewNative = false;  // 1:1 inspection, toggled by double-clicking the preview
 
 static HANDLE   g_hPlaybackThread = nullptr;
 static CRITICAL_SECTION g_csState;
 static CRITICAL_SECTION g_csMarkCache;
 static volatile bool g_playThreadShouldExit = false;
 static volatile bool g_isPlaying = false;
-static volatile bool g_seekRequested = false;
-static volatile int64_t g_seekTargetMs = 0;
 static volatile int64_t g_currentPosMs = 0;
-static volatile bool g_decodeSingleFrame = false;
+static const double  kPlayRates[]    = { 0.25, 0.5, 1.0, 2.0, 4.0, 8.0 };
+static const int     kPlayRateCount  = (int)(sizeof(kPlayRates) / sizeof(kPlayRates[0]));
+static const int     kPlayRateNormal = 2;
+static volatile LONG g_playRateIdx   = kPlayRateNormal;   // index into kPlayRates
 static double   g_videoFPS = 30.0;
 static bool     g_playerReady = false;
-static volatile int  g_stepDir = 0; // +1 forward, -1 backward
-static volatile bool g_stepFileReady = false; // thread file ptr is right after last step-decoded frame
 static bool          g_isDragging   = false; // true while user drags the seekbar thumb
+static bool          g_scrubResume  = false; // drag paused playback; resume it on release
 static bool          g_isGenerating = false; // true while a seek-frame decode is in flight
 
 // Forward declarations
@@ -251,16 +320,28 @@ static bool IsSystemDarkMode();
 static void ApplyTheme(HWND hwnd);
 void HandleResize(HWND hwnd, int clientW, int clientH);
 static unsigned __stdcall ThumbExtractThreadProc(void* param);
-static unsigned __stdcall ZoomThumbThreadProc(void* param);
+static void ThumbStop();
+static void DrawPlayStats(HDC hdc, int x, int y);
+static int ThumbWidthFor(int srcW, int srcH, int h);
+static unsigned __stdcall AtlasThreadProc(void* param);
+static void AtlasStart(double duration);
+static void AtlasStop();
+static void AtlasFocusView(double hint);
+static void PeaksStart(const char* path, int stream);
+static void PeaksStop(bool wait = false);
+struct ThumbDecoder;
+static bool ScrubKeyframe(ThumbDecoder*& td, MediaSession* session, int w, int h, double t,
+                          uint8_t* dst, int dstStride, double* outSecs);
+static void ScrubDecoderFree(ThumbDecoder*& td);
+static void TimelineHover(HWND hwnd, int x);
+LRESULT CALLBACK HoverPreviewWndProc(HWND, UINT, WPARAM, LPARAM);
+LRESULT CALLBACK QueueWndProc(HWND, UINT, WPARAM, LPARAM);
 bool GetVideoInfo(const char* filepath, int& width, int& height, double& durationSeconds);
-HBITMAP ExtractMiddleFrameBitmap(const char* filepath, int orig_w, int orig_h, double duration);
-bool TranscodeWithSizeAndScale(const char* in_filename, const char* out_filename, double target_size_mb,
-    int scale_factor, int orig_w, int orig_h, double start_seconds, double end_seconds,
-    int audio_stream_index = -1, int subtitle_stream_index = -1, bool convert_hdr_to_sdr = false,
-    const char* ext_subtitle_path = nullptr);
+HBITMAP ExtractMiddleFrameBitmap(MediaSession* session, int orig_w, int orig_h, double duration);
 
 // Audio/subtitle track enumeration
 static void PopulateAudioAndSubsDropdowns(const char* filepath);
+static int  SelectedAudioStream();
 static void ScanExternalSubtitles(const char* videoPath);
 static void DetectHdr(const char* filepath);
 
@@ -271,6 +352,11 @@ void StopPlayback();
 void TogglePlayPause(HWND hwnd);
 void EnsureThreadRunningPaused(HWND hwnd);
 void SeekMs(int64_t ms, bool decodeSingle);
+void ScrubMs(int64_t ms);
+void SetPlayRate(int idx);
+static void RefreshPreviewFrame(HWND hwnd);
+static void SetPreviewBitmap(HBITMAP bmp);
+static void FrameRingFree();
 static bool IsXvidAvi(const char* filepath);
 static bool RemuxXvidToMp4(const char* in_path, const char* out_path);
 void StepForward(HWND hwnd);
@@ -278,77 +364,409 @@ void StepBackward(HWND hwnd);
 void UpdateSeekbarFromPos();
 void SetMarkInFromCurrent(HWND hwnd);
 void SetMarkOutFromCurrent(HWND hwnd);
+void RangeListChanged();
+
+// ------------------------------ Media Session ------------------------------
+// One MediaSession per loaded file.  It keeps a small pool of ready-to-use
+// readers (demuxer + video decoder, plus an audio decoder for playback) that
+// subsystems lease and hand back instead of paying avformat_open_input,
+// avformat_find_stream_info and avcodec_open2 on every interaction — which is
+// expensive for NVDEC and for MKVs with many streams.
+//
+// Readers are keyed by profile and lowres factor.  A returned reader is flushed
+// and parked; callers must seek before decoding.  Closing the session frees the
+// idle readers immediately; readers still leased are freed when returned, and
+// the session itself goes away with the last one.
+
+enum ReaderProfile {
+    READER_PLAYBACK,   // NVDEC when available, first audio stream decoder opened too
+    READER_THUMB,      // software video decoder only; other streams discarded at the demuxer
+};
 
-// ------------------------------ NVIDIA Hardware Acceleration ------------------------------
-static const char* get_cuvid_name(AVCodecID id) {
-    switch (id) {
-        case AV_CODEC_ID_H264:       return "h264_cuvid";
-        case AV_CODEC_ID_HEVC:       return "hevc_cuvid";
-        case AV_CODEC_ID_AV1:        return "av1_cuvid";
-        case AV_CODEC_ID_VP9:        return "vp9_cuvid";
-        case AV_CODEC_ID_VP8:        return "vp8_cuvid";
-        case AV_CODEC_ID_MPEG2VIDEO: return "mpeg2_cuvid";
-        case AV_CODEC_ID_MPEG4:      return "mpeg4_cuvid";
-        case AV_CODEC_ID_VC1:        return "vc1_cuvid";
-        default: return nullptr;
-    }
+struct MediaSession;
+
+struct MediaReader {
+    MediaSession*    owner       = nullptr;
+    ReaderProfile    profile     = READER_PLAYBACK;
+    int              lowres      = 0;
+    AVFormatContext* fmt_ctx     = nullptr;
+    AVCodecContext*  dec_ctx     = nullptr;
+    AVStream*        videoStream = nullptr;
+    int              videoIdx    = -1;
+    bool             using_hw    = false;
+    AVCodecContext*  aDecCtx     = nullptr;   // READER_PLAYBACK only; null if no decodable audio
+    int              audioIdx    = -1;
+};
+
+struct MediaSession {
+    char             path[MAX_PATH] = {};
+    CRITICAL_SECTION cs;
+    std::vector<MediaReader*> idle;
+    int              leased    = 0;
+    bool             closing   = false;
+    int              srcH      = 0;    // coded height of the video stream
+    int              maxLowres = 0;    // software decoder's lowres limit
+};
+
+static const int kMaxIdleReaders = 7;  // 4 filmstrip workers + atlas + playback + scrub
+
+static void FreeMediaReader(MediaReader* r) {
+    if (!r) return;
+    if (r->aDecCtx) avcodec_free_context(&r->aDecCtx);
+    if (r->dec_ctx) avcodec_free_context(&r->dec_ctx);
+    if (r->fmt_ctx) avformat_close_input(&r->fmt_ctx);
+    delete r;
+}
+
+static MediaReader* OpenMediaReader(MediaSession* s, ReaderProfile profile, int lowres) {
+    MediaReader* r = new MediaReader();
+    r->owner   = s;
+    r->profile = profile;
+    r->lowres  = lowres;
+    bool ok = false;
+    do {
+        if (avformat_open_input(&r->fmt_ctx, s->path, nullptr, nullptr) < 0) break;
+        if (avformat_find_stream_info(r->fmt_ctx, nullptr) < 0) break;
+        for (unsigned i = 0; i < r->fmt_ctx->nb_streams; i++) {
+            if (r->fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) { r->videoIdx = (int)i; break; }
+        }
+        if (r->videoIdx < 0) break;
+        r->videoStream = r->fmt_ctx->streams[r->videoIdx];
+
+        const AVCodec* dec = nullptr;
+        if (profile == READER_PLAYBACK) dec = find_best_decoder(r->videoStream->codecpar->codec_id, r->using_hw);
+        else                            dec = avcodec_find_decoder(r->videoStream->codecpar->codec_id);
+        if (!dec) break;
+        r->dec_ctx = avcodec_alloc_context3(dec);
+        if (!r->dec_ctx) break;
+        if (avcodec_parameters_to_context(r->dec_ctx, r->videoStream->codecpar) < 0) break;
+        if (r->using_hw) AttachHwDevice(r->dec_ctx);
+        r->dec_ctx->lowres = lowres;
+        if (avcodec_open2(r->dec_ctx, dec, nullptr) < 0) break;
+
+        if (profile == READER_THUMB) {
+            // Thumbnails only ever read video; let the demuxer skip everything else.
+            for (unsigned i = 0; i < r->fmt_ctx->nb_streams; i++)
+                if ((int)i != r->videoIdx) r->fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        } else {
+            // Optional audio — failure means silent playback, not an error.
+            for (unsigned i = 0; i < r->fmt_ctx->nb_streams && r->audioIdx < 0; i++)
+                if (r->fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+                    r->audioIdx = (int)i;
+            if (r->audioIdx >= 0) {
+                AVStream* aStream   = r->fmt_ctx->streams[r->audioIdx];
+                const AVCodec* aDec = avcodec_find_decoder(aStream->codecpar->codec_id);
+                r->aDecCtx = aDec ? avcodec_alloc_context3(aDec) : nullptr;
+                if (r->aDecCtx && (avcodec_parameters_to_context(r->aDecCtx, aStream->codecpar) < 0 ||
+                                   avcodec_open2(r->aDecCtx, aDec, nullptr) < 0))
+                    avcodec_free_context(&r->aDecCtx);
+                if (!r->aDecCtx) r->audioIdx = -1;
+            }
+        }
+        ok = true;
+    } while (false);
+
+    if (!ok) { FreeMediaReader(r); return nullptr; }
+    return r;
 }
 
-static AVPixelFormat get_hw_format(AVCodecContext*, const AVPixelFormat* pix_fmts) {
-    for (const AVPixelFormat* p = pix_fmts; *p != AV_PIX_FMT_NONE; p++)
-        if (*p == AV_PIX_FMT_CUDA) return AV_PIX_FMT_CUDA;
-    return pix_fmts[0];
+// Opens a session for path and keeps one playback reader warm, which the
+// middle-frame preview and the first play/step then lease without reopening.
+static MediaSession* MediaSessionOpen(const char* path) {
+    MediaSession* s = new MediaSession();
+    InitializeCriticalSection(&s->cs);
+    StringCchCopyA(s->path, MAX_PATH, path);
+    MediaReader* r = OpenMediaReader(s, READER_PLAYBACK, 0);
+    if (r) {
+        s->srcH = r->videoStream->codecpar->height;
+        const AVCodec* sw = avcodec_find_decoder(r->videoStream->codecpar->codec_id);
+        s->maxLowres = sw ? sw->max_lowres : 0;
+        s->idle.push_back(r);
+    }
+    return s;
 }
 
-static void TryInitHWDevice() {
-    if (av_hwdevice_ctx_create(&g_hwDeviceCtx, AV_HWDEVICE_TYPE_CUDA,
-                               nullptr, nullptr, 0) >= 0)
-        g_nvdecAvailable = true;
+static void MediaSessionDestroy(MediaSession* s) {
+    DeleteCriticalSection(&s->cs);
+    delete s;
 }
 
-// Returns best decoder for codec_id: cuvid (NVDEC) if available, else software.
-// Sets using_hw=true when a hardware decoder was found.
-static const AVCodec* find_best_decoder(AVCodecID id, bool& using_hw) {
-    using_hw = false;
-    if (g_nvdecAvailable) {
-        const char* name = get_cuvid_name(id);
-        if (name) {
-            const AVCodec* hw = avcodec_find_decoder_by_name(name);
-            if (hw) { using_hw = true; return hw; }
+// Leases a reader with the given profile.  lowres is clamped to what the
+// software decoder supports (always 0 for playback readers).
+static MediaReader* MediaSessionLease(MediaSession* s, ReaderProfile profile, int lowres = 0) {
+    if (!s) return nullptr;
+    lowres = (profile == READER_THUMB) ? max(0, min(lowres, s->maxLowres)) : 0;
+    MediaReader* r = nullptr;
+    EnterCriticalSection(&s->cs);
+    for (size_t i = 0; i < s->idle.size(); i++) {
+        if (s->idle[i]->profile == profile && s->idle[i]->lowres == lowres) {
+            r = s->idle[i];
+            s->idle.erase(s->idle.begin() + i);
+            break;
         }
     }
-    return avcodec_find_decoder(id);
+    bool closing = s->closing;
+    if (r || !closing) s->leased++;
+    LeaveCriticalSection(&s->cs);
+    if (r || closing) return r;
+
+    r = OpenMediaReader(s, profile, lowres);
+    if (!r) {
+        EnterCriticalSection(&s->cs);
+        bool last = (--s->leased == 0) && s->closing;
+        LeaveCriticalSection(&s->cs);
+        if (last) MediaSessionDestroy(s);
+    }
+    return r;
+}
+
+// Hands a reader back.  Decoders are flushed and reset so the next lessee starts clean.
+static void MediaSessionReturn(MediaReader* r) {
+    if (!r) return;
+    MediaSession* s = r->owner;
+    avcodec_flush_buffers(r->dec_ctx);
+    r->dec_ctx->skip_frame       = AVDISCARD_DEFAULT;
+    r->dec_ctx->skip_loop_filter = AVDISCARD_DEFAULT;
+    if (r->aDecCtx) avcodec_flush_buffers(r->aDecCtx);
+
+    EnterCriticalSection(&s->cs);
+    bool keep = !s->closing && (int)s->idle.size() < kMaxIdleReaders;
+    if (keep) s->idle.push_back(r);
+    bool last = (--s->leased == 0) && s->closing;
+    LeaveCriticalSection(&s->cs);
+    if (!keep) FreeMediaReader(r);
+    if (last) MediaSessionDestroy(s);
+}
+
+static void MediaSessionClose(MediaSession* s) {
+    if (!s) return;
+    EnterCriticalSection(&s->cs);
+    s->closing = true;
+    std::vector<MediaReader*> idle;
+    idle.swap(s->idle);
+    bool last = (s->leased == 0);
+    LeaveCriticalSection(&s->cs);
+    for (MediaReader* r : idle) FreeMediaReader(r);
+    if (last) MediaSessionDestroy(s);
+}
+
+// Stops every thread that leases readers, then replaces g_session with a fresh
+// session for path (or just closes it when path is null).
+static void ResetMediaSession(const char* path) {
+    StopPlayback();
+    ThumbStop();
+    AtlasStop();
+    PeaksStop();
+    MediaSessionClose(g_session);
+    g_session = path ? MediaSessionOpen(path) : nullptr;
 }
 
 // ------------------------------ Encode Thread ------------------------------
-struct EncodeArgs {
-    char   inPath[MAX_PATH];
-    char   outPath[MAX_PATH];
-    double targetSizeMB;
-    int    scaleFactor;
-    int    origW, origH;
-    double startSecs, endSecs;
-    int    selAudio, selSubs;
-    bool   convertHdrToSdr;
-    HWND   hwnd;
-    char   extSubPath[MAX_PATH]; // external subtitle file (empty = none)
-};
+// Runs on the session's thread; the window tears the session down on
+// WM_APP_ENCODE_DONE.
+static void OnEncodeDone(void* opaque, TranscodeSession* session) {
+    PostMessage((HWND)opaque, WM_APP_ENCODE_DONE, session->Succeeded() ? 1 : 0, 0);
+}
 
-static unsigned __stdcall EncodeThreadProc(void* param) {
-    EncodeArgs* args = (EncodeArgs*)param;
-    g_encodeProgress = 0.0f;
-    StringCchCopyA(g_encodeOutPath, MAX_PATH, args->outPath);
-    bool ok = TranscodeWithSizeAndScale(
-        args->inPath, args->outPath, args->targetSizeMB,
-        args->scaleFactor, args->origW, args->origH,
-        args->startSecs, args->endSecs,
-        args->selAudio, args->selSubs, args->convertHdrToSdr,
-        args->extSubPath[0] ? args->extSubPath : nullptr);
-    g_encodeProgress = ok ? 1.0f : 0.0f;
-    g_encodeRunning  = false;
-    PostMessage(args->hwnd, WM_APP_ENCODE_DONE, ok ? 1 : 0, 0);
-    delete args;
-    return 0;
+// ------------------------------ Encode Queue ------------------------------
+// "Add to Queue" hands the Start button's settings to g_queue instead of
+// running them now; the queue window lists the jobs and steers them.  The
+// queue lives in %LOCALAPPDATA%\Resizer\queue.txt between runs.
+static void QueueStatePath(char* out, size_t size) {
+    out[0] = 0;
+    PWSTR base = nullptr;
+    if (FAILED(SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, nullptr, &base))) return;
+    wchar_t dir[MAX_PATH];
+    StringCchPrintfW(dir, MAX_PATH, L"%s\\Resizer", base);
+    CoTaskMemFree(base);
+    CreateDirectoryW(dir, nullptr);
+    char dirA[MAX_PATH];
+    WideCharToMultiByte(CP_ACP, 0, dir, -1, dirA, MAX_PATH, nullptr, nullptr);
+    StringCchPrintfA(out, size, "%s\\queue.txt", dirA);
+}
+
+// Runs on a job's thread; the list is refreshed on the UI thread.
+static void OnQueueChanged(void* opaque) {
+    PostMessage((HWND)opaque, WM_APP_QUEUE_CHANGED, 0, 0);
+}
+
+static int QueueSelectedJob() {
+    if (!g_hQueueList) return -1;
+    int sel = ListView_GetNextItem(g_hQueueList, -1, LVNI_SELECTED);
+    if (sel < 0) return -1;
+    LVITEMW it = {};
+    it.mask  = LVIF_PARAM;
+    it.iItem = sel;
+    ListView_GetItem(g_hQueueList, &it);
+    return (int)it.lParam;
+}
+
+// Rewrites the rows in place (keyed by job id in lParam) so the selection and
+// scroll position survive the twice-a-second refresh.
+static void QueueRefreshList() {
+    if (!g_hQueueList || !g_queue) return;
+    static const wchar_t* kStateNames[] = { L"Queued", L"Running", L"Done", L"Failed", L"Cancelled" };
+    std::vector<QueueJob> jobs = g_queue->Snapshot();
+
+    SendMessage(g_hQueueList, WM_SETREDRAW, FALSE, 0);
+    int rows = ListView_GetItemCount(g_hQueueList);
+    for (int i = 0; i < (int)jobs.size(); i++) {
+        const QueueJob&        j = jobs[i];
+        const TranscodeParams& p = j.params;
+        LVITEMW it = {};
+        it.mask  = LVIF_PARAM;
+        it.iItem = i;
+        if (i >= rows || !ListView_GetItem(g_hQueueList, &it) || (int)it.lParam != j.id) {
+            while (ListView_GetItemCount(g_hQueueList) > i) ListView_DeleteItem(g_hQueueList, i);
+            rows = i + 1;
+            it.mask    = LVIF_PARAM | LVIF_TEXT;
+            it.lParam  = j.id;
+            it.pszText = (LPWSTR)L"";
+            ListView_InsertItem(g_hQueueList, &it);
+        }
+
+        wchar_t col[MAX_PATH];
+        const char* name = p.in_path.c_str();
+        const char* sep  = strrchr(name, '\\');
+        MultiByteToWideChar(CP_ACP, 0, sep ? sep + 1 : name, -1, col, MAX_PATH);
+        ListView_SetItemText(g_hQueueList, i, 0, col);
+        if (!p.ranges.empty())
+            StringCchPrintfW(col, MAX_PATH, L"%d ranges%s", (int)p.ranges.size(), p.split_ranges ? L", split" : L"");
+        else
+            StringCchPrintfW(col, MAX_PATH, L"%d:%02d \u2013 %d:%02d",
+                             (int)p.start_seconds / 60, (int)p.start_seconds % 60,
+                             (int)p.end_seconds / 60, (int)p.end_seconds % 60);
+        ListView_SetItemText(g_hQueueList, i, 1, col);
+        StringCchPrintfW(col, MAX_PATH, L"%.1f MB", p.target_size_mb);
+        ListView_SetItemText(g_hQueueList, i, 2, col);
+        StringCchPrintfW(col, MAX_PATH, L"%d", j.priority);
+        ListView_SetItemText(g_hQueueList, i, 3, col);
+        if (j.state == JOB_RUNNING)
+            StringCchPrintfW(col, MAX_PATH, L"%s %d%% (%s)", kStateNames[j.state],
+                             (int)(j.progress * 100.0), j.hardware ? L"NVENC" : L"x264");
+        else
+            StringCchCopyW(col, MAX_PATH, kStateNames[j.state]);
+        ListView_SetItemText(g_hQueueList, i, 4, col);
+    }
+    while (ListView_GetItemCount(g_hQueueList) > (int)jobs.size())
+        ListView_DeleteItem(g_hQueueList, (int)jobs.size());
+    SendMessage(g_hQueueList, WM_SETREDRAW, TRUE, 0);
+
+    SetWindowTextW(g_hQueuePauseBtn, g_queue->Paused() ? L"Resume" : L"Pause");
+}
+
+static void ShowQueueWindow() {
+    if (!g_hQueueWnd) {
+        g_hQueueWnd = CreateWindowEx(0, L"ResizerQueue", L"Encode Queue",
+            WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, CW_USEDEFAULT, 720, 360,
+            g_mainHwnd, nullptr, GetModuleHandle(nullptr), nullptr);
+        if (!g_hQueueWnd) return;
+    }
+    ShowWindow(g_hQueueWnd, SW_SHOWNORMAL);
+    SetForegroundWindow(g_hQueueWnd);
+    QueueRefreshList();
+}
+
+LRESULT CALLBACK QueueWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
+    static const struct { int id; const wchar_t* label; } kButtons[] = {
+        { IDC_QUEUE_PAUSE,  L"Pause" },
+        { IDC_QUEUE_UP,     L"Priority \u25B2" },
+        { IDC_QUEUE_DOWN,   L"Priority \u25BC" },
+        { IDC_QUEUE_CANCEL, L"Cancel" },
+        { IDC_QUEUE_RETRY,  L"Retry" },
+        { IDC_QUEUE_REMOVE, L"Remove" },
+        { IDC_QUEUE_CLEAR,  L"Clear Finished" },
+    };
+    const int kBtnW = 96, kBtnH = 28, M = 10;
+
+    switch (msg) {
+    case WM_CREATE: {
+        BOOL dm = g_darkMode ? TRUE : FALSE;
+        if (DwmSetWindowAttribute(hwnd, 20, &dm, sizeof(dm)) != S_OK)
+            DwmSetWindowAttribute(hwnd, 19, &dm, sizeof(dm));
+
+        g_hQueueList = CreateWindowEx(WS_EX_CLIENTEDGE, WC_LISTVIEW, L"",
+            WS_CHILD | WS_VISIBLE | LVS_REPORT | LVS_SHOWSELALWAYS | LVS_SINGLESEL,
+            0, 0, 0, 0, hwnd, (HMENU)IDC_QUEUE_LIST, GetModuleHandle(nullptr), nullptr);
+        ListView_SetExtendedListViewStyle(g_hQueueList, LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER);
+        ListView_SetBkColor(g_hQueueList, g_theme.editBk);
+        ListView_SetTextBkColor(g_hQueueList, g_theme.editBk);
+        ListView_SetTextColor(g_hQueueList, g_theme.editText);
+        if (g_darkMode) SetWindowTheme(g_hQueueList, L"DarkMode_Explorer", nullptr);
+        SendMessage(g_hQueueList, WM_SETFONT, (WPARAM)g_hFont, FALSE);
+
+        static const struct { const wchar_t* title; int width; } kColumns[] = {
+            { L"File", 250 }, { L"Range", 110 }, { L"Size", 70 }, { L"Priority", 60 }, { L"Status", 150 },
+        };
+        for (int i = 0; i < (int)ARRAYSIZE(kColumns); i++) {
+            LVCOLUMNW c = {};
+            c.mask    = LVCF_TEXT | LVCF_WIDTH;
+            c.pszText = (LPWSTR)kColumns[i].title;
+            c.cx      = kColumns[i].width;
+            ListView_InsertColumn(g_hQueueList, i, &c);
+        }
+
+        for (const auto& b : kButtons) {
+            HWND h = CreateWindowEx(0, L"BUTTON", b.label, WS_CHILD | WS_VISIBLE,
+                0, 0, 0, 0, hwnd, (HMENU)(INT_PTR)b.id, GetModuleHandle(nullptr), nullptr);
+            SendMessage(h, WM_SETFONT, (WPARAM)g_hFont, FALSE);
+            if (g_darkMode) SetWindowTheme(h, L"DarkMode_Explorer", nullptr);
+            if (b.id == IDC_QUEUE_PAUSE) g_hQueuePauseBtn = h;
+        }
+        SetTimer(hwnd, IDT_QUEUE_REFRESH, 500, nullptr);
+        return 0;
+    }
+
+    case WM_SIZE: {
+        int w = LOWORD(lParam), h = HIWORD(lParam);
+        MoveWindow(g_hQueueList, M, M, max(0, w - M * 2), max(0, h - kBtnH - M * 3), TRUE);
+        int bx = M;
+        for (const auto& b : kButtons) {
+            MoveWindow(GetDlgItem(hwnd, b.id), bx, h - kBtnH - M, kBtnW, kBtnH, TRUE);
+            bx += kBtnW + 6;
+        }
+        return 0;
+    }
+
+    case WM_ERASEBKGND: {
+        if (!g_hBkBrush) break;
+        RECT rc; GetClientRect(hwnd, &rc);
+        FillRect((HDC)wParam, &rc, g_hBkBrush);
+        return 1;
+    }
+
+    case WM_TIMER:
+        if (wParam == IDT_QUEUE_REFRESH) QueueRefreshList();
+        return 0;
+
+    case WM_COMMAND: {
+        if (!g_queue) return 0;
+        int id  = LOWORD(wParam);
+        int job = QueueSelectedJob();
+        int priority = 0;
+        if (job >= 0 && (id == IDC_QUEUE_UP || id == IDC_QUEUE_DOWN)) {
+            for (const QueueJob& j : g_queue->Snapshot())
+                if (j.id == job) priority = j.priority;
+        }
+        if      (id == IDC_QUEUE_PAUSE)              g_queue->Pause(!g_queue->Paused());
+        else if (id == IDC_QUEUE_CLEAR)              g_queue->ClearFinished();
+        else if (job < 0)                            return 0;
+        else if (id == IDC_QUEUE_UP)                 g_queue->SetPriority(job, priority + 1);
+        else if (id == IDC_QUEUE_DOWN)               g_queue->SetPriority(job, priority - 1);
+        else if (id == IDC_QUEUE_CANCEL)             g_queue->Cancel(job);
+        else if (id == IDC_QUEUE_RETRY)              g_queue->Retry(job);
+        else if (id == IDC_QUEUE_REMOVE && !g_queue->Remove(job))
+            MessageBox(hwnd, L"Cancel the job before removing it.", L"Encode Queue", MB_ICONINFORMATION);
+        QueueRefreshList();
+        return 0;
+    }
+
+    case WM_DESTROY:
+        KillTimer(hwnd, IDT_QUEUE_REFRESH);
+        g_hQueueWnd = g_hQueueList = g_hQueuePauseBtn = nullptr;
+        return 0;
+    }
+    return DefWindowProc(hwnd, msg, wParam, lParam);
 }
 
 // ------------------------------ UI Layout ------------------------------
@@ -401,7 +819,7 @@ void HandleResize(HWND hwnd, int clientW, int clientH) {
     y += settingsH + M;
 
     // === Range (left) + Color Space (right) ===
-    int rangeH = GH + P + RH + P;
+    int rangeH = GH + P + RH + 5 + RH + P;
     MoveWindow(g_hGrpRange, M,                  y, lColW, rangeH, TRUE);
     MoveWindow(g_hGrpColor, M + lColW + colGap, y, rColW, rangeH, TRUE);
     {
@@ -419,6 +837,14 @@ void HandleResize(HWND hwnd, int clientW, int clientH) {
         MoveWindow(g_hStartEdit,   midLeft + labelW,                 iy, editW,  RH, TRUE);
         MoveWindow(g_hEndStatic,   midLeft + labelW + editW + 8,     iy, labelW, RH, TRUE);
         MoveWindow(g_hEndEdit,     midLeft + labelW * 2 + editW + 8, iy, editW,  RH, TRUE);
+
+        iy += RH + 5;
+        const int addW = 90, clearW = 70, splitW = 110;
+        MoveWindow(g_hRangeAddBtn,     ix,                     iy, addW,   RH, TRUE);
+        MoveWindow(g_hRangeClearBtn,   ix + addW + 6,          iy, clearW, RH, TRUE);
+        MoveWindow(g_hRangeSplitCheck, ix + addW + clearW + 18, iy, splitW, RH, TRUE);
+        int listLeft = ix + addW + clearW + splitW + 24;
+        MoveWindow(g_hRangeListStatic, listLeft, iy, max(40, rightIx - listLeft), RH, TRUE);
     }
     {
         int cx     = M + lColW + colGap + P;
@@ -459,20 +885,39 @@ void HandleResize(HWND hwnd, int clientW, int clientH) {
         MoveWindow(g_hBtnGotoMarkIn,  bx, iy, gotoW, btnH, TRUE); bx += gotoW + 10;
         MoveWindow(g_hBtnMarkOut,     bx, iy, btnW,  btnH, TRUE); bx += btnW + 4;
         MoveWindow(g_hBtnGotoMarkOut, bx, iy, gotoW, btnH, TRUE); bx += gotoW + 6;
-        MoveWindow(g_hBtnZoom,        bx, iy, gotoW, btnH, TRUE);
+        MoveWindow(g_hBtnZoom,        bx, iy, gotoW, btnH, TRUE); bx += gotoW + 6;
+        MoveWindow(g_hBtnRate,        bx, iy, 52,    btnH, TRUE); bx += 52 + 6;
+        MoveWindow(g_hBtnLoop,        bx, iy, gotoW, btnH, TRUE);
         iy += btnH + 6;
         MoveWindow(g_hTimeline, ix, iy, avail, seekH, TRUE);
     }
     y += playerH + M;
 
     // === Start Processing button — very bottom ===
-    MoveWindow(g_hStartButton, M, y, totalW, 32, TRUE);
+    const int queueBtnW = 120;
+    MoveWindow(g_hStartButton, M, y, max(0, totalW - queueBtnW - 6), 32, TRUE);
+    MoveWindow(g_hQueueButton, M + totalW - queueBtnW, y, queueBtnW, 32, TRUE);
     g_videoTop = y + 32 + M;  // video preview starts below the start button
 
     // frame preview fills remaining client area below the start button
+    g_previewW = max(0, totalW);
+    g_previewH = max(0, clientH - g_videoTop - M);
+    if (g_playerReady) SetTimer(hwnd, IDT_PREVIEW_RESIZE, 150, nullptr);  // re-render once sizing settles
     InvalidateRect(hwnd, nullptr, TRUE);
 }
 
+// Size to convert a srcW x srcH frame to for the preview: the letterboxed fit
+// of the preview box (never upscaled), or the source size in 1:1 mode.
+static void PreviewTargetSize(int srcW, int srcH, int* outW, int* outH) {
+    int boxW = g_previewW, boxH = g_previewH;
+    *outW = srcW; *outH = srcH;
+    if (g_previewNative || boxW <= 0 || boxH <= 0 || srcW <= 0 || srcH <= 0) return;
+    double scale = min((double)boxW / srcW, (double)boxH / srcH);
+    if (scale >= 1.0) return;
+    *outW = max(2, (int)(srcW * scale + 0.5));
+    *outH = max(2, (int)(srcH * scale + 0.5));
+}
+
 // ------------------------------ App Entry ------------------------------
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, LPSTR, int nCmdShow) {
     CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
@@ -480,7 +925,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, LPSTR, int nCmdShow) {
     Gdiplus::GdiplusStartupInput gdiplusInput;
     Gdiplus::GdiplusStartup(&g_gdiplusToken, &gdiplusInput, nullptr);
 
-    INITCOMMONCONTROLSEX icex = { sizeof(icex), ICC_STANDARD_CLASSES | ICC_BAR_CLASSES };
+    INITCOMMONCONTROLSEX icex = { sizeof(icex), ICC_STANDARD_CLASSES | ICC_BAR_CLASSES | ICC_LISTVIEW_CLASSES };
     InitCommonControlsEx(&icex);
 
     // Register custom timeline window class
@@ -491,10 +936,26 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, LPSTR, int nCmdShow) {
         wct.lpszClassName = L"ResizerTimeline";
         wct.hCursor       = LoadCursor(nullptr, IDC_ARROW);
         RegisterClass(&wct);
+
+        WNDCLASS wch = {};
+        wch.lpfnWndProc   = HoverPreviewWndProc;
+        wch.hInstance     = hInstance;
+        wch.lpszClassName = L"ResizerHoverPreview";
+        wch.hCursor       = LoadCursor(nullptr, IDC_ARROW);
+        RegisterClass(&wch);
+
+        WNDCLASS wcq = {};
+        wcq.lpfnWndProc   = QueueWndProc;
+        wcq.hInstance     = hInstance;
+        wcq.lpszClassName = L"ResizerQueue";
+        wcq.hCursor       = LoadCursor(nullptr, IDC_ARROW);
+        wcq.hIcon         = LoadIcon(hInstance, MAKEINTRESOURCE(IDI_APPICON));
+        RegisterClass(&wcq);
     }
 
     const wchar_t CLASS_NAME[] = L"FFmpegDragDropClass";
     WNDCLASS wc = {};
+    wc.style         = CS_DBLCLKS;  // double-click toggles 1:1 preview
     wc.lpfnWndProc   = WndProc;
     wc.hInstance     = hInstance;
     wc.lpszClassName = CLASS_NAME;
@@ -521,6 +982,9 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, LPSTR, int nCmdShow) {
     ApplyTheme(g_mainHwnd);   // sets colours and dark title bar before first paint
     InitializeCriticalSection(&g_csState);
     InitializeCriticalSection(&g_csMarkCache);
+    InitializeCriticalSection(&g_csThumbs);
+    InitializeCriticalSection(&g_csAtlas);
+    InitializeCriticalSection(&g_csPeaks);
 
     ShowWindow(g_mainHwnd, nCmdShow);
     UpdateWindow(g_mainHwnd);
@@ -533,6 +997,9 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, LPSTR, int nCmdShow) {
 
     DeleteCriticalSection(&g_csState);
     DeleteCriticalSection(&g_csMarkCache);
+    DeleteCriticalSection(&g_csThumbs);
+    DeleteCriticalSection(&g_csAtlas);
+    DeleteCriticalSection(&g_csPeaks);
     if (g_gdiplusToken) Gdiplus::GdiplusShutdown(g_gdiplusToken);
     CoUninitialize();
     return (int)msg.wParam;
@@ -617,6 +1084,7 @@ static void ApplyTheme(HWND hwnd) {
         // Radio buttons — dot, circle and text rendered in correct mode
         if (g_hRangeFullRadio)   SetWindowTheme(g_hRangeFullRadio,   ctrlTheme, nullptr);
         if (g_hRangeCustomRadio) SetWindowTheme(g_hRangeCustomRadio, ctrlTheme, nullptr);
+        if (g_hRangeSplitCheck)  SetWindowTheme(g_hRangeSplitCheck,  ctrlTheme, nullptr);
         if (g_hSaveSameRadio)    SetWindowTheme(g_hSaveSameRadio,    ctrlTheme, nullptr);
         if (g_hSaveCustomRadio)  SetWindowTheme(g_hSaveCustomRadio,  ctrlTheme, nullptr);
         if (g_hGrpColor)         SetWindowTheme(g_hGrpColor,         ctrlTheme, nullptr);
@@ -666,9 +1134,10 @@ static void DrawPlayerButton(const DRAWITEMSTRUCT* dis) {
         path.AddArc(bx+bw-r*2.0f, by, r*2.0f, bh, 270.0f, 180.0f);
         path.CloseFigure();
 
-        float prog = g_encodeProgress;  // 0.0..1.0
-        bool inProgress = g_encodeRunning || (prog > 0.0f && prog < 1.0f);
-        bool done       = (!g_encodeRunning && prog >= 1.0f);
+        bool  running = g_encode && g_encode->Running();
+        float prog    = g_encode ? (float)g_encode->Progress() : 0.0f;  // 0.0..1.0
+        bool inProgress = running || (prog > 0.0f && prog < 1.0f);
+        bool done       = (!running && prog >= 1.0f);
 
         if (inProgress || done) {
             // Red background pill
@@ -909,6 +1378,36 @@ static void DrawPlayerButton(const DRAWITEMSTRUCT* dis) {
             g.DrawLine(&inner, cx - 4.5f, cy - 2.5f, cx + 1.5f, cy - 2.5f);
         }
     }
+    else if (id == IDC_BTN_RATE) {
+        // "2×" etc. — teal at normal speed, amber fast-forward, violet slow motion
+        double rate = kPlayRates[g_playRateIdx];
+        Gdiplus::Color col = (rate > 1.0) ? Gdiplus::Color(a, 255, 198, 55)
+                           : (rate < 1.0) ? Gdiplus::Color(a, 155, 95, 255)
+                                          : Gdiplus::Color(a, 72, 220, 155);
+        wchar_t label[16];
+        StringCchPrintfW(label, 16, L"%g\u00d7", rate);
+        HFONT hf = g_hFont ? g_hFont : (HFONT)GetStockObject(DEFAULT_GUI_FONT);
+        Gdiplus::Font font(memDC, hf);
+        Gdiplus::RectF tr(bx, by + (pressed ? 0.5f : 0.0f), bw, bh);
+        Gdiplus::StringFormat sf;
+        sf.SetAlignment(Gdiplus::StringAlignmentCenter);
+        sf.SetLineAlignment(Gdiplus::StringAlignmentCenter);
+        Gdiplus::SolidBrush tb(col);
+        g.DrawString(label, -1, &font, tr, &sf, &tb);
+    }
+    else if (id == IDC_BTN_LOOP) {
+        // Two arcs chasing each other — teal when the A-B loop is on
+        Gdiplus::Color col = g_loopAB ? Gdiplus::Color(a, 72, 220, 155)
+                                      : Gdiplus::Color(a, 150, 155, 175);
+        Gdiplus::Pen pen(col, 2.0f);
+        Gdiplus::SolidBrush b(col);
+        g.DrawArc(&pen, cx - 8.0f, cy - 7.0f, 16.0f, 14.0f, 200.0f, 140.0f);
+        g.DrawArc(&pen, cx - 8.0f, cy - 7.0f, 16.0f, 14.0f,  20.0f, 140.0f);
+        Gdiplus::PointF top[3] = { {cx + 4.0f, cy - 10.0f}, {cx + 4.0f, cy - 3.0f}, {cx + 9.0f, cy - 6.5f} };
+        Gdiplus::PointF bot[3] = { {cx - 4.0f, cy + 10.0f}, {cx - 4.0f, cy + 3.0f}, {cx - 9.0f, cy + 6.5f} };
+        g.FillPolygon(&b, top, 3);
+        g.FillPolygon(&b, bot, 3);
+    }
     }   // end else (player buttons)
     }   // end Graphics scope — GDI+ content flushed to memDC
 
@@ -957,6 +1456,21 @@ static void LoadSettings() {
                          (BYTE*)folder, &sz) == ERROR_SUCCESS && type == REG_SZ)
         wcscpy_s(g_saveFolder, folder);
 
+    // MP4 layout
+    DWORD layout = 0;
+    sz = sizeof(layout);
+    if (RegQueryValueExW(hk, L"Mp4Layout", nullptr, &type,
+                         (BYTE*)&layout, &sz) == ERROR_SUCCESS && type == REG_DWORD &&
+        layout <= MP4_FRAGMENTED)
+        g_mp4Layout = (int)layout;
+
+    // Unbuffered output flag
+    DWORD unbuf = 0;
+    sz = sizeof(unbuf);
+    if (RegQueryValueExW(hk, L"UnbufferedOutput", nullptr, &type,
+                         (BYTE*)&unbuf, &sz) == ERROR_SUCCESS && type == REG_DWORD)
+        g_unbufferedOutput = (unbuf != 0);
+
     RegCloseKey(hk);
 
     // Apply to UI
@@ -1002,6 +1516,14 @@ static void SaveSettings() {
                    (const BYTE*)g_saveFolder,
                    (DWORD)((wcslen(g_saveFolder) + 1) * sizeof(wchar_t)));
 
+    // MP4 layout
+    DWORD layout = (DWORD)g_mp4Layout;
+    RegSetValueExW(hk, L"Mp4Layout", 0, REG_DWORD, (const BYTE*)&layout, sizeof(layout));
+
+    // Unbuffered output flag
+    DWORD unbuf = g_unbufferedOutput ? 1 : 0;
+    RegSetValueExW(hk, L"UnbufferedOutput", 0, REG_DWORD, (const BYTE*)&unbuf, sizeof(unbuf));
+
     RegCloseKey(hk);
 }
 
@@ -1085,6 +1607,18 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
         g_hEndEdit = CreateWindowEx(WS_EX_CLIENTEDGE, L"EDIT", L"",
             WS_CHILD | WS_VISIBLE | WS_DISABLED | ES_NUMBER,
             580, 100, 80, 20, hwnd, (HMENU)IDC_END_EDIT, GetModuleHandle(nullptr), nullptr);
+        g_hRangeAddBtn = CreateWindowEx(0, L"BUTTON", L"Add Range",
+            WS_CHILD | WS_VISIBLE | WS_DISABLED,
+            0, 0, 0, 0, hwnd, (HMENU)IDC_RANGE_ADD_BUTTON, GetModuleHandle(nullptr), nullptr);
+        g_hRangeClearBtn = CreateWindowEx(0, L"BUTTON", L"Clear",
+            WS_CHILD | WS_VISIBLE | WS_DISABLED,
+            0, 0, 0, 0, hwnd, (HMENU)IDC_RANGE_CLEAR_BUTTON, GetModuleHandle(nullptr), nullptr);
+        g_hRangeSplitCheck = CreateWindowEx(0, L"BUTTON", L"Separate files",
+            WS_CHILD | WS_VISIBLE | WS_DISABLED | BS_AUTOCHECKBOX,
+            0, 0, 0, 0, hwnd, (HMENU)IDC_RANGE_SPLIT_CHECK, GetModuleHandle(nullptr), nullptr);
+        g_hRangeListStatic = CreateWindowEx(0, L"STATIC", L"No ranges added",
+            WS_CHILD | WS_VISIBLE | WS_DISABLED,
+            0, 0, 0, 0, hwnd, (HMENU)IDC_RANGE_LIST_STATIC, GetModuleHandle(nullptr), nullptr);
 
         g_hFullRadio = CreateWindowEx(0, L"BUTTON", L"Full resolution",
             WS_CHILD | WS_DISABLED | BS_AUTORADIOBUTTON | WS_GROUP,
@@ -1123,6 +1657,9 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
         g_hStartButton = CreateWindowEx(0, L"BUTTON", L"",
             WS_CHILD | WS_VISIBLE | WS_DISABLED | BS_OWNERDRAW,
             10, 210, 150, 30, hwnd, (HMENU)IDC_START_BUTTON, GetModuleHandle(nullptr), nullptr);
+        g_hQueueButton = CreateWindowEx(0, L"BUTTON", L"Add to Queue",
+            WS_CHILD | WS_VISIBLE | WS_DISABLED,
+            0, 0, 0, 0, hwnd, (HMENU)IDC_QUEUE_BUTTON, GetModuleHandle(nullptr), nullptr);
 
         g_hBtnPlayPause = CreateWindowEx(0, L"BUTTON", L"",
             WS_CHILD | WS_VISIBLE | WS_DISABLED | BS_OWNERDRAW, 10, 250, 90, 26, hwnd,
@@ -1148,6 +1685,12 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
         g_hBtnZoom = CreateWindowEx(0, L"BUTTON", L"",
             WS_CHILD | WS_VISIBLE | WS_DISABLED | BS_OWNERDRAW, 614, 250, 38, 26, hwnd,
             (HMENU)IDC_BTN_ZOOM, GetModuleHandle(nullptr), nullptr);
+        g_hBtnRate = CreateWindowEx(0, L"BUTTON", L"",
+            WS_CHILD | WS_VISIBLE | WS_DISABLED | BS_OWNERDRAW, 656, 250, 52, 26, hwnd,
+            (HMENU)IDC_BTN_RATE, GetModuleHandle(nullptr), nullptr);
+        g_hBtnLoop = CreateWindowEx(0, L"BUTTON", L"",
+            WS_CHILD | WS_VISIBLE | WS_DISABLED | BS_OWNERDRAW, 714, 250, 38, 26, hwnd,
+            (HMENU)IDC_BTN_LOOP, GetModuleHandle(nullptr), nullptr);
         g_hTimeline = CreateWindowEx(0, L"ResizerTimeline", L"",
             WS_CHILD | WS_VISIBLE,
             10, 285, 600, 72, hwnd, (HMENU)IDC_SEEKBAR, GetModuleHandle(nullptr), nullptr);
@@ -1186,12 +1729,15 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
             applyLabelFont(g_hRangeFullRadio); applyLabelFont(g_hRangeCustomRadio);
             applyLabelFont(g_hStartStatic);    applyFont(g_hStartEdit);
             applyLabelFont(g_hEndStatic);      applyFont(g_hEndEdit);
+            applyFont(g_hRangeAddBtn);         applyFont(g_hRangeClearBtn);
+            applyLabelFont(g_hRangeSplitCheck); applyLabelFont(g_hRangeListStatic);
             applyFont(g_hFullRadio);      applyFont(g_hHalfRadio);   applyFont(g_hQuarterRadio);
             applyLabelFont(g_hAudioStatic);    applyFont(g_hAudioDrop);
             applyLabelFont(g_hSubsStatic);     applyFont(g_hSubsDrop);
             applyFont(g_hBtnPlayPause);   applyFont(g_hBtnBack);
             applyFont(g_hBtnFwd);         applyFont(g_hBtnMarkIn);   applyFont(g_hBtnMarkOut);
             applyFont(g_hBtnGotoMarkIn);  applyFont(g_hBtnGotoMarkOut);  applyFont(g_hBtnZoom);
+            applyFont(g_hBtnRate);        applyFont(g_hBtnLoop);
             applyFont(g_hGrpSaveLoc);
             applyLabelFont(g_hSaveSameRadio);  applyLabelFont(g_hSaveCustomRadio);
             applyFont(g_hSavePathEdit);        applyFont(g_hSaveBrowseBtn);
@@ -1216,6 +1762,9 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
             SendMessageW(g_hTooltip, TTM_ADDTOOLW, 0, (LPARAM)&ti);
         };
         addTip(g_hStartButton,  L"Transcode video to the target file size");
+        addTip(g_hQueueButton,  L"Queue this file and range with the current settings to encode later");
+        addTip(g_hRangeAddBtn,     L"Add the custom range to the list; Start then exports every listed range in one pass");
+        addTip(g_hRangeSplitCheck, L"Write each range to its own file at the target size, instead of joining them into one");
         addTip(g_hResDrop,      L"Output resolution — click to change");
         addTip(g_hAudioDrop,    L"Select which audio track to include in the output");
         addTip(g_hSubsDrop,      L"Select a subtitle track to burn into the video, or None to skip");
@@ -1229,6 +1778,8 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
         addTip(g_hBtnGotoMarkIn,   L"Jump playhead to mark-in position");
         addTip(g_hBtnGotoMarkOut,  L"Jump playhead to mark-out position");
         addTip(g_hBtnZoom,         L"Zoom timeline \u00b130 s around playhead (click again to zoom out)");
+        addTip(g_hBtnRate,         L"Playback speed \u2014 click for faster, Shift+click for slower");
+        addTip(g_hBtnLoop,         L"Loop playback between mark-in and mark-out");
 
         // Try to initialise CUDA device for NVDEC hardware decoding.
         TryInitHWDevice();
@@ -1236,10 +1787,34 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
         // Restore saved settings from the registry
         LoadSettings();
 
-        // Add "About" to the system menu (right-click title bar)
+        // Reload the queue left by the last run.  It comes back paused, with
+        // the queue window up, so nothing starts encoding unasked.
+        {
+            char statePath[MAX_PATH];
+            QueueStatePath(statePath, MAX_PATH);
+            g_queue = new EncodeQueue(statePath[0] ? statePath : nullptr);
+            g_queue->SetChangeCallback(OnQueueChanged, hwnd);
+            if (g_queue->Load(true)) {
+                for (const QueueJob& j : g_queue->Snapshot())
+                    if (j.state == JOB_QUEUED) { PostMessage(hwnd, WM_SYSCOMMAND, IDM_ENCODE_QUEUE, 0); break; }
+            }
+        }
+
+        // Add "Output" and "About" to the system menu (right-click title bar)
         {
             HMENU hSys = GetSystemMenu(hwnd, FALSE);
+            g_hMp4Menu = CreatePopupMenu();
+            AppendMenuW(g_hMp4Menu, MF_STRING, IDM_MP4_RESERVE_MOOV, L"Reserved index (no rewrite)");
+            AppendMenuW(g_hMp4Menu, MF_STRING, IDM_MP4_FRAGMENTED,   L"Fragmented");
+            AppendMenuW(g_hMp4Menu, MF_STRING, IDM_MP4_FASTSTART,    L"Faststart (rewrite at end)");
+            CheckMenuRadioItem(g_hMp4Menu, IDM_MP4_FASTSTART, IDM_MP4_FRAGMENTED,
+                               IDM_MP4_FASTSTART + g_mp4Layout, MF_BYCOMMAND);
+            AppendMenuW(g_hMp4Menu, MF_SEPARATOR, 0, nullptr);
+            AppendMenuW(g_hMp4Menu, MF_STRING | (g_unbufferedOutput ? MF_CHECKED : 0),
+                        IDM_UNBUFFERED_OUTPUT, L"Unbuffered writes");
             AppendMenuW(hSys, MF_SEPARATOR, 0, nullptr);
+            AppendMenuW(hSys, MF_POPUP, (UINT_PTR)g_hMp4Menu, L"Output");
+            AppendMenuW(hSys, MF_STRING, IDM_ENCODE_QUEUE, L"Encode Queue...");
             AppendMenuW(hSys, MF_STRING, IDM_ABOUT, L"About Resizer...");
         }
 
@@ -1309,6 +1884,7 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
         StopPlayback();
         if (DragQueryFileA(hDrop, 0, g_inputPath, MAX_PATH)) {
             if (GetVideoInfo(g_inputPath, g_vidWidth, g_vidHeight, g_duration)) {
+                ResetMediaSession(g_inputPath);
                 wchar_t infoText[512];
                 double minutes = floor(g_duration / 60.0);
                 double seconds = g_duration - minutes * 60.0;
@@ -1340,6 +1916,8 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
                 EnableWindow(g_hStartEdit, FALSE);
                 EnableWindow(g_hEndStatic, FALSE);
                 EnableWindow(g_hEndEdit, FALSE);
+                g_ranges.clear();
+                RangeListChanged();
 
                 EnableWindow(g_hFullRadio, TRUE);
                 EnableWindow(g_hHalfRadio, TRUE);
@@ -1357,6 +1935,7 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
                 EnableWindow(g_hSubsStatic,  TRUE);
                 EnableWindow(g_hSubsDrop,    TRUE);
                 PopulateAudioAndSubsDropdowns(g_inputPath);
+                PeaksStart(g_inputPath, SelectedAudioStream());
 
                 // Auto-detect external subtitle files (.srt/.ass/.ssa) next to the video
                 ScanExternalSubtitles(g_inputPath);
@@ -1387,6 +1966,7 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
                 }
 
                 EnableWindow(g_hStartButton, TRUE);
+                EnableWindow(g_hQueueButton, TRUE);
 
                 wchar_t startBuf[32], endBuf[32];
                 StringCchPrintfW(startBuf, 32, L"0");
@@ -1400,17 +1980,9 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
                 g_tlEnabled = true;
                 g_markInMs  = -1;
                 g_markOutMs = -1;
+                g_loopAB    = false;
                 // Reset zoom state on new file
                 g_isZoomed = false;
-                g_zoomThumbStop = true;
-                if (g_zoomThumbThread) {
-                    WaitForSingleObject(g_zoomThumbThread, 2000);
-                    CloseHandle(g_zoomThumbThread); g_zoomThumbThread = nullptr;
-                }
-                for (int zi = 0; zi < 21; zi++) {
-                    if (g_zoomThumbs[zi]) { DeleteObject(g_zoomThumbs[zi]); g_zoomThumbs[zi] = nullptr; }
-                }
-                g_zoomThumbStop = false;
                 InvalidateRect(g_hTimeline, nullptr, TRUE);
 
                 EnableWindow(g_hBtnPlayPause, TRUE);
@@ -1421,28 +1993,22 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
                 EnableWindow(g_hBtnGotoMarkIn,  FALSE);
                 EnableWindow(g_hBtnGotoMarkOut, FALSE);
                 EnableWindow(g_hBtnZoom,        TRUE);
+                EnableWindow(g_hBtnRate,        TRUE);
+                EnableWindow(g_hBtnLoop,        FALSE);
                 InvalidateRect(g_hBtnPlayPause, nullptr, TRUE);
 
-                // Start thumbnail extraction in background
-                g_thumbThreadStop = true;
-                if (g_thumbThread) {
-                    WaitForSingleObject(g_thumbThread, 3000);
-                    CloseHandle(g_thumbThread);
-                    g_thumbThread = nullptr;
-                }
+                // Start thumbnail extraction in background (ResetMediaSession
+                // already stopped the previous file's thumbnail thread).
                 for (int i = 0; i < 21; i++) {
                     if (g_thumbs[i]) { DeleteObject(g_thumbs[i]); g_thumbs[i] = nullptr; }
                 }
-                g_thumbW = 0; g_thumbH = 0;
+                g_thumbH = kThumbH;
+                g_thumbW = ThumbWidthFor(g_vidWidth, g_vidHeight, kThumbH);
                 g_thumbThreadStop = false;
-                g_thumbThread = (HANDLE)_beginthreadex(nullptr, 0, ThumbExtractThreadProc, nullptr, 0, nullptr);
+                g_thumbThread = (HANDLE)_beginthreadex(nullptr, 0, ThumbExtractThreadProc, g_session, 0, nullptr);
+                AtlasStart(g_duration);
 
-                if (g_hFrameBitmap) { DeleteObject(g_hFrameBitmap); g_hFrameBitmap = nullptr; }
-                g_hFrameBitmap = ExtractMiddleFrameBitmap(g_inputPath, g_vidWidth, g_vidHeight, g_duration);
-                if (g_hFrameBitmap) {
-                    BITMAP bi; GetObject(g_hFrameBitmap, sizeof(bi), &bi);
-                    g_frameWidth = bi.bmWidth; g_frameHeight = bi.bmHeight;
-                }
+                SetPreviewBitmap(ExtractMiddleFrameBitmap(g_session, g_vidWidth, g_vidHeight, g_duration));
 
                 g_isPlaying = false;
                 g_currentPosMs = 0;
@@ -1491,13 +2057,16 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
                                 // Reload info for the new file and fall through to normal init.
                                 GetVideoInfo(g_inputPath, g_vidWidth, g_vidHeight, g_duration);
                                 g_tlMax = (int)(g_duration * 1000);
+                                // Readers must point at the remuxed file from here on.
+                                ResetMediaSession(g_inputPath);
+                                g_thumbH = kThumbH;
+                                g_thumbW = ThumbWidthFor(g_vidWidth, g_vidHeight, kThumbH);
+                                g_thumbThreadStop = false;
+                                g_thumbThread = (HANDLE)_beginthreadex(nullptr, 0, ThumbExtractThreadProc, g_session, 0, nullptr);
+                                AtlasStart(g_duration);
+                                PeaksStart(g_inputPath, -1);
                                 InvalidateRect(hwnd, nullptr, TRUE);
-                                if (g_hFrameBitmap) { DeleteObject(g_hFrameBitmap); g_hFrameBitmap = nullptr; }
-                                g_hFrameBitmap = ExtractMiddleFrameBitmap(g_inputPath, g_vidWidth, g_vidHeight, g_duration);
-                                if (g_hFrameBitmap) {
-                                    BITMAP bi2; GetObject(g_hFrameBitmap, sizeof(bi2), &bi2);
-                                    g_frameWidth = bi2.bmWidth; g_frameHeight = bi2.bmHeight;
-                                }
+                                SetPreviewBitmap(ExtractMiddleFrameBitmap(g_session, g_vidWidth, g_vidHeight, g_duration));
                             }
                         } else {
                             MessageBoxW(hwnd,
@@ -1523,6 +2092,8 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
 
     case WM_APP_THUMBS_READY: {
         InvalidateRect(g_hTimeline, nullptr, FALSE);
+        if (g_hHoverWnd && IsWindowVisible(g_hHoverWnd))
+            InvalidateRect(g_hHoverWnd, nullptr, FALSE);
         break;
     }
 
@@ -1559,6 +2130,11 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
                 InvalidateRect(g_hResDrop, nullptr, TRUE);
             }
         }
+        else if (id == IDC_AUDIO_DROPDOWN) {
+            // Follow the chosen track with the timeline waveform.
+            if (HIWORD(wParam) == CBN_SELCHANGE && g_playerReady)
+                PeaksStart(g_inputPath, SelectedAudioStream());
+        }
         else if (id == IDC_RANGE_FULL_RADIO) {
             SendMessage(g_hRangeFullRadio, BM_SETCHECK, BST_CHECKED, 0);
             SendMessage(g_hRangeCustomRadio, BM_SETCHECK, BST_UNCHECKED, 0);
@@ -1575,6 +2151,26 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
             EnableWindow(g_hEndStatic, TRUE);
             EnableWindow(g_hEndEdit, TRUE);
         }
+        else if (id == IDC_RANGE_ADD_BUTTON) {
+            // The custom range (Mark In / Mark Out fill it) joins the list.
+            wchar_t startBuf[32], endBuf[32];
+            GetWindowTextW(g_hStartEdit, startBuf, ARRAYSIZE(startBuf));
+            GetWindowTextW(g_hEndEdit, endBuf, ARRAYSIZE(endBuf));
+            TranscodeRange r;
+            r.start_seconds = _wtof(startBuf);
+            r.end_seconds   = _wtof(endBuf);
+            if (SendMessage(g_hRangeCustomRadio, BM_GETCHECK, 0, 0) != BST_CHECKED ||
+                r.start_seconds < 0.0 || r.end_seconds <= r.start_seconds || r.end_seconds > g_duration) {
+                MessageBox(hwnd, L"Set a custom start/end range within the video duration first.", L"Input Error", MB_ICONWARNING);
+                break;
+            }
+            g_ranges.push_back(r);
+            RangeListChanged();
+        }
+        else if (id == IDC_RANGE_CLEAR_BUTTON) {
+            g_ranges.clear();
+            RangeListChanged();
+        }
         else if (id == IDC_SAVE_SAME_RADIO) {
             g_saveCustom = false;
             EnableWindow(g_hSavePathEdit,  FALSE);
@@ -1617,7 +2213,7 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
             }
         }
 
-        if (id == IDC_START_BUTTON) {
+        if (id == IDC_START_BUTTON || id == IDC_QUEUE_BUTTON) {
             wchar_t sizeBuf[32] = { 0 };
             GetWindowTextW(g_hSizeEdit, sizeBuf, ARRAYSIZE(sizeBuf));
             double targetSizeMB = _wtof(sizeBuf);
@@ -1633,7 +2229,7 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
             WideCharToMultiByte(CP_ACP, 0, suffixW, -1, suffixA, sizeof(suffixA), nullptr, nullptr);
 
             double startSecs = 0.0, endSecs = g_duration;
-            if (SendMessage(g_hRangeCustomRadio, BM_GETCHECK, 0, 0) == BST_CHECKED) {
+            if (g_ranges.empty() && SendMessage(g_hRangeCustomRadio, BM_GETCHECK, 0, 0) == BST_CHECKED) {
                 wchar_t startBuf[32], endBuf[32];
                 GetWindowTextW(g_hStartEdit, startBuf, ARRAYSIZE(startBuf));
                 GetWindowTextW(g_hEndEdit, endBuf, ARRAYSIZE(endBuf));
@@ -1654,7 +2250,12 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
                 break;
             }
 
+            // A queued job's output doesn't exist yet but is just as taken.
+            auto taken = [](const char* p) {
+                return _access(p, 0) == 0 || (g_queue && g_queue->HasOutput(p));
+            };
             char outPath[MAX_PATH] = { 0 };
+            char outStem[MAX_PATH] = { 0 };     // <dir><name>_<suffix>
             {
                 char drive[_MAX_DRIVE], dir[_MAX_DIR], fname[_MAX_FNAME], ext[_MAX_EXT];
                 _splitpath_s(g_inputPath, drive, _MAX_DRIVE, dir, _MAX_DIR, fname, _MAX_FNAME, ext, _MAX_EXT);
@@ -1670,15 +2271,11 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
                     StringCchPrintfA(outDir, MAX_PATH, "%s%s", drive, dir);
                 }
 
+                StringCchPrintfA(outStem, MAX_PATH, "%s%s_%s", outDir, fname, suffixA);
                 char candidate[MAX_PATH];
-                StringCchPrintfA(candidate, MAX_PATH, "%s%s_%s.mp4", outDir, fname, suffixA);
-                if (_access(candidate, 0) == 0) {
-                    for (int i = 1;; i++) {
-                        StringCchPrintfA(candidate, MAX_PATH, "%s%s_%s-%d.mp4",
-                                         outDir, fname, suffixA, i);
-                        if (_access(candidate, 0) != 0) break;
-                    }
-                }
+                StringCchPrintfA(candidate, MAX_PATH, "%s.mp4", outStem);
+                for (int i = 1; taken(candidate); i++)
+                    StringCchPrintfA(candidate, MAX_PATH, "%s-%d.mp4", outStem, i);
                 StringCchCopyA(outPath, MAX_PATH, candidate);
             }
 
@@ -1708,32 +2305,52 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
                 convertHdrToSdr = (colorSel == 1);  // index 1 = "Convert to SDR"
             }
 
+            TranscodeParams tp;
+            tp.in_path               = g_inputPath;
+            tp.out_path              = outPath;
+            tp.ext_subtitle_path     = selExtSubPath;
+            tp.target_size_mb        = targetSizeMB;
+            tp.scale_factor          = scaleFactor;
+            tp.orig_w                = g_vidWidth;
+            tp.orig_h                = g_vidHeight;
+            tp.start_seconds         = startSecs;
+            tp.end_seconds           = endSecs;
+            tp.audio_stream_index    = selAudio;
+            tp.subtitle_stream_index = selSubs;
+            tp.convert_hdr_to_sdr    = convertHdrToSdr;
+            tp.mp4_layout            = g_mp4Layout;
+            tp.unbuffered_output     = g_unbufferedOutput;
+            // Listed ranges go out in one pass: joined into outPath or, split,
+            // as <name>_<suffix>_clipN[-M].mp4 at the target size each.
+            tp.ranges                = g_ranges;
+            tp.split_ranges          = !g_ranges.empty() &&
+                                       SendMessage(g_hRangeSplitCheck, BM_GETCHECK, 0, 0) == BST_CHECKED;
+            if (tp.split_ranges) {
+                for (size_t i = 0; i < tp.ranges.size(); i++) {
+                    char clip[MAX_PATH];
+                    StringCchPrintfA(clip, MAX_PATH, "%s_clip%d.mp4", outStem, (int)i + 1);
+                    for (int n = 1; taken(clip); n++)
+                        StringCchPrintfA(clip, MAX_PATH, "%s_clip%d-%d.mp4", outStem, (int)i + 1, n);
+                    tp.ranges[i].out_path       = clip;
+                    tp.ranges[i].target_size_mb = targetSizeMB;
+                }
+            }
+
+            if (id == IDC_QUEUE_BUTTON) {
+                if (g_queue) g_queue->Add(tp);
+                ShowQueueWindow();
+                break;
+            }
+
             // Launch transcoding on a background thread so the UI stays responsive.
             EnableWindow(g_hStartButton, FALSE);
             StopPlayback();
 
-            EncodeArgs* args = new EncodeArgs{};
-            StringCchCopyA(args->inPath,  MAX_PATH, g_inputPath);
-            StringCchCopyA(args->outPath, MAX_PATH, outPath);
-            args->targetSizeMB   = targetSizeMB;
-            args->scaleFactor    = scaleFactor;
-            args->origW          = g_vidWidth;
-            args->origH          = g_vidHeight;
-            args->startSecs      = startSecs;
-            args->endSecs        = endSecs;
-            args->selAudio       = selAudio;
-            args->selSubs        = selSubs;
-            args->convertHdrToSdr = convertHdrToSdr;
-            args->hwnd           = hwnd;
-            StringCchCopyA(args->extSubPath, MAX_PATH, selExtSubPath);
-
-            g_encodeProgress = 0.0f;
-            g_encodeRunning  = true;
+            delete g_encode;
+            g_encode = new TranscodeSession(tp);
             InvalidateRect(g_hStartButton, nullptr, TRUE);
             SetTimer(hwnd, IDT_ENCODE_PROGRESS, 100, nullptr);
-
-            if (g_encodeThread) { CloseHandle(g_encodeThread); g_encodeThread = nullptr; }
-            g_encodeThread = (HANDLE)_beginthreadex(nullptr, 0, EncodeThreadProc, args, 0, nullptr);
+            g_encode->Start(OnEncodeDone, hwnd);
         }
 
         if (id == IDC_BTN_PLAYPAUSE && g_playerReady) {
@@ -1767,29 +2384,32 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
             SeekMs(g_markOutMs, !g_isPlaying);
             InvalidateRect(hwnd, nullptr, FALSE);
         }
+        else if (id == IDC_BTN_LOOP && g_playerReady) {
+            g_loopAB = !g_loopAB;
+            InvalidateRect(g_hBtnLoop, nullptr, TRUE);
+        }
+        else if (id == IDC_BTN_RATE && g_playerReady) {
+            int step = (GetKeyState(VK_SHIFT) < 0) ? -1 : 1;
+            SetPlayRate((g_playRateIdx + step + kPlayRateCount) % kPlayRateCount);
+        }
         else if (id == IDC_BTN_ZOOM && g_playerReady) {
-            // Stop any previous zoom thread and discard zoom thumbs.
-            g_zoomThumbStop = true;
-            if (g_zoomThumbThread) {
-                WaitForSingleObject(g_zoomThumbThread, 2000);
-                CloseHandle(g_zoomThumbThread); g_zoomThumbThread = nullptr;
-            }
-            for (int zi = 0; zi < 21; zi++) {
-                if (g_zoomThumbs[zi]) { DeleteObject(g_zoomThumbs[zi]); g_zoomThumbs[zi] = nullptr; }
-            }
-
+            // Zoom slots are drawn straight from the thumbnail atlas; toggling
+            // only moves the atlas generator's focus to the newly viewed level.
             if (g_isZoomed) {
                 // Zoom out — return to normal timeline.
                 g_isZoomed = false;
             } else {
-                // Zoom in — centre on current playhead, ±30 s window.
+                // Zoom in — centre on current playhead, ±30 s window at 3 s slots.
                 g_isZoomed     = true;
                 g_zoomCenterMs = g_currentPosMs;
                 g_zoomStartMs  = max((int64_t)0, g_zoomCenterMs - 30000LL);
                 g_zoomEndMs    = (int64_t)min(g_duration * 1000.0, (double)(g_zoomCenterMs + 30000LL));
-                g_zoomThumbStop = false;
-                g_zoomThumbThread = (HANDLE)_beginthreadex(nullptr, 0, ZoomThumbThreadProc, nullptr, 0, nullptr);
+                for (int zi = 0; zi < 21; zi++) {
+                    double t = g_zoomCenterMs / 1000.0 + (zi - 10) * 3.0;
+                    g_zoomThumbTimes[zi] = max(0.0, min(t, g_duration));
+                }
             }
+            AtlasFocusView(g_isZoomed ? g_zoomCenterMs / 1000.0 : -1.0);
             InvalidateRect(g_hBtnZoom, nullptr, TRUE);
             InvalidateRect(g_hTimeline, nullptr, TRUE);
         }
@@ -1817,6 +2437,15 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
                 InvalidateRect(hwnd, &rc, FALSE);
             }
         }
+        if (wParam == IDT_PREVIEW_RESIZE) {
+            KillTimer(hwnd, IDT_PREVIEW_RESIZE);
+            RefreshPreviewFrame(hwnd);
+        }
+        if (wParam == IDT_SCRUB_SETTLE) {
+            // Timeline drag paused on a position: decode the exact frame there.
+            KillTimer(hwnd, IDT_SCRUB_SETTLE);
+            if (g_isDragging && g_playerReady) SeekMs(g_tlPos, true);
+        }
         if (wParam == IDT_ENCODE_PROGRESS) {
             // Repaint the button to update the progress fill
             InvalidateRect(g_hStartButton, nullptr, FALSE);
@@ -1825,9 +2454,12 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
         break;
     }
 
+    case WM_APP_QUEUE_CHANGED:
+        QueueRefreshList();
+        break;
+
     case WM_APP_ENCODE_DONE: {
         KillTimer(hwnd, IDT_ENCODE_PROGRESS);
-        if (g_encodeThread) { CloseHandle(g_encodeThread); g_encodeThread = nullptr; }
 
         // Show "Done" state briefly, then re-enable
         InvalidateRect(g_hStartButton, nullptr, TRUE);
@@ -1838,8 +2470,8 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
             MessageBox(hwnd, L"Transcoding failed. See debug output for details.", L"Error", MB_ICONERROR);
         }
 
-        g_encodeProgress = 0.0f;
-        g_encodeRunning  = false;
+        delete g_encode;
+        g_encode = nullptr;
         EnableWindow(g_hStartButton, TRUE);
         InvalidateRect(g_hStartButton, nullptr, TRUE);
         break;
@@ -1849,6 +2481,9 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
         PAINTSTRUCT ps;
         HDC hdc = BeginPaint(hwnd, &ps);
 
+        // Held across the blit: a playback frame-ring slot is only recycled
+        // under g_csState, so the bitmap can't be rewritten while it's drawn.
+        EnterCriticalSection(&g_csState);
         if (g_hFrameBitmap || g_isGenerating) {
             RECT clientRect; GetClientRect(hwnd, &clientRect);
 
@@ -1871,29 +2506,62 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
                               DT_CENTER | DT_VCENTER | DT_SINGLELINE);
                     if (oldFont) SelectObject(hdc, oldFont);
                 }
+                else if (g_previewNative) {
+                    // 1:1 inspection: centre the full-resolution frame, cropping what doesn't fit.
+                    int w = min(availW, g_frameWidth), h = min(availH, g_frameHeight);
+                    HDC memDC = CreateCompatibleDC(hdc);
+                    HBITMAP oldBmp = (HBITMAP)SelectObject(memDC, g_hFrameBitmap);
+                    BitBlt(hdc, (clientRect.right - w) / 2, topY, w, h,
+                           memDC, (g_frameWidth - w) / 2, (g_frameHeight - h) / 2, SRCCOPY);
+                    SelectObject(memDC, oldBmp);
+                    DeleteDC(memDC);
+                    if (g_isPlaying) DrawPlayStats(hdc, (clientRect.right - w) / 2 + 4, topY + 4);
+                }
                 else {
                     double imgAR = (double)g_frameWidth / (double)g_frameHeight;
                     int destW = availW;
                     int destH = (int)(availW / imgAR);
                     if (destH > availH) { destH = availH; destW = (int)(availH * imgAR); }
+                    // Frames are normally already converted at this size; rounding can
+                    // differ by a pixel, which isn't worth a HALFTONE resample.
+                    if (abs(destW - g_frameWidth) <= 1 && abs(destH - g_frameHeight) <= 1) {
+                        destW = g_frameWidth; destH = g_frameHeight;
+                    }
                     int destX = (clientRect.right - destW) / 2;
                     int destY = topY;
 
                     HDC memDC = CreateCompatibleDC(hdc);
                     HBITMAP oldBmp = (HBITMAP)SelectObject(memDC, g_hFrameBitmap);
-                    SetStretchBltMode(hdc, HALFTONE);
-                    SetBrushOrgEx(hdc, 0, 0, nullptr);
-                    StretchBlt(hdc, destX, destY, destW, destH, memDC, 0, 0, g_frameWidth, g_frameHeight, SRCCOPY);
+                    if (destW == g_frameWidth && destH == g_frameHeight) {
+                        BitBlt(hdc, destX, destY, destW, destH, memDC, 0, 0, SRCCOPY);
+                    } else {
+                        SetStretchBltMode(hdc, HALFTONE);
+                        SetBrushOrgEx(hdc, 0, 0, nullptr);
+                        StretchBlt(hdc, destX, destY, destW, destH, memDC, 0, 0, g_frameWidth, g_frameHeight, SRCCOPY);
+                    }
                     SelectObject(memDC, oldBmp);
                     DeleteDC(memDC);
+                    if (g_isPlaying) DrawPlayStats(hdc, destX + 4, destY + 4);
                 }
             }
         }
+        GdiFlush();   // batched blits must finish reading the slot before it is released
+        LeaveCriticalSection(&g_csState);
 
         EndPaint(hwnd, &ps);
         break;
     }
 
+    case WM_LBUTTONDBLCLK: {
+        // Toggle 1:1 inspection when the preview itself is double-clicked.
+        if (!g_playerReady || !g_hFrameBitmap || g_videoTop <= 0) break;
+        if (GET_Y_LPARAM(lParam) < g_videoTop) break;
+        g_previewNative = !g_previewNative;
+        RefreshPreviewFrame(hwnd);
+        InvalidateRect(hwnd, nullptr, TRUE);
+        break;
+    }
+
     case WM_SYSCOMMAND:
         if (wParam == IDM_ABOUT) {
             MessageBoxW(hwnd,
@@ -1904,35 +2572,49 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
                 MB_OK | MB_ICONINFORMATION);
             return 0;
         }
+        if (wParam >= IDM_MP4_FASTSTART && wParam <= IDM_MP4_FRAGMENTED) {
+            g_mp4Layout = (int)(wParam - IDM_MP4_FASTSTART);
+            CheckMenuRadioItem(g_hMp4Menu, IDM_MP4_FASTSTART, IDM_MP4_FRAGMENTED,
+                               (UINT)wParam, MF_BYCOMMAND);
+            return 0;
+        }
+        if (wParam == IDM_ENCODE_QUEUE) {
+            ShowQueueWindow();
+            return 0;
+        }
+        if (wParam == IDM_UNBUFFERED_OUTPUT) {
+            g_unbufferedOutput = !g_unbufferedOutput;
+            CheckMenuItem(g_hMp4Menu, IDM_UNBUFFERED_OUTPUT,
+                          MF_BYCOMMAND | (g_unbufferedOutput ? MF_CHECKED : MF_UNCHECKED));
+            return 0;
+        }
         return DefWindowProc(hwnd, msg, wParam, lParam);
 
     case WM_DESTROY:
         SaveSettings();
         StopPlayback();
-        g_thumbThreadStop = true;
-        if (g_thumbThread) {
-            WaitForSingleObject(g_thumbThread, 3000);
-            CloseHandle(g_thumbThread);
-            g_thumbThread = nullptr;
-        }
+        ThumbStop();
         for (int i = 0; i < 21; i++) {
             if (g_thumbs[i]) { DeleteObject(g_thumbs[i]); g_thumbs[i] = nullptr; }
         }
-        g_zoomThumbStop = true;
-        if (g_zoomThumbThread) {
-            WaitForSingleObject(g_zoomThumbThread, 2000);
-            CloseHandle(g_zoomThumbThread); g_zoomThumbThread = nullptr;
-        }
-        for (int i = 0; i < 21; i++) {
-            if (g_zoomThumbs[i]) { DeleteObject(g_zoomThumbs[i]); g_zoomThumbs[i] = nullptr; }
-        }
-        if (g_hFrameBitmap) { DeleteObject(g_hFrameBitmap); g_hFrameBitmap = nullptr; }
+        AtlasStop();
+        if (g_atlasWake) { CloseHandle(g_atlasWake); g_atlasWake = nullptr; }
+        PeaksStop(true);
+        MediaSessionClose(g_session); g_session = nullptr;
+        if (g_hHoverWnd) { DestroyWindow(g_hHoverWnd); g_hHoverWnd = nullptr; }
+        FrameRingFree();
         if (g_hFont)        { DeleteObject(g_hFont);        g_hFont        = nullptr; }
         if (g_hLabelFont)   { DeleteObject(g_hLabelFont);   g_hLabelFont   = nullptr; }
         if (g_hBkBrush)     { DeleteObject(g_hBkBrush);    g_hBkBrush     = nullptr; }
         if (g_hEditBrush)   { DeleteObject(g_hEditBrush);  g_hEditBrush   = nullptr; }
-        if (g_hwDeviceCtx)  { av_buffer_unref(&g_hwDeviceCtx); g_hwDeviceCtx = nullptr; }
-        if (g_encodeThread) { CloseHandle(g_encodeThread); g_encodeThread = nullptr; }
+        // Closing mid-encode cancels it (the partial file is deleted) rather than
+        // leaving the thread writing as the process exits.
+        delete g_encode; g_encode = nullptr;
+        // Running queue jobs are cancelled the same way and saved as queued,
+        // so the next launch offers them again.
+        if (g_hQueueWnd) DestroyWindow(g_hQueueWnd);
+        delete g_queue; g_queue = nullptr;
+        ReleaseHWDevice();
         PostQuitMessage(0);
         break;
 
@@ -2048,6 +2730,12 @@ static void PopulateAudioAndSubsDropdowns(const char* filepath) {
     SendMessage(g_hSubsDrop,  CB_SETCURSEL, 0, 0);
 }
 
+// Stream index of the audio dropdown's selection; -1 = default / none.
+static int SelectedAudioStream() {
+    LRESULT a = SendMessage(g_hAudioDrop, CB_GETCURSEL, 0, 0);
+    return (a != CB_ERR) ? (int)(INT_PTR)SendMessage(g_hAudioDrop, CB_GETITEMDATA, a, 0) : -1;
+}
+
 // ------------------------------ Xvid/packed-B-frame detection & remux ------------------------------
 
 // Returns true if the file is MPEG-4 video inside an AVI container — the condition
@@ -2159,149 +2847,132 @@ done:
 }
 
 // ------------------------------ Video Info ------------------------------
+// Thin wrapper over ProbeMedia (media.cpp) that also sets g_videoFPS.
 bool GetVideoInfo(const char* filepath, int& width, int& height, double& durationSeconds) {
-    AVFormatContext* fmt_ctx = nullptr;
-    if (avformat_open_input(&fmt_ctx, filepath, nullptr, nullptr) < 0) return false;
-    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) { avformat_close_input(&fmt_ctx); return false; }
-
-    int videoStreamIndex = -1;
-    for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
-        if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) { videoStreamIndex = i; break; }
-    }
-    if (videoStreamIndex < 0) { avformat_close_input(&fmt_ctx); return false; }
-
-    AVStream* videoStream = fmt_ctx->streams[videoStreamIndex];
-    width = videoStream->codecpar->width;
-    height = videoStream->codecpar->height;
-    if (fmt_ctx->duration != AV_NOPTS_VALUE) durationSeconds = fmt_ctx->duration / (double)AV_TIME_BASE;
-    else durationSeconds = 0.0;
-
-    if (videoStream->avg_frame_rate.num && videoStream->avg_frame_rate.den) {
-        g_videoFPS = av_q2d(videoStream->avg_frame_rate);
-    }
-    else if (videoStream->r_frame_rate.num && videoStream->r_frame_rate.den) {
-        g_videoFPS = av_q2d(videoStream->r_frame_rate);
-    }
-    else g_videoFPS = 30.0;
-
-    avformat_close_input(&fmt_ctx);
+    MediaInfo info;
+    if (!ProbeMedia(filepath, info)) return false;
+    width           = info.width;
+    height          = info.height;
+    durationSeconds = info.duration;
+    g_videoFPS      = info.fps;
     return true;
 }
 
-// ------------------------------ HDR Helpers (shared by preview, playback & encode) ------
-// Guard for older FFmpeg builds that don't define SWS_CS_BT2020
-#ifndef SWS_CS_BT2020
-#define SWS_CS_BT2020 9
-#endif
-
-// PQ (SMPTE ST 2084) EOTF: normalised [0,1] → linear light [0,1] (1.0 = 10 000 nits)
-static double pq_eotf(double N) {
-    if (N <= 0.0) return 0.0;
-    const double m1 = 0.1593017578125, m2 = 78.84375;
-    const double c1 = 0.8359375,       c2 = 18.8515625, c3 = 18.6875;
-    double p   = pow(N, 1.0 / m2);
-    double num = p - c1; if (num < 0.0) num = 0.0;
-    double den = c2 - c3 * p;
-    return den > 0.0 ? pow(num / den, 1.0 / m1) : 0.0;
-}
-// HLG (ARIB STD-B67) OETF inverse: normalised [0,1] → scene-linear [0,1]
-static double hlg_eotf(double E) {
-    if (E < 0.0) return 0.0;
-    if (E <= 0.5) return (E * E) / 3.0;
-    const double a = 0.17883277, b = 0.28466892, c = 0.55991073;
-    return (exp((E - c) / a) + b) / 12.0;
+// ------------------------------ HDR Display Helpers ------------------------------
+// The per-frame HDR glue (HdrTrcOf, HdrFrameToBgr) and the tone-mapping
+// kernel live in hdr.cpp, shared with the engine's thumbnails and the transcode.
+// Detect HDR from container metadata; sets g_isHdr, g_hdrTrc.  ProbeMedia
+// prepares the LUTs, before the thumbnail and playback threads start converting.
+static void DetectHdr(const char* filepath) {
+    MediaInfo info;
+    ProbeMedia(filepath, info);
+    g_isHdr  = info.isHdr;
+    g_hdrTrc = info.videoStream >= 0 ? info.hdrTrc : (int)AVCOL_TRC_UNSPECIFIED;
 }
-// Reinhard tone mapping in linear light; white = reference white level.
-// Maps v=0→0, v=white→1.0, v>white→clamped. Uses 2v/(white+v) so the
-// slope at the origin is 2/white (linear), avoiding the quadratic collapse
-// of the "extended" formula when v << white (common with PQ linear values).
-static inline double reinhard_tm(double v, double white) {
-    return 2.0 * v / (white + v);
+
+// ------------------------------ Preview Frame Ring ------------------------------
+// Playback frames are converted straight into a fixed set of DIB sections that
+// are reused for the life of the app; a slot's DIB is only recreated when the
+// preview size changes.  Slot ownership moves FREE → BUSY (decoder writing it,
+// or waiting in the presenter queue) → SHOWN (g_hFrameBitmap) → FREE, with the
+// state flipped by Interlocked operations.  SHOWN → FREE only happens under
+// g_csState, which WM_PAINT holds while it blits.
+enum { SLOT_FREE = 0, SLOT_BUSY = 1, SLOT_SHOWN = 2 };
+
+// Presenter queue depth + the frame on screen + the one being written + one
+// in transit between queue and screen.
+static const int kFrameRingSlots = 10;
+
+struct FrameSlot {
+    HBITMAP       bmp    = nullptr;
+    uint8_t*      bits   = nullptr;
+    int           w = 0, h = 0;
+    int           stride = 0;              // DWORD-aligned BGR24 row pitch
+    volatile LONG state  = SLOT_FREE;
+};
+static FrameSlot     g_frameRing[kFrameRingSlots];
+static volatile LONG g_ringShown = -1;     // slot behind g_hFrameBitmap, -1 = a standalone bitmap
+
+// Claims a free slot sized w x h for the decoder.  -1 if every slot is in use.
+static int FrameRingAcquire(int w, int h) {
+    for (int i = 0; i < kFrameRingSlots; i++) {
+        FrameSlot& s = g_frameRing[i];
+        if (InterlockedCompareExchange(&s.state, SLOT_BUSY, SLOT_FREE) != SLOT_FREE) continue;
+        if (s.bmp && s.w == w && s.h == h) return i;
+
+        if (s.bmp) { DeleteObject(s.bmp); s.bmp = nullptr; s.bits = nullptr; }
+        BITMAPINFO bmi = {};
+        bmi.bmiHeader.biSize        = sizeof(BITMAPINFOHEADER);
+        bmi.bmiHeader.biWidth       = w;
+        bmi.bmiHeader.biHeight      = -h;
+        bmi.bmiHeader.biPlanes      = 1;
+        bmi.bmiHeader.biBitCount    = 24;
+        bmi.bmiHeader.biCompression = BI_RGB;
+        void* bits = nullptr;
+        s.bmp = CreateDIBSection(nullptr, &bmi, DIB_RGB_COLORS, &bits, nullptr, 0);
+        if (!s.bmp) { InterlockedExchange(&s.state, SLOT_FREE); return -1; }
+        s.bits   = (uint8_t*)bits;
+        s.w      = w;
+        s.h      = h;
+        s.stride = (w * 3 + 3) & ~3;
+        return i;
+    }
+    return -1;
 }
-// sRGB OETF: linear [0,1] → gamma-encoded uint8
-static inline uint8_t srgb_pack(double v) {
-    double g = (v <= 0.0031308) ? 12.92 * v : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
-    int i = (int)(g * 255.0 + 0.5);
-    return (uint8_t)(i < 0 ? 0 : i > 255 ? 255 : i);
+
+static void FrameRingRelease(int idx) {
+    if (idx >= 0) InterlockedExchange(&g_frameRing[idx].state, SLOT_FREE);
 }
-// BT.2020 → BT.709 primaries matrix (linear RGB)
-static const double k_bt2020_to_bt709[3][3] = {
-    { 1.6605, -0.5876, -0.0728 },
-    {-0.1246,  1.1329, -0.0083 },
-    {-0.0182, -0.1006,  1.1187 }
-};
-// Float copy for vectorisable inner loops
-static const float k_bt2020_to_bt709f[3][3] = {
-    { 1.6605f, -0.5876f, -0.0728f },
-    {-0.1246f,  1.1329f, -0.0083f },
-    {-0.0182f, -0.1006f,  1.1187f }
-};
 
-// ----- Tone-mapping LUTs for fast transcode (built once per encode session) -----
-// s_eotf_lut[i] = EOTF(i/65535) — eliminates all pow() calls in Stage 2.
-static float   s_eotf_lut[65536]   = {};
-// s_srgb_lut16[i] = sRGB_encode(i/65535) as uint8 — eliminates sRGB pow() calls.
-static uint8_t s_srgb_lut16[65536] = {};
-static bool    s_srgb_lut_ready    = false;
+// Both helpers below expect g_csState held.  Drops whatever the preview shows:
+// a ring slot goes back to the pool, a standalone bitmap is deleted.
+static void ReleaseShownFrameLocked() {
+    LONG shown = InterlockedExchange(&g_ringShown, -1);
+    if (shown >= 0) FrameRingRelease(shown);
+    else if (g_hFrameBitmap) DeleteObject(g_hFrameBitmap);
+    g_hFrameBitmap = nullptr;
+}
 
-// Call once before each HDR→SDR encode with the source transfer characteristic.
-static void BuildToneMappingLuts(bool isPQ) {
-    for (int i = 0; i < 65536; i++) {
-        double v = i / 65535.0;
-        s_eotf_lut[i] = isPQ ? (float)pq_eotf(v) : (float)hlg_eotf(v);
-    }
-    if (!s_srgb_lut_ready) {
-        for (int i = 0; i < 65536; i++)
-            s_srgb_lut16[i] = srgb_pack(i / 65535.0);
-        s_srgb_lut_ready = true;
-    }
+static void ShowRingSlotLocked(int idx, int64_t ms) {
+    ReleaseShownFrameLocked();
+    FrameSlot& s = g_frameRing[idx];
+    InterlockedExchange(&s.state, SLOT_SHOWN);
+    InterlockedExchange(&g_ringShown, idx);
+    g_hFrameBitmap = s.bmp;
+    g_frameWidth   = s.w;
+    g_frameHeight  = s.h;
+    g_currentPosMs = ms;
 }
 
-// Build an 8-bit LUT for fast display tone-mapping in the playback thread.
-// sws_scale to BGR24 from an HDR source outputs PQ/HLG-encoded values linearly
-// mapped to [0,255]; this LUT applies the inverse EOTF + Reinhard + sRGB.
-static void BuildHdrDisplayLut() {
-    bool   isPQ = (g_hdrTrc == AVCOL_TRC_SMPTE2084);
-    double refW = isPQ ? 0.0203 : 0.25;
-    for (int i = 0; i < 256; i++) {
-        double v   = i / 255.0;
-        double lin = isPQ ? pq_eotf(v) : hlg_eotf(v);
-        double tm  = reinhard_tm(lin, refW);
-        g_hdrDisplay8Lut[i] = srgb_pack(tm);
-    }
-    g_hdrLutValid = true;
+// Replaces the preview with a standalone bitmap (middle frame) or nothing.
+static void SetPreviewBitmap(HBITMAP bmp) {
+    EnterCriticalSection(&g_csState);
+    ReleaseShownFrameLocked();
+    g_hFrameBitmap = bmp;
+    if (bmp) {
+        BITMAP bi; GetObject(bmp, sizeof(bi), &bi);
+        g_frameWidth = bi.bmWidth; g_frameHeight = bi.bmHeight;
+    }
+    LeaveCriticalSection(&g_csState);
 }
 
-// Detect HDR from container metadata; sets g_isHdr, g_hdrTrc, and rebuilds the LUT.
-static void DetectHdr(const char* filepath) {
-    g_isHdr       = false;
-    g_hdrTrc      = AVCOL_TRC_UNSPECIFIED;
-    g_hdrLutValid = false;
-    AVFormatContext* fmt_ctx = nullptr;
-    if (avformat_open_input(&fmt_ctx, filepath, nullptr, nullptr) < 0) return;
-    if (avformat_find_stream_info(fmt_ctx, nullptr) >= 0) {
-        for (unsigned i = 0; i < fmt_ctx->nb_streams; i++) {
-            if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-                AVColorTransferCharacteristic trc =
-                    fmt_ctx->streams[i]->codecpar->color_trc;
-                g_hdrTrc = (int)trc;
-                if (trc == AVCOL_TRC_SMPTE2084 || trc == AVCOL_TRC_ARIB_STD_B67)
-                    g_isHdr = true;
-                else if (fmt_ctx->streams[i]->codecpar->color_primaries == AVCOL_PRI_BT2020)
-                    g_isHdr = true;  // BT.2020 primaries without explicit TRC tag
-                break;
-            }
-        }
+// WM_DESTROY, after playback has stopped.
+static void FrameRingFree() {
+    SetPreviewBitmap(nullptr);
+    for (FrameSlot& s : g_frameRing) {
+        if (s.bmp) DeleteObject(s.bmp);
+        s.bmp = nullptr; s.bits = nullptr;
+        s.w = s.h = s.stride = 0;
+        s.state = SLOT_FREE;
     }
-    avformat_close_input(&fmt_ctx);
-    if (g_isHdr) BuildHdrDisplayLut();
 }
 
 // ------------------------------ Extract Middle Frame ------------------------------
-HBITMAP ExtractMiddleFrameBitmap(const char* filepath, int orig_w, int orig_h, double duration) {
+HBITMAP ExtractMiddleFrameBitmap(MediaSession* session, int orig_w, int orig_h, double duration) {
+    MediaReader* reader = nullptr;
     AVFormatContext* fmt_ctx = nullptr;
     AVCodecContext* dec_ctx = nullptr;
-    SwsContext* sws_ctx = nullptr;
+    BgrConverter conv;
     AVPacket* pkt = nullptr;
     AVFrame* frame = nullptr;
     AVFrame* rgbFrame = nullptr;
@@ -2311,32 +2982,22 @@ HBITMAP ExtractMiddleFrameBitmap(const char* filepath, int orig_w, int orig_h, d
     HBITMAP hBitmap = nullptr;
     int videoStreamIndex = -1;
     AVStream* videoStream = nullptr;
-    const AVCodec* decoder = nullptr;
     bool gotFrame = false;
     bool using_hw = false;
     int rgbBufSize = 0;
+    int outW = 0, outH = 0;     // converted size: fits the preview box
     BITMAPINFO bmi = {};
     HDC hdc = nullptr;
     void* dibBits = nullptr;
 
-    if (avformat_open_input(&fmt_ctx, filepath, nullptr, nullptr) < 0) goto cleanup;
-    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) goto cleanup;
-    for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
-        if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) { videoStreamIndex = i; break; }
-    }
-    if (videoStreamIndex < 0) goto cleanup;
-    videoStream = fmt_ctx->streams[videoStreamIndex];
-
-    decoder = find_best_decoder(videoStream->codecpar->codec_id, using_hw);
-    if (!decoder) goto cleanup;
-    dec_ctx = avcodec_alloc_context3(decoder);
-    if (!dec_ctx) goto cleanup;
-    if (avcodec_parameters_to_context(dec_ctx, videoStream->codecpar) < 0) goto cleanup;
-    if (using_hw) {
-        dec_ctx->hw_device_ctx = av_buffer_ref(g_hwDeviceCtx);
-        dec_ctx->get_format    = get_hw_format;
-    }
-    if (avcodec_open2(dec_ctx, decoder, nullptr) < 0) goto cleanup;
+    // The session keeps a playback reader warm, so this normally costs no open at all.
+    reader = MediaSessionLease(session, READER_PLAYBACK);
+    if (!reader) goto cleanup;
+    fmt_ctx          = reader->fmt_ctx;
+    dec_ctx          = reader->dec_ctx;
+    videoStreamIndex = reader->videoIdx;
+    videoStream      = reader->videoStream;
+    using_hw         = reader->using_hw;
 
     middle_ts = (int64_t)((duration / 2.0) * AV_TIME_BASE);
     av_seek_frame(fmt_ctx, -1, middle_ts, AVSEEK_FLAG_BACKWARD);
@@ -2348,93 +3009,25 @@ HBITMAP ExtractMiddleFrameBitmap(const char* filepath, int orig_w, int orig_h, d
     pkt = av_packet_alloc();
     if (!pkt) goto cleanup;
 
-    // sws_ctx and rgbBuffer are created lazily on the first decoded frame because
-    // with NVDEC the pixel format is not known until av_hwframe_transfer_data runs.
-    rgbBufSize = av_image_get_buffer_size(AV_PIX_FMT_BGR24, dec_ctx->width, dec_ctx->height, 1);
+    PreviewTargetSize(dec_ctx->width, dec_ctx->height, &outW, &outH);
+
+    // The converter is set up on the first decoded frame because with NVDEC
+    // the pixel format is not known until av_hwframe_transfer_data runs.
+    rgbBufSize = av_image_get_buffer_size(AV_PIX_FMT_BGR24, outW, outH, 1);
     rgbBuffer = (uint8_t*)av_malloc(rgbBufSize);
     if (!rgbBuffer) goto cleanup;
     av_image_fill_arrays(rgbFrame->data, rgbFrame->linesize, rgbBuffer,
-        AV_PIX_FMT_BGR24, dec_ctx->width, dec_ctx->height, 1);
+        AV_PIX_FMT_BGR24, outW, outH, 1);
 
     while (av_read_frame(fmt_ctx, pkt) >= 0) {
         if (pkt->stream_index == videoStreamIndex) {
             if (avcodec_send_packet(dec_ctx, pkt) < 0) { av_packet_unref(pkt); break; }
             if (avcodec_receive_frame(dec_ctx, frame) == 0) {
                 // Transfer NVDEC hardware frame to CPU memory if needed.
-                AVFrame* sw_frame = frame;
-                if (using_hw && frame->format == AV_PIX_FMT_CUDA) {
-                    if (!cpu_frame) cpu_frame = av_frame_alloc();
-                    if (cpu_frame && av_hwframe_transfer_data(cpu_frame, frame, 0) >= 0) {
-                        cpu_frame->color_trc   = frame->color_trc;
-                        cpu_frame->colorspace  = frame->colorspace;
-                        cpu_frame->color_range = frame->color_range;
-                        sw_frame = cpu_frame;
-                    }
-                }
-                // Lazy-init sws_ctx now that we know the actual pixel format.
-                if (!sws_ctx) {
-                    sws_ctx = sws_getContext(
-                        sw_frame->width, sw_frame->height, (AVPixelFormat)sw_frame->format,
-                        sw_frame->width, sw_frame->height, AV_PIX_FMT_BGR24,
-                        SWS_BILINEAR, nullptr, nullptr, nullptr);
-                }
-                bool isPQ  = (sw_frame->color_trc == AVCOL_TRC_SMPTE2084);
-                bool isHLG = (sw_frame->color_trc == AVCOL_TRC_ARIB_STD_B67);
-                if (isPQ || isHLG) {
-                    // Full-quality HDR→SDR: decode → RGB48LE → EOTF+matrix+TM → sRGB
-                    int srcCs = (sw_frame->colorspace == AVCOL_SPC_BT2020_NCL ||
-                                 sw_frame->colorspace == AVCOL_SPC_BT2020_CL)
-                                ? SWS_CS_BT2020 : SWS_CS_ITU709;
-                    int srcRange = (sw_frame->color_range == AVCOL_RANGE_JPEG) ? 1 : 0;
-                    SwsContext* hdr_sws = sws_getContext(
-                        dec_ctx->width, dec_ctx->height, (AVPixelFormat)sw_frame->format,
-                        dec_ctx->width, dec_ctx->height, AV_PIX_FMT_RGB48LE,
-                        SWS_BILINEAR, nullptr, nullptr, nullptr);
-                    if (hdr_sws) {
-                        sws_setColorspaceDetails(hdr_sws,
-                            sws_getCoefficients(srcCs), srcRange,
-                            sws_getCoefficients(SWS_CS_ITU709), 1,
-                            0, 1 << 16, 1 << 16);
-                        int stride48 = dec_ctx->width * 6;
-                        uint8_t* rgb48 = (uint8_t*)av_malloc((size_t)dec_ctx->height * stride48);
-                        if (rgb48) {
-                            uint8_t* d[1] = { rgb48 }; int s[1] = { stride48 };
-                            sws_scale(hdr_sws, sw_frame->data, sw_frame->linesize,
-                                      0, dec_ctx->height, d, s);
-                            double refW = isPQ ? 0.0203 : 0.25;
-                            for (int row = 0; row < dec_ctx->height; row++) {
-                                const uint16_t* src16 =
-                                    (const uint16_t*)(rgb48 + row * stride48);
-                                uint8_t* dst =
-                                    rgbFrame->data[0] + row * rgbFrame->linesize[0];
-                                for (int x = 0; x < dec_ctx->width; x++) {
-                                    double R = src16[x*3+0] / 65535.0;
-                                    double G = src16[x*3+1] / 65535.0;
-                                    double B = src16[x*3+2] / 65535.0;
-                                    if (isPQ){ R=pq_eotf(R); G=pq_eotf(G); B=pq_eotf(B); }
-                                    else     { R=hlg_eotf(R);G=hlg_eotf(G);B=hlg_eotf(B); }
-                                    double Ro=k_bt2020_to_bt709[0][0]*R+k_bt2020_to_bt709[0][1]*G+k_bt2020_to_bt709[0][2]*B;
-                                    double Go=k_bt2020_to_bt709[1][0]*R+k_bt2020_to_bt709[1][1]*G+k_bt2020_to_bt709[1][2]*B;
-                                    double Bo=k_bt2020_to_bt709[2][0]*R+k_bt2020_to_bt709[2][1]*G+k_bt2020_to_bt709[2][2]*B;
-                                    if (Ro<0.0) Ro=0.0; if (Go<0.0) Go=0.0; if (Bo<0.0) Bo=0.0;
-                                    Ro=reinhard_tm(Ro,refW); Go=reinhard_tm(Go,refW); Bo=reinhard_tm(Bo,refW);
-                                    dst[x*3+0] = srgb_pack(Bo);
-                                    dst[x*3+1] = srgb_pack(Go);
-                                    dst[x*3+2] = srgb_pack(Ro);
-                                }
-                            }
-                            av_free(rgb48);
-                            gotFrame = true;
-                        }
-                        sws_freeContext(hdr_sws);
-                    }
-                } else {
-                    if (sws_ctx) {
-                        sws_scale(sws_ctx, sw_frame->data, sw_frame->linesize, 0, dec_ctx->height,
-                            rgbFrame->data, rgbFrame->linesize);
-                        gotFrame = true;
-                    }
-                }
+                AVFrame* sw_frame = HwFrameToCpu(frame, &cpu_frame);
+                // PQ/HLG get full-quality HDR→SDR through the shared display kernel.
+                gotFrame = FrameToBgr(conv, sw_frame, HdrTrcOf(sw_frame, g_isHdr, g_hdrTrc),
+                                      outW, outH, rgbFrame->data[0], rgbFrame->linesize[0]);
                 av_frame_unref(frame);
                 av_packet_unref(pkt);
                 break;
@@ -2445,8 +3038,8 @@ HBITMAP ExtractMiddleFrameBitmap(const char* filepath, int orig_w, int orig_h, d
     if (!gotFrame) goto cleanup;
 
     bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-    bmi.bmiHeader.biWidth = dec_ctx->width;
-    bmi.bmiHeader.biHeight = -dec_ctx->height;
+    bmi.bmiHeader.biWidth = outW;
+    bmi.bmiHeader.biHeight = -outH;
     bmi.bmiHeader.biPlanes = 1;
     bmi.bmiHeader.biBitCount = 24;
     bmi.bmiHeader.biCompression = BI_RGB;
@@ -2457,105 +3050,906 @@ HBITMAP ExtractMiddleFrameBitmap(const char* filepath, int orig_w, int orig_h, d
     if (!hBitmap) goto cleanup;
 
     {
-        int rowBytes = dec_ctx->width * 3;
-        for (int y = 0; y < dec_ctx->height; y++) {
-            memcpy((uint8_t*)dibBits + y * rowBytes,
+        int rowBytes  = outW * 3;
+        int dibStride = (rowBytes + 3) & ~3;   // DIB rows are DWORD-aligned
+        for (int y = 0; y < outH; y++) {
+            memcpy((uint8_t*)dibBits + y * dibStride,
                 rgbFrame->data[0] + y * rgbFrame->linesize[0], rowBytes);
         }
     }
 
 cleanup:
-    if (sws_ctx) sws_freeContext(sws_ctx);
+    BgrConverterFree(conv);
     if (cpu_frame) av_frame_free(&cpu_frame);
     if (frame) av_frame_free(&frame);
     if (rgbFrame) { if (rgbBuffer) av_free(rgbBuffer); av_frame_free(&rgbFrame); }
     if (pkt) av_packet_free(&pkt);
-    if (dec_ctx) avcodec_free_context(&dec_ctx);
-    if (fmt_ctx) avformat_close_input(&fmt_ctx);
+    MediaSessionReturn(reader);
     return hBitmap;
 }
 
-// ------------------------------ Playback Thread (no goto) ------------------------------
-struct PlaybackCtx { std::string path; };
-
-unsigned __stdcall PlaybackThreadProc(void* p) {
-    PlaybackCtx* ctx = (PlaybackCtx*)p;
-    const char* filepath = ctx->path.c_str();
-
-    AVFormatContext* fmt_ctx = nullptr;
-    AVCodecContext* dec_ctx = nullptr;
-    SwsContext* sws_ctx = nullptr;
-    AVPacket* pkt = nullptr;
-    AVFrame* frame = nullptr;
-    AVFrame* rgbFrame = nullptr;
-    AVFrame* cpu_frame = nullptr;   // for NVDEC hw→cpu transfer
-    int              videoStreamIndex = -1;
-    AVStream* videoStream = nullptr;
-    const AVCodec* decoder = nullptr;
-    uint8_t* rgbBuffer = nullptr;
-    int              rgbBufSize = 0;
-    bool             using_hw = false;
+// ------------------------------ Audio Output ------------------------------
+// Playback audio is S16 stereo.  The decoder pushes PCM into a fixed SPSC ring;
+// the sink drains it to the device in a few recycled blocks and reports the
+// exact number of samples played, which the presenter uses as its clock.
+
+static const int kAudioBlocks  = 4;     // device queue: 4 x 30 ms = 120 ms output latency
+static const int kAudioBlockMs = 30;
+static const int kAudioRingMs  = 250;   // decoded-ahead PCM on top of the device queue
+
+// Single-producer (decoder) / single-consumer (sink) byte ring.  The two
+// running totals only ever grow; each side owns one of them.
+struct PcmRing {
+    uint8_t*        buf     = nullptr;
+    size_t          cap     = 0;
+    volatile LONG64 written = 0;
+    volatile LONG64 read    = 0;
+
+    bool Init(size_t bytes) {
+        buf = (uint8_t*)malloc(bytes);
+        cap = buf ? bytes : 0;
+        written = read = 0;
+        return buf != nullptr;
+    }
+    void Free() { free(buf); buf = nullptr; cap = 0; }
 
-    // Audio playback state
-    int              audioStreamIdx  = -1;
-    AVCodecContext*  aDecCtx         = nullptr;
-    SwrContext*      swrCtx          = nullptr;
-    HWAVEOUT         hWaveOut        = nullptr;
-    AVFrame*         aFrame          = nullptr;
-    bool             waveOutIsPaused = false;
-    std::deque<WAVEHDR*> waveBlocks;
+    size_t Avail() const {
+        return (size_t)(InterlockedCompareExchange64((volatile LONG64*)&written, 0, 0) -
+                        InterlockedCompareExchange64((volatile LONG64*)&read, 0, 0));
+    }
+    size_t Space() const { return cap - Avail(); }
+
+    size_t Push(const uint8_t* src, size_t n) {
+        n = min(n, Space());
+        size_t pos   = (size_t)(written % (LONG64)cap);
+        size_t first = min(n, cap - pos);
+        memcpy(buf + pos, src, first);
+        memcpy(buf, src + first, n - first);
+        InterlockedExchangeAdd64(&written, (LONG64)n);   // publish after the copy
+        return n;
+    }
+    size_t Pop(uint8_t* dst, size_t n) {
+        n = min(n, Avail());
+        size_t pos   = (size_t)(read % (LONG64)cap);
+        size_t first = min(n, cap - pos);
+        memcpy(dst, buf + pos, first);
+        memcpy(dst + first, buf, n - first);
+        InterlockedExchangeAdd64(&read, (LONG64)n);
+        return n;
+    }
+    // Drop everything queued.  Consumer side; callers serialise with the sink.
+    void Clear() { InterlockedExchange64(&read, InterlockedCompareExchange64(&written, 0, 0)); }
+};
 
-    // PTS-based video timing
-    bool      timingInit     = false;
-    ULONGLONG t0Wall         = 0;
-    int64_t   t0PtsMs        = 0;
-    bool      prevWasPlaying = false; // initialised below after audio init
-    int64_t   catchUpToMs    = -1;   // skip frames before this PTS after a seek
-    int64_t   vid_play_start = 0;    // stream->start_time offset (AVI/Xvid may be non-zero)
-    int64_t   last_vid_dts   = AV_NOPTS_VALUE; // most-recent valid video packet DTS
+// Audio device as the playback engine sees it.  All calls come from the
+// decoder thread except PlayedSamples, which the presenter also uses.
+struct AudioSink {
+    virtual ~AudioSink() {}
+    virtual bool    Open(int sampleRate) = 0;
+    virtual void    Close() = 0;
+    virtual size_t  Write(const uint8_t* pcm, size_t bytes) = 0;  // non-blocking; bytes accepted
+    virtual void    Pause(bool paused) = 0;
+    virtual void    Reset() = 0;              // drop queued audio; played position back to 0
+    virtual int64_t PlayedSamples() = 0;      // since Open/Reset, -1 if unknown
+};
 
-    bool init_ok = false;
-    do {
-        if (avformat_open_input(&fmt_ctx, filepath, nullptr, nullptr) < 0) break;
-        if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) break;
-        for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
-            if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) { videoStreamIndex = i; break; }
+// waveOut backend.  A feeder thread refills whichever blocks the device has
+// finished with (signalled through CALLBACK_EVENT) from the ring.
+struct WaveOutSink : AudioSink {
+    HWAVEOUT         wo      = nullptr;
+    HANDLE           wake    = nullptr;
+    HANDLE           thread  = nullptr;
+    volatile bool    quit    = false;
+    CRITICAL_SECTION cs;                 // feeder vs Reset/Close
+    WAVEHDR          hdr[kAudioBlocks]   = {};
+    bool             queued[kAudioBlocks] = {};
+    size_t           blockBytes = 0;
+    PcmRing          ring;
+
+    static unsigned __stdcall FeederProc(void* p) {
+        WaveOutSink* s = (WaveOutSink*)p;
+        while (!s->quit) {
+            WaitForSingleObject(s->wake, 50);
+            EnterCriticalSection(&s->cs);
+            for (int i = 0; i < kAudioBlocks && !s->quit; i++) {
+                if (s->queued[i] && !(s->hdr[i].dwFlags & WHDR_DONE)) continue;
+                size_t n = s->ring.Pop((uint8_t*)s->hdr[i].lpData, s->blockBytes);
+                s->queued[i] = (n > 0);
+                if (!n) break;
+                s->hdr[i].dwBufferLength = (DWORD)n;
+                s->hdr[i].dwFlags &= ~WHDR_DONE;
+                waveOutWrite(s->wo, &s->hdr[i], sizeof(WAVEHDR));
+            }
+            LeaveCriticalSection(&s->cs);
         }
-        if (videoStreamIndex < 0) break;
-        videoStream = fmt_ctx->streams[videoStreamIndex];
-        // AVI/Xvid: stream->start_time can be non-zero; subtract it from all PTS values
-        // so that elapsed time is always measured from the actual start of the file.
-        vid_play_start = (videoStream->start_time != AV_NOPTS_VALUE)
-                          ? videoStream->start_time : 0;
+        return 0;
+    }
 
-        decoder = find_best_decoder(videoStream->codecpar->codec_id, using_hw);
-        if (!decoder) break;
-        dec_ctx = avcodec_alloc_context3(decoder);
-        if (!dec_ctx) break;
-        if (avcodec_parameters_to_context(dec_ctx, videoStream->codecpar) < 0) break;
-        if (using_hw) {
-            dec_ctx->hw_device_ctx = av_buffer_ref(g_hwDeviceCtx);
-            dec_ctx->get_format    = get_hw_format;
+    bool Open(int sampleRate) override {
+        WAVEFORMATEX wfx    = {};
+        wfx.wFormatTag      = WAVE_FORMAT_PCM;
+        wfx.nChannels       = 2;
+        wfx.nSamplesPerSec  = (DWORD)sampleRate;
+        wfx.wBitsPerSample  = 16;
+        wfx.nBlockAlign     = 4;
+        wfx.nAvgBytesPerSec = (DWORD)(sampleRate * 4);
+        wake = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (!wake) return false;
+        if (waveOutOpen(&wo, WAVE_MAPPER, &wfx, (DWORD_PTR)wake, 0, CALLBACK_EVENT) != MMSYSERR_NOERROR) {
+            wo = nullptr;
+            CloseHandle(wake); wake = nullptr;
+            return false;
+        }
+        blockBytes = (size_t)sampleRate * kAudioBlockMs / 1000 * 4;
+        bool ok = ring.Init((size_t)sampleRate * kAudioRingMs / 1000 * 4);
+        for (int i = 0; i < kAudioBlocks && ok; i++) {
+            hdr[i].lpData         = (LPSTR)malloc(blockBytes);
+            hdr[i].dwBufferLength = (DWORD)blockBytes;
+            ok = hdr[i].lpData &&
+                 waveOutPrepareHeader(wo, &hdr[i], sizeof(WAVEHDR)) == MMSYSERR_NOERROR;
         }
-        if (avcodec_open2(dec_ctx, decoder, nullptr) < 0) break;
+        InitializeCriticalSection(&cs);
+        if (ok) thread = (HANDLE)_beginthreadex(nullptr, 0, FeederProc, this, 0, nullptr);
+        if (!thread) {
+            // Half set up: undo it so the caller can fall back to the null sink.
+            Release();
+            return false;
+        }
+        return true;
+    }
 
-        // bsf_ctx / bsf_pkt intentionally not used in playback: the mpeg4_unpack_bframes
-        // BSF reorders packets in a way that sends B-frames to the decoder before their
-        // reference P-frames, causing progressive quality degradation every GOP (~3 s).
-        // Wrong VOP timestamps are handled instead by the last_vid_dts fallback below.
+    void Close() override {
+        if (!wo) return;
+        quit = true;
+        SetEvent(wake);
+        if (thread) { WaitForSingleObject(thread, INFINITE); CloseHandle(thread); thread = nullptr; }
+        Release();
+    }
 
-        // sws_ctx is created lazily on the first frame so we get the real pixel
-        // format after NVDEC hw→cpu transfer (dec_ctx->pix_fmt == CUDA with hw).
+    // Everything Open set up but the feeder thread.  Headers are unprepared
+    // only if they were prepared, so this also undoes a partial Open.
+    void Release() {
+        waveOutReset(wo);
+        for (int i = 0; i < kAudioBlocks; i++) {
+            if (hdr[i].dwFlags & WHDR_PREPARED) waveOutUnprepareHeader(wo, &hdr[i], sizeof(WAVEHDR));
+            free(hdr[i].lpData);
+            hdr[i] = {};
+        }
+        waveOutClose(wo); wo = nullptr;
+        CloseHandle(wake); wake = nullptr;
+        DeleteCriticalSection(&cs);
+        ring.Free();
+    }
 
-        frame = av_frame_alloc();
-        rgbFrame = av_frame_alloc();
-        if (!frame || !rgbFrame) break;
+    size_t Write(const uint8_t* pcm, size_t bytes) override {
+        size_t n = ring.Push(pcm, bytes);
+        if (n) SetEvent(wake);
+        return n;
+    }
+
+    void Pause(bool paused) override {
+        if (paused) waveOutPause(wo); else waveOutRestart(wo);
+    }
+
+    void Reset() override {
+        EnterCriticalSection(&cs);
+        waveOutReset(wo);             // returns every block marked WHDR_DONE
+        ring.Clear();
+        for (bool& q : queued) q = false;
+        LeaveCriticalSection(&cs);
+    }
+
+    int64_t PlayedSamples() override {
+        MMTIME mmt = {};
+        mmt.wType  = TIME_SAMPLES;
+        if (waveOutGetPosition(wo, &mmt, sizeof(mmt)) != MMSYSERR_NOERROR) return -1;
+        return (mmt.wType == TIME_BYTES) ? mmt.u.cb / 4 : mmt.u.sample;
+    }
+};
+
+// No device: consumes PCM in real time against the performance counter, so
+// playback (and its clock) behave the same without audio hardware.
+struct NullAudioSink : AudioSink {
+    CRITICAL_SECTION cs;
+    int      rate     = 0;
+    int64_t  capSamples = 0;
+    int64_t  written  = 0;      // samples accepted since Reset
+    int64_t  played   = 0;      // samples consumed before startQpc
+    LONGLONG startQpc = 0;      // 0 = not running
+    bool     paused   = false;
+
+    int64_t ConsumedLocked() {
+        if (!startQpc) return played;
+        int64_t run = (QpcNow() - startQpc) * rate / QpcFreq();
+        return min(written, played + run);
+    }
+    bool Open(int sampleRate) override {
+        InitializeCriticalSection(&cs);
+        rate       = sampleRate;
+        capSamples = (int64_t)sampleRate * (kAudioRingMs + kAudioBlocks * kAudioBlockMs) / 1000;
+        return true;
+    }
+    void Close() override { DeleteCriticalSection(&cs); }
+    size_t Write(const uint8_t*, size_t bytes) override {
+        EnterCriticalSection(&cs);
+        int64_t done = ConsumedLocked();
+        if (done == written) { played = written; startQpc = 0; }   // ran dry: restart the clock on new data
+        int64_t n = (int64_t)(bytes / 4);
+        if (n > capSamples - (written - done)) n = capSamples - (written - done);
+        if (n < 0) n = 0;
+        if (n && !startQpc && !paused) startQpc = QpcNow();
+        written += n;
+        LeaveCriticalSection(&cs);
+        return (size_t)n * 4;
+    }
+    void Pause(bool p) override {
+        EnterCriticalSection(&cs);
+        if (p && !paused) { played = ConsumedLocked(); startQpc = 0; }
+        if (!p && paused && written > played) startQpc = QpcNow();
+        paused = p;
+        LeaveCriticalSection(&cs);
+    }
+    void Reset() override {
+        EnterCriticalSection(&cs);
+        written = played = 0; startQpc = 0;
+        LeaveCriticalSection(&cs);
+    }
+    int64_t PlayedSamples() override {
+        EnterCriticalSection(&cs);
+        int64_t v = ConsumedLocked();
+        LeaveCriticalSection(&cs);
+        return v;
+    }
+};
+
+// ------------------------------ Playback Commands ------------------------------
+// The UI thread tells PlaybackThreadProc where to go through a single latest-
+// wins slot.  Posting overwrites whatever the thread hasn't picked up yet, so
+// a drag across the timeline never queues up stale seeks.  g_cmdSeq is a
+// seqlock: odd while the UI is writing g_cmd, and every publish bumps it by
+// two, so it doubles as the command generation.  Long decodes on the thread
+// poll it between packets and give up as soon as a newer command exists.
+
+enum PlayCmdKind { PLAYCMD_SEEK, PLAYCMD_STEP };
+
+struct PlayCommand {
+    int     kind;
+    int64_t ms;          // SEEK: target; STEP: frame shown when the step was asked for
+    int     stepDir;     // STEP: +1 forward, -1 backward
+    bool    showFrame;   // SEEK: decode and show the frame at ms (paused preview)
+    bool    scrub;       // SEEK: nearest keyframe is good enough (timeline drag)
+};
+
+static PlayCommand   g_cmd = {};      // written by the UI thread only
+static volatile LONG g_cmdSeq = 0;
+
+// Forward drags closer than this to the decode position extend the running
+// decode instead of restarting it from the previous keyframe.
+static const int64_t kScrubFollowMs = 1000;
+
+static void PostPlayCommand(const PlayCommand& c) {
+    InterlockedIncrement(&g_cmdSeq);   // odd: slot is being written
+    g_cmd = c;
+    InterlockedIncrement(&g_cmdSeq);   // even: published
+}
+
+static bool PlayCommandPending(LONG seenSeq) {
+    return g_cmdSeq != seenSeq;
+}
+
+// Copies out the newest command if it is newer than seenSeq, which is then
+// advanced past it.  Intermediate commands the thread never saw are dropped.
+static bool TakePlayCommand(LONG& seenSeq, PlayCommand& out) {
+    for (;;) {
+        LONG before = InterlockedCompareExchange(&g_cmdSeq, 0, 0);
+        if (before == seenSeq) return false;
+        if (before & 1) { YieldProcessor(); continue; }
+        PlayCommand c = g_cmd;
+        if (InterlockedCompareExchange(&g_cmdSeq, 0, 0) != before) continue;
+        seenSeq = before;
+        out = c;
+        return true;
+    }
+}
+
+// ------------------------------ Playback Presenter ------------------------------
+// Playback is split in two: PlaybackThreadProc demuxes, decodes and converts
+// frames into a bounded queue, and PresenterThreadProc hands them to the UI
+// when they are due.  "Due" is measured against the audio device's played-
+// sample position when there is audio, so picture follows sound on long clips;
+// silent files fall back to QueryPerformanceCounter.
+
+struct PlayFrame {
+    int     slot;   // g_frameRing index, BUSY while queued
+    int64_t ms;     // presentation time on the clock's timeline
+    int64_t pos;    // media position shown; ms keeps counting across laps of an A-B loop
+};
+
+static const size_t kPlayQueueFrames = kFrameRingSlots - 3;
+
+struct PlayFrameQueue {
+    CRITICAL_SECTION      cs;
+    CONDITION_VARIABLE    changed;    // signalled on push, pop and flush
+    std::deque<PlayFrame> frames;
+    bool                  eof = false;   // decoder hit end of file; drain then stop
+};
+
+// Presentation clock.  Owned by the decoder thread (it opens, resets and
+// pauses the audio sink); read by the presenter.
+struct PlayClock {
+    CRITICAL_SECTION cs;
+    AudioSink* sink       = nullptr;
+    int       rate        = 0;
+    int64_t   audioBaseMs = -1;   // media time of the first sample written since the last reset
+    int64_t   lastSamples = -1;   // device position at the last query ...
+    LONGLONG  lastMoveQpc = 0;    // ... and when it last changed (underrun detection)
+    bool      anchored    = false;   // QPC fallback: anchorMs corresponds to anchorQpc
+    int64_t   anchorMs    = 0;
+    LONGLONG  anchorQpc   = 0;
+    double    speed       = 1.0;     // media ms per device / wall-clock ms
+};
+
+// Forget the current timeline after a seek.  AudioSink::Reset has already
+// zeroed the played position when audio is involved.
+static void PlayClockReset(PlayClock& c) {
+    EnterCriticalSection(&c.cs);
+    c.audioBaseMs = -1;
+    c.lastSamples = -1;
+    c.anchored    = false;
+    LeaveCriticalSection(&c.cs);
+}
+
+// Pause/resume: the device position simply stops and restarts, only the
+// wall-clock fallback needs re-anchoring.
+static void PlayClockHold(PlayClock& c) {
+    EnterCriticalSection(&c.cs);
+    c.anchored    = false;
+    c.lastSamples = -1;
+    LeaveCriticalSection(&c.cs);
+}
+
+// Playback rate.  Only changed together with a reset, so there is no
+// position to carry across.  With the audio path time-stretched, the device
+// plays speed media seconds per second as well.
+static void PlayClockSetSpeed(PlayClock& c, double speed) {
+    EnterCriticalSection(&c.cs);
+    c.speed = speed;
+    LeaveCriticalSection(&c.cs);
+}
+
+static double PlayClockSpeed(PlayClock& c) {
+    EnterCriticalSection(&c.cs);
+    double v = c.speed;
+    LeaveCriticalSection(&c.cs);
+    return v;
+}
+
+// Current media time in ms.  With no reference yet the clock anchors itself to
+// nextMs, i.e. the first frame after a (re)start is shown immediately.
+static int64_t PlayClockNow(PlayClock& c, int64_t nextMs) {
+    EnterCriticalSection(&c.cs);
+    int64_t now;
+    int64_t samples = (c.sink && c.audioBaseMs >= 0) ? c.sink->PlayedSamples() : -1;
+    if (samples >= 0) {
+        LONGLONG qpc = QpcNow();
+        if (samples != c.lastSamples) { c.lastSamples = samples; c.lastMoveQpc = qpc; }
+        now = c.audioBaseMs + (int64_t)(samples * 1000.0 * c.speed / c.rate);
+        // A starved device stops counting; keep time moving so the presenter
+        // drains the queue and the decoder gets back to feeding audio.
+        int64_t stalledMs = (qpc - c.lastMoveQpc) * 1000 / QpcFreq();
+        if (stalledMs > 40) now += (int64_t)(stalledMs * c.speed);
+    } else {
+        if (!c.anchored) { c.anchorMs = nextMs; c.anchorQpc = QpcNow(); c.anchored = true; }
+        now = c.anchorMs + (int64_t)((QpcNow() - c.anchorQpc) * 1000.0 * c.speed / QpcFreq());
+    }
+    LeaveCriticalSection(&c.cs);
+    return now;
+}
+
+// The decoder's view of the clock: never anchors it, and returns false while
+// the presenter hasn't established a reference yet (start, seek, resume).
+static bool PlayClockPeek(PlayClock& c, int64_t* now) {
+    EnterCriticalSection(&c.cs);
+    bool ok = true;
+    int64_t samples = (c.sink && c.audioBaseMs >= 0) ? c.sink->PlayedSamples() : -1;
+    if (samples >= 0)    *now = c.audioBaseMs + (int64_t)(samples * 1000.0 * c.speed / c.rate);
+    else if (c.anchored) *now = c.anchorMs + (int64_t)((QpcNow() - c.anchorQpc) * 1000.0 * c.speed / QpcFreq());
+    else                 ok = false;
+    LeaveCriticalSection(&c.cs);
+    return ok;
+}
+
+// Playback health counters, reset when a playback thread starts.  Written by
+// the decoder and presenter threads; anyone may read them.
+struct PlayStats {
+    volatile LONG decoded;   // video frames decoded while playing
+    volatile LONG late;      // ... that were already due when they came out of the decoder
+    volatile LONG dropped;   // discarded by the decoder before conversion
+    volatile LONG skipped;   // converted, then skipped by the presenter
+    volatile LONG quality;   // current degradation level, 0 = full quality
+};
+
+static PlayStats g_playStats = {};
+
+// Consistent-enough copy of the counters for display; each field is read once.
+static PlayStats GetPlayStats() {
+    PlayStats s;
+    s.decoded = g_playStats.decoded;
+    s.late    = g_playStats.late;
+    s.dropped = g_playStats.dropped;
+    s.skipped = g_playStats.skipped;
+    s.quality = g_playStats.quality;
+    return s;
+}
+
+// One line over the top-left corner of the preview while playing, so a
+// stutter can be told apart from decode degradation without a debugger.
+static void DrawPlayStats(HDC hdc, int x, int y) {
+    PlayStats st = GetPlayStats();
+    wchar_t text[128];
+    StringCchPrintfW(text, ARRAYSIZE(text), L" Q%ld   decoded %ld   late %ld   dropped %ld   skipped %ld ",
+                     st.quality, st.decoded, st.late, st.dropped, st.skipped);
+    HFONT oldFont = g_hFont ? (HFONT)SelectObject(hdc, g_hFont) : nullptr;
+    SetBkMode(hdc, OPAQUE);
+    SetBkColor(hdc, RGB(0, 0, 0));
+    SetTextColor(hdc, st.quality > 0 ? RGB(255, 198, 55) : RGB(200, 200, 200));
+    TextOutW(hdc, x, y, text, (int)wcslen(text));
+    if (oldFont) SelectObject(hdc, oldFont);
+}
+
+// Degradation ladder when decode + conversion can't keep up:
+//   1  skip the deblocking loop filter
+//   2  also skip non-reference frames
+//   3  also convert at half the preview size
+// The level is re-evaluated every kQualityWindow decoded frames: up one step
+// when more than a quarter arrived late, down one after two windows with none
+// late and the queue at least half full.
+static const int kMaxQuality    = 3;
+static const int kQualityWindow = 24;
+static const int kMaxDropRun    = 3;   // always convert at least every 4th frame
+
+static void FrameQueueFlush(PlayFrameQueue& q) {
+    EnterCriticalSection(&q.cs);
+    for (PlayFrame& f : q.frames) FrameRingRelease(f.slot);
+    q.frames.clear();
+    q.eof = false;
+    WakeAllConditionVariable(&q.changed);
+    LeaveCriticalSection(&q.cs);
+}
+
+// Blocks while the queue is full.  Gives up (returns false, caller keeps the
+// slot) as soon as the decoder has something more urgent to do.
+static bool FrameQueuePush(PlayFrameQueue& q, const PlayFrame& f, LONG cmdSeq) {
+    EnterCriticalSection(&q.cs);
+    while (q.frames.size() >= kPlayQueueFrames) {
+        if (g_playThreadShouldExit || PlayCommandPending(cmdSeq) || !g_isPlaying) {
+            LeaveCriticalSection(&q.cs);
+            return false;
+        }
+        SleepConditionVariableCS(&q.changed, &q.cs, 10);
+    }
+    q.frames.push_back(f);
+    WakeAllConditionVariable(&q.changed);
+    LeaveCriticalSection(&q.cs);
+    return true;
+}
+
+static size_t FrameQueueDepth(PlayFrameQueue& q) {
+    EnterCriticalSection(&q.cs);
+    size_t n = q.frames.size();
+    LeaveCriticalSection(&q.cs);
+    return n;
+}
+
+static void FrameQueueSetEof(PlayFrameQueue& q) {
+    EnterCriticalSection(&q.cs);
+    q.eof = true;
+    WakeAllConditionVariable(&q.changed);
+    LeaveCriticalSection(&q.cs);
+}
+
+struct PresenterCtx {
+    PlayFrameQueue* q;
+    PlayClock*      clock;
+    volatile bool   stop;
+};
 
-        rgbBufSize = av_image_get_buffer_size(AV_PIX_FMT_BGR24, dec_ctx->width, dec_ctx->height, 1);
-        rgbBuffer = (uint8_t*)av_malloc(rgbBufSize);
-        if (!rgbBuffer) break;
-        av_image_fill_arrays(rgbFrame->data, rgbFrame->linesize, rgbBuffer,
-            AV_PIX_FMT_BGR24, dec_ctx->width, dec_ctx->height, 1);
+static unsigned __stdcall PresenterThreadProc(void* param) {
+    PresenterCtx*   pc    = (PresenterCtx*)param;
+    PlayFrameQueue& q     = *pc->q;
+    PlayClock&      clock = *pc->clock;
+    timeBeginPeriod(1);   // condition-variable timeouts at 1 ms rather than the 15.6 ms tick
+
+    EnterCriticalSection(&q.cs);
+    while (!pc->stop) {
+        if (!g_isPlaying) {
+            SleepConditionVariableCS(&q.changed, &q.cs, 10);
+            continue;
+        }
+        if (q.frames.empty()) {
+            if (q.eof) { g_isPlaying = false; q.eof = false; }
+            SleepConditionVariableCS(&q.changed, &q.cs, 10);
+            continue;
+        }
+
+        PlayFrame f = q.frames.front();
+        LeaveCriticalSection(&q.cs);
+        int64_t now = PlayClockNow(clock, f.ms);
+        EnterCriticalSection(&q.cs);
+        // A flush may have happened while the lock was dropped.
+        if (q.frames.empty() || q.frames.front().slot != f.slot) continue;
+
+        // Media ms to wall-clock ms at the current playback rate.
+        int64_t wait = (int64_t)((f.ms - now) / PlayClockSpeed(clock));
+        if (wait > 1) {
+            SleepConditionVariableCS(&q.changed, &q.cs, (DWORD)(wait > 51 ? 50 : wait - 1));
+            continue;
+        }
+        q.frames.pop_front();
+        // Behind the clock with the next frame also due: skip this one
+        // rather than letting the picture fall further behind the audio.
+        if (!q.frames.empty() && q.frames.front().ms <= now) {
+            InterlockedIncrement(&g_playStats.skipped);
+            FrameRingRelease(f.slot);
+            WakeAllConditionVariable(&q.changed);
+            continue;
+        }
+        WakeAllConditionVariable(&q.changed);
+        LeaveCriticalSection(&q.cs);
+
+        EnterCriticalSection(&g_csState);
+        ShowRingSlotLocked(f.slot, f.pos);
+        LeaveCriticalSection(&g_csState);
+        PostMessage(g_mainHwnd, WM_APP_FRAME_READY, 0, 0);
+
+        EnterCriticalSection(&q.cs);
+    }
+    LeaveCriticalSection(&q.cs);
+
+    timeEndPeriod(1);
+    return 0;
+}
+
+// ------------------------------ Step Cache ------------------------------
+// Display-converted copies of recently decoded frames, so stepping over frames
+// the decoder has already produced (in either direction) is a memcpy instead
+// of a seek plus a GOP decode.  Frames are grouped into spans: each span holds
+// frames the decoder produced back to back, so neighbours within a span really
+// are adjacent frames.  Owned by the playback thread; no locking.
+
+static const size_t kStepCacheBytes = 256u << 20;
+
+struct CachedFrame {
+    int64_t  ms;
+    uint8_t* bgr;     // h rows of the owning cache's stride bytes
+};
+
+struct StepCache {
+    std::deque<std::deque<CachedFrame>> spans;   // oldest first
+    bool   live   = false;   // back() is still being appended to
+    int    w = 0, h = 0, stride = 0;
+    size_t bytes  = 0;
+};
+
+static void StepCacheClear(StepCache& c) {
+    for (auto& span : c.spans)
+        for (CachedFrame& f : span) free(f.bgr);
+    c.spans.clear();
+    c.live  = false;
+    c.bytes = 0;
+}
+
+// The next frame the decoder produces does not follow the last one added
+// (seek, dropped or unconverted frame).
+static void StepCacheBreak(StepCache& c) { c.live = false; }
+
+static void StepCacheAdd(StepCache& c, const FrameSlot& s, int64_t ms) {
+    if (s.w != c.w || s.h != c.h) {        // preview resized: old copies are the wrong size
+        StepCacheClear(c);
+        c.w = s.w; c.h = s.h; c.stride = s.stride;
+    }
+    if (c.live && !c.spans.back().empty() && ms <= c.spans.back().back().ms) c.live = false;
+
+    // At the budget the oldest frame's buffer is recycled for this one, so
+    // steady-state playback doesn't allocate.
+    size_t   size = (size_t)c.stride * c.h;
+    uint8_t* bgr  = nullptr;
+    if (c.bytes + size > kStepCacheBytes && !c.spans.empty()) {
+        auto& oldest = c.spans.front();
+        bgr = oldest.front().bgr;
+        oldest.pop_front();
+        c.bytes -= size;
+        if (oldest.empty()) {
+            c.spans.pop_front();
+            if (c.spans.empty()) c.live = false;
+        }
+    }
+    if (!bgr) bgr = (uint8_t*)malloc(size);
+    if (!bgr) { c.live = false; return; }
+    memcpy(bgr, s.bits, size);
+    if (!c.live) { c.spans.emplace_back(); c.live = true; }
+    c.spans.back().push_back({ ms, bgr });
+    c.bytes += size;
+}
+
+// Frame adjacent (dir = +1 / -1) to the one at curMs, if a span holds both.
+static const CachedFrame* StepCacheFind(const StepCache& c, int64_t curMs, int dir) {
+    for (auto it = c.spans.rbegin(); it != c.spans.rend(); ++it) {
+        const auto& span = *it;
+        if (span.empty() || curMs < span.front().ms || curMs > span.back().ms) continue;
+        for (size_t i = 0; i < span.size(); i++) {
+            if (span[i].ms != curMs) continue;
+            if (dir > 0 && i + 1 < span.size()) return &span[i + 1];
+            if (dir < 0 && i > 0)               return &span[i - 1];
+            break;
+        }
+    }
+    return nullptr;
+}
+
+// ------------------------------ A-B Loop ------------------------------
+// With the loop toggle on and both marks set, playback decodes Mark In..Mark
+// Out once into memory (preview-sized frames plus the PCM played with them)
+// and then goes round from there.  No seek, no GOP decode, and the audio is
+// one continuous stream, so the wrap is gapless.  The cache is decoded in the
+// background while playback streams the segment, wrapping by seeking back to
+// Mark In, and is taken over at the first wrap after it is done.  Segments
+// that don't fit in kLoopCacheBytes keep looping by seeking.
+
+static const size_t kLoopCacheBytes = 384ull * 1024 * 1024;
+
+struct LoopCache {
+    int64_t inMs = -1, outMs = -1;    // segment this was built for; set even if it didn't fit
+    int     w = 0, h = 0, stride = 0;
+    std::deque<CachedFrame> frames;   // ascending ms, from the first frame at or after inMs
+    std::vector<uint8_t>    pcm;      // exactly outMs - inMs of S16 stereo; empty when silent
+    bool    ready = false;            // frames hold the whole segment
+};
+
+static void LoopCacheClear(LoopCache& c) {
+    for (CachedFrame& f : c.frames) free(f.bgr);
+    c.frames.clear();
+    std::vector<uint8_t>().swap(c.pcm);
+    c.inMs = c.outMs = -1;
+    c.ready = false;
+}
+
+// First cached frame at or after ms; the start of the segment if ms is outside it.
+static size_t LoopCacheFind(const LoopCache& c, int64_t ms) {
+    for (size_t i = 0; i < c.frames.size(); i++)
+        if (c.frames[i].ms >= ms) return (ms < c.outMs) ? i : 0;
+    return 0;
+}
+
+// One segment's cache, decoded on a thread of its own with its own reader so
+// playback keeps going (wrapping by seek) while it fills.  The playback thread
+// owns it: it polls done, takes the cache at the next wrap, and stops and
+// joins a build whose marks have changed before freeing it.
+struct LoopBuild {
+    MediaSession* session   = nullptr;
+    int64_t       inMs      = 0, outMs = 0;
+    int           w         = 0, h = 0;    // preview size the frames are converted at
+    bool          withAudio = false;       // playback has a sink: cache the PCM too
+    volatile LONG stop      = 0;
+    volatile LONG done      = 0;           // cache is final (ready only if it fit and decoded whole)
+    LoopCache     cache;
+    HANDLE        thread    = nullptr;
+};
+
+// Decodes [inMs, outMs) into lb->cache at full quality.  A segment over
+// budget, or one with a frame that could not be stored, leaves the cache not
+// ready: a missing frame would skip on every lap, so that loop seeks instead.
+// The up-front estimate only skips segments that plainly won't fit; the bytes
+// actually stored are counted as they go in, so a VFR clip or a wrong stream
+// frame rate still can't take the cache past kLoopCacheBytes.
+static unsigned __stdcall LoopBuildThreadProc(void* param) {
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+    LoopBuild* lb   = (LoopBuild*)param;
+    LoopCache& loop = lb->cache;
+    int64_t    in   = lb->inMs, out = lb->outMs;
+    int        w    = lb->w,    h   = lb->h;
+    int        stride = (w * 3 + 3) & ~3;
+    loop.inMs = in; loop.outMs = out;
+
+    MediaReader* r        = MediaSessionLease(lb->session, READER_PLAYBACK);
+    BgrConverter conv;
+    SwrContext*  swr      = nullptr;
+    AVPacket*    pkt      = av_packet_alloc();
+    AVFrame*     frame    = av_frame_alloc();
+    AVFrame*     aFrame   = av_frame_alloc();
+    AVFrame*     cpuFrame = nullptr;
+    std::vector<uint8_t> pcmBuf;
+    bool ok = r && pkt && frame && aFrame;
+
+    AVCodecContext* aDec = (ok && lb->withAudio) ? r->aDecCtx : nullptr;
+    if (aDec && (swr = swr_alloc()) != nullptr) {
+        AVChannelLayout stereo = AV_CHANNEL_LAYOUT_STEREO;
+        av_opt_set_chlayout  (swr, "in_chlayout",    &aDec->ch_layout,   0);
+        av_opt_set_int       (swr, "in_sample_rate",  aDec->sample_rate,  0);
+        av_opt_set_sample_fmt(swr, "in_sample_fmt",   aDec->sample_fmt,   0);
+        av_opt_set_chlayout  (swr, "out_chlayout",   &stereo,             0);
+        av_opt_set_int       (swr, "out_sample_rate", aDec->sample_rate,  0);
+        av_opt_set_sample_fmt(swr, "out_sample_fmt",  AV_SAMPLE_FMT_S16,  0);
+        if (swr_init(swr) < 0) swr_free(&swr);
+    }
+    if (!swr) aDec = nullptr;
+
+    double fps      = (g_videoFPS > 0.0) ? g_videoFPS : 30.0;
+    size_t pcmBytes = aDec ? (size_t)((out - in) * aDec->sample_rate / 1000) * 4 : 0;
+    double estimate = ((out - in) / 1000.0 * fps + 2.0) * stride * h + pcmBytes;
+    if (estimate > (double)kLoopCacheBytes) ok = false;
+    size_t cachedBytes = 0;                        // frames + PCM stored so far
+
+    if (ok) {
+        loop.w = w; loop.h = h; loop.stride = stride;
+        AVStream*  vs       = r->videoStream;
+        int64_t    vidStart = (vs->start_time != AV_NOPTS_VALUE) ? vs->start_time : 0;
+        int64_t    startMs  = av_rescale_q(vidStart, vs->time_base, AVRational{ 1, 1000 });
+        AVRational audioTb  = aDec ? r->fmt_ctx->streams[r->audioIdx]->time_base : AVRational{ 1, 1000 };
+        int64_t    lastDts  = AV_NOPTS_VALUE;
+        av_seek_frame(r->fmt_ctx, r->videoIdx,
+                      av_rescale_q(in, AVRational{ 1, 1000 }, vs->time_base) + vidStart, AVSEEK_FLAG_BACKWARD);
+        avcodec_flush_buffers(r->dec_ctx);
+        if (aDec) avcodec_flush_buffers(aDec);
+
+        bool videoDone = false, audioDone = (aDec == nullptr);
+        while (ok && (!videoDone || !audioDone) && !lb->stop) {
+            if (av_read_frame(r->fmt_ctx, pkt) < 0) break;
+            if (pkt->stream_index == r->videoIdx && !videoDone) {
+                if (pkt->dts != AV_NOPTS_VALUE) lastDts = pkt->dts;
+                if (avcodec_send_packet(r->dec_ctx, pkt) >= 0) {
+                    while (ok && avcodec_receive_frame(r->dec_ctx, frame) == 0) {
+                        // As the playback thread's videoMsOf: stale VOP stamps fall back to the DTS.
+                        int64_t raw = (frame->best_effort_timestamp != AV_NOPTS_VALUE)
+                                          ? frame->best_effort_timestamp
+                                          : (frame->pts != AV_NOPTS_VALUE ? frame->pts : vidStart);
+                        int64_t ms    = (int64_t)((raw - vidStart) * av_q2d(vs->time_base) * 1000.0);
+                        int64_t durMs = (int64_t)(g_duration * 1000.0);
+                        if (ms < 0 || ms > durMs + 1000) {
+                            int64_t d = (lastDts != AV_NOPTS_VALUE) ? lastDts : vidStart;
+                            ms = min(max((int64_t)((d - vidStart) * av_q2d(vs->time_base) * 1000.0), (int64_t)0), durMs);
+                        }
+                        if (ms >= out) videoDone = true;
+                        if (ms >= in && !videoDone) {
+                            cachedBytes += (size_t)stride * h;
+                            AVFrame* sw  = (cachedBytes <= kLoopCacheBytes)
+                                           ? (r->using_hw ? HwFrameToCpu(frame, &cpuFrame) : frame) : nullptr;
+                            uint8_t* bgr = sw ? (uint8_t*)malloc((size_t)stride * h) : nullptr;
+                            if (!bgr || !FrameToBgr(conv, sw, HdrTrcOf(sw, g_isHdr, g_hdrTrc),
+                                                    w, h, bgr, stride)) {
+                                free(bgr);
+                                ok = false;
+                            } else {
+                                loop.frames.push_back({ ms, bgr });
+                            }
+                        }
+                        av_frame_unref(frame);
+                    }
+                }
+            } else if (pkt->stream_index == r->audioIdx && aDec && !audioDone) {
+                if (avcodec_send_packet(aDec, pkt) >= 0) {
+                    while (avcodec_receive_frame(aDec, aFrame) == 0) {
+                        int64_t apts = aFrame->best_effort_timestamp;
+                        int64_t ams  = (apts != AV_NOPTS_VALUE)
+                                       ? av_rescale_q(apts, audioTb, AVRational{ 1, 1000 }) - startMs : -1;
+                        if (!audioDone && (ams >= 0 || !loop.pcm.empty())) {
+                            int maxSamples = (int)av_rescale_rnd(
+                                swr_get_delay(swr, aDec->sample_rate) + aFrame->nb_samples,
+                                aDec->sample_rate, aDec->sample_rate, AV_ROUND_UP);
+                            if (pcmBuf.size() < (size_t)maxSamples * 4) pcmBuf.resize((size_t)maxSamples * 4);
+                            uint8_t* outPtrs[1] = { pcmBuf.data() };
+                            int n = swr_convert(swr, outPtrs, maxSamples,
+                                (const uint8_t**)aFrame->data, aFrame->nb_samples);
+                            if (n > 0) {
+                                // Trim whatever precedes Mark In in the first frame(s), or
+                                // pad with silence up to the first frame if it starts late,
+                                // so the lap's audio lines up with its video.
+                                size_t bytes = (size_t)n * 4, skip = 0, before = loop.pcm.size();
+                                if (loop.pcm.empty() && ams < in)
+                                    skip = min(bytes, (size_t)((in - ams) * aDec->sample_rate / 1000) * 4);
+                                else if (loop.pcm.empty() && ams > in)
+                                    loop.pcm.resize(min(pcmBytes, (size_t)((ams - in) * aDec->sample_rate / 1000) * 4), 0);
+                                loop.pcm.insert(loop.pcm.end(), pcmBuf.data() + skip, pcmBuf.data() + bytes);
+                                cachedBytes += loop.pcm.size() - before;
+                                if (cachedBytes > kLoopCacheBytes) ok = false;
+                            }
+                            if (loop.pcm.size() >= pcmBytes) audioDone = true;
+                        }
+                        av_frame_unref(aFrame);
+                    }
+                }
+            }
+            av_packet_unref(pkt);
+        }
+        if (lb->stop) ok = false;
+    }
+
+    if (ok) {
+        if (aDec) loop.pcm.resize(pcmBytes, 0);   // exactly one lap: pad or trim
+        loop.ready = !loop.frames.empty();
+    } else {
+        LoopCacheClear(loop);
+        loop.inMs = in; loop.outMs = out;
+    }
+    if (swr)      swr_free(&swr);
+    if (cpuFrame) av_frame_free(&cpuFrame);
+    if (aFrame)   av_frame_free(&aFrame);
+    if (frame)    av_frame_free(&frame);
+    if (pkt)      av_packet_free(&pkt);
+    BgrConverterFree(conv);
+    MediaSessionReturn(r);
+    InterlockedExchange(&lb->done, 1);
+    return 0;
+}
+
+// ------------------------------ Playback Thread (no goto) ------------------------------
+struct PlaybackCtx {
+    MediaSession* session;
+    LONG          cmdSeq;    // g_cmdSeq at start; later commands are for this thread
+};
+
+unsigned __stdcall PlaybackThreadProc(void* p) {
+    PlaybackCtx* ctx = (PlaybackCtx*)p;
+
+    MediaReader*     reader  = nullptr;   // demuxer + decoders leased from the session
+    AVFormatContext* fmt_ctx = nullptr;
+    AVCodecContext* dec_ctx = nullptr;
+    BgrConverter conv;              // SDR scaler / PQ/HLG tone mapping, cached across frames
+    AVPacket* pkt = nullptr;
+    AVFrame* frame = nullptr;
+    AVFrame* cpu_frame = nullptr;   // for NVDEC hw→cpu transfer
+    int              videoStreamIndex = -1;
+    AVStream* videoStream = nullptr;
+    bool             using_hw = false;
+
+    // Audio playback state
+    int              audioStreamIdx  = -1;
+    AVCodecContext*  aDecCtx         = nullptr;
+    SwrContext*      swrCtx          = nullptr;
+    AudioSink*       sink            = nullptr;
+    AVFrame*         aFrame          = nullptr;
+    std::vector<uint8_t> pcmBuf;        // swr output, reused across frames
+    std::vector<uint8_t> pcmHeld;       // converted PCM a pause stopped short of the ring
+
+    // Frame queue + clock shared with the presenter thread
+    PlayFrameQueue queue;
+    PlayClock      clock;
+    PresenterCtx   presenter     = { &queue, &clock, false };
+    HANDLE         hPresenter    = nullptr;
+    bool           eofQueued     = false;  // told the presenter there is nothing more to come
+    StepCache      stepCache;              // recent converted frames for instant stepping
+    int64_t        lastDecodedMs = -1;     // demuxer/decoder sit just after this frame; -1 = unknown
+    bool      prevWasPlaying = false; // initialised below after audio init
+    int64_t   catchUpToMs    = -1;   // skip frames before this PTS after a seek
+    int64_t   vid_play_start = 0;    // stream->start_time offset (AVI/Xvid may be non-zero)
+    int64_t   last_vid_dts   = AV_NOPTS_VALUE; // most-recent valid video packet DTS
+
+    bool init_ok = false;
+    do {
+        // Restarting playback (stop, step, new play) reuses the session's open
+        // reader instead of reopening the file and the (possibly NVDEC) decoder.
+        reader = MediaSessionLease(ctx->session, READER_PLAYBACK);
+        if (!reader) break;
+        fmt_ctx          = reader->fmt_ctx;
+        dec_ctx          = reader->dec_ctx;
+        videoStreamIndex = reader->videoIdx;
+        videoStream      = reader->videoStream;
+        using_hw         = reader->using_hw;
+        // AVI/Xvid: stream->start_time can be non-zero; subtract it from all PTS values
+        // so that elapsed time is always measured from the actual start of the file.
+        vid_play_start = (videoStream->start_time != AV_NOPTS_VALUE)
+                          ? videoStream->start_time : 0;
+
+        // bsf_ctx / bsf_pkt intentionally not used in playback: the mpeg4_unpack_bframes
+        // BSF reorders packets in a way that sends B-frames to the decoder before their
+        // reference P-frames, causing progressive quality degradation every GOP (~3 s).
+        // Wrong VOP timestamps are handled instead by the last_vid_dts fallback below.
+
+        // conv is set up lazily on the first frame so we get the real pixel
+        // format after NVDEC hw→cpu transfer (dec_ctx->pix_fmt == CUDA with hw).
+
+        frame = av_frame_alloc();
+        if (!frame) break;
 
         pkt = av_packet_alloc();
         if (!pkt) break;
@@ -2566,29 +3960,64 @@ unsigned __stdcall PlaybackThreadProc(void* p) {
     if (!init_ok) {
         // cleanup and exit
         if (pkt) av_packet_free(&pkt);
-        if (rgbFrame) { if (rgbBuffer) av_free(rgbBuffer); av_frame_free(&rgbFrame); }
         if (frame) av_frame_free(&frame);
-        if (sws_ctx) sws_freeContext(sws_ctx);
-        if (dec_ctx) avcodec_free_context(&dec_ctx);
-        if (fmt_ctx) avformat_close_input(&fmt_ctx);
+        BgrConverterFree(conv);
+        MediaSessionReturn(reader);
         delete ctx;
         _endthreadex(0);
         return 0;
     }
 
-    // Optional audio init — failure means silent playback, not an error.
-    for (unsigned int i = 0; i < fmt_ctx->nb_streams && audioStreamIdx < 0; i++)
-        if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
-            audioStreamIdx = (int)i;
+    // Decoded frame → a g_frameRing slot (BGR24) at the preview size, so 4K
+    // sources are scaled once here rather than converted in full and shrunk
+    // again by GDI.  The target is re-read every frame to follow resizes and
+    // the 1:1 toggle.  Returns the BUSY slot, or -1 if none could be had.
+    int convShift = 0;   // degraded playback converts at half the preview size
+    auto convertFrame = [&](AVFrame* sw_frame) -> int {
+        int w = 0, h = 0;
+        PreviewTargetSize(sw_frame->width, sw_frame->height, &w, &h);
+        w = max(1, w >> convShift);
+        h = max(1, h >> convShift);
+        int slot = FrameRingAcquire(w, h);
+        if (slot < 0) return -1;
+        FrameSlot& s = g_frameRing[slot];
+        if (!FrameToBgr(conv, sw_frame, HdrTrcOf(sw_frame, g_isHdr, g_hdrTrc),
+                        w, h, s.bits, s.stride)) {
+            FrameRingRelease(slot);
+            return -1;
+        }
+        return slot;
+    };
+
+    // Transfers an NVDEC hardware frame to CPU memory if needed.
+    auto cpuFrameOf = [&](AVFrame* f) -> AVFrame* {
+        return using_hw ? HwFrameToCpu(f, &cpu_frame) : f;
+    };
+
+    // Media time (ms) of a decoded video frame.  If the codec returned a stale
+    // VOP timestamp from outside this clip (e.g. Xvid cut from a long
+    // recording), falls back to the container DTS.
+    auto videoMsOf = [&](const AVFrame* f) -> int64_t {
+        int64_t raw_pts = (f->best_effort_timestamp != AV_NOPTS_VALUE)
+                              ? f->best_effort_timestamp
+                              : (f->pts != AV_NOPTS_VALUE ? f->pts : vid_play_start);
+        int64_t ms = (int64_t)((raw_pts - vid_play_start) * av_q2d(videoStream->time_base) * 1000.0);
+        int64_t durMs = (int64_t)(g_duration * 1000.0);
+        if (ms < 0 || ms > durMs + 1000) {
+            int64_t dts_pts = (last_vid_dts != AV_NOPTS_VALUE) ? last_vid_dts : vid_play_start;
+            ms = (int64_t)((dts_pts - vid_play_start) * av_q2d(videoStream->time_base) * 1000.0);
+            ms = (ms < 0) ? 0 : (ms > durMs ? durMs : ms);
+        }
+        return ms;
+    };
+
+    // Optional audio — the reader already opened a decoder for the first audio
+    // stream if it could; failure anywhere below means silent playback.
+    audioStreamIdx = reader->audioIdx;
+    aDecCtx        = reader->aDecCtx;
 
     if (audioStreamIdx >= 0) {
-        AVStream* aStream   = fmt_ctx->streams[audioStreamIdx];
-        const AVCodec* aDec = avcodec_find_decoder(aStream->codecpar->codec_id);
-        aDecCtx = aDec ? avcodec_alloc_context3(aDec) : nullptr;
-        if (aDecCtx && avcodec_parameters_to_context(aDecCtx, aStream->codecpar) >= 0
-                    && avcodec_open2(aDecCtx, aDec, nullptr) >= 0) {
-            swrCtx = swr_alloc();
-        }
+        if (aDecCtx) swrCtx = swr_alloc();
         if (swrCtx) {
             AVChannelLayout stereo = AV_CHANNEL_LAYOUT_STEREO;
             av_opt_set_chlayout  (swrCtx, "in_chlayout",    &aDecCtx->ch_layout,   0);
@@ -2600,29 +4029,129 @@ unsigned __stdcall PlaybackThreadProc(void* p) {
             if (swr_init(swrCtx) < 0) { swr_free(&swrCtx); swrCtx = nullptr; }
         }
         if (swrCtx) {
-            WAVEFORMATEX wfx      = {};
-            wfx.wFormatTag        = WAVE_FORMAT_PCM;
-            wfx.nChannels         = 2;
-            wfx.nSamplesPerSec    = (DWORD)aDecCtx->sample_rate;
-            wfx.wBitsPerSample    = 16;
-            wfx.nBlockAlign       = 4;
-            wfx.nAvgBytesPerSec   = (DWORD)(aDecCtx->sample_rate * 4);
-            if (waveOutOpen(&hWaveOut, WAVE_MAPPER, &wfx, 0, 0, CALLBACK_NULL) == MMSYSERR_NOERROR)
-                aFrame = av_frame_alloc();
-            else
-                hWaveOut = nullptr;
+            // No usable output device: the null sink keeps audio timing (and
+            // the presenter clock) running in real time.
+            sink = new WaveOutSink();
+            if (!sink->Open(aDecCtx->sample_rate)) {
+                delete sink;
+                sink = new NullAudioSink();
+                sink->Open(aDecCtx->sample_rate);
+            }
+            aFrame     = av_frame_alloc();
+            clock.sink = sink;
+            clock.rate = aDecCtx->sample_rate;
         }
-        if (!hWaveOut) {
-            if (swrCtx)  { swr_free(&swrCtx);           swrCtx  = nullptr; }
-            if (aDecCtx) { avcodec_free_context(&aDecCtx); aDecCtx = nullptr; }
+        if (!sink) {
+            if (swrCtx)  { swr_free(&swrCtx); swrCtx = nullptr; }
+            aDecCtx = nullptr;   // still owned by the reader
             audioStreamIdx = -1;
         }
     }
 
     prevWasPlaying = g_isPlaying; // avoid spurious pause/resume transition on first tick
 
+    InitializeCriticalSection(&queue.cs);
+    InitializeConditionVariable(&queue.changed);
+    InitializeCriticalSection(&clock.cs);
+    hPresenter = (HANDLE)_beginthreadex(nullptr, 0, PresenterThreadProc, &presenter, 0, nullptr);
+
+    // Media time (ms) of a decoded audio frame, on the same origin as video.
+    AVRational audioTb = (audioStreamIdx >= 0) ? fmt_ctx->streams[audioStreamIdx]->time_base
+                                               : AVRational{ 1, 1000 };
+    int64_t    startMs = av_rescale_q(vid_play_start, videoStream->time_base, AVRational{ 1, 1000 });
+
+    // Paused single-frame request being worked on.  stepDir 0 is a plain seek
+    // (show the first frame at or after targetMs).
+    LONG    cmdSeq      = ctx->cmdSeq;
+    bool    showPending = false;
+    int     stepDir     = 0;
+    int64_t targetMs    = 0;
+    int64_t backFromMs  = 0;       // backward step: show the frame just before this one
+    bool    fileReady   = false;   // file ptr is right after the last step-decoded frame
+    ThumbDecoder* scrubDec = nullptr;  // keyframe decoder for timeline drags, opened on first use
+
+    // Late-frame policy state (play mode only).
+    int  quality        = 0;       // level playback should run at
+    int  appliedLevel   = 0;       // level dec_ctx / convertFrame are currently set to
+    bool appliedKeyOnly = false;
+    int  windowFrames = 0, windowLate = 0, cleanWindows = 0;
+    int  dropRun      = 0;
+    g_playStats = {};
+
+    // Paused decodes always run at full quality; steps and the step cache need
+    // every frame, fully filtered.  keyFrames is the fast-forward mode.
+    auto setQuality = [&](int level, bool keyFrames) {
+        if (level == appliedLevel && keyFrames == appliedKeyOnly) return;
+        dec_ctx->skip_loop_filter = (level >= 1) ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+        dec_ctx->skip_frame       = keyFrames    ? AVDISCARD_NONKEY
+                                  : (level >= 2) ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+        convShift                 = (level >= 3) ? 1 : 0;
+        appliedLevel   = level;
+        appliedKeyOnly = keyFrames;
+        };
+
+    // Playback rate, picked up at every reset.  0.5x-2x keeps sound through
+    // atempo; outside that audio is muted and the clock runs on QPC.  From 4x
+    // only keyframes are decoded, so cost stays near that of 1x on long GOPs.
+    // Slow motion needs nothing extra: frames are simply held longer, and the
+    // step cache still collects every one of them.
+    double speed   = 1.0;
+    bool   audioOn = sink != nullptr;
+    bool   keyOnly = false;
+
+    // atempo between the audio decoder and swr.  Rebuilt after every reset so
+    // it never holds audio from before a seek.
+    AVFilterGraph*   tempoGraph = nullptr;
+    AVFilterContext* tempoSrc   = nullptr;
+    AVFilterContext* tempoSink  = nullptr;
+    AVFrame*         tempoFrame = nullptr;
+
+    auto closeTempo = [&]() {
+        if (tempoGraph) avfilter_graph_free(&tempoGraph);
+        tempoSrc = tempoSink = nullptr;
+        };
+
+    auto openTempo = [&]() -> bool {
+        const AVFilter* fSrc   = avfilter_get_by_name("abuffer");
+        const AVFilter* fTempo = avfilter_get_by_name("atempo");
+        const AVFilter* fSink  = avfilter_get_by_name("abuffersink");
+        if (!fSrc || !fTempo || !fSink) return false;
+        if (!tempoFrame && !(tempoFrame = av_frame_alloc())) return false;
+        if (!(tempoGraph = avfilter_graph_alloc())) return false;
+        char layout[64] = {};
+        av_channel_layout_describe(&aDecCtx->ch_layout, layout, sizeof(layout));
+        char srcArgs[256], tempoArgs[32];
+        StringCchPrintfA(srcArgs, sizeof(srcArgs),
+            "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=%s",
+            audioTb.num, audioTb.den, aDecCtx->sample_rate,
+            av_get_sample_fmt_name(aDecCtx->sample_fmt), layout);
+        StringCchPrintfA(tempoArgs, sizeof(tempoArgs), "tempo=%.3f", speed);
+        AVFilterContext* tempoCtx = nullptr;
+        bool ok = avfilter_graph_create_filter(&tempoSrc,  fSrc,   "in",    srcArgs,   nullptr, tempoGraph) >= 0 &&
+                  avfilter_graph_create_filter(&tempoCtx,  fTempo, "tempo", tempoArgs, nullptr, tempoGraph) >= 0 &&
+                  avfilter_graph_create_filter(&tempoSink, fSink,  "out",   nullptr,   nullptr, tempoGraph) >= 0 &&
+                  avfilter_link(tempoSrc, 0, tempoCtx, 0) == 0 &&
+                  avfilter_link(tempoCtx, 0, tempoSink, 0) == 0 &&
+                  avfilter_graph_config(tempoGraph, nullptr) >= 0 &&
+                  // swr was set up for the decoder's format; atempo must not change it.
+                  av_buffersink_get_format(tempoSink) == (int)aDecCtx->sample_fmt;
+        if (!ok) closeTempo();
+        return ok;
+        };
+
+    auto applySpeed = [&]() {
+        speed   = kPlayRates[g_playRateIdx];
+        audioOn = sink && speed >= 0.5 && speed <= 2.0;
+        keyOnly = speed >= 4.0;
+        PlayClockSetSpeed(clock, speed);
+        closeTempo();
+        };
+
     auto doSeek = [&](int64_t toMs) {
-        g_stepFileReady = false;
+        fileReady = false;
+        eofQueued = false;
+        StepCacheBreak(stepCache);
+        lastDecodedMs = -1;
         // Add vid_play_start so the seek target is an absolute stream PTS, not a
         // relative offset.  Without this, files with non-zero start_time (e.g. MP4s
         // produced by h264_nvenc) seek slightly before the intended position.
@@ -2632,226 +4161,424 @@ unsigned __stdcall PlaybackThreadProc(void* p) {
         avcodec_flush_buffers(dec_ctx);
         };
 
-    if (g_seekRequested) { doSeek(g_seekTargetMs); g_seekRequested = false; }
-    else { doSeek(g_currentPosMs); }
+    auto seekAll = [&](int64_t toMs) {
+        if (sink) {
+            sink->Reset();
+            sink->Pause(false);
+        }
+        pcmHeld.clear();
+        if (aDecCtx) avcodec_flush_buffers(aDecCtx);
+        FrameQueueFlush(queue);
+        PlayClockReset(clock);
+        applySpeed();
+        doSeek(toMs);
+        catchUpToMs = toMs;  // discard frames before the actual seek target
+        windowFrames = windowLate = 0;
+        dropRun      = 0;
+        };
+
+    applySpeed();
+    doSeek(g_currentPosMs);
+
+    // Hands PCM to the sink.  The ring is bounded, so this waits for the
+    // device to drain a block rather than queueing without limit.  A pause
+    // keeps what is left in pcmHeld for the resume; a command or exit drops it.
+    auto feedSink = [&](const uint8_t* src, size_t left) {
+        while (left) {
+            size_t n = sink->Write(src, left);
+            src += n; left -= n;
+            if (!left || g_playThreadShouldExit || PlayCommandPending(cmdSeq)) break;
+            if (!g_isPlaying) {
+                pcmHeld.insert(pcmHeld.end(), src, src + left);
+                break;
+            }
+            Sleep(kAudioBlockMs / 3);
+        }
+        };
+    auto feedHeld = [&]() {
+        std::vector<uint8_t> held;
+        held.swap(pcmHeld);
+        feedSink(held.data(), held.size());
+        };
+
+    // Resamples one decoded (or tempo-filtered) audio frame to S16 stereo and
+    // hands it to the sink, after anything a pause held back.
+    auto writeAudio = [&](AVFrame* af) {
+        int maxSamples = (int)av_rescale_rnd(
+            swr_get_delay(swrCtx, aDecCtx->sample_rate) + af->nb_samples,
+            aDecCtx->sample_rate, aDecCtx->sample_rate, AV_ROUND_UP);
+        if (pcmBuf.size() < (size_t)maxSamples * 4) pcmBuf.resize((size_t)maxSamples * 4);
+        uint8_t* outPtrs[1] = { pcmBuf.data() };
+        int outSamples = swr_convert(swrCtx, outPtrs, maxSamples,
+            (const uint8_t**)af->data, af->nb_samples);
+        if (outSamples <= 0) return;
+        if (!pcmHeld.empty()) {
+            pcmHeld.insert(pcmHeld.end(), pcmBuf.data(), pcmBuf.data() + (size_t)outSamples * 4);
+            feedHeld();
+        } else {
+            feedSink(pcmBuf.data(), (size_t)outSamples * 4);
+        }
+        };
+
+    // A-B loop state.
+    LoopCache loop;
+    bool      loopRunning   = false;   // queueing frames from loop
+    bool      loopStreaming = false;   // no cache (yet, or over budget): wrap by seeking
+    bool      loopAudio     = false;   // cached PCM is being played with it
+    size_t    loopNext      = 0;       // next frame to queue
+    int64_t   loopLap       = 0;       // added to frame times after each wrap
+    size_t    loopPcmPos    = 0;       // next PCM byte for the device
+
+    // Background build of loop's segment; null when none is in flight.
+    LoopBuild* loopBuild = nullptr;
+
+    auto stopLoopBuild = [&]() {
+        if (!loopBuild) return;
+        InterlockedExchange(&loopBuild->stop, 1);
+        if (loopBuild->thread) {
+            WaitForSingleObject(loopBuild->thread, INFINITE);
+            CloseHandle(loopBuild->thread);
+        }
+        LoopCacheClear(loopBuild->cache);
+        delete loopBuild;
+        loopBuild = nullptr;
+        };
+
+    // Marks [in, out) as loop's segment and starts decoding it on a thread of
+    // its own; playback streams the segment meanwhile.
+    auto startLoopBuild = [&](int64_t in, int64_t out) {
+        stopLoopBuild();
+        LoopCacheClear(loop);
+        loop.inMs = in; loop.outMs = out;
+        loopBuild = new LoopBuild();
+        loopBuild->session   = ctx->session;
+        loopBuild->inMs      = in;
+        loopBuild->outMs     = out;
+        loopBuild->withAudio = (sink != nullptr);
+        PreviewTargetSize(dec_ctx->width, dec_ctx->height, &loopBuild->w, &loopBuild->h);
+        loopBuild->thread = (HANDLE)_beginthreadex(nullptr, 0, LoopBuildThreadProc, loopBuild, 0, nullptr);
+        if (!loopBuild->thread) loopBuild->done = 1;   // no cache: keep looping by seeking
+        };
+
+    // At a wrap: takes over a finished build.  True if loop is now ready.
+    auto takeLoopBuild = [&]() -> bool {
+        if (!loopBuild || !loopBuild->done) return loop.ready;
+        if (loopBuild->cache.ready) std::swap(loop, loopBuild->cache);
+        stopLoopBuild();
+        return loop.ready;
+        };
+
+    // Starts queueing from the cached frame at or after fromMs.
+    auto startLoop = [&](int64_t fromMs) {
+        if (sink) {
+            sink->Reset();
+            sink->Pause(false);
+        }
+        pcmHeld.clear();
+        FrameQueueFlush(queue);
+        PlayClockReset(clock);
+        applySpeed();
+        catchUpToMs = -1;
+        loopNext = LoopCacheFind(loop, fromMs);
+        loopLap  = 0;
+        int64_t firstMs = loop.frames[loopNext].ms;
+        // Cached PCM never went through atempo, so other rates loop silently.
+        loopAudio  = audioOn && speed == 1.0 && !loop.pcm.empty();
+        loopPcmPos = 0;
+        if (loopAudio) {
+            size_t off = (size_t)((firstMs - loop.inMs) * aDecCtx->sample_rate / 1000) * 4;
+            loopPcmPos = (off < loop.pcm.size()) ? off : 0;
+            EnterCriticalSection(&clock.cs);
+            clock.audioBaseMs = firstMs;
+            LeaveCriticalSection(&clock.cs);
+        }
+        loopRunning = true;
+        };
+
+    // Tops up the device with PCM, wrapping at the end of the lap, and queues
+    // the next cached frame when the presenter has room for it.
+    auto serveLoop = [&]() {
+        if (loopAudio) {
+            for (;;) {
+                size_t n = sink->Write(loop.pcm.data() + loopPcmPos, loop.pcm.size() - loopPcmPos);
+                loopPcmPos += n;
+                if (loopPcmPos >= loop.pcm.size()) loopPcmPos = 0;
+                if (n == 0) break;
+            }
+        }
+        if (FrameQueueDepth(queue) >= kPlayQueueFrames) { Sleep(5); return; }
+        int slot = FrameRingAcquire(loop.w, loop.h);
+        if (slot < 0) { Sleep(2); return; }
+        const CachedFrame& cf = loop.frames[loopNext];
+        memcpy(g_frameRing[slot].bits, cf.bgr, (size_t)loop.stride * loop.h);
+        PlayFrame pf = { slot, cf.ms + loopLap, cf.ms };
+        if (!FrameQueuePush(queue, pf, cmdSeq)) FrameRingRelease(slot);
+        if (++loopNext == loop.frames.size()) {
+            loopNext = 0;
+            loopLap += loop.outMs - loop.inMs;
+        }
+        };
 
     while (!g_playThreadShouldExit) {
-        if (g_seekRequested) {
-            int64_t target = g_seekTargetMs;
-            g_seekRequested = false;
-            if (hWaveOut) {
-                waveOutReset(hWaveOut);
-                waveOutIsPaused = false;
-                for (WAVEHDR* wh : waveBlocks) {
-                    waveOutUnprepareHeader(hWaveOut, wh, sizeof(WAVEHDR));
-                    delete[] (uint8_t*)wh->lpData;
-                    delete wh;
+        PlayCommand cmd;
+        if (TakePlayCommand(cmdSeq, cmd)) {
+            int64_t durMs = (int64_t)(g_duration * 1000.0);
+            showPending = false;
+            loopRunning = false;
+            if (cmd.kind == PLAYCMD_STEP) {
+                // Frame step onto a frame that is already cached: no seek, no decode.
+                int w = 0, h = 0;
+                PreviewTargetSize(dec_ctx->width, dec_ctx->height, &w, &h);
+                const CachedFrame* cf = (w == stepCache.w && h == stepCache.h)
+                                        ? StepCacheFind(stepCache, cmd.ms, cmd.stepDir) : nullptr;
+                int slot = cf ? FrameRingAcquire(w, h) : -1;
+                if (slot >= 0) {
+                    memcpy(g_frameRing[slot].bits, cf->bgr, (size_t)stepCache.stride * h);
+                    FrameQueueFlush(queue);
+                    EnterCriticalSection(&g_csState);
+                    ShowRingSlotLocked(slot, cf->ms);
+                    LeaveCriticalSection(&g_csState);
+                    // The decoder hasn't moved, so a forward step past the cache can
+                    // still continue from it as long as it is not ahead of the picture.
+                    fileReady = (lastDecodedMs >= 0 && lastDecodedMs <= cf->ms);
+                    PostMessage(g_mainHwnd, WM_APP_FRAME_READY, 0, 0);
+                    continue;
                 }
-                waveBlocks.clear();
+                int64_t frameMs = (int64_t)max(1.0, 1000.0 / g_videoFPS);
+                if (cmd.stepDir > 0) {
+                    targetMs = (cmd.ms + frameMs < durMs) ? cmd.ms + frameMs : durMs;
+                    // Right after the last decoded frame: read the next packet
+                    // directly (1 frame decode vs entire GOP).
+                    if (!fileReady) seekAll(targetMs);
+                } else {
+                    // Land slightly more than a frame early, then walk forward.
+                    backFromMs = cmd.ms;
+                    targetMs   = (cmd.ms > frameMs * 2) ? cmd.ms - frameMs * 2 : 0;
+                    seekAll(targetMs);
+                }
+                stepDir     = cmd.stepDir;
+                showPending = true;
+            } else if (cmd.scrub) {
+                // Drag in progress: the keyframe under the cursor from the scrub
+                // decoder.  The playback reader doesn't move.
+                FrameQueueFlush(queue);
+                fileReady = false;
+                int w = 0, h = 0;
+                PreviewTargetSize(dec_ctx->width, dec_ctx->height, &w, &h);
+                int    slot = FrameRingAcquire(w, h);
+                double secs = 0.0;
+                if (slot >= 0 && ScrubKeyframe(scrubDec, ctx->session, w, h, (cmd.ms + startMs) / 1000.0,
+                                               g_frameRing[slot].bits, g_frameRing[slot].stride, &secs)) {
+                    int64_t ms = (int64_t)(secs * 1000.0) - startMs;
+                    ms = (ms < 0) ? 0 : (ms > durMs ? durMs : ms);
+                    EnterCriticalSection(&g_csState);
+                    ShowRingSlotLocked(slot, ms);
+                    LeaveCriticalSection(&g_csState);
+                    PostMessage(g_mainHwnd, WM_APP_FRAME_READY, 0, 0);
+                } else {
+                    FrameRingRelease(slot);
+                }
+                continue;
+            } else {
+                seekAll(cmd.ms);
+                stepDir     = 0;
+                targetMs    = cmd.ms;
+                showPending = cmd.showFrame;
             }
-            if (aDecCtx) avcodec_flush_buffers(aDecCtx);
-            timingInit = false;
-            doSeek(target);
-            catchUpToMs = target;  // discard frames before the actual seek target
         }
 
         // Pause / resume detection
         {
             bool nowPlaying = g_isPlaying;
-            if (prevWasPlaying && !nowPlaying && hWaveOut) {
-                waveOutPause(hWaveOut);
-                waveOutIsPaused = true;
-                timingInit = false;
+            if (prevWasPlaying && !nowPlaying) {
+                if (sink) sink->Pause(true);
+                PlayClockHold(clock);
             }
-            if (!prevWasPlaying && nowPlaying && hWaveOut) {
-                if (waveOutIsPaused) { waveOutRestart(hWaveOut); waveOutIsPaused = false; }
-                timingInit = false;
+            if (!prevWasPlaying && nowPlaying) {
+                if (sink) sink->Pause(false);
+                PlayClockHold(clock);
+                if (sink && !pcmHeld.empty()) feedHeld();
             }
             prevWasPlaying = nowPlaying;
         }
 
         // Paused single-frame preview with proper step logic
-        if (g_decodeSingleFrame && !g_isPlaying) {
-            bool produced = false;
-            int64_t targetMs = g_seekTargetMs;
+        if (showPending && !g_isPlaying) {
+            FrameQueueFlush(queue);   // frames decoded ahead of the pause are stale now
+            setQuality(0, false);
+            bool produced   = false;
+            bool superseded = false;
             int64_t bestMs = -1;
-            HBITMAP bestBmp = nullptr;
-
-            while (av_read_frame(fmt_ctx, pkt) >= 0) {
+            int bestSlot = -1;
+
+            for (;;) {
+                if (g_playThreadShouldExit) { superseded = true; break; }
+                if (PlayCommandPending(cmdSeq)) {
+                    // A seek a little further ahead is on the way: keep decoding
+                    // toward it.  Anything else abandons this decode.
+                    LONG        seq  = cmdSeq;
+                    PlayCommand next;
+                    int64_t     from = (lastDecodedMs >= 0) ? lastDecodedMs : targetMs;
+                    if (stepDir == 0 && TakePlayCommand(seq, next) && next.kind == PLAYCMD_SEEK &&
+                        next.showFrame && next.ms >= from && next.ms - from <= kScrubFollowMs) {
+                        cmdSeq      = seq;
+                        targetMs    = next.ms;
+                        catchUpToMs = next.ms;
+                    } else {
+                        superseded = true;
+                        break;
+                    }
+                }
+                if (av_read_frame(fmt_ctx, pkt) < 0) break;
                 if (pkt->stream_index != videoStreamIndex) { av_packet_unref(pkt); continue; }
                 if (pkt->dts != AV_NOPTS_VALUE) last_vid_dts = pkt->dts;
                 if (avcodec_send_packet(dec_ctx, pkt) < 0) { av_packet_unref(pkt); break; }
 
                 while (avcodec_receive_frame(dec_ctx, frame) == 0) {
-                    // Transfer NVDEC hardware frame to CPU memory if needed.
-                    AVFrame* sw_frame = frame;
-                    if (using_hw && frame->format == AV_PIX_FMT_CUDA) {
-                        if (!cpu_frame) cpu_frame = av_frame_alloc();
-                        if (cpu_frame && av_hwframe_transfer_data(cpu_frame, frame, 0) >= 0)
-                            sw_frame = cpu_frame;
-                    }
-                    // Lazy-init sws_ctx on first decoded frame.
-                    if (!sws_ctx) {
-                        sws_ctx = sws_getContext(
-                            sw_frame->width, sw_frame->height, (AVPixelFormat)sw_frame->format,
-                            sw_frame->width, sw_frame->height, AV_PIX_FMT_BGR24,
-                            SWS_BILINEAR, nullptr, nullptr, nullptr);
-                    }
-                    if (sws_ctx) {
-                        sws_scale(sws_ctx, sw_frame->data, sw_frame->linesize, 0, dec_ctx->height,
-                            rgbFrame->data, rgbFrame->linesize);
-                    }
-                    if (g_isHdr && g_hdrLutValid) {
-                        for (int row = 0; row < dec_ctx->height; row++) {
-                            uint8_t* p = rgbFrame->data[0] + row * rgbFrame->linesize[0];
-                            for (int col = 0; col < dec_ctx->width * 3; col++)
-                                p[col] = g_hdrDisplay8Lut[p[col]];
-                        }
-                    }
-
-                    // Create DIB
-                    BITMAPINFO bmi = {};
-                    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-                    bmi.bmiHeader.biWidth = dec_ctx->width;
-                    bmi.bmiHeader.biHeight = -dec_ctx->height;
-                    bmi.bmiHeader.biPlanes = 1;
-                    bmi.bmiHeader.biBitCount = 24;
-                    bmi.bmiHeader.biCompression = BI_RGB;
-
-                    HDC hdc = GetDC(nullptr);
-                    void* dibBits = nullptr;
-                    HBITMAP hNew = CreateDIBSection(hdc, &bmi, DIB_RGB_COLORS, &dibBits, nullptr, 0);
-                    ReleaseDC(nullptr, hdc);
-
-                    if (hNew) {
-                        int rowBytes = dec_ctx->width * 3;
-                        for (int y = 0; y < dec_ctx->height; y++) {
-                            memcpy((uint8_t*)dibBits + y * rowBytes,
-                                rgbFrame->data[0] + y * rgbFrame->linesize[0], rowBytes);
-                        }
-                    }
+                    int     slot = convertFrame(cpuFrameOf(frame));
+                    int64_t ms   = videoMsOf(frame);
+                    lastDecodedMs = ms;
+                    if (slot >= 0) StepCacheAdd(stepCache, g_frameRing[slot], ms);
+                    else           StepCacheBreak(stepCache);
 
-                    int64_t raw_pts = (frame->best_effort_timestamp != AV_NOPTS_VALUE)
-                                          ? frame->best_effort_timestamp
-                                          : (frame->pts != AV_NOPTS_VALUE ? frame->pts : vid_play_start);
-                    int64_t ms = (int64_t)((raw_pts - vid_play_start) *
-                        av_q2d(videoStream->time_base) * 1000.0);
-                    // If the codec returned a stale VOP timestamp from outside this clip
-                    // (e.g. Xvid cut from a long recording), fall back to the container DTS.
-                    {
-                        int64_t durMs = (int64_t)(g_duration * 1000.0);
-                        if (ms < 0 || ms > durMs + 1000) {
-                            int64_t dts_pts = (last_vid_dts != AV_NOPTS_VALUE) ? last_vid_dts : vid_play_start;
-                            ms = (int64_t)((dts_pts - vid_play_start) * av_q2d(videoStream->time_base) * 1000.0);
-                            ms = (ms < 0) ? 0 : (ms > durMs ? durMs : ms);
-                        }
-                    }
-
-                    if (g_stepDir >= 0) {
+                    if (stepDir >= 0) {
                         // Forward step: stop at first frame >= target
-                        if (ms >= targetMs) {
+                        if (ms >= targetMs && slot >= 0) {
                             EnterCriticalSection(&g_csState);
-                            if (g_hFrameBitmap) DeleteObject(g_hFrameBitmap);
-                            g_hFrameBitmap = hNew; hNew = nullptr;
-                            g_frameWidth = dec_ctx->width;
-                            g_frameHeight = dec_ctx->height;
-                            g_currentPosMs = ms;
+                            ShowRingSlotLocked(slot, ms); slot = -1;
                             LeaveCriticalSection(&g_csState);
                             produced = true;
                         }
                     }
                     else {
-                        // Backward step: remember last frame strictly before target
-                        if (ms < targetMs) {
-                            if (bestBmp) DeleteObject(bestBmp);
-                            bestBmp = hNew; hNew = nullptr;
-                            bestMs = ms;
+                        // Backward step: remember last frame strictly before the one shown
+                        if (ms < backFromMs) {
+                            if (slot >= 0) {
+                                FrameRingRelease(bestSlot);
+                                bestSlot = slot; slot = -1;
+                                bestMs = ms;
+                            }
                         }
                         else {
                             // Crossed target, present best previous if exists
-                            if (bestBmp) {
+                            if (bestSlot >= 0) {
                                 EnterCriticalSection(&g_csState);
-                                if (g_hFrameBitmap) DeleteObject(g_hFrameBitmap);
-                                g_hFrameBitmap = bestBmp; bestBmp = nullptr;
-                                g_frameWidth = dec_ctx->width;
-                                g_frameHeight = dec_ctx->height;
-                                g_currentPosMs = (bestMs >= 0) ? bestMs : ms;
+                                ShowRingSlotLocked(bestSlot, (bestMs >= 0) ? bestMs : ms); bestSlot = -1;
                                 LeaveCriticalSection(&g_csState);
                                 produced = true;
                             }
-                            else {
+                            else if (slot >= 0) {
                                 EnterCriticalSection(&g_csState);
-                                if (g_hFrameBitmap) DeleteObject(g_hFrameBitmap);
-                                g_hFrameBitmap = hNew; hNew = nullptr;
-                                g_frameWidth = dec_ctx->width;
-                                g_frameHeight = dec_ctx->height;
-                                g_currentPosMs = ms;
+                                ShowRingSlotLocked(slot, ms); slot = -1;
                                 LeaveCriticalSection(&g_csState);
                                 produced = true;
                             }
                         }
                     }
 
-                    if (hNew) DeleteObject(hNew);
+                    FrameRingRelease(slot);
                     av_frame_unref(frame);
                     if (produced) break;
                 }
                 av_packet_unref(pkt);
                 if (produced) break;
             }
+            FrameRingRelease(bestSlot);   // hit EOF or a newer command before crossing the target
 
-            g_decodeSingleFrame = false;
-            g_stepDir = 0;
+            showPending = false;
+            stepDir     = 0;
             if (produced) {
-                g_stepFileReady = true; // file ptr is now right after decoded frame — next forward step can skip seek
+                // File ptr is right after the last decoded frame; the next forward step can
+                // skip the seek unless that frame is ahead of the one shown (backward step).
+                fileReady = (lastDecodedMs <= g_currentPosMs);
                 PostMessage(g_mainHwnd, WM_APP_FRAME_READY, 0, 0);
             }
-            Sleep(2);
+            if (!superseded) Sleep(2);
             continue;
         }
 
         if (!g_isPlaying) { Sleep(5); continue; }
-        g_stepFileReady = false; // playback advances file position — no longer right after a specific frame
+        showPending = false;
+        fileReady   = false; // playback advances file position — no longer right after a specific frame
+        setQuality(quality, keyOnly);
+
+        bool loopOn = g_loopAB && g_markInMs >= 0 && g_markOutMs > g_markInMs;
+        if (!loopOn) {
+            if (loopBuild) {
+                // Off before its cache was taken: rebuild if it comes back on.
+                stopLoopBuild();
+                LoopCacheClear(loop);
+            }
+            if (loopRunning || loopStreaming) {
+                // Loop switched off: carry on from the picture on screen.
+                loopRunning = loopStreaming = false;
+                seekAll(g_currentPosMs);
+                continue;
+            }
+        } else {
+            int w = 0, h = 0;
+            PreviewTargetSize(dec_ctx->width, dec_ctx->height, &w, &h);
+            int64_t from = (catchUpToMs >= 0) ? catchUpToMs : g_currentPosMs;
+            if (loop.inMs != g_markInMs || loop.outMs != g_markOutMs ||
+                (loop.ready && (loop.w != w || loop.h != h))) {
+                loopRunning   = false;
+                loopStreaming = true;
+                startLoopBuild(g_markInMs, g_markOutMs);
+                seekAll((from >= loop.inMs && from < loop.outMs) ? from : loop.inMs);
+                continue;
+            }
+            if (loopRunning) { serveLoop(); continue; }
+            if (loop.ready)  { startLoop(from); continue; }
+            loopStreaming = true;
+            if (lastDecodedMs >= loop.outMs) {
+                // The wrap: switch to the cache if its build has finished.
+                if (takeLoopBuild()) { loopStreaming = false; startLoop(loop.inMs); }
+                else                 seekAll(loop.inMs);
+                continue;
+            }
+        }
 
+        if (eofQueued) { Sleep(5); continue; }
         if (av_read_frame(fmt_ctx, pkt) < 0) {
-            g_isPlaying = false;
+            // The presenter plays out what is queued and then stops playback.
+            FrameQueueSetEof(queue);
+            eofQueued = true;
             continue;
         }
-        // Audio packet — decode, resample, feed to waveOut
-        if (pkt->stream_index == audioStreamIdx && aDecCtx && hWaveOut) {
+        // Audio packet — decode, resample, feed to the sink
+        if (pkt->stream_index == audioStreamIdx && aDecCtx && sink) {
             // Skip audio during video seek catchup to prevent AV desync:
             // waveOut starts playing the moment the first buffer is written, so
             // if we feed audio before video has caught up to the target PTS the
             // audio will be ahead of the picture by up to one keyframe interval.
-            if (catchUpToMs >= 0) { av_packet_unref(pkt); continue; }
-            // Reclaim completed buffers to avoid unbounded growth
-            while (!waveBlocks.empty() && (waveBlocks.front()->dwFlags & WHDR_DONE)) {
-                WAVEHDR* wh = waveBlocks.front();
-                waveOutUnprepareHeader(hWaveOut, wh, sizeof(WAVEHDR));
-                delete[] (uint8_t*)wh->lpData;
-                delete wh;
-                waveBlocks.pop_front();
-            }
+            if (catchUpToMs >= 0 || !audioOn) { av_packet_unref(pkt); continue; }
             if (avcodec_send_packet(aDecCtx, pkt) >= 0) {
                 while (avcodec_receive_frame(aDecCtx, aFrame) == 0) {
-                    int maxSamples = (int)av_rescale_rnd(
-                        swr_get_delay(swrCtx, aDecCtx->sample_rate) + aFrame->nb_samples,
-                        aDecCtx->sample_rate, aDecCtx->sample_rate, AV_ROUND_UP);
-                    uint8_t* pcm = new uint8_t[(size_t)maxSamples * 4];
-                    uint8_t* outPtrs[1] = { pcm };
-                    int outSamples = swr_convert(swrCtx, outPtrs, maxSamples,
-                        (const uint8_t**)aFrame->data, aFrame->nb_samples);
-                    if (outSamples > 0) {
-                        WAVEHDR* wh  = new WAVEHDR{};
-                        wh->lpData        = (LPSTR)pcm;
-                        wh->dwBufferLength = (DWORD)(outSamples * 4);
-                        wh->dwFlags       = 0;
-                        waveOutPrepareHeader(hWaveOut, wh, sizeof(WAVEHDR));
-                        waveOutWrite(hWaveOut, wh, sizeof(WAVEHDR));
-                        waveBlocks.push_back(wh);
-                        pcm = nullptr; // owned by wh
+                    if (speed != 1.0 && !tempoSrc && !openTempo()) {
+                        // No time-stretch available: play this rate silently.
+                        audioOn = false;
+                        sink->Reset();
+                        pcmHeld.clear();
+                        av_frame_unref(aFrame);
+                        break;
+                    }
+                    // First PCM since the last reset: played sample 0 is this frame.
+                    int64_t apts = aFrame->best_effort_timestamp;
+                    if (apts != AV_NOPTS_VALUE && clock.audioBaseMs < 0) {
+                        EnterCriticalSection(&clock.cs);
+                        clock.audioBaseMs = av_rescale_q(apts, audioTb, AVRational{ 1, 1000 }) - startMs;
+                        LeaveCriticalSection(&clock.cs);
+                    }
+                    if (tempoSrc) {
+                        if (av_buffersrc_add_frame(tempoSrc, aFrame) >= 0) {
+                            while (av_buffersink_get_frame(tempoSink, tempoFrame) >= 0) {
+                                writeAudio(tempoFrame);
+                                av_frame_unref(tempoFrame);
+                            }
+                        }
+                    } else {
+                        writeAudio(aFrame);
                     }
-                    delete[] pcm; // no-op if transferred
                     av_frame_unref(aFrame);
                 }
             }
@@ -2869,119 +4596,109 @@ unsigned __stdcall PlaybackThreadProc(void* p) {
             continue;
         }
         while (avcodec_receive_frame(dec_ctx, frame) == 0) {
-            // Transfer NVDEC hardware frame to CPU memory if needed.
-            AVFrame* sw_frame = frame;
-            if (using_hw && frame->format == AV_PIX_FMT_CUDA) {
-                if (!cpu_frame) cpu_frame = av_frame_alloc();
-                if (cpu_frame && av_hwframe_transfer_data(cpu_frame, frame, 0) >= 0)
-                    sw_frame = cpu_frame;
-            }
             // Compute PTS early so we can skip frames still before the seek target.
-            int64_t raw_pts2 = (frame->best_effort_timestamp != AV_NOPTS_VALUE)
-                                   ? frame->best_effort_timestamp
-                                   : (frame->pts != AV_NOPTS_VALUE ? frame->pts : vid_play_start);
-            int64_t ms = (int64_t)((raw_pts2 - vid_play_start) *
-                av_q2d(videoStream->time_base) * 1000.0);
-            // Guard against stale VOP timestamps from Xvid clips cut from longer recordings.
-            {
-                int64_t durMs = (int64_t)(g_duration * 1000.0);
-                if (ms < 0 || ms > durMs + 1000) {
-                    int64_t dts_pts = (last_vid_dts != AV_NOPTS_VALUE) ? last_vid_dts : vid_play_start;
-                    ms = (int64_t)((dts_pts - vid_play_start) * av_q2d(videoStream->time_base) * 1000.0);
-                    ms = (ms < 0) ? 0 : (ms > durMs ? durMs : ms);
-                }
-            }
+            // Skipped and dropped frames never leave the GPU: the NVDEC download
+            // is only paid for a frame that is going to be converted.
+            int64_t ms = videoMsOf(frame);
+            lastDecodedMs = ms;
             if (catchUpToMs >= 0 && ms < catchUpToMs) {
+                StepCacheBreak(stepCache);
                 av_frame_unref(frame);
                 continue;  // discard — still catching up to the seek target
             }
             catchUpToMs = -1;
-
-            // Lazy-init sws_ctx on first decoded frame.
-            if (!sws_ctx) {
-                sws_ctx = sws_getContext(
-                    sw_frame->width, sw_frame->height, (AVPixelFormat)sw_frame->format,
-                    sw_frame->width, sw_frame->height, AV_PIX_FMT_BGR24,
-                    SWS_BILINEAR, nullptr, nullptr, nullptr);
-            }
-            if (sws_ctx) {
-                sws_scale(sws_ctx, sw_frame->data, sw_frame->linesize, 0, dec_ctx->height,
-                    rgbFrame->data, rgbFrame->linesize);
-            }
-            if (g_isHdr && g_hdrLutValid) {
-                for (int row = 0; row < dec_ctx->height; row++) {
-                    uint8_t* p = rgbFrame->data[0] + row * rgbFrame->linesize[0];
-                    for (int col = 0; col < dec_ctx->width * 3; col++)
-                        p[col] = g_hdrDisplay8Lut[p[col]];
-                }
+            // Streaming an A-B loop: the first frame at Mark Out is the wrap, not a picture.
+            if (loopStreaming && ms >= loop.outMs) {
+                av_frame_unref(frame);
+                continue;
             }
 
-            BITMAPINFO bmi = {};
-            bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-            bmi.bmiHeader.biWidth = dec_ctx->width;
-            bmi.bmiHeader.biHeight = -dec_ctx->height;
-            bmi.bmiHeader.biPlanes = 1;
-            bmi.bmiHeader.biBitCount = 24;
-            bmi.bmiHeader.biCompression = BI_RGB;
-
-            HDC hdc = GetDC(nullptr);
-            void* dibBits = nullptr;
-            HBITMAP hNew = CreateDIBSection(hdc, &bmi, DIB_RGB_COLORS, &dibBits, nullptr, 0);
-            ReleaseDC(nullptr, hdc);
-            if (hNew) {
-                int rowBytes = dec_ctx->width * 3;
-                for (int y = 0; y < dec_ctx->height; y++) {
-                    memcpy((uint8_t*)dibBits + y * rowBytes,
-                        rgbFrame->data[0] + y * rgbFrame->linesize[0], rowBytes);
-                }
-                // PTS-based timing: sleep until this frame is due
-                if (!timingInit) {
-                    t0Wall   = GetTickCount64();
-                    t0PtsMs  = ms;
-                    timingInit = true;
+            // Already behind the clock: a frame more than one interval late would
+            // be skipped by the presenter anyway, so don't pay for its conversion.
+            int64_t nowMs  = 0;
+            int64_t lateMs = PlayClockPeek(clock, &nowMs) ? nowMs - ms : 0;
+            bool    late   = lateMs > 0;
+            InterlockedIncrement(&g_playStats.decoded);
+            if (late) { InterlockedIncrement(&g_playStats.late); windowLate++; }
+            if (++windowFrames >= kQualityWindow) {
+                int prev = quality;
+                if (windowLate * 4 > windowFrames) {
+                    cleanWindows = 0;
+                    if (quality < kMaxQuality) quality++;
+                } else if (windowLate == 0 && FrameQueueDepth(queue) >= kPlayQueueFrames / 2) {
+                    if (++cleanWindows >= 2 && quality > 0) { quality--; cleanWindows = 0; }
                 } else {
-                    int64_t elapsed = (int64_t)(GetTickCount64() - t0Wall);
-                    int64_t due     = ms - t0PtsMs;
-                    if (due > elapsed + 2)
-                        Sleep((DWORD)(due - elapsed));
+                    cleanWindows = 0;
                 }
-                EnterCriticalSection(&g_csState);
-                if (g_hFrameBitmap) DeleteObject(g_hFrameBitmap);
-                g_hFrameBitmap = hNew;
-                g_frameWidth   = dec_ctx->width;
-                g_frameHeight  = dec_ctx->height;
-                g_currentPosMs = ms;
-                LeaveCriticalSection(&g_csState);
+                windowFrames = windowLate = 0;
+                if (quality != prev) {
+                    InterlockedExchange(&g_playStats.quality, quality);
+                    char msg[128];
+                    StringCchPrintfA(msg, 128, "Playback quality %d -> %d (decoded %ld, late %ld, dropped %ld, skipped %ld)\n",
+                        prev, quality, g_playStats.decoded, g_playStats.late, g_playStats.dropped, g_playStats.skipped);
+                    OutputDebugStringA(msg);
+                    setQuality(quality, keyOnly);
+                }
+            }
+            int64_t frameIntervalMs = (int64_t)max(1.0, 1000.0 / g_videoFPS);
+            if (lateMs > frameIntervalMs && dropRun < kMaxDropRun) {
+                InterlockedIncrement(&g_playStats.dropped);
+                dropRun++;
+                StepCacheBreak(stepCache);
+                av_frame_unref(frame);
+                continue;
             }
-            PostMessage(g_mainHwnd, WM_APP_FRAME_READY, 0, 0);
+            dropRun = 0;
+
+            // Hand over to the presenter; blocks while it is a full queue ahead.
+            // With non-reference frames skipped the cache would have holes.
+            AVFrame*  sw_frame = cpuFrameOf(frame);
+            PlayFrame pf = { sw_frame ? convertFrame(sw_frame) : -1, ms, ms };
+            if (pf.slot >= 0 && appliedLevel < 2 && !appliedKeyOnly)
+                StepCacheAdd(stepCache, g_frameRing[pf.slot], ms);
+            else
+                StepCacheBreak(stepCache);
+            if (pf.slot >= 0 && !FrameQueuePush(queue, pf, cmdSeq)) FrameRingRelease(pf.slot);
             av_frame_unref(frame);
         }
         av_packet_unref(pkt);
     }
 
-    // cleanup — audio first so waveOut stops before we free FFmpeg state
-    if (hWaveOut) {
-        waveOutReset(hWaveOut);
-        for (WAVEHDR* wh : waveBlocks) {
-            waveOutUnprepareHeader(hWaveOut, wh, sizeof(WAVEHDR));
-            delete[] (uint8_t*)wh->lpData;
-            delete wh;
-        }
-        waveBlocks.clear();
-        waveOutClose(hWaveOut);
+    PlayStats totals = GetPlayStats();
+    if (totals.decoded > 0) {
+        char msg[160];
+        StringCchPrintfA(msg, 160, "Playback stats: decoded %ld, late %ld, dropped %ld, skipped %ld, quality %ld\n",
+            totals.decoded, totals.late, totals.dropped, totals.skipped, totals.quality);
+        OutputDebugStringA(msg);
     }
+
+    // Presenter first: it reads the sink's played position.
+    presenter.stop = true;
+    EnterCriticalSection(&queue.cs);
+    WakeAllConditionVariable(&queue.changed);
+    LeaveCriticalSection(&queue.cs);
+    if (hPresenter) { WaitForSingleObject(hPresenter, INFINITE); CloseHandle(hPresenter); }
+    FrameQueueFlush(queue);
+    StepCacheClear(stepCache);
+    ScrubDecoderFree(scrubDec);
+    stopLoopBuild();
+    LoopCacheClear(loop);
+    closeTempo();
+    if (tempoFrame) av_frame_free(&tempoFrame);
+    DeleteCriticalSection(&queue.cs);
+    DeleteCriticalSection(&clock.cs);
+
+    // cleanup — audio first so the device stops before we free FFmpeg state
+    if (sink) { sink->Close(); delete sink; }
     if (aFrame)  av_frame_free(&aFrame);
     if (swrCtx)  swr_free(&swrCtx);
-    if (aDecCtx) avcodec_free_context(&aDecCtx);
 
     // video cleanup
     if (pkt) av_packet_free(&pkt);
     if (cpu_frame) av_frame_free(&cpu_frame);
-    if (rgbFrame) { if (rgbBuffer) av_free(rgbBuffer); av_frame_free(&rgbFrame); }
     if (frame) av_frame_free(&frame);
-    if (sws_ctx) sws_freeContext(sws_ctx);
-    if (dec_ctx) avcodec_free_context(&dec_ctx);
-    if (fmt_ctx) avformat_close_input(&fmt_ctx);
+    BgrConverterFree(conv);
+    MediaSessionReturn(reader);
 
     delete ctx;
     _endthreadex(0);
@@ -2989,16 +4706,15 @@ unsigned __stdcall PlaybackThreadProc(void* p) {
 }
 
 void StartPlayback(HWND hwnd) {
-    EnterCriticalSection(&g_csState);
-    if (g_hFrameBitmap) { DeleteObject(g_hFrameBitmap); g_hFrameBitmap = nullptr; }
-    LeaveCriticalSection(&g_csState);
+    SetPreviewBitmap(nullptr);
 
     if (g_hPlaybackThread) return;
     g_playThreadShouldExit = false;
     g_isPlaying = true;
 
     PlaybackCtx* ctx = new PlaybackCtx();
-    ctx->path = g_inputPath;
+    ctx->session = g_session;
+    ctx->cmdSeq  = g_cmdSeq;
     uintptr_t th = _beginthreadex(nullptr, 0, PlaybackThreadProc, ctx, 0, nullptr);
     g_hPlaybackThread = (HANDLE)th;
 
@@ -3010,7 +4726,8 @@ void EnsureThreadRunningPaused(HWND hwnd) {
         g_playThreadShouldExit = false;
         g_isPlaying = false;
         PlaybackCtx* ctx = new PlaybackCtx();
-        ctx->path = g_inputPath;
+        ctx->session = g_session;
+        ctx->cmdSeq  = g_cmdSeq;
         uintptr_t th = _beginthreadex(nullptr, 0, PlaybackThreadProc, ctx, 0, nullptr);
         g_hPlaybackThread = (HANDLE)th;
         SetTimer(hwnd, IDT_UI_REFRESH, 33, nullptr);
@@ -3032,9 +4749,8 @@ void TogglePlayPause(HWND hwnd) {
     if (!g_hPlaybackThread) {
         // Sync g_currentPosMs to the slider before the thread starts so the
         // first timer tick never sees a stale value and snaps the slider back.
+        // The thread's initial seek goes there too.
         g_currentPosMs = sliderPos;
-        g_seekTargetMs = sliderPos;
-        g_seekRequested = true;
         StartPlayback(hwnd);
         InvalidateRect(g_hBtnPlayPause, nullptr, TRUE);
         return;
@@ -3054,29 +4770,54 @@ void SeekMs(int64_t ms, bool decodeSingle) {
     int64_t durMs = (int64_t)(g_duration * 1000.0);
     if (ms > durMs) ms = durMs;
 
-    g_seekTargetMs = ms;
-    g_seekRequested = true;
-    if (decodeSingle) g_decodeSingleFrame = true;
+    PostPlayCommand({ PLAYCMD_SEEK, ms, 0, decodeSingle, false });
 }
 
+// Timeline drag: show the keyframe at or before ms from the low-cost scrub
+// decoder.  The caller follows up with an exact SeekMs once the cursor rests.
+void ScrubMs(int64_t ms) {
+    if (ms < 0) ms = 0;
+    int64_t durMs = (int64_t)(g_duration * 1000.0);
+    if (ms > durMs) ms = durMs;
 
+    PostPlayCommand({ PLAYCMD_SEEK, ms, 0, true, true });
+}
+
+// Selects kPlayRates[idx].  The playback thread picks the rate up at its next
+// reset, so running playback is re-seeked in place; paused playback gets it
+// from the seek that resumes it.
+void SetPlayRate(int idx) {
+    InterlockedExchange(&g_playRateIdx, idx);
+    InvalidateRect(g_hBtnRate, nullptr, TRUE);
+    if (g_hPlaybackThread && g_isPlaying) SeekMs(g_currentPosMs, false);
+}
+
+// Re-renders the paused preview after a resize or 1:1 toggle changed its
+// target size.  While playing, the next decoded frame picks the size up.
+static void RefreshPreviewFrame(HWND hwnd) {
+    if (!g_playerReady || g_isPlaying || g_isGenerating) return;
+    int w = 0, h = 0;
+    PreviewTargetSize(g_vidWidth, g_vidHeight, &w, &h);
+    if (w == g_frameWidth && h == g_frameHeight) return;
+    if (g_hPlaybackThread) { SeekMs(g_currentPosMs, true); return; }
+
+    // No thread yet: the preview is still the middle frame from load.
+    HBITMAP bmp = ExtractMiddleFrameBitmap(g_session, g_vidWidth, g_vidHeight, g_duration);
+    if (!bmp) return;
+    SetPreviewBitmap(bmp);
+    InvalidateRect(hwnd, nullptr, TRUE);
+}
+
+
+// Steps are resolved on the playback thread: it knows whether the target is
+// cached or whether the file is already positioned right after the picture.
 void StepForward(HWND hwnd) {
     EnsureThreadRunningPaused(hwnd);
     g_isPlaying = false;
     int frameMs = (int)max(1.0, 1000.0 / g_videoFPS);
-    g_stepDir = +1;
     int64_t durMs = (int64_t)(g_duration * 1000.0);
     int64_t target = min(g_currentPosMs + frameMs, durMs);
-
-    if (g_stepFileReady) {
-        // Thread file ptr is right after the last decoded frame — skip the costly I-frame seek
-        // and let the thread read the next packet directly (1 frame decode vs entire GOP).
-        g_stepFileReady = false;
-        g_seekTargetMs = target;
-        g_decodeSingleFrame = true;
-    } else {
-        SeekMs(target, true);
-    }
+    PostPlayCommand({ PLAYCMD_STEP, g_currentPosMs, +1, true, false });
     g_tlPos = (int)target;
     InvalidateRect(g_hTimeline, nullptr, FALSE);
 }
@@ -3085,12 +4826,9 @@ void StepForward(HWND hwnd) {
 void StepBackward(HWND hwnd) {
     EnsureThreadRunningPaused(hwnd);
     g_isPlaying = false;
-    g_stepFileReady = false;
     int frameMs = (int)max(1.0, 1000.0 / g_videoFPS);
-    g_stepDir = -1;
-    // Seek slightly earlier than one frame to ensure we land before target and then walk forward
     int64_t target = (g_currentPosMs > frameMs * 2) ? (g_currentPosMs - frameMs * 2) : 0;
-    SeekMs(target, true);
+    PostPlayCommand({ PLAYCMD_STEP, g_currentPosMs, -1, true, false });
     g_tlPos = (int)max((int64_t)0, target);
     InvalidateRect(g_hTimeline, nullptr, FALSE);
 }
@@ -3117,6 +4855,7 @@ void SetMarkInFromCurrent(HWND hwnd) {
     SetWindowTextW(g_hStartEdit, buf);
     g_markInMs = (int64_t)g_currentPosMs;
     EnableWindow(g_hBtnGotoMarkIn, TRUE);
+    EnableWindow(g_hBtnLoop, g_markInMs >= 0 && g_markOutMs > g_markInMs);
     InvalidateRect(g_hTimeline, nullptr, FALSE);
 }
 
@@ -3133,1808 +4872,1008 @@ void SetMarkOutFromCurrent(HWND hwnd) {
     SetWindowTextW(g_hEndEdit, buf);
     g_markOutMs = (int64_t)g_currentPosMs;
     EnableWindow(g_hBtnGotoMarkOut, TRUE);
+    EnableWindow(g_hBtnLoop, g_markInMs >= 0 && g_markOutMs > g_markInMs);
     InvalidateRect(g_hTimeline, nullptr, FALSE);
 }
 
-// ------------------------------ Transcode (unchanged) ------------------------------
-
-// Bitmap subtitle types (PGS, VOBSUB) are pre-decoded to these structs and
-// alpha-blended directly onto YUV frames; text-based subs go through libavfilter/libass.
-// x/y/w/h are at OUTPUT (encoder) resolution; yuva holds [Y,Cb,Cr,A] per pixel,
-// pre-converted at load time so the per-frame blend loop needs no float math or
-// colour conversion.
-struct PgsRect  { int x, y, w, h; std::vector<uint8_t> yuva; };
-struct PgsEvent { int64_t pts_ms;  std::vector<PgsRect> rects; }; // rects.empty() = clear screen
-// Text subtitle event decoded from SUBTITLE_ASS / SUBTITLE_TEXT rects (fallback path)
-struct TextSubEvent { double start_s, end_s; std::string ass_text; };
-
-bool TranscodeWithSizeAndScale(const char* in_filename, const char* out_filename, double target_size_mb,
-    int scale_factor, int orig_w, int orig_h, double start_seconds, double end_seconds,
-    int audio_stream_index, int subtitle_stream_index, bool convert_hdr_to_sdr,
-    const char* ext_subtitle_path) {
-    int64_t           target_bitrate   = 0;
-    AVFormatContext*  in_fmt_ctx       = nullptr;
-    AVFormatContext*  out_fmt_ctx      = nullptr;
-    AVCodecContext*   dec_ctx          = nullptr;
-    AVCodecContext*   enc_ctx          = nullptr;
-    AVStream*         video_in_stream  = nullptr;
-    AVStream*         video_out_stream = nullptr;
-    AVStream*         audio_in_stream  = nullptr;
-    AVStream*         audio_out_stream = nullptr;
-    const AVCodec*    video_decoder    = nullptr;
-    const AVCodec*    video_encoder    = nullptr;
-    SwsContext*       sws_ctx          = nullptr;
-    SwsContext*       sws_hdr2rgb      = nullptr;   // HDR→SDR: native → RGB48LE
-    SwsContext*       sws_rgb2yuv      = nullptr;   // HDR→SDR: BGR24 → encoder YUV
-    uint8_t*          hdr_rgb48_buf    = nullptr;   // intermediate RGB48LE plane
-    uint8_t*          hdr_bgr24_buf    = nullptr;   // intermediate BGR24 plane
-    AVFilterGraph*    filter_graph     = nullptr;
-    AVFilterContext*  buffersrc_ctx    = nullptr;
-    AVFilterContext*  buffersink_ctx   = nullptr;
-    bool              use_filter       = false;
-    bool              use_bitmap_subs  = false;
-    char              ext_sub_tmp[MAX_PATH]        = {}; // temp copy of the subtitle file at a plain ASCII path
-    char              ext_sub_filter_path[MAX_PATH] = {}; // path used in filter (for lazy format-mismatch reinit)
-    bool              ext_sub_fmt_fixed             = false; // true after one lazy reinit attempt
-    AVFrame*          pre_filter_frame              = nullptr; // YUV420P staging frame for subtitle filter
-    SwsContext*       pre_filter_sws                = nullptr; // NV12/P010/etc → YUV420P for filter input
-    AVFilterGraph*    deint_graph                   = nullptr; // yadif deinterlace filter graph
-    AVFilterContext*  deint_src_ctx                 = nullptr;
-    AVFilterContext*  deint_sink_ctx                = nullptr;
-    bool              needs_deint                   = false;
-    bool              deint_tried                   = false;
-
-    int               pgs_plane_w      = 0;   // subtitle coordinate space (may differ from video for 4K)
-    int               pgs_plane_h      = 0;
-    std::vector<PgsEvent>    pgs_events;
-    std::vector<TextSubEvent> text_sub_events;
-    int               videoStreamIndex = -1;
-    int               audioStreamIndex = -1;
-    AVFrame*          frame            = nullptr;
-    AVFrame*          filt_frame       = nullptr;
-    AVFrame*          cpu_frame        = nullptr;   // for NVDEC hw→cpu transfer
-    AVPacket*         pkt              = nullptr;
-    AVPacket*         enc_pkt          = nullptr;
-    bool              success          = false;
-    bool              using_hw         = false;
-    int64_t           video_start_pts  = 0;
-    int64_t           audio_start_pts  = 0;
-    int64_t           vid_stream_start = 0;  // stream->start_time for video (AVI/Xvid offset)
-    int64_t           aud_stream_start = 0;  // stream->start_time for audio
-    int64_t           last_vid_pkt_dts = AV_NOPTS_VALUE; // most-recent valid video packet DTS
-    AVBSFContext*     trans_bsf_ctx    = nullptr; // mpeg4_unpack_bframes for packed-B AVIs
-    AVPacket*         trans_bsf_pkt    = nullptr;
-    AVCodecContext*   aDec_ctx         = nullptr;
-    AVCodecContext*   aEnc_ctx         = nullptr;
-    SwrContext*       aSwrCtx          = nullptr;
-    AVFrame*          aFrame           = nullptr;
-    AVFrame*          aEncFrame        = nullptr;
-    AVPacket*         aEncPkt          = nullptr;
-    int64_t           aOutPts          = 0;
-
-    if (end_seconds <= start_seconds) { OutputDebugStringA("End time must be greater than start time.\n"); return false; }
-    double segment_duration = end_seconds - start_seconds;
-    if (segment_duration <= 0.0) { OutputDebugStringA("Invalid segment duration.\n"); return false; }
-
-    if (avformat_open_input(&in_fmt_ctx, in_filename, nullptr, nullptr) < 0) { OutputDebugStringA("Could not open input file.\n"); goto cleanup; }
-    if (avformat_find_stream_info(in_fmt_ctx, nullptr) < 0) { OutputDebugStringA("Could not find stream info.\n"); goto cleanup; }
-    for (unsigned int i = 0; i < in_fmt_ctx->nb_streams; i++) {
-        AVStream* st = in_fmt_ctx->streams[i];
-        if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && videoStreamIndex < 0) { videoStreamIndex = (int)i; }
-        else if (st->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && audioStreamIndex < 0) { audioStreamIndex = (int)i; }
-    }
-    // Use user-selected audio stream if valid
-    if (audio_stream_index >= 0 && (unsigned int)audio_stream_index < in_fmt_ctx->nb_streams &&
-        in_fmt_ctx->streams[audio_stream_index]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
-        audioStreamIndex = audio_stream_index;
-
-    if (videoStreamIndex < 0) { OutputDebugStringA("No video stream found.\n"); goto cleanup; }
-    video_in_stream = in_fmt_ctx->streams[videoStreamIndex];
-    if (audioStreamIndex >= 0) audio_in_stream = in_fmt_ctx->streams[audioStreamIndex];
-
-    // Detect interlaced content from the stream's field_order.
-    // AV_FIELD_PROGRESSIVE and AV_FIELD_UNKNOWN indicate progressive content.
-    needs_deint = (video_in_stream->codecpar->field_order != AV_FIELD_PROGRESSIVE &&
-                   video_in_stream->codecpar->field_order != AV_FIELD_UNKNOWN);
-
-    // Stream start_time offsets: AVI/Xvid (and some other containers) can have a
-    // non-zero start_time so that the first frame's PTS is not 0.  All timestamp
-    // arithmetic must subtract this offset to get elapsed-seconds-from-file-start.
-    vid_stream_start = (video_in_stream->start_time != AV_NOPTS_VALUE)
-                        ? video_in_stream->start_time : 0;
-    aud_stream_start = (audio_in_stream && audio_in_stream->start_time != AV_NOPTS_VALUE)
-                        ? audio_in_stream->start_time : 0;
-
-    // Bitrate calculation: subtract audio and a safety margin so the encoder's CBR
-    // overshoot and container overhead never push the file over the target size.
-    // 5% overhead absorbs: ~1-2% MP4 container (moov/stbl index tables) + 3-4%
-    // NVENC CBR overshoot, which is content-dependent and causes occasional oversize.
-    {
-        int64_t total_bits    = (int64_t)(target_size_mb * 8.0 * 1024.0 * 1024.0);
-        int64_t audio_bitrate = audio_in_stream ? 192000 : 0; // always encode stereo AAC @ 192 kbps
-        int64_t audio_bits  = (int64_t)(audio_bitrate * segment_duration);
-        int64_t overhead    = (int64_t)(total_bits * 0.05); // 5% covers container + encoder overshoot
-        int64_t video_bits  = total_bits - audio_bits - overhead;
-        if (video_bits <= 0) video_bits = total_bits / 2;  // audio alone exceeds budget; give video 50%
-        target_bitrate = (int64_t)(video_bits / segment_duration);
-    }
-    if (target_bitrate <= 0) { OutputDebugStringA("Invalid target bitrate calculated.\n"); goto cleanup; }
-
-    video_decoder = find_best_decoder(video_in_stream->codecpar->codec_id, using_hw);
-    if (!video_decoder) { OutputDebugStringA("Video decoder not found.\n"); goto cleanup; }
-    dec_ctx = avcodec_alloc_context3(video_decoder);
-    if (!dec_ctx) { OutputDebugStringA("Failed to allocate video decoder context.\n"); goto cleanup; }
-    if (avcodec_parameters_to_context(dec_ctx, video_in_stream->codecpar) < 0) { OutputDebugStringA("Failed to copy video params to decoder.\n"); goto cleanup; }
-    if (using_hw) {
-        dec_ctx->hw_device_ctx = av_buffer_ref(g_hwDeviceCtx);
-        dec_ctx->get_format    = get_hw_format;
-    }
-    if (avcodec_open2(dec_ctx, video_decoder, nullptr) < 0) { OutputDebugStringA("Failed to open video decoder.\n"); goto cleanup; }
-
-    // Apply mpeg4_unpack_bframes BSF for packed-B-frame Xvid/DivX AVIs.
-    if (video_in_stream->codecpar->codec_id == AV_CODEC_ID_MPEG4) {
-        const AVBitStreamFilter* tbsf = av_bsf_get_by_name("mpeg4_unpack_bframes");
-        if (tbsf && av_bsf_alloc(tbsf, &trans_bsf_ctx) >= 0) {
-            avcodec_parameters_copy(trans_bsf_ctx->par_in, video_in_stream->codecpar);
-            trans_bsf_ctx->time_base_in = video_in_stream->time_base;
-            if (av_bsf_init(trans_bsf_ctx) < 0) {
-                av_bsf_free(&trans_bsf_ctx); trans_bsf_ctx = nullptr;
-            }
-        }
-    }
-    trans_bsf_pkt = trans_bsf_ctx ? av_packet_alloc() : nullptr;
-
-    avformat_alloc_output_context2(&out_fmt_ctx, nullptr, nullptr, out_filename);
-    if (!out_fmt_ctx) { OutputDebugStringA("Could not create output format context.\n"); goto cleanup; }
-
-    video_encoder = avcodec_find_encoder_by_name("h264_nvenc");
-    if (!video_encoder) { video_encoder = avcodec_find_encoder(AV_CODEC_ID_H264); if (!video_encoder) { OutputDebugStringA("H.264 encoder not found.\n"); goto cleanup; } }
-
-    video_out_stream = avformat_new_stream(out_fmt_ctx, video_encoder);
-    if (!video_out_stream) { OutputDebugStringA("Could not create video output stream.\n"); goto cleanup; }
-    enc_ctx = avcodec_alloc_context3(video_encoder);
-    if (!enc_ctx) { OutputDebugStringA("Failed to allocate video encoder context.\n"); goto cleanup; }
-    enc_ctx->height = orig_h / scale_factor;
-    enc_ctx->width = orig_w / scale_factor;
-    enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
-    // Use YUV420P for both h264_nvenc and libx264.  h264_nvenc accepts YUV420P
-    // and converts to NV12 internally; this avoids semi-planar UV confusion when
-    // the decoded frame (NV12 from NVDEC) is scaled or filtered.
-    enc_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
-    if (strcmp(video_encoder->name, "h264_nvenc") == 0) {
-        av_opt_set(enc_ctx->priv_data, "preset", "p4",  0);
-        // vbr + explicit maxrate enforces the ceiling more accurately than cbr
-        // across all NVENC driver versions; cbr can overshoot by 3-8% on
-        // complex content because the driver-side rate controller isn't HRD-exact.
-        av_opt_set(enc_ctx->priv_data, "rc", "vbr", 0);
-        // h264_nvenc ignores enc_ctx->max_b_frames; force B-frames off via its own option.
-        // Without this the encoder adds a ~3-frame DTS offset that shifts the output
-        // video start by ~0.1 s relative to the input, causing AV/timestamp drift.
-        av_opt_set(enc_ctx->priv_data, "bf", "0", 0);
-    } else {
-        av_opt_set(enc_ctx->priv_data, "preset",  "medium", 0);
-        av_opt_set(enc_ctx->priv_data, "nal-hrd", "cbr",    0);
-    }
-    // Propagate input colour-space metadata so players decode with the right matrix/range.
-    if (!convert_hdr_to_sdr) {
-        enc_ctx->color_range     = video_in_stream->codecpar->color_range;
-        enc_ctx->color_primaries = video_in_stream->codecpar->color_primaries;
-        enc_ctx->color_trc       = video_in_stream->codecpar->color_trc;
-        enc_ctx->colorspace      = video_in_stream->codecpar->color_space;
+// After the "Add Range" list changes: its summary, the buttons that depend
+// on it and the timeline's range bands.
+void RangeListChanged() {
+    double total = 0.0;
+    for (const TranscodeRange& r : g_ranges) total += r.end_seconds - r.start_seconds;
+    wchar_t buf[96];
+    if (g_ranges.empty())
+        StringCchCopyW(buf, 96, L"No ranges added");
+    else
+        StringCchPrintfW(buf, 96, L"%d range%s, %d:%02d in all", (int)g_ranges.size(),
+                         g_ranges.size() == 1 ? L"" : L"s", (int)total / 60, (int)total % 60);
+    SetWindowTextW(g_hRangeListStatic, buf);
+    EnableWindow(g_hRangeAddBtn,     g_duration > 0.0);
+    EnableWindow(g_hRangeListStatic, g_duration > 0.0);
+    EnableWindow(g_hRangeClearBtn,   !g_ranges.empty());
+    EnableWindow(g_hRangeSplitCheck, g_ranges.size() > 1);
+    InvalidateRect(g_hTimeline, nullptr, FALSE);
+}
+
+// ------------------------------ Filmstrip Thumbnail Extraction ------------------------------
+// The 21 slots are split across a small pool of decoders, each with its own
+// format/codec context, working on disjoint slots (w, w + nWorkers, ...).
+// In fast mode each decoder runs with skip_frame = AVDISCARD_NONKEY (plus lowres
+// when the codec supports it), so a slot costs a single keyframe decode instead of
+// decoding forward through a long GOP to the exact timestamp.  When the refinement
+// pass is enabled, each worker then re-decodes its coarse slots at the exact time
+// and swaps the bitmap in under g_csThumbs.
+
+struct ThumbDecoder {
+    MediaReader*     reader   = nullptr;  // leased from g_session; fmt_ctx/dec_ctx/videoIdx alias it
+    AVFormatContext* fmt_ctx  = nullptr;
+    AVCodecContext*  dec_ctx  = nullptr;
+    BgrConverter     conv;                // cached across frames and lowres changes
+    AVPacket*        pkt      = nullptr;
+    AVFrame*         frame    = nullptr;
+    uint8_t*         bgr      = nullptr;  // dstW x dstH BGR24, stride bgrStride
+    int              bgrStride = 0;
+    int              videoIdx = -1;
+    int              dstW = 0, dstH = kThumbH;
+    int              lowres   = 0;
+    double           lastSecs = -1.0;     // time of the last exact decode; -1 = must seek
+    volatile bool*   stop     = &g_thumbThreadStop;
+};
+
+// Swaps td's reader for one decoding at the given lowres factor (clamped to
+// what the codec supports).  lowres is fixed once a decoder is open, so a
+// change means handing the reader back and leasing a different one.
+static bool LeaseThumbReader(ThumbDecoder& td, MediaSession* session, int lowres) {
+    if (td.reader) { MediaSessionReturn(td.reader); td.reader = nullptr; }
+    td.reader   = MediaSessionLease(session, READER_THUMB, lowres);
+    td.lastSecs = -1.0;
+    if (!td.reader) return false;
+    td.fmt_ctx  = td.reader->fmt_ctx;
+    td.dec_ctx  = td.reader->dec_ctx;
+    td.videoIdx = td.reader->videoIdx;
+    td.lowres   = td.reader->lowres;
+    return true;
+}
+
+static void CloseThumbDecoder(ThumbDecoder& td) {
+    BgrConverterFree(td.conv);
+    if (td.frame)   av_frame_free(&td.frame);
+    if (td.pkt)     av_packet_free(&td.pkt);
+    if (td.bgr)     { av_free(td.bgr); td.bgr = nullptr; }
+    if (td.reader)  { MediaSessionReturn(td.reader); td.reader = nullptr; }
+    td.fmt_ctx = nullptr; td.dec_ctx = nullptr;
+}
+
+// Width of an h-row thumbnail, following the full-resolution aspect.
+static int ThumbWidthFor(int srcW, int srcH, int h) {
+    int w = (srcH > 0) ? (int)((double)srcW / srcH * h) : 160;
+    return (w < 1) ? 1 : w;
+}
+
+// Leases a thumbnail reader from the session.  In fast mode the largest lowres
+// factor that still decodes at least twice the thumbnail height is requested;
+// most long-GOP codecs (H.264/HEVC) report max_lowres = 0.
+static bool OpenThumbDecoder(ThumbDecoder& td, MediaSession* session, bool fast) {
+    if (!session) return false;
+    int lowres = 0;
+    if (fast)
+        while (lowres < 3 && (session->srcH >> (lowres + 1)) >= td.dstH * 2) lowres++;
+    if (!LeaseThumbReader(td, session, lowres)) return false;
+
+    // Thumbnail size follows the full-resolution aspect, independent of lowres.
+    const AVCodecParameters* par = td.fmt_ctx->streams[td.videoIdx]->codecpar;
+    td.dstW = ThumbWidthFor(par->width, par->height, td.dstH);
+    td.bgrStride = td.dstW * 3;
+    td.bgr   = (uint8_t*)av_malloc((size_t)td.bgrStride * td.dstH);
+    td.frame = av_frame_alloc();
+    td.pkt   = av_packet_alloc();
+    return td.bgr && td.frame && td.pkt;
+}
+
+// Scales td.frame into td.bgr.  PQ/HLG sources go through the same
+// RGB48 → EOTF → BT.2020→709 → Reinhard → sRGB path as the preview.
+// Source dimensions come from the frame so lowres output is handled.
+static bool ConvertThumbFrame(ThumbDecoder& td) {
+    return FrameToBgr(td.conv, td.frame, HdrTrcOf(td.frame, g_isHdr, g_hdrTrc),
+                      td.dstW, td.dstH, td.bgr, td.bgrStride);
+}
+
+// Seeks to t and decodes one frame into td.bgr.  keyOnly returns the keyframe at
+// or before t (non-key packets are not even sent); otherwise decoding runs forward
+// to the first frame at or after t.  *outSecs receives the chosen frame's time.
+// Exact decodes a few seconds past the previous one skip the seek and keep
+// decoding forward, which is what sequential atlas tiles hit.
+static bool DecodeThumbAt(ThumbDecoder& td, double t, bool keyOnly, double* outSecs) {
+    AVStream* vs    = td.fmt_ctx->streams[td.videoIdx];
+    double    tbase = av_q2d(vs->time_base);
+    bool      gotFrame = false;
+    bool      eof      = false;
+
+    bool contiguous = !keyOnly && td.lastSecs >= 0.0 &&
+                      t > td.lastSecs && t - td.lastSecs < 4.0;
+    td.lastSecs = -1.0;
+    td.dec_ctx->skip_frame = keyOnly ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+    if (!contiguous) {
+        av_seek_frame(td.fmt_ctx, -1, (int64_t)(t * AV_TIME_BASE), AVSEEK_FLAG_BACKWARD);
+        avcodec_flush_buffers(td.dec_ctx);
     }
-    {
-        // Prefer codec framerate, fall back to stream's avg_frame_rate, then 30 fps
-        AVRational fps = dec_ctx->framerate;
-        if (fps.num <= 0 || fps.den <= 0) fps = video_in_stream->avg_frame_rate;
-        if (fps.num <= 0 || fps.den <= 0) fps = { 30, 1 };
-        enc_ctx->time_base    = av_inv_q(fps);
-        enc_ctx->max_b_frames = 0;  // no B-frames → DTS always == PTS → clean seeking
-        enc_ctx->gop_size     = max(1, (int)(av_q2d(fps) * 2.0)); // keyframe every ~2 s
-    }
-    enc_ctx->bit_rate       = target_bitrate;
-    enc_ctx->rc_max_rate    = target_bitrate;
-    enc_ctx->rc_buffer_size = target_bitrate * 2; // 2-second VBV window for smoother rate control
-    if (out_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-    if (avcodec_open2(enc_ctx, video_encoder, nullptr) < 0) { OutputDebugStringA("Could not open video encoder.\n"); goto cleanup; }
-    if (avcodec_parameters_from_context(video_out_stream->codecpar, enc_ctx) < 0) { OutputDebugStringA("Failed to copy encoder params to output.\n"); goto cleanup; }
-    video_out_stream->time_base = enc_ctx->time_base;
-
-    if (audio_in_stream) {
-        audio_out_stream = avformat_new_stream(out_fmt_ctx, nullptr);
-        bool audioOk = false;
-        if (audio_out_stream) {
-            const AVCodec* aDec = avcodec_find_decoder(audio_in_stream->codecpar->codec_id);
-            aDec_ctx = aDec ? avcodec_alloc_context3(aDec) : nullptr;
-            if (aDec_ctx && avcodec_parameters_to_context(aDec_ctx, audio_in_stream->codecpar) >= 0
-                         && avcodec_open2(aDec_ctx, aDec, nullptr) >= 0) {
-                const AVCodec* aEnc = avcodec_find_encoder(AV_CODEC_ID_AAC);
-                aEnc_ctx = aEnc ? avcodec_alloc_context3(aEnc) : nullptr;
-                if (aEnc_ctx) {
-                    int outRate = aDec_ctx->sample_rate > 48000 ? 48000 : aDec_ctx->sample_rate;
-                    aEnc_ctx->sample_fmt  = AV_SAMPLE_FMT_FLTP;
-                    aEnc_ctx->sample_rate = outRate;
-                    aEnc_ctx->bit_rate    = 192000;
-                    aEnc_ctx->time_base   = { 1, outRate };
-                    AVChannelLayout stereoLayout = AV_CHANNEL_LAYOUT_STEREO;
-                    av_channel_layout_copy(&aEnc_ctx->ch_layout, &stereoLayout);
-                    if (out_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) aEnc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-                    if (avcodec_open2(aEnc_ctx, aEnc, nullptr) >= 0
-                     && avcodec_parameters_from_context(audio_out_stream->codecpar, aEnc_ctx) >= 0) {
-                        audio_out_stream->time_base = aEnc_ctx->time_base;
-                        aSwrCtx = swr_alloc();
-                        if (aSwrCtx) {
-                            av_opt_set_chlayout  (aSwrCtx, "in_chlayout",    &aDec_ctx->ch_layout, 0);
-                            av_opt_set_int       (aSwrCtx, "in_sample_rate",  aDec_ctx->sample_rate, 0);
-                            av_opt_set_sample_fmt(aSwrCtx, "in_sample_fmt",   aDec_ctx->sample_fmt,  0);
-                            av_opt_set_chlayout  (aSwrCtx, "out_chlayout",   &stereoLayout,         0);
-                            av_opt_set_int       (aSwrCtx, "out_sample_rate", outRate,               0);
-                            av_opt_set_sample_fmt(aSwrCtx, "out_sample_fmt",  AV_SAMPLE_FMT_FLTP,   0);
-                            if (swr_init(aSwrCtx) >= 0) {
-                                aFrame    = av_frame_alloc();
-                                aEncFrame = av_frame_alloc();
-                                aEncPkt   = av_packet_alloc();
-                                if (aEncFrame) {
-                                    aEncFrame->nb_samples  = aEnc_ctx->frame_size;
-                                    aEncFrame->format      = AV_SAMPLE_FMT_FLTP;
-                                    aEncFrame->sample_rate = outRate;
-                                    av_channel_layout_copy(&aEncFrame->ch_layout, &aEnc_ctx->ch_layout);
-                                    av_frame_get_buffer(aEncFrame, 0);
-                                }
-                                audioOk = aFrame && aEncFrame && aEncPkt;
-                            }
-                        }
-                    }
-                }
+
+    while (!*td.stop && !gotFrame) {
+        // Pull whatever the decoder already holds before feeding it more; on the
+        // contiguous path it may still have output left from the previous call.
+        while (!gotFrame && avcodec_receive_frame(td.dec_ctx, td.frame) == 0) {
+            int64_t pts = td.frame->best_effort_timestamp;
+            if (pts == AV_NOPTS_VALUE) pts = td.frame->pts;
+            double fSecs = (pts != AV_NOPTS_VALUE) ? (double)pts * tbase : t;
+            if (keyOnly || fSecs + 0.001 >= t) {
+                gotFrame = ConvertThumbFrame(td);
+                if (outSecs) *outSecs = fSecs;
+                if (gotFrame && !keyOnly && !eof) td.lastSecs = fSecs;
             }
+            av_frame_unref(td.frame);
         }
-        if (!audioOk) {
-            OutputDebugStringA("Audio encode setup failed; output will have no audio.\n");
-            if (aSwrCtx)   { swr_free(&aSwrCtx);              aSwrCtx   = nullptr; }
-            if (aDec_ctx)  { avcodec_free_context(&aDec_ctx); aDec_ctx  = nullptr; }
-            if (aEnc_ctx)  { avcodec_free_context(&aEnc_ctx); aEnc_ctx  = nullptr; }
-            if (aFrame)    { av_frame_free(&aFrame);           aFrame    = nullptr; }
-            if (aEncFrame) { av_frame_free(&aEncFrame);        aEncFrame = nullptr; }
-            if (aEncPkt)   { av_packet_free(&aEncPkt);         aEncPkt   = nullptr; }
-            audio_in_stream  = nullptr;
-            audio_out_stream = nullptr;
+        if (gotFrame || eof) break;
+
+        if (av_read_frame(td.fmt_ctx, td.pkt) < 0) {
+            // Drain so reorder-delayed frames near the end still come out.
+            avcodec_send_packet(td.dec_ctx, nullptr);
+            eof = true;
+            continue;
         }
+        if (td.pkt->stream_index == td.videoIdx &&
+            (!keyOnly || (td.pkt->flags & AV_PKT_FLAG_KEY)))
+            avcodec_send_packet(td.dec_ctx, td.pkt);
+        av_packet_unref(td.pkt);
     }
+    return gotFrame && !*td.stop;
+}
+
+// Timeline scrubbing reuses the keyframe path above on its own thumbnail-profile
+// reader: software decode, keyframes only, no loop filter and lowres where the
+// codec allows it, scaled straight to the preview size.  The playback reader is
+// left where it was, and the exact frame is decoded there once the cursor rests.
+
+static void ScrubDecoderFree(ThumbDecoder*& td) {
+    if (!td) return;
+    CloseThumbDecoder(*td);
+    delete td;
+    td = nullptr;
+}
 
-    if (!(out_fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
-        if (avio_open(&out_fmt_ctx->pb, out_filename, AVIO_FLAG_WRITE) < 0) { OutputDebugStringA("Could not open output file.\n"); goto cleanup; }
+// Decodes the keyframe at or before t (seconds, container time) into dst at w x h.
+// The decoder is created on first use and recreated when the preview size changes.
+static bool ScrubKeyframe(ThumbDecoder*& td, MediaSession* session, int w, int h, double t,
+                          uint8_t* dst, int dstStride, double* outSecs) {
+    if (!session) return false;
+    if (td && (td->dstW != w || td->dstH != h)) ScrubDecoderFree(td);
+    if (!td) {
+        td = new ThumbDecoder();
+        td->stop      = &g_playThreadShouldExit;
+        td->dstW      = w;
+        td->dstH      = h;
+        td->bgrStride = w * 3;
+        td->bgr   = (uint8_t*)av_malloc((size_t)td->bgrStride * h);
+        td->frame = av_frame_alloc();
+        td->pkt   = av_packet_alloc();
+        // Smallest decode that still covers the preview height.
+        int lowres = 0;
+        while (lowres < 3 && (session->srcH >> (lowres + 1)) >= h) lowres++;
+        if (!td->bgr || !td->frame || !td->pkt || !LeaseThumbReader(*td, session, lowres)) {
+            ScrubDecoderFree(td);
+            return false;
+        }
+        td->dec_ctx->skip_loop_filter = AVDISCARD_ALL;
     }
-    {
-        AVDictionary* mux_opts = nullptr;
-        av_dict_set(&mux_opts, "movflags", "faststart", 0); // moov atom at front → instant seeking
-        int wh = avformat_write_header(out_fmt_ctx, &mux_opts);
-        av_dict_free(&mux_opts);
-        if (wh < 0) { OutputDebugStringA("Error writing header to output.\n"); goto cleanup; }
+    if (!DecodeThumbAt(*td, t, true, outSecs)) return false;
+    for (int y = 0; y < h; y++)
+        memcpy(dst + (size_t)y * dstStride, td->bgr + (size_t)y * td->bgrStride, (size_t)w * 3);
+    return true;
+}
+
+static HBITMAP MakeThumbBitmap(const uint8_t* bgr, int stride, int w, int h) {
+    BITMAPINFO bmi = {};
+    bmi.bmiHeader.biSize        = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth       = w;
+    bmi.bmiHeader.biHeight      = -h;
+    bmi.bmiHeader.biPlanes      = 1;
+    bmi.bmiHeader.biBitCount    = 24;
+    bmi.bmiHeader.biCompression = BI_RGB;
+    void* dibBits = nullptr;
+    HDC hdc = GetDC(nullptr);
+    HBITMAP bmp = CreateDIBSection(hdc, &bmi, DIB_RGB_COLORS, &dibBits, nullptr, 0);
+    ReleaseDC(nullptr, hdc);
+    if (!bmp || !dibBits) {
+        if (bmp) DeleteObject(bmp);
+        return nullptr;
     }
+    int rowBytes  = w * 3;
+    int dibStride = (rowBytes + 3) & ~3;  // DWORD-align
+    for (int y = 0; y < h; y++)
+        memcpy((uint8_t*)dibBits + y * dibStride, bgr + y * stride, rowBytes);
+    return bmp;
+}
 
-    {
-        AVRational video_tb = video_in_stream->time_base;
-        // Convert start_seconds to stream PTS, accounting for the stream's own start_time
-        // offset so that seeking and rel-PTS rebasing both work correctly for AVI/Xvid.
-        int64_t start_av = (int64_t)llround(start_seconds * AV_TIME_BASE);
-        video_start_pts = av_rescale_q(start_av, AV_TIME_BASE_Q, video_tb) + vid_stream_start;
+// Installs bmp into slot i, deleting whatever coarse thumbnail it replaces.
+static void StoreThumb(int i, HBITMAP bmp) {
+    EnterCriticalSection(&g_csThumbs);
+    HBITMAP old = g_thumbs[i];
+    g_thumbs[i] = bmp;
+    LeaveCriticalSection(&g_csThumbs);
+    if (old) DeleteObject(old);
+    PostMessage(g_mainHwnd, WM_APP_THUMBS_READY, 0, 0);
+}
 
-        // Seek the demuxer to (or just before) the requested start on the video stream.
-        if (av_seek_frame(in_fmt_ctx, videoStreamIndex, video_start_pts, AVSEEK_FLAG_BACKWARD) < 0) {
-            OutputDebugStringA("Warning: could not seek exactly to start time (video).\n");
-        }
+static void ThumbWorker(MediaSession* session, int first, int step) {
+    const int N = 21;
+    const bool fast = g_thumbFastMode;
+    ThumbDecoder td;
+    bool   coarse[N] = {};
+    bool   anyCoarse = false;
+
+    if (!OpenThumbDecoder(td, session, fast)) { CloseThumbDecoder(td); return; }
+
+    // A keyframe within half a frame of the slot time is already exact.
+    const double tol = 0.5 / (g_videoFPS > 0.0 ? g_videoFPS : 30.0);
+    for (int i = first; i < N && !g_thumbThreadStop; i += step) {
+        double t = g_thumbTimes[i], got = t;
+        if (!DecodeThumbAt(td, t, fast, &got)) continue;
+        HBITMAP bmp = MakeThumbBitmap(td.bgr, td.bgrStride, td.dstW, td.dstH);
+        if (!bmp) continue;
+        StoreThumb(i, bmp);
+        coarse[i] = fast && (td.lowres > 0 || got + tol < t);
+        anyCoarse |= coarse[i];
+    }
 
-        // Prepare audio timeline anchor too (if present).
-        if (audio_in_stream) {
-            AVRational audio_tb = audio_in_stream->time_base;
-            audio_start_pts = av_rescale_q(start_av, AV_TIME_BASE_Q, audio_tb) + aud_stream_start;
+    if (g_thumbRefine && anyCoarse && !g_thumbThreadStop &&
+        (td.lowres == 0 || LeaseThumbReader(td, session, 0))) {
+        for (int i = first; i < N && !g_thumbThreadStop; i += step) {
+            if (!coarse[i]) continue;
+            if (!DecodeThumbAt(td, g_thumbTimes[i], false, nullptr)) continue;
+            HBITMAP bmp = MakeThumbBitmap(td.bgr, td.bgrStride, td.dstW, td.dstH);
+            if (bmp) StoreThumb(i, bmp);
         }
     }
-    avcodec_flush_buffers(dec_ctx);
+    CloseThumbDecoder(td);
+}
 
+static unsigned __stdcall ThumbExtractThreadProc(void* param) {
+    MediaSession* session = (MediaSession*)param;
+    const int N = 21;
+    // Use the left edge of each slot so the thumbnail shows the first frame
+    // of that section — more intuitive than the centre when browsing.
+    for (int i = 0; i < N; i++)
+        g_thumbTimes[i] = (double)i / N * g_duration;
+
+    // Each worker holds a full decoder, so keep the pool small; disk seeks
+    // and decoder memory stop paying off beyond a handful.
+    int nWorkers = max(1, min(4, (int)std::thread::hardware_concurrency()));
+    std::vector<std::thread> workers;
+    workers.reserve(nWorkers);
+    for (int w = 0; w < nWorkers; w++)
+        workers.emplace_back(ThumbWorker, session, w, nWorkers);
+    for (auto& th : workers) th.join();
+    return 0;
+}
 
-    frame = av_frame_alloc();
-    filt_frame = av_frame_alloc();
-    pkt = av_packet_alloc();
-    enc_pkt = av_packet_alloc();
-    if (!frame || !filt_frame || !pkt || !enc_pkt) { OutputDebugStringA("Could not allocate frame/packet.\n"); goto cleanup; }
-    // sws_ctx is created lazily on the first decoded frame because with NVDEC the
-    // pixel format (dec_ctx->pix_fmt) is AV_PIX_FMT_CUDA until hw→cpu transfer reveals it.
-    filt_frame->format = enc_ctx->pix_fmt;
-    filt_frame->width = enc_ctx->width;
-    filt_frame->height = enc_ctx->height;
-    if (av_frame_get_buffer(filt_frame, 32) < 0) { OutputDebugStringA("Could not allocate buffer for scaled frame.\n"); goto cleanup; }
-
-    if (convert_hdr_to_sdr) {
-        // Stage 1 (sws_hdr2rgb) is created lazily on first frame — input pixel format
-        // is not known until after hw→cpu transfer.
-        // Stage 3: BGR24 (BT.709 full-range) → encoder YUV (BT.709 limited-range)
-        sws_rgb2yuv = sws_getContext(enc_ctx->width, enc_ctx->height, AV_PIX_FMT_BGR24,
-            enc_ctx->width, enc_ctx->height, enc_ctx->pix_fmt,
-            SWS_BILINEAR, nullptr, nullptr, nullptr);
-        if (sws_rgb2yuv) {
-            sws_setColorspaceDetails(sws_rgb2yuv,
-                sws_getCoefficients(SWS_CS_ITU709), 1,   // src: BT.709, full range (sRGB 0-255)
-                sws_getCoefficients(SWS_CS_ITU709), 0,   // dst: BT.709, limited range (H.264)
-                0, 1 << 16, 1 << 16);
-        }
-        hdr_rgb48_buf = (uint8_t*)av_malloc((size_t)enc_ctx->height * enc_ctx->width * 6);
-        hdr_bgr24_buf = (uint8_t*)av_malloc((size_t)enc_ctx->height * enc_ctx->width * 3);
-        if (!sws_rgb2yuv || !hdr_rgb48_buf || !hdr_bgr24_buf) {
-            OutputDebugStringA("HDR→SDR pre-setup failed; falling back to direct encode.\n");
-            convert_hdr_to_sdr = false;
-        } else {
-            // Pre-build EOTF + sRGB LUTs so Stage 2 uses table lookups instead of pow().
-            BuildToneMappingLuts(g_hdrTrc == AVCOL_TRC_SMPTE2084);
-            // Tag output as BT.709 so players know it's been tone-mapped
-            video_out_stream->codecpar->color_primaries = AVCOL_PRI_BT709;
-            video_out_stream->codecpar->color_trc       = AVCOL_TRC_BT709;
-            video_out_stream->codecpar->color_space     = AVCOL_SPC_BT709;
-        }
-    }
-
-    // Pre-load bitmap subtitle events (PGS/VOBSUB) using a separate format context.
-    // Text-based subtitles fall through to the libavfilter/libass path below.
-    if (subtitle_stream_index >= 0 &&
-        (unsigned)subtitle_stream_index < in_fmt_ctx->nb_streams) {
-        AVCodecID cid = in_fmt_ctx->streams[subtitle_stream_index]->codecpar->codec_id;
-        bool is_bitmap = (cid == AV_CODEC_ID_HDMV_PGS_SUBTITLE ||
-                          cid == AV_CODEC_ID_DVD_SUBTITLE ||
-                          cid == AV_CODEC_ID_XSUB ||
-                          cid == AV_CODEC_ID_DVB_SUBTITLE);
-        if (is_bitmap) {
-            const AVCodec* sub_codec = avcodec_find_decoder(cid);
-            AVCodecContext* sub_dec = sub_codec ? avcodec_alloc_context3(sub_codec) : nullptr;
-            if (sub_dec) {
-                avcodec_parameters_to_context(sub_dec, in_fmt_ctx->streams[subtitle_stream_index]->codecpar);
-                if (avcodec_open2(sub_dec, sub_codec, nullptr) >= 0) {
-                    // Record the subtitle plane dimensions so we can scale coords correctly.
-                    // 4K Blu-ray PGS subtitles are typically authored at 1920×1080 even
-                    // when the video track is 3840×2160.
-                    pgs_plane_w = sub_dec->width;
-                    pgs_plane_h = sub_dec->height;
-                    AVFormatContext* sub_fmt = nullptr;
-                    if (avformat_open_input(&sub_fmt, in_filename, nullptr, nullptr) >= 0 &&
-                        avformat_find_stream_info(sub_fmt, nullptr) >= 0) {
-                        AVPacket* sub_pkt = av_packet_alloc();
-                        while (sub_pkt && av_read_frame(sub_fmt, sub_pkt) >= 0) {
-                            if (sub_pkt->stream_index == subtitle_stream_index) {
-                                AVSubtitle sub = {};
-                                int got_sub = 0;
-                                avcodec_decode_subtitle2(sub_dec, &sub, &got_sub, sub_pkt);
-                                if (got_sub) {
-                                    // PGS codec sets sub_dec->width/height from the PCS segment
-                                    // during avcodec_decode_subtitle2, not before. Refresh here
-                                    // so the scaling below uses the correct authored plane size
-                                    // (e.g. 1920×1080 for 4K Blu-ray with 1080p PGS track).
-                                    if (sub_dec->width  > 0) pgs_plane_w = sub_dec->width;
-                                    if (sub_dec->height > 0) pgs_plane_h = sub_dec->height;
-
-                                    // AVSubtitle.pts is in microseconds (AV_TIME_BASE)
-                                    int64_t s_ms = (sub.pts != AV_NOPTS_VALUE)
-                                        ? sub.pts / 1000
-                                        : (int64_t)(sub_pkt->pts * av_q2d(in_fmt_ctx->streams[subtitle_stream_index]->time_base) * 1000.0);
-                                    PgsEvent ev;
-                                    ev.pts_ms = s_ms;
-                                    for (unsigned ri = 0; ri < sub.num_rects; ri++) {
-                                        AVSubtitleRect* rect = sub.rects[ri];
-                                        if (rect->type == SUBTITLE_BITMAP && rect->w > 0 && rect->h > 0) {
-                                            // Pre-scale to output resolution and pre-convert
-                                            // palette → [Y, Cb, Cr, A].  Doing this once at load
-                                            // time removes all float coordinate math and per-pixel
-                                            // colour conversion from the per-frame blend loop.
-                                            int srcRefW = (pgs_plane_w > 0) ? pgs_plane_w : dec_ctx->width;
-                                            int srcRefH = (pgs_plane_h > 0) ? pgs_plane_h : dec_ctx->height;
-                                            double psx = (srcRefW > 0) ? (double)enc_ctx->width  / srcRefW : 1.0;
-                                            double psy = (srcRefH > 0) ? (double)enc_ctx->height / srcRefH : 1.0;
-                                            PgsRect pr;
-                                            pr.x = (int)(rect->x * psx);
-                                            pr.y = (int)(rect->y * psy);
-                                            pr.w = max(1, (int)(rect->w * psx + 0.5));
-                                            pr.h = max(1, (int)(rect->h * psy + 0.5));
-                                            pr.yuva.resize((size_t)pr.w * pr.h * 4);
-                                            uint8_t* pal = rect->data[1]; // BGRA palette (256 × 4 bytes)
-                                            for (int dy = 0; dy < pr.h; dy++) {
-                                                int sy_s = min(rect->h - 1, (int)((dy + 0.5) * rect->h / pr.h));
-                                                for (int dx = 0; dx < pr.w; dx++) {
-                                                    int sx_s = min(rect->w - 1, (int)((dx + 0.5) * rect->w / pr.w));
-                                                    uint8_t idx = rect->data[0][sy_s * rect->linesize[0] + sx_s];
-                                                    uint8_t b = pal[idx * 4 + 0];
-                                                    uint8_t g = pal[idx * 4 + 1];
-                                                    uint8_t r = pal[idx * 4 + 2];
-                                                    uint8_t a = pal[idx * 4 + 3];
-                                                    uint8_t* dst = pr.yuva.data() + ((size_t)dy * pr.w + dx) * 4;
-                                                    dst[0] = (uint8_t)max(16, min(235, (( 66*r + 129*g +  25*b + 128) >> 8) + 16));
-                                                    dst[1] = (uint8_t)max(16, min(240, ((-38*r -  74*g + 112*b + 128) >> 8) + 128));
-                                                    dst[2] = (uint8_t)max(16, min(240, ((112*r -  94*g -  18*b + 128) >> 8) + 128));
-                                                    dst[3] = a;
-                                                }
-                                            }
-                                            ev.rects.push_back(std::move(pr));
-                                        }
-                                    }
-                                    pgs_events.push_back(std::move(ev));
-                                    avsubtitle_free(&sub);
-                                }
-                            }
-                            av_packet_unref(sub_pkt);
-                        }
-                        av_packet_free(&sub_pkt);
-                        avformat_close_input(&sub_fmt);
-                        std::sort(pgs_events.begin(), pgs_events.end(),
-                            [](const PgsEvent& a, const PgsEvent& b){ return a.pts_ms < b.pts_ms; });
-                        use_bitmap_subs = !pgs_events.empty();
-                    }
-                }
-                avcodec_free_context(&sub_dec);
-            }
-        }
+// Every worker checks g_thumbThreadStop per packet, so the join is short.  It
+// has to be complete before g_thumbs[] is freed or the flag is cleared for the
+// next file, or a straggler stores the old file's frames into the new strip.
+static void ThumbStop() {
+    g_thumbThreadStop = true;
+    if (g_thumbThread) {
+        WaitForSingleObject(g_thumbThread, INFINITE);
+        CloseHandle(g_thumbThread);
+        g_thumbThread = nullptr;
     }
+}
+
+// ------------------------------ Thumbnail Atlas ------------------------------
+// A three-level pyramid of small BGR24 tiles (one every 60 s, 10 s and 2 s) used
+// by the zoomed timeline and the hover preview.  Tile k of a level sits at
+// k * step seconds, so the time→tile index is a division.  Tile storage is
+// allocated in chunks of kAtlasChunk tiles on first write, keeping the 2 s level
+// cheap for long files where only the zoomed windows ever get filled.
+//
+// A single low-priority generator thread fills tiles in this order: the focus
+// level within the focus window (nearest the hint time first), then the whole
+// 60 s and 10 s levels.  The UI moves the focus via AtlasSetFocus whenever the
+// view or hover position changes.  The coarse levels use keyframe-only decodes;
+// the 2 s level decodes exactly so neighbouring tiles are not the same keyframe.
+
+static const int    kAtlasLevels = 3;
+static const double kAtlasStep[kAtlasLevels] = { 60.0, 10.0, 2.0 };
+static const int    kAtlasChunk  = 64;
+static const int    kAtlasTileH  = 54;
+
+struct AtlasLevel {
+    int       count  = 0;        // tiles covering [0, duration]
+    uint8_t** chunks = nullptr;  // (count + kAtlasChunk - 1) / kAtlasChunk lazily allocated blocks
+    uint8_t*  ready  = nullptr;  // per tile: 1 once its pixels are complete
+};
+
+static AtlasLevel g_atlas[kAtlasLevels];
+static int      g_atlasTileW = 0, g_atlasTileStride = 0;   // set once the generator has opened the file
+static int      g_atlasFocusLevel = 1;
+static double   g_atlasFocusT0 = 0.0, g_atlasFocusT1 = 0.0;
+static double   g_atlasFocusHint = -1.0;                   // preferred time within the window; -1 = none
 
-    // External subtitle file (.srt/.ass/.ssa alongside the video).
-    // libass silently fails to open files whose paths contain special characters
-    // (spaces, !!, non-ASCII).  Fix: copy the file into a temp path with a plain
-    // ASCII name before passing it to the filter.  This preserves all styling
-    // (ASS overrides, fonts, etc.) because libass reads the actual file content.
-    if (ext_subtitle_path && ext_subtitle_path[0] && !use_bitmap_subs) {
-        {
-            char tmp_dir[MAX_PATH] = {}, tmp_base[MAX_PATH] = {};
-            GetTempPathA(MAX_PATH, tmp_dir);
-            if (GetTempFileNameA(tmp_dir, "sub", 0, tmp_base)) {
-                DeleteFileA(tmp_base); // GetTempFileName creates a placeholder; replace it
-                const char* orig_dot = strrchr(ext_subtitle_path, '.');
-                snprintf(ext_sub_tmp, MAX_PATH, "%s%s", tmp_base, orig_dot ? orig_dot : ".srt");
-                FILE* fi = nullptr; FILE* fo = nullptr;
-                fopen_s(&fi, ext_subtitle_path, "rb");
-                fopen_s(&fo, ext_sub_tmp,        "wb");
-                if (fi && fo) {
-                    char chunk[65536]; size_t n;
-                    while ((n = fread(chunk, 1, sizeof(chunk), fi)) > 0) fwrite(chunk, 1, n, fo);
-                }
-                if (fo) fclose(fo);
-                if (fi) fclose(fi);
-            }
-        }
-        // Use the temp copy if it was created, otherwise fall back to the original path.
-        const char* sub_path_for_filter = ext_sub_tmp[0] ? ext_sub_tmp : ext_subtitle_path;
-        // Store for the lazy format-mismatch reinit in the encode loop.
-        StringCchCopyA(ext_sub_filter_path, MAX_PATH, sub_path_for_filter);
-
-        const AVFilter* buffersrc  = avfilter_get_by_name("buffer");
-        const AVFilter* buffersink = avfilter_get_by_name("buffersink");
-        if (buffersrc && buffersink) {
-            filter_graph = avfilter_graph_alloc();
-            if (filter_graph) {
-                char src_args[256];
-                AVRational tb  = video_in_stream->time_base;
-                AVRational sar = dec_ctx->sample_aspect_ratio;
-                // The buffersrc is configured for YUV420P.  Frames that arrive in a
-                // different format (e.g. NV12 from NVDEC) are converted to YUV420P
-                // explicitly in the encode loop before being pushed to the filter.
-                AVPixelFormat filter_fmt;
-                if (using_hw && dec_ctx->hw_frames_ctx)
-                    filter_fmt = ((AVHWFramesContext*)dec_ctx->hw_frames_ctx->data)->sw_format;
-                else
-                    filter_fmt = AV_PIX_FMT_YUV420P;
-                snprintf(src_args, sizeof(src_args),
-                    "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-                    dec_ctx->width, dec_ctx->height, (int)filter_fmt,
-                    tb.num, tb.den, sar.num ? sar.num : 1, sar.den ? sar.den : 1);
-                int ret = avfilter_graph_create_filter(&buffersrc_ctx,  buffersrc,  "in",  src_args, nullptr, filter_graph);
-                if (ret >= 0)
-                    ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out", nullptr,  nullptr, filter_graph);
-                if (ret >= 0) {
-                    // Build the subtitle filter directly (no avfilter_graph_parse_ptr).
-                    // avfilter_graph_parse_ptr consistently returns EINVAL when the path
-                    // contains colons (drive letters) even inside single quotes.
-                    // Using av_opt_set bypasses all string-escaping issues entirely.
-                    char windir[MAX_PATH] = {};
-                    GetWindowsDirectoryA(windir, MAX_PATH);
-                    char fontspath_raw[MAX_PATH + 8];
-                    snprintf(fontspath_raw, sizeof(fontspath_raw), "%s\\Fonts", windir);
-
-                    const AVFilter* sub_filt = avfilter_get_by_name("subtitles");
-                    // avfilter_graph_create_filter calls init() immediately (before we can
-                    // set options), so filename is null and init rejects it.
-                    // Use alloc_filter + av_opt_set + avfilter_init_str instead:
-                    // alloc_filter creates the context without calling init().
-                    AVFilterContext* sub_ctx = sub_filt
-                        ? avfilter_graph_alloc_filter(filter_graph, sub_filt, "sub")
-                        : nullptr;
-                    if (sub_ctx) {
-                        av_opt_set(sub_ctx->priv, "filename", sub_path_for_filter, 0);
-                        av_opt_set(sub_ctx->priv, "fontsdir", fontspath_raw, 0);
-                        int init_ret = avfilter_init_str(sub_ctx, nullptr);
-                        if (init_ret >= 0 &&
-                            avfilter_link(buffersrc_ctx, 0, sub_ctx, 0) == 0 &&
-                            avfilter_link(sub_ctx, 0, buffersink_ctx, 0) == 0) {
-                            ret = avfilter_graph_config(filter_graph, nullptr);
-                        } else { ret = (init_ret < 0) ? init_ret : AVERROR(EINVAL); }
-                    } else { ret = AVERROR(ENOSYS); }
-                    if (ret >= 0) {
-                        use_filter = true;
-                    } else {
-                        // subtitles filter failed (likely no libass) — open the external
-                        // subtitle file with avformat, decode events, and render via GDI.
-                        avfilter_graph_free(&filter_graph); filter_graph = nullptr;
-                        buffersrc_ctx = nullptr; buffersink_ctx = nullptr;
-
-                        AVFormatContext* ext_fmt = nullptr;
-                        if (avformat_open_input(&ext_fmt, ext_subtitle_path, nullptr, nullptr) >= 0 &&
-                            avformat_find_stream_info(ext_fmt, nullptr) >= 0) {
-                            int ext_sub_idx = -1;
-                            for (unsigned si = 0; si < ext_fmt->nb_streams; si++) {
-                                if (ext_fmt->streams[si]->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE) {
-                                    ext_sub_idx = (int)si; break;
-                                }
-                            }
-                            if (ext_sub_idx >= 0) {
-                                AVCodecID ext_cid = ext_fmt->streams[ext_sub_idx]->codecpar->codec_id;
-                                const AVCodec* ext_codec = avcodec_find_decoder(ext_cid);
-                                AVCodecContext* ext_dec = ext_codec ? avcodec_alloc_context3(ext_codec) : nullptr;
-                                if (ext_dec) {
-                                    avcodec_parameters_to_context(ext_dec, ext_fmt->streams[ext_sub_idx]->codecpar);
-                                    if (avcodec_open2(ext_dec, ext_codec, nullptr) >= 0) {
-                                        AVPacket* ext_pkt = av_packet_alloc();
-                                        while (ext_pkt && av_read_frame(ext_fmt, ext_pkt) >= 0) {
-                                            if (ext_pkt->stream_index == ext_sub_idx) {
-                                                AVSubtitle ext_sub2 = {}; int got2 = 0;
-                                                avcodec_decode_subtitle2(ext_dec, &ext_sub2, &got2, ext_pkt);
-                                                if (got2) {
-                                                    double s2_start = (ext_sub2.pts != AV_NOPTS_VALUE)
-                                                        ? ext_sub2.pts * 1e-6
-                                                        : ext_pkt->pts * av_q2d(ext_fmt->streams[ext_sub_idx]->time_base);
-                                                    double s2_end = s2_start + ext_sub2.end_display_time * 1e-3;
-                                                    for (unsigned ri = 0; ri < ext_sub2.num_rects; ri++) {
-                                                        AVSubtitleRect* r2 = ext_sub2.rects[ri];
-                                                        std::string txt2;
-                                                        if (r2->type == SUBTITLE_ASS && r2->ass) {
-                                                            const char* p2 = r2->ass;
-                                                            // FFmpeg ≥6 omits "Dialogue: " prefix from r->ass; the text field is
-// then the 9th field (8 commas) instead of the 10th (9 commas).
-{ int _skip = (p2[0]=='D'&&p2[1]=='i'&&p2[2]=='a') ? 9 : 8;
-  for (int nc = 0; *p2 && nc < _skip; p2++) if (*p2 == ',') nc++; }
-                                                            txt2 = p2;
-                                                        } else if (r2->type == SUBTITLE_TEXT && r2->text) {
-                                                            for (const char* p2 = r2->text; *p2; p2++) {
-                                                                if      (*p2 == '{')  txt2 += "\\{";
-                                                                else if (*p2 == '\n') txt2 += "\\N";
-                                                                else if (*p2 != '\r') txt2 += *p2;
-                                                            }
-                                                        }
-                                                        if (!txt2.empty())
-                                                            text_sub_events.push_back({s2_start, s2_end, std::move(txt2)});
-                                                    }
-                                                    avsubtitle_free(&ext_sub2);
-                                                }
-                                            }
-                                            av_packet_unref(ext_pkt);
-                                        }
-                                        if (ext_pkt) av_packet_free(&ext_pkt);
-                                    }
-                                    avcodec_free_context(&ext_dec);
-                                }
-                            }
-                            avformat_close_input(&ext_fmt);
-                        }
+static int AtlasTileBytes() { return g_atlasTileStride * kAtlasTileH; }
 
-                        // GDI render collected text events into pgs_events.
-                        if (!text_sub_events.empty()) {
-                            int frame_w  = enc_ctx->width;
-                            int frame_h  = enc_ctx->height;
-                            int font_h   = max(14, frame_h / 20);
-                            int margin_v = max(12, frame_h / 18);
-                            int max_tw   = frame_w * 85 / 100;
-                            HDC screen_dc = GetDC(nullptr);
-                            HDC mem_dc    = CreateCompatibleDC(screen_dc);
-                            BITMAPINFO bmi2 = {};
-                            bmi2.bmiHeader.biSize        = sizeof(BITMAPINFOHEADER);
-                            bmi2.bmiHeader.biWidth       = frame_w;
-                            bmi2.bmiHeader.biHeight      = -frame_h;
-                            bmi2.bmiHeader.biPlanes      = 1;
-                            bmi2.bmiHeader.biBitCount    = 32;
-                            bmi2.bmiHeader.biCompression = BI_RGB;
-                            uint32_t* pixels2 = nullptr;
-                            HBITMAP hbm2 = CreateDIBSection(screen_dc, &bmi2, DIB_RGB_COLORS,
-                                                            (void**)&pixels2, nullptr, 0);
-                            ReleaseDC(nullptr, screen_dc);
-                            if (hbm2 && pixels2 && mem_dc) {
-                                HBITMAP old_bm2 = (HBITMAP)SelectObject(mem_dc, hbm2);
-                                HFONT hfont2 = CreateFontA(
-                                    -font_h, 0, 0, 0, FW_BOLD, FALSE, FALSE, FALSE,
-                                    DEFAULT_CHARSET, OUT_TT_PRECIS, CLIP_DEFAULT_PRECIS,
-                                    NONANTIALIASED_QUALITY, DEFAULT_PITCH | FF_SWISS, "Arial");
-                                HFONT old_font2 = (HFONT)SelectObject(mem_dc, hfont2);
-                                SetBkMode(mem_dc, TRANSPARENT);
-                                auto strip_ass2 = [](const std::string& s) -> std::wstring {
-                                    std::string out;
-                                    bool in_tag = false;
-                                    for (size_t i = 0; i < s.size(); i++) {
-                                        if (s[i] == '{') { in_tag = true;  continue; }
-                                        if (s[i] == '}') { in_tag = false; continue; }
-                                        if (in_tag) continue;
-                                        if (s[i] == '\\' && i + 1 < s.size()) {
-                                            char n = s[i + 1];
-                                            if (n == 'N' || n == 'n') { out += '\n'; i++; continue; }
-                                            if (n == 'h')             { out += ' ';  i++; continue; }
-                                        }
-                                        out += s[i];
-                                    }
-                                    while (!out.empty() && (out.back() == '\n' || out.back() == '\r' || out.back() == ' '))
-                                        out.pop_back();
-                                    int wlen = MultiByteToWideChar(CP_UTF8, 0, out.c_str(), -1, nullptr, 0);
-                                    std::wstring w(wlen, 0);
-                                    MultiByteToWideChar(CP_UTF8, 0, out.c_str(), -1, &w[0], wlen);
-                                    if (!w.empty() && w.back() == 0) w.pop_back();
-                                    return w;
-                                };
-                                const uint32_t MAGENTA2 = 0x00FF00FFu;
-                                for (const auto& ev : text_sub_events) {
-                                    std::wstring wtxt = strip_ass2(ev.ass_text);
-                                    if (wtxt.empty()) continue;
-                                    RECT measure2 = {0, 0, (LONG)max_tw, 0};
-                                    DrawTextW(mem_dc, wtxt.c_str(), -1, &measure2,
-                                              DT_CALCRECT | DT_CENTER | DT_WORDBREAK);
-                                    int tw = measure2.right - measure2.left;
-                                    int th = measure2.bottom - measure2.top;
-                                    if (tw <= 0 || th <= 0) continue;
-                                    const int outline2 = 2, pad2 = outline2 + 1;
-                                    int tx = (frame_w - tw) / 2;
-                                    int ty = frame_h - margin_v - th;
-                                    if (tx < pad2) tx = pad2;
-                                    if (ty < pad2) ty = pad2;
-                                    int rx = tx - pad2, ry = ty - pad2;
-                                    int rw = tw + pad2 * 2, rh = th + pad2 * 2;
-                                    if (rx + rw > frame_w) rw = frame_w - rx;
-                                    if (ry + rh > frame_h) rh = frame_h - ry;
-                                    if (rw <= 0 || rh <= 0) continue;
-                                    for (int dy = 0; dy < rh; dy++)
-                                        for (int dx = 0; dx < rw; dx++)
-                                            pixels2[(ry + dy) * frame_w + (rx + dx)] = MAGENTA2;
-                                    RECT draw_rect2 = {(LONG)tx, (LONG)ty, (LONG)(tx+tw), (LONG)(ty+th)};
-                                    SetTextColor(mem_dc, RGB(0, 0, 0));
-                                    for (int oy = -outline2; oy <= outline2; oy++)
-                                        for (int ox = -outline2; ox <= outline2; ox++) {
-                                            if (ox == 0 && oy == 0) continue;
-                                            RECT r2b = {draw_rect2.left+ox, draw_rect2.top+oy,
-                                                        draw_rect2.right+ox, draw_rect2.bottom+oy};
-                                            DrawTextW(mem_dc, wtxt.c_str(), -1, &r2b, DT_CENTER | DT_WORDBREAK);
-                                        }
-                                    SetTextColor(mem_dc, RGB(255, 255, 255));
-                                    DrawTextW(mem_dc, wtxt.c_str(), -1, &draw_rect2, DT_CENTER | DT_WORDBREAK);
-                                    PgsRect pg2;
-                                    pg2.x = rx; pg2.y = ry; pg2.w = rw; pg2.h = rh;
-                                    pg2.yuva.resize((size_t)rw * rh * 4);
-                                    for (int dy = 0; dy < rh; dy++) {
-                                        for (int dx = 0; dx < rw; dx++) {
-                                            uint32_t pv = pixels2[(ry + dy) * frame_w + (rx + dx)];
-                                            uint8_t r = (uint8_t)((pv >> 16) & 0xFF);
-                                            uint8_t g = (uint8_t)((pv >>  8) & 0xFF);
-                                            uint8_t b = (uint8_t)( pv        & 0xFF);
-                                            bool is_bg = (r > 200 && g < 30 && b > 200);
-                                            uint8_t Y, Cb, Cr, A;
-                                            if (is_bg) {
-                                                Y = 16; Cb = 128; Cr = 128; A = 0;
-                                            } else {
-                                                Y  = (uint8_t)(16  + ( 65*r + 129*g +  25*b + 128) / 256);
-                                                Cb = (uint8_t)(128 + (-38*r -  74*g + 112*b + 128) / 256);
-                                                Cr = (uint8_t)(128 + (112*r -  94*g -  18*b + 128) / 256);
-                                                A  = 255;
-                                            }
-                                            size_t idx = ((size_t)dy * rw + dx) * 4;
-                                            pg2.yuva[idx]   = Y;
-                                            pg2.yuva[idx+1] = Cb;
-                                            pg2.yuva[idx+2] = Cr;
-                                            pg2.yuva[idx+3] = A;
-                                        }
-                                    }
-                                    PgsEvent start_ev2;
-                                    start_ev2.pts_ms = (int64_t)(ev.start_s * 1000.0);
-                                    start_ev2.rects.push_back(std::move(pg2));
-                                    pgs_events.push_back(std::move(start_ev2));
-                                    PgsEvent end_ev2;
-                                    end_ev2.pts_ms = (int64_t)(ev.end_s * 1000.0);
-                                    pgs_events.push_back(std::move(end_ev2));
-                                }
-                                SelectObject(mem_dc, old_font2);
-                                DeleteObject(hfont2);
-                                SelectObject(mem_dc, old_bm2);
-                            }
-                            if (hbm2)    DeleteObject(hbm2);
-                            if (mem_dc)  DeleteDC(mem_dc);
-                            std::sort(pgs_events.begin(), pgs_events.end(),
-                                [](const PgsEvent& a, const PgsEvent& b){ return a.pts_ms < b.pts_ms; });
-                            use_bitmap_subs = !pgs_events.empty();
-                        }
-                    }
-                } else {
-                    avfilter_graph_free(&filter_graph); filter_graph = nullptr;
-                }
-            }
+static uint8_t* AtlasTilePtr(const AtlasLevel& lv, int k) {
+    uint8_t* chunk = lv.chunks[k / kAtlasChunk];
+    return chunk ? chunk + (size_t)(k % kAtlasChunk) * AtlasTileBytes() : nullptr;
+}
+
+static void AtlasFree() {
+    for (int l = 0; l < kAtlasLevels; l++) {
+        AtlasLevel& lv = g_atlas[l];
+        if (lv.chunks) {
+            for (int c = 0; c < (lv.count + kAtlasChunk - 1) / kAtlasChunk; c++)
+                free(lv.chunks[c]);
+            free(lv.chunks);
         }
+        free(lv.ready);
+        lv = AtlasLevel();
     }
+    g_atlasTileW = 0; g_atlasTileStride = 0;
+}
 
-    // Set up subtitle burn-in filter graph if a subtitle stream was selected
-    // (text-based subtitles only — bitmap types handled by use_bitmap_subs above)
-    if (subtitle_stream_index >= 0 && !use_bitmap_subs && !use_filter) {
-        const AVFilter* buffersrc  = avfilter_get_by_name("buffer");
-        const AVFilter* buffersink = avfilter_get_by_name("buffersink");
-        if (buffersrc && buffersink) {
-            filter_graph = avfilter_graph_alloc();
-            if (filter_graph) {
-                // Describe the input video stream for the buffer source
-                char src_args[256];
-                AVRational tb  = video_in_stream->time_base;
-                AVRational sar = dec_ctx->sample_aspect_ratio;
-                // With NVDEC, dec_ctx->pix_fmt == AV_PIX_FMT_CUDA.  Use the actual
-                // software transfer format from the hw_frames_ctx (e.g. NV12) so the
-                // buffersrc matches the frames we will actually feed it.  Falling back
-                // to the codecpar format (YUV420P) caused a semi-planar / planar
-                // mismatch that corrupted chroma and produced a green tint.
-                AVPixelFormat filter_fmt;
-                if (using_hw && dec_ctx->hw_frames_ctx) {
-                    filter_fmt = ((AVHWFramesContext*)dec_ctx->hw_frames_ctx->data)->sw_format;
-                } else if (using_hw) {
-                    filter_fmt = (AVPixelFormat)video_in_stream->codecpar->format;
-                } else {
-                    filter_fmt = dec_ctx->pix_fmt;
-                }
-                snprintf(src_args, sizeof(src_args),
-                    "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-                    dec_ctx->width, dec_ctx->height, (int)filter_fmt,
-                    tb.num, tb.den, sar.num ? sar.num : 1, sar.den ? sar.den : 1);
-
-                int ret = avfilter_graph_create_filter(&buffersrc_ctx,  buffersrc,  "in",  src_args, nullptr, filter_graph);
-                if (ret >= 0)
-                    ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out", nullptr,  nullptr, filter_graph);
-
-                if (ret >= 0) {
-                    // The subtitles filter si= takes 0-based index among subtitle streams,
-                    // not the global stream index stored in the combo box item data.
-                    int subtitle_si = 0;
-                    for (unsigned int j = 0; j < in_fmt_ctx->nb_streams && (int)j < subtitle_stream_index; j++)
-                        if (in_fmt_ctx->streams[j]->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE)
-                            subtitle_si++;
-
-                    // Get Windows Fonts dir so libass can initialize its font engine
-                    char windir[MAX_PATH] = {};
-                    GetWindowsDirectoryA(windir, MAX_PATH);
-                    char fontspath_raw[MAX_PATH + 8];
-                    snprintf(fontspath_raw, sizeof(fontspath_raw), "%s\\Fonts", windir);
-
-                    // Use avfilter_graph_alloc_filter + av_opt_set instead of
-                    // avfilter_graph_parse_ptr: the parse path consistently returns
-                    // EINVAL on Windows when the file path contains a drive-letter
-                    // colon (e.g. "C:/..."), even inside single quotes.
-                    const AVFilter* sub_filt = avfilter_get_by_name("subtitles");
-                    AVFilterContext* sub_ctx = sub_filt
-                        ? avfilter_graph_alloc_filter(filter_graph, sub_filt, "sub")
-                        : nullptr;
-                    if (sub_ctx) {
-                        av_opt_set    (sub_ctx->priv, "filename",     in_filename,  0);
-                        av_opt_set_int(sub_ctx->priv, "stream_index", subtitle_si,  0);
-                        av_opt_set    (sub_ctx->priv, "fontsdir",     fontspath_raw, 0);
-                        int init_ret = avfilter_init_str(sub_ctx, nullptr);
-                        if (init_ret >= 0 &&
-                            avfilter_link(buffersrc_ctx, 0, sub_ctx, 0) == 0 &&
-                            avfilter_link(sub_ctx, 0, buffersink_ctx, 0) == 0) {
-                            ret = avfilter_graph_config(filter_graph, nullptr);
-                        } else { ret = (init_ret < 0) ? init_ret : AVERROR(EINVAL); }
-                    } else { ret = AVERROR(ENOSYS); }
-                    if (ret >= 0) {
-                        use_filter = true;
-                    } else {
-                        // Primary subtitles filter failed — pre-decode subtitle events via
-                        // avcodec_decode_subtitle2, write a temp ASS file, and retry.
-                        // This handles formats that libass/subtitles-filter doesn't open
-                        // directly (e.g. MOV_TEXT in MP4, unusual codec wrappings).
-                        avfilter_graph_free(&filter_graph); filter_graph = nullptr;
-                        buffersrc_ctx = nullptr; buffersink_ctx = nullptr;
-
-                        // --- decode all subtitle events from the stream ---
-                        {
-                            AVCodecID sub_cid2 = in_fmt_ctx->streams[subtitle_stream_index]->codecpar->codec_id;
-                            const AVCodec* sub_codec2 = avcodec_find_decoder(sub_cid2);
-                            AVCodecContext* sub_dec2 = sub_codec2 ? avcodec_alloc_context3(sub_codec2) : nullptr;
-                            if (sub_dec2) {
-                                avcodec_parameters_to_context(sub_dec2, in_fmt_ctx->streams[subtitle_stream_index]->codecpar);
-                                if (avcodec_open2(sub_dec2, sub_codec2, nullptr) >= 0) {
-                                    AVFormatContext* sub_fmt2 = nullptr;
-                                    if (avformat_open_input(&sub_fmt2, in_filename, nullptr, nullptr) >= 0 &&
-                                        avformat_find_stream_info(sub_fmt2, nullptr) >= 0) {
-                                        AVPacket* sub_pkt2 = av_packet_alloc();
-                                        while (sub_pkt2 && av_read_frame(sub_fmt2, sub_pkt2) >= 0) {
-                                            if (sub_pkt2->stream_index == subtitle_stream_index) {
-                                                AVSubtitle sub2 = {};
-                                                int got2 = 0;
-                                                avcodec_decode_subtitle2(sub_dec2, &sub2, &got2, sub_pkt2);
-                                                if (got2) {
-                                                    double s2_start = (sub2.pts != AV_NOPTS_VALUE)
-                                                        ? sub2.pts * 1e-6
-                                                        : sub_pkt2->pts * av_q2d(sub_fmt2->streams[subtitle_stream_index]->time_base);
-                                                    double s2_end = s2_start + sub2.end_display_time * 1e-3;
-                                                    for (unsigned ri = 0; ri < sub2.num_rects; ri++) {
-                                                        AVSubtitleRect* r2 = sub2.rects[ri];
-                                                        std::string txt2;
-                                                        if (r2->type == SUBTITLE_ASS && r2->ass) {
-                                                            // Skip commas to reach the Text field (8 for new FFmpeg, 9 for old).
-                                                            const char* p2 = r2->ass;
-                                                            // FFmpeg ≥6 omits "Dialogue: " prefix from r->ass; the text field is
-// then the 9th field (8 commas) instead of the 10th (9 commas).
-{ int _skip = (p2[0]=='D'&&p2[1]=='i'&&p2[2]=='a') ? 9 : 8;
-  for (int nc = 0; *p2 && nc < _skip; p2++) if (*p2 == ',') nc++; }
-                                                            txt2 = p2;
-                                                        } else if (r2->type == SUBTITLE_TEXT && r2->text) {
-                                                            for (const char* p2 = r2->text; *p2; p2++) {
-                                                                if      (*p2 == '{')  txt2 += "\\{";
-                                                                else if (*p2 == '\n') txt2 += "\\N";
-                                                                else if (*p2 != '\r') txt2 += *p2;
-                                                            }
-                                                        }
-                                                        if (!txt2.empty())
-                                                            text_sub_events.push_back({s2_start, s2_end, std::move(txt2)});
-                                                    }
-                                                    avsubtitle_free(&sub2);
-                                                }
-                                            }
-                                            av_packet_unref(sub_pkt2);
-                                        }
-                                        if (sub_pkt2) av_packet_free(&sub_pkt2);
-                                        avformat_close_input(&sub_fmt2);
-                                    }
-                                }
-                                avcodec_free_context(&sub_dec2);
-                            }
-                        }
+// Moves the generator's attention.  t0/t1 bound the window (seconds) on the
+// given level; hint orders work by distance from that time.
+static void AtlasSetFocus(int level, double t0, double t1, double hint) {
+    EnterCriticalSection(&g_csAtlas);
+    g_atlasFocusLevel = max(0, min(level, kAtlasLevels - 1));
+    g_atlasFocusT0    = t0;
+    g_atlasFocusT1    = t1;
+    g_atlasFocusHint  = hint;
+    LeaveCriticalSection(&g_csAtlas);
+    if (g_atlasWake) SetEvent(g_atlasWake);
+}
 
-                        // --- GDI text rendering fallback (no libass required) ---
-                        // Render decoded text events as YUVA bitmaps and feed into the
-                        // existing pgs_events / use_bitmap_subs blending path.
-                        if (!text_sub_events.empty()) {
-                            int frame_w  = enc_ctx->width;
-                            int frame_h  = enc_ctx->height;
-                            int font_h   = max(14, frame_h / 20);
-                            int margin_v = max(12, frame_h / 18);
-                            int max_tw   = frame_w * 85 / 100;
-
-                            HDC screen_dc = GetDC(nullptr);
-                            HDC mem_dc    = CreateCompatibleDC(screen_dc);
-                            BITMAPINFO bmi = {};
-                            bmi.bmiHeader.biSize        = sizeof(BITMAPINFOHEADER);
-                            bmi.bmiHeader.biWidth       = frame_w;
-                            bmi.bmiHeader.biHeight      = -frame_h; // top-down
-                            bmi.bmiHeader.biPlanes      = 1;
-                            bmi.bmiHeader.biBitCount    = 32;
-                            bmi.bmiHeader.biCompression = BI_RGB;
-                            uint32_t* pixels = nullptr;
-                            HBITMAP hbm = CreateDIBSection(screen_dc, &bmi, DIB_RGB_COLORS,
-                                                           (void**)&pixels, nullptr, 0);
-                            ReleaseDC(nullptr, screen_dc);
-
-                            if (hbm && pixels && mem_dc) {
-                                HBITMAP old_bm = (HBITMAP)SelectObject(mem_dc, hbm);
-                                // NONANTIALIASED_QUALITY ensures pixels are exactly the text
-                                // colour or the background key with no blended intermediates.
-                                HFONT hfont = CreateFontA(
-                                    -font_h, 0, 0, 0, FW_BOLD, FALSE, FALSE, FALSE,
-                                    DEFAULT_CHARSET, OUT_TT_PRECIS, CLIP_DEFAULT_PRECIS,
-                                    NONANTIALIASED_QUALITY, DEFAULT_PITCH | FF_SWISS, "Arial");
-                                HFONT old_font = (HFONT)SelectObject(mem_dc, hfont);
-                                SetBkMode(mem_dc, TRANSPARENT);
-
-                                // Strip ASS override tags; convert \N / \n to newline, \h to space.
-                                auto strip_ass = [](const std::string& s) -> std::wstring {
-                                    std::string out;
-                                    bool in_tag = false;
-                                    for (size_t i = 0; i < s.size(); i++) {
-                                        if (s[i] == '{') { in_tag = true;  continue; }
-                                        if (s[i] == '}') { in_tag = false; continue; }
-                                        if (in_tag) continue;
-                                        if (s[i] == '\\' && i + 1 < s.size()) {
-                                            char n = s[i + 1];
-                                            if (n == 'N' || n == 'n') { out += '\n'; i++; continue; }
-                                            if (n == 'h')             { out += ' ';  i++; continue; }
-                                        }
-                                        out += s[i];
-                                    }
-                                    while (!out.empty() && (out.back() == '\n' || out.back() == '\r' || out.back() == ' '))
-                                        out.pop_back();
-                                    int wlen = MultiByteToWideChar(CP_UTF8, 0, out.c_str(), -1, nullptr, 0);
-                                    std::wstring w(wlen, 0);
-                                    MultiByteToWideChar(CP_UTF8, 0, out.c_str(), -1, &w[0], wlen);
-                                    if (!w.empty() && w.back() == 0) w.pop_back();
-                                    return w;
-                                };
-
-                                // Magenta (R=255,G=0,B=255) used as background transparency key.
-                                // In a 32-bpp top-down DIB the DWORD layout is 0x00RRGGBB.
-                                const uint32_t MAGENTA = 0x00FF00FFu;
-
-                                for (const auto& ev : text_sub_events) {
-                                    std::wstring wtxt = strip_ass(ev.ass_text);
-                                    if (wtxt.empty()) continue;
-
-                                    // Measure wrapped text dimensions.
-                                    RECT measure = {0, 0, (LONG)max_tw, 0};
-                                    DrawTextW(mem_dc, wtxt.c_str(), -1, &measure,
-                                              DT_CALCRECT | DT_CENTER | DT_WORDBREAK);
-                                    int tw = measure.right  - measure.left;
-                                    int th = measure.bottom - measure.top;
-                                    if (tw <= 0 || th <= 0) continue;
-
-                                    // Position: centred horizontally, above bottom margin.
-                                    const int outline = 2;
-                                    const int pad     = outline + 1;
-                                    int tx = (frame_w - tw) / 2;
-                                    int ty = frame_h - margin_v - th;
-                                    if (tx < pad) tx = pad;
-                                    if (ty < pad) ty = pad;
-
-                                    // Bounding rect including outline padding.
-                                    int rx = tx - pad, ry = ty - pad;
-                                    int rw = tw + pad * 2, rh = th + pad * 2;
-                                    if (rx + rw > frame_w) rw = frame_w - rx;
-                                    if (ry + rh > frame_h) rh = frame_h - ry;
-                                    if (rw <= 0 || rh <= 0) continue;
-
-                                    // Fill bounding area with magenta key colour.
-                                    for (int dy = 0; dy < rh; dy++)
-                                        for (int dx = 0; dx < rw; dx++)
-                                            pixels[(ry + dy) * frame_w + (rx + dx)] = MAGENTA;
-
-                                    RECT draw_rect = {(LONG)tx, (LONG)ty,
-                                                      (LONG)(tx + tw), (LONG)(ty + th)};
-
-                                    // Draw black outline at all surrounding offsets.
-                                    SetTextColor(mem_dc, RGB(0, 0, 0));
-                                    for (int oy = -outline; oy <= outline; oy++) {
-                                        for (int ox = -outline; ox <= outline; ox++) {
-                                            if (ox == 0 && oy == 0) continue;
-                                            RECT r2 = {draw_rect.left + ox, draw_rect.top + oy,
-                                                       draw_rect.right + ox, draw_rect.bottom + oy};
-                                            DrawTextW(mem_dc, wtxt.c_str(), -1, &r2,
-                                                      DT_CENTER | DT_WORDBREAK);
-                                        }
-                                    }
-
-                                    // Draw white main text on top.
-                                    SetTextColor(mem_dc, RGB(255, 255, 255));
-                                    DrawTextW(mem_dc, wtxt.c_str(), -1, &draw_rect,
-                                              DT_CENTER | DT_WORDBREAK);
-
-                                    // Convert bounding rect pixels to YUVA (BT.709 limited range).
-                                    PgsRect pg;
-                                    pg.x = rx; pg.y = ry; pg.w = rw; pg.h = rh;
-                                    pg.yuva.resize((size_t)rw * rh * 4);
-                                    for (int dy = 0; dy < rh; dy++) {
-                                        for (int dx = 0; dx < rw; dx++) {
-                                            uint32_t pv = pixels[(ry + dy) * frame_w + (rx + dx)];
-                                            uint8_t r = (uint8_t)((pv >> 16) & 0xFF);
-                                            uint8_t g = (uint8_t)((pv >>  8) & 0xFF);
-                                            uint8_t b = (uint8_t)( pv        & 0xFF);
-                                            bool is_bg = (r > 200 && g < 30 && b > 200);
-                                            uint8_t Y, Cb, Cr, A;
-                                            if (is_bg) {
-                                                Y = 16; Cb = 128; Cr = 128; A = 0;
-                                            } else {
-                                                Y  = (uint8_t)(16  + ( 65*r + 129*g +  25*b + 128) / 256);
-                                                Cb = (uint8_t)(128 + (-38*r -  74*g + 112*b + 128) / 256);
-                                                Cr = (uint8_t)(128 + (112*r -  94*g -  18*b + 128) / 256);
-                                                A  = 255;
-                                            }
-                                            size_t idx = ((size_t)dy * rw + dx) * 4;
-                                            pg.yuva[idx]   = Y;
-                                            pg.yuva[idx+1] = Cb;
-                                            pg.yuva[idx+2] = Cr;
-                                            pg.yuva[idx+3] = A;
-                                        }
-                                    }
-
-                                    // Add start event (rect visible) and end event (clear screen).
-                                    PgsEvent start_ev;
-                                    start_ev.pts_ms = (int64_t)(ev.start_s * 1000.0);
-                                    start_ev.rects.push_back(std::move(pg));
-                                    pgs_events.push_back(std::move(start_ev));
-
-                                    PgsEvent end_ev;
-                                    end_ev.pts_ms = (int64_t)(ev.end_s * 1000.0);
-                                    pgs_events.push_back(std::move(end_ev));
-                                }
-
-                                SelectObject(mem_dc, old_font);
-                                DeleteObject(hfont);
-                                SelectObject(mem_dc, old_bm);
-                            }
-                            if (hbm)    DeleteObject(hbm);
-                            if (mem_dc) DeleteDC(mem_dc);
+// Picks the next missing tile, or returns false when there is nothing to do.
+static bool AtlasNextTile(int& outLevel, int& outK) {
+    EnterCriticalSection(&g_csAtlas);
+    bool found = false;
+    const AtlasLevel& fl = g_atlas[g_atlasFocusLevel];
+    double step = kAtlasStep[g_atlasFocusLevel];
+    int k0 = max(0, (int)floor(g_atlasFocusT0 / step));
+    int k1 = min(fl.count - 1, (int)ceil(g_atlasFocusT1 / step));
+    int kHint = (g_atlasFocusHint >= 0.0) ? (int)floor(g_atlasFocusHint / step + 0.5) : k0;
+    int bestDist = INT_MAX;
+    for (int k = k0; k <= k1; k++) {
+        if (fl.ready[k]) continue;
+        int d = abs(k - kHint);
+        if (d < bestDist) { bestDist = d; outLevel = g_atlasFocusLevel; outK = k; found = true; }
+    }
+    for (int l = 0; l < 2 && !found; l++) {
+        for (int k = 0; k < g_atlas[l].count; k++) {
+            if (!g_atlas[l].ready[k]) { outLevel = l; outK = k; found = true; break; }
+        }
+    }
+    LeaveCriticalSection(&g_csAtlas);
+    return found;
+}
 
-                            std::sort(pgs_events.begin(), pgs_events.end(),
-                                [](const PgsEvent& a, const PgsEvent& b){ return a.pts_ms < b.pts_ms; });
-                            use_bitmap_subs = !pgs_events.empty();
-                        }
-                    }
-                } else {
-                    avfilter_graph_free(&filter_graph); filter_graph = nullptr;
-                }
-            }
+static unsigned __stdcall AtlasThreadProc(void* param) {
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+    ThumbDecoder td;
+    td.dstH = kAtlasTileH;
+    td.stop = &g_atlasStop;
+    if (!OpenThumbDecoder(td, (MediaSession*)param, false)) { CloseThumbDecoder(td); return 0; }
+
+    EnterCriticalSection(&g_csAtlas);
+    g_atlasTileW      = td.dstW;
+    g_atlasTileStride = (td.dstW * 3 + 3) & ~3;  // DWORD-aligned for StretchDIBits
+    LeaveCriticalSection(&g_csAtlas);
+
+    while (!g_atlasStop) {
+        int level = 0, k = 0;
+        if (!AtlasNextTile(level, k)) {
+            WaitForSingleObject(g_atlasWake, INFINITE);
+            continue;
+        }
+        double t = min(k * kAtlasStep[level], max(0.0, g_duration - 0.05));
+        bool keyOnly = (level < kAtlasLevels - 1);
+        AtlasLevel& lv = g_atlas[level];
+
+        EnterCriticalSection(&g_csAtlas);
+        uint8_t*& chunk = lv.chunks[k / kAtlasChunk];
+        if (!chunk) chunk = (uint8_t*)calloc(kAtlasChunk, AtlasTileBytes());
+        uint8_t* dst = AtlasTilePtr(lv, k);
+        LeaveCriticalSection(&g_csAtlas);
+        if (!dst) break;
+
+        // A failed decode (past EOF, corrupt GOP) leaves the tile black rather
+        // than retrying it forever.
+        if (DecodeThumbAt(td, t, keyOnly, nullptr)) {
+            for (int y = 0; y < kAtlasTileH; y++)
+                memcpy(dst + y * g_atlasTileStride, td.bgr + y * td.bgrStride, td.dstW * 3);
+        } else if (g_atlasStop) {
+            break;
         }
+        EnterCriticalSection(&g_csAtlas);
+        lv.ready[k] = 1;
+        LeaveCriticalSection(&g_csAtlas);
+        PostMessage(g_mainHwnd, WM_APP_THUMBS_READY, 0, 0);
     }
+    CloseThumbDecoder(td);
+    return 0;
+}
 
-    while (av_read_frame(in_fmt_ctx, pkt) >= 0) {
-        if (pkt->stream_index == videoStreamIndex) {
-            if (pkt->dts != AV_NOPTS_VALUE) last_vid_pkt_dts = pkt->dts;
-            if (trans_bsf_ctx) {
-                if (av_bsf_send_packet(trans_bsf_ctx, pkt) >= 0) {
-                    while (av_bsf_receive_packet(trans_bsf_ctx, trans_bsf_pkt) >= 0) {
-                        if (trans_bsf_pkt->dts != AV_NOPTS_VALUE) last_vid_pkt_dts = trans_bsf_pkt->dts;
-                        avcodec_send_packet(dec_ctx, trans_bsf_pkt);
-                        av_packet_unref(trans_bsf_pkt);
-                    }
-                }
-                av_packet_unref(pkt);
-            } else {
-                if (avcodec_send_packet(dec_ctx, pkt) < 0) { av_packet_unref(pkt); break; }
-            }
-            while (avcodec_receive_frame(dec_ctx, frame) == 0) {
-                int64_t in_pts = (frame->best_effort_timestamp != AV_NOPTS_VALUE)
-                                    ? frame->best_effort_timestamp
-                                    : (frame->pts != AV_NOPTS_VALUE ? frame->pts : vid_stream_start);
-                // Subtract stream start_time so in_time is elapsed seconds from the
-                // beginning of the file regardless of container offset (AVI/Xvid fix).
-                double in_time = (in_pts - vid_stream_start) * av_q2d(video_in_stream->time_base);
-                // Guard against stale VOP timestamps (e.g. Xvid clip cut from a long recording).
-                if (in_time < -1.0 || in_time > end_seconds + segment_duration) {
-                    int64_t dts_fb = (last_vid_pkt_dts != AV_NOPTS_VALUE) ? last_vid_pkt_dts : vid_stream_start;
-                    in_pts  = dts_fb;
-                    in_time = (in_pts - vid_stream_start) * av_q2d(video_in_stream->time_base);
-                }
-                if (in_time > end_seconds) { av_frame_unref(frame); goto flush_encoder; }
+// The generator checks g_atlasStop between tiles and inside each decode, so
+// the join is short; it has to be complete before the tiles are freed.
+static void AtlasStop() {
+    g_atlasStop = true;
+    if (g_atlasThread) {
+        SetEvent(g_atlasWake);
+        WaitForSingleObject(g_atlasThread, INFINITE);
+        CloseHandle(g_atlasThread);
+        g_atlasThread = nullptr;
+    }
+    EnterCriticalSection(&g_csAtlas);
+    AtlasFree();
+    LeaveCriticalSection(&g_csAtlas);
+}
 
-                // Drop frames that still decode before the requested start
-                if (in_time < start_seconds) { av_frame_unref(frame); continue; }
-                if (in_time > end_seconds) { av_frame_unref(frame); goto flush_encoder; }
+// Discards the previous file's pyramid and starts filling one for g_inputPath.
+static void AtlasStart(double duration) {
+    AtlasStop();
+    if (!g_atlasWake) g_atlasWake = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    EnterCriticalSection(&g_csAtlas);
+    for (int l = 0; l < kAtlasLevels; l++) {
+        AtlasLevel& lv = g_atlas[l];
+        lv.count  = (int)(duration / kAtlasStep[l]) + 1;
+        lv.chunks = (uint8_t**)calloc((lv.count + kAtlasChunk - 1) / kAtlasChunk, sizeof(uint8_t*));
+        lv.ready  = (uint8_t*)calloc(lv.count, 1);
+    }
+    g_atlasFocusLevel = 1;
+    g_atlasFocusT0    = 0.0;
+    g_atlasFocusT1    = duration;
+    g_atlasFocusHint  = -1.0;
+    LeaveCriticalSection(&g_csAtlas);
+    g_atlasStop   = false;
+    g_atlasThread = (HANDLE)_beginthreadex(nullptr, 0, AtlasThreadProc, g_session, 0, nullptr);
+}
 
-                // Update encode progress for the button's progress bar
-                if (end_seconds > start_seconds)
-                    g_encodeProgress = (float)((in_time - start_seconds) / (end_seconds - start_seconds));
+// Draws the tile nearest t from the finest ready level at or below maxLevel,
+// falling back to coarser levels.  Returns false if nothing was drawn.
+static bool AtlasDraw(HDC dc, int x, int y, int w, int h, double t, int maxLevel) {
+    bool drawn = false;
+    EnterCriticalSection(&g_csAtlas);
+    if (g_atlasTileW > 0) {
+        for (int l = min(maxLevel, kAtlasLevels - 1); l >= 0 && !drawn; l--) {
+            const AtlasLevel& lv = g_atlas[l];
+            if (lv.count <= 0) continue;
+            int k = max(0, min(lv.count - 1, (int)floor(t / kAtlasStep[l] + 0.5)));
+            if (!lv.ready[k]) continue;
+            const uint8_t* px = AtlasTilePtr(lv, k);
+            if (!px) continue;
+            BITMAPINFO bmi = {};
+            bmi.bmiHeader.biSize        = sizeof(BITMAPINFOHEADER);
+            bmi.bmiHeader.biWidth       = g_atlasTileW;
+            bmi.bmiHeader.biHeight      = -kAtlasTileH;
+            bmi.bmiHeader.biPlanes      = 1;
+            bmi.bmiHeader.biBitCount    = 24;
+            bmi.bmiHeader.biCompression = BI_RGB;
+            SetStretchBltMode(dc, HALFTONE);
+            SetBrushOrgEx(dc, 0, 0, nullptr);
+            StretchDIBits(dc, x, y, w, h, 0, 0, g_atlasTileW, kAtlasTileH,
+                px, &bmi, DIB_RGB_COLORS, SRCCOPY);
+            drawn = true;
+        }
+    }
+    LeaveCriticalSection(&g_csAtlas);
+    return drawn;
+}
 
-                // Transfer NVDEC hardware frame to CPU memory if needed.
-                AVFrame* sw_frame = frame;
-                if (using_hw && frame->format == AV_PIX_FMT_CUDA) {
-                    if (!cpu_frame) cpu_frame = av_frame_alloc();
-                    if (cpu_frame && av_hwframe_transfer_data(cpu_frame, frame, 0) >= 0) {
-                        cpu_frame->pts                  = frame->pts;
-                        cpu_frame->best_effort_timestamp = frame->best_effort_timestamp;
-                        cpu_frame->color_trc            = frame->color_trc;
-                        cpu_frame->colorspace           = frame->colorspace;
-                        cpu_frame->color_range          = frame->color_range;
-                        sw_frame = cpu_frame;
-                    }
-                }
+// Focuses the generator on what the timeline currently shows: the 2 s level
+// inside the zoom window, otherwise the 10 s level that backs hover previews.
+static void AtlasFocusView(double hint) {
+    if (g_isZoomed)
+        AtlasSetFocus(kAtlasLevels - 1, g_zoomStartMs / 1000.0, g_zoomEndMs / 1000.0, hint);
+    else
+        AtlasSetFocus(1, 0.0, g_duration, hint);
+}
 
-                // Lazy-init yadif deinterlace filter graph on first decoded frame.
-                // yadif runs on CPU frames; sw_frame is already CPU here (post-NVDEC transfer),
-                // so this path is fully NVDEC-compatible without any extra hw→cpu steps.
-                if (needs_deint && !deint_tried) {
-                    deint_tried = true;
-                    const AVFilter* yd_src  = avfilter_get_by_name("buffer");
-                    const AVFilter* yd_sink = avfilter_get_by_name("buffersink");
-                    const AVFilter* yd_filt = avfilter_get_by_name("yadif");
-                    if (yd_src && yd_sink && yd_filt) {
-                        deint_graph = avfilter_graph_alloc();
-                        if (deint_graph) {
-                            char yd_args[256];
-                            AVRational yd_tb  = video_in_stream->time_base;
-                            AVRational yd_sar = dec_ctx->sample_aspect_ratio;
-                            snprintf(yd_args, sizeof(yd_args),
-                                "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-                                sw_frame->width, sw_frame->height, sw_frame->format,
-                                yd_tb.num, yd_tb.den,
-                                yd_sar.num ? yd_sar.num : 1, yd_sar.den ? yd_sar.den : 1);
-                            int yd_ret = avfilter_graph_create_filter(&deint_src_ctx,  yd_src,  "in",  yd_args, nullptr, deint_graph);
-                            if (yd_ret >= 0)
-                                yd_ret = avfilter_graph_create_filter(&deint_sink_ctx, yd_sink, "out", nullptr, nullptr, deint_graph);
-                            if (yd_ret >= 0) {
-                                AVFilterContext* yd_ctx = nullptr;
-                                // mode=0: one output frame per interlaced input (preserves frame rate)
-                                // parity=-1: auto-detect top/bottom field from frame flags
-                                // deint=0: deinterlace all frames
-                                yd_ret = avfilter_graph_create_filter(&yd_ctx, yd_filt, "yadif",
-                                    "mode=0:parity=-1:deint=0", nullptr, deint_graph);
-                                if (yd_ret >= 0) yd_ret = avfilter_link(deint_src_ctx, 0, yd_ctx, 0);
-                                if (yd_ret >= 0) yd_ret = avfilter_link(yd_ctx, 0, deint_sink_ctx, 0);
-                                if (yd_ret >= 0) yd_ret = avfilter_graph_config(deint_graph, nullptr);
-                            }
-                            if (yd_ret < 0) {
-                                OutputDebugStringA("yadif init failed; skipping deinterlace.\n");
-                                avfilter_graph_free(&deint_graph);
-                                deint_graph = nullptr; deint_src_ctx = nullptr; deint_sink_ctx = nullptr;
-                                needs_deint = false;
-                            }
-                        } else { needs_deint = false; }
-                    } else { needs_deint = false; }
-                }
+// ------------------------------ Audio Peaks ------------------------------
+// A min/max peak index of one audio track, drawn as a waveform along the
+// bottom of the timeline.  The base level holds one (min, max) pair per
+// kPeakBaseMs of timeline; each coarser level folds kPeakFanout buckets of the
+// one below, so a paint at any zoom reads at most a few buckets per column.
+//
+// Extraction demuxes only the audio stream (everything else is discarded) and
+// splits the file into contiguous bucket ranges, one decoder per range, like
+// the filmstrip workers.  Decoded samples are reduced with SSE2 min/max.  The
+// base level is then written to a hidden "<file>.peaks" next to the source,
+// keyed by size, mtime and stream, so reopening the file skips the decode.
+//
+// Each build has its own heap-allocated PeakIndex and stop flag.  Switching
+// tracks detaches the running build instead of waiting for it; whichever of
+// the build thread and PeaksStop sees the other done last frees the index,
+// and the build thread only does so after its workers have joined.
+
+static const int      kPeakBaseMs    = 10;
+static const int      kPeakFanout    = 4;
+static const int      kPeakLevels    = 8;           // 10 ms .. ~164 s per bucket
+static const uint32_t kPeakFileMagic = 0x4B505A52;  // "RZPK"
+static const uint32_t kPeakFileVer   = 1;
+
+struct PeakIndex {
+    char     path[MAX_PATH] = {};
+    int      stream       = -1;                // requested as -1 = best audio; resolved by PeaksProbe
+    int      rate         = 0;
+    int64_t  startSamples = 0;                 // timeline zero (video start_time) in audio samples
+    int      count[kPeakLevels] = {};
+    int16_t* mm[kPeakLevels]    = {};          // count[l] (min, max) pairs; min > max = no audio there
+    volatile bool stop    = false;             // set by PeaksStop; the build and its workers give up
+    bool     ready        = false;             // levels complete; set under g_csPeaks
+    bool     finished     = false;             // build thread is done with it; set under g_csPeaks
+};
 
-                // Apply yadif deinterlace to sw_frame if active.
-                AVFrame* deint_out_frame = nullptr;
-                if (needs_deint && deint_graph) {
-                    sw_frame->pts = in_pts; // yadif uses pts for temporal ordering
-                    if (av_buffersrc_add_frame_flags(deint_src_ctx, sw_frame, AV_BUFFERSRC_FLAG_KEEP_REF) >= 0) {
-                        deint_out_frame = av_frame_alloc();
-                        if (deint_out_frame) {
-                            if (av_buffersink_get_frame(deint_sink_ctx, deint_out_frame) >= 0) {
-                                deint_out_frame->pts = sw_frame->pts;
-                                sw_frame = deint_out_frame;
-                            } else {
-                                av_frame_free(&deint_out_frame);
-                                deint_out_frame = nullptr;
-                            }
-                        }
-                    }
-                }
+struct PeakFileHeader {
+    uint32_t magic, version;
+    int64_t  fileSize, fileMtime;
+    int32_t  stream, rate;
+    int64_t  startSamples;
+    int32_t  count, reserved;
+};
 
-                // Lazy-init sws_hdr2rgb (HDR→SDR Stage 1) on first decoded frame.
-                if (convert_hdr_to_sdr && !sws_hdr2rgb) {
-                    int srcCs    = (dec_ctx->colorspace == AVCOL_SPC_BT2020_NCL ||
-                                    dec_ctx->colorspace == AVCOL_SPC_BT2020_CL)
-                                   ? SWS_CS_BT2020 : SWS_CS_ITU709;
-                    int srcRange = (dec_ctx->color_range == AVCOL_RANGE_JPEG) ? 1 : 0;
-                    sws_hdr2rgb = sws_getContext(
-                        dec_ctx->width, dec_ctx->height, (AVPixelFormat)sw_frame->format,
-                        enc_ctx->width, enc_ctx->height, AV_PIX_FMT_RGB48LE,
-                        SWS_BILINEAR, nullptr, nullptr, nullptr);
-                    if (sws_hdr2rgb) {
-                        sws_setColorspaceDetails(sws_hdr2rgb,
-                            sws_getCoefficients(srcCs),         srcRange,
-                            sws_getCoefficients(SWS_CS_ITU709), 1,
-                            0, 1 << 16, 1 << 16);
-                    } else {
-                        OutputDebugStringA("HDR→SDR sws_hdr2rgb init failed; falling back.\n");
-                        convert_hdr_to_sdr = false;
-                    }
-                }
+static PeakIndex* g_peaks = nullptr;           // the index on screen; guarded by g_csPeaks
 
-                // Rebase video PTS to 0 at start_seconds, then convert to encoder time_base
-                int64_t rel_vid_pts = in_pts - video_start_pts;
-                if (rel_vid_pts < 0) rel_vid_pts = 0;
-                filt_frame->pts = av_rescale_q(rel_vid_pts, video_in_stream->time_base, enc_ctx->time_base);
-
-                // Route through subtitle filter graph if active, otherwise scale directly
-                AVFrame* src_frame = sw_frame;
-                AVFrame* filter_out = nullptr;
-                if (use_filter) {
-                    sw_frame->pts = in_pts; // filter needs original pts for subtitle timing
-
-                    // The subtitles filter only accepts planar YUV.  NVDEC gives NV12 (semi-planar),
-                    // so convert to YUV420P with a dedicated sws context before pushing to the filter.
-                    AVFrame* filt_input = sw_frame;
-                    if ((AVPixelFormat)sw_frame->format != AV_PIX_FMT_YUV420P) {
-                        if (!pre_filter_sws)
-                            pre_filter_sws = sws_getContext(
-                                sw_frame->width, sw_frame->height, (AVPixelFormat)sw_frame->format,
-                                sw_frame->width, sw_frame->height, AV_PIX_FMT_YUV420P,
-                                SWS_BILINEAR, nullptr, nullptr, nullptr);
-                        if (!pre_filter_frame) {
-                            pre_filter_frame = av_frame_alloc();
-                            if (pre_filter_frame) {
-                                pre_filter_frame->format = AV_PIX_FMT_YUV420P;
-                                pre_filter_frame->width  = sw_frame->width;
-                                pre_filter_frame->height = sw_frame->height;
-                                av_frame_get_buffer(pre_filter_frame, 32);
-                            }
-                        }
-                        if (pre_filter_sws && pre_filter_frame) {
-                            sws_scale(pre_filter_sws,
-                                (const uint8_t* const*)sw_frame->data, sw_frame->linesize,
-                                0, sw_frame->height,
-                                pre_filter_frame->data, pre_filter_frame->linesize);
-                            pre_filter_frame->pts = sw_frame->pts;
-                            filt_input = pre_filter_frame;
-                        }
-                    }
+// First sample of base bucket b.  Sample s belongs to bucket s*1000/(rate*kPeakBaseMs).
+static int64_t PeakBucketStart(int64_t b, int rate) {
+    int64_t num = b * rate * kPeakBaseMs;
+    return (num + 999) / 1000;
+}
 
-                    if (av_buffersrc_add_frame_flags(buffersrc_ctx, filt_input, AV_BUFFERSRC_FLAG_KEEP_REF) >= 0) {
-                        filter_out = av_frame_alloc();
-                        int fret = filter_out ? av_buffersink_get_frame(buffersink_ctx, filter_out) : AVERROR(ENOMEM);
-                        if (fret < 0) { av_frame_free(&filter_out); filter_out = nullptr; }
-                        else { src_frame = filter_out; }
-                    }
-                }
-                // Lazy-init sws_ctx (non-HDR path) using the ACTUAL source frame format
-                // (post-filter).  Initialising from sw_frame before the filter ran could
-                // produce a format mismatch when NVDEC outputs NV12 but the filter graph
-                // was configured for YUV420P — causing incorrect chroma (green tint).
-                if (!sws_ctx) {
-                    sws_ctx = sws_getContext(
-                        src_frame->width, src_frame->height, (AVPixelFormat)src_frame->format,
-                        enc_ctx->width,   enc_ctx->height,   enc_ctx->pix_fmt,
-                        SWS_BILINEAR, nullptr, nullptr, nullptr);
-                }
-                if (convert_hdr_to_sdr && sws_hdr2rgb && sws_rgb2yuv && hdr_rgb48_buf && hdr_bgr24_buf) {
-                    // Stage 1: native → RGB48LE
-                    int rgb48W     = enc_ctx->width;
-                    int rgb48H     = enc_ctx->height;
-                    int rgb48Stride = rgb48W * 6;
-                    uint8_t* r48data[8] = { hdr_rgb48_buf, nullptr };
-                    int      r48stride[8] = { rgb48Stride, 0 };
-                    sws_scale(sws_hdr2rgb, src_frame->data, src_frame->linesize, 0, src_frame->height,
-                        r48data, r48stride);
-                    // Stage 2: EOTF (LUT) + BT.2020→BT.709 matrix + Reinhard TM + sRGB (LUT)
-                    // Multi-threaded across rows; uses precomputed float LUTs to avoid
-                    // per-pixel pow() calls (was ~9 pow() calls/pixel at 4K = billions/sec).
-                    {
-                        const bool  bPQ   = (g_hdrTrc == AVCOL_TRC_SMPTE2084);
-                        const float refWf = bPQ ? 0.0203f : 0.25f;
-                        const uint8_t* srcBuf  = hdr_rgb48_buf;
-                        uint8_t*       dstBuf  = hdr_bgr24_buf;
-                        const int      dstStride = rgb48W * 3;
-
-                        auto process_rows = [&](int rStart, int rEnd) {
-                            for (int row = rStart; row < rEnd; row++) {
-                                const uint16_t* s = (const uint16_t*)(srcBuf + row * rgb48Stride);
-                                uint8_t*        d = dstBuf + row * dstStride;
-                                for (int x = 0; x < rgb48W; x++) {
-                                    float R = s_eotf_lut[s[x*3+0]];
-                                    float G = s_eotf_lut[s[x*3+1]];
-                                    float B = s_eotf_lut[s[x*3+2]];
-                                    float Ro = k_bt2020_to_bt709f[0][0]*R + k_bt2020_to_bt709f[0][1]*G + k_bt2020_to_bt709f[0][2]*B;
-                                    float Go = k_bt2020_to_bt709f[1][0]*R + k_bt2020_to_bt709f[1][1]*G + k_bt2020_to_bt709f[1][2]*B;
-                                    float Bo = k_bt2020_to_bt709f[2][0]*R + k_bt2020_to_bt709f[2][1]*G + k_bt2020_to_bt709f[2][2]*B;
-                                    if (Ro < 0.0f) Ro = 0.0f;
-                                    if (Go < 0.0f) Go = 0.0f;
-                                    if (Bo < 0.0f) Bo = 0.0f;
-                                    Ro = 2.0f * Ro / (refWf + Ro);
-                                    Go = 2.0f * Go / (refWf + Go);
-                                    Bo = 2.0f * Bo / (refWf + Bo);
-                                    int ir = (int)(Ro * 65535.0f + 0.5f); if (ir > 65535) ir = 65535;
-                                    int ig = (int)(Go * 65535.0f + 0.5f); if (ig > 65535) ig = 65535;
-                                    int ib = (int)(Bo * 65535.0f + 0.5f); if (ib > 65535) ib = 65535;
-                                    d[x*3+0] = s_srgb_lut16[ib];
-                                    d[x*3+1] = s_srgb_lut16[ig];
-                                    d[x*3+2] = s_srgb_lut16[ir];
-                                }
-                            }
-                        };
-
-                        static const int nWorkers = max(1, min(8, (int)std::thread::hardware_concurrency()));
-                        if (nWorkers > 1 && rgb48H >= nWorkers * 4) {
-                            int rowsEach = (rgb48H + nWorkers - 1) / nWorkers;
-                            std::vector<std::future<void>> futures;
-                            futures.reserve(nWorkers);
-                            for (int t = 0; t < nWorkers; t++) {
-                                int r0 = t * rowsEach;
-                                int r1 = min(r0 + rowsEach, rgb48H);
-                                if (r0 >= rgb48H) break;
-                                futures.push_back(std::async(std::launch::async, process_rows, r0, r1));
-                            }
-                            for (auto& f : futures) f.get();
-                        } else {
-                            process_rows(0, rgb48H);
-                        }
-                    }
-                    // Stage 3: BGR24 → encoder YUV
-                    uint8_t* b24data[8]  = { hdr_bgr24_buf, nullptr };
-                    int      b24stride[8] = { rgb48W * 3, 0 };
-                    sws_scale(sws_rgb2yuv, (const uint8_t* const*)b24data, b24stride, 0, rgb48H,
-                        filt_frame->data, filt_frame->linesize);
-                } else {
-                    sws_scale(sws_ctx, src_frame->data, src_frame->linesize, 0, src_frame->height,
-                        filt_frame->data, filt_frame->linesize);
-                }
-                if (filter_out)      av_frame_free(&filter_out);
-                if (deint_out_frame) av_frame_free(&deint_out_frame);
-
-                // Alpha-blend PGS bitmap subtitle onto the scaled YUV output frame.
-                // Rects are already at output resolution with pre-converted YCbCr values,
-                // so this loop contains no float math or colour conversion.
-                if (use_bitmap_subs) {
-                    int64_t cur_ms = (int64_t)(in_time * 1000.0);
-                    const PgsEvent* active = nullptr;
-                    for (const auto& ev : pgs_events) {
-                        if (ev.pts_ms <= cur_ms) active = &ev;
-                        else break;
-                    }
-                    if (active && !active->rects.empty()) {
-                        for (const auto& rect : active->rects) {
-                            const uint8_t* yuva = rect.yuva.data();
-                            for (int dy = 0; dy < rect.h; dy++) {
-                                int fy = rect.y + dy;
-                                if (fy < 0 || fy >= enc_ctx->height) continue;
-                                uint8_t* Yrow = filt_frame->data[0] + fy * filt_frame->linesize[0];
-                                for (int dx = 0; dx < rect.w; dx++) {
-                                    int fx = rect.x + dx;
-                                    if (fx < 0 || fx >= enc_ctx->width) continue;
-                                    const uint8_t* px = yuva + ((size_t)dy * rect.w + dx) * 4;
-                                    uint8_t a = px[3];
-                                    if (a == 0) continue;
-                                    int inv_a = 255 - a;
-                                    Yrow[fx] = (uint8_t)((px[0] * a + Yrow[fx] * inv_a) >> 8);
-                                    if ((fx & 1) == 0 && (fy & 1) == 0) {
-                                        int cy = fy >> 1, cx = fx >> 1;
-                                        if (enc_ctx->pix_fmt == AV_PIX_FMT_YUV420P) {
-                                            uint8_t* Up = filt_frame->data[1] + cy * filt_frame->linesize[1] + cx;
-                                            uint8_t* Vp = filt_frame->data[2] + cy * filt_frame->linesize[2] + cx;
-                                            *Up = (uint8_t)((px[1] * a + *Up * inv_a) >> 8);
-                                            *Vp = (uint8_t)((px[2] * a + *Vp * inv_a) >> 8);
-                                        } else if (enc_ctx->pix_fmt == AV_PIX_FMT_NV12) {
-                                            uint8_t* UVp = filt_frame->data[1] + cy * filt_frame->linesize[1] + cx * 2;
-                                            UVp[0] = (uint8_t)((px[1] * a + UVp[0] * inv_a) >> 8);
-                                            UVp[1] = (uint8_t)((px[2] * a + UVp[1] * inv_a) >> 8);
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
+static void PeaksFree(PeakIndex* pk) {
+    for (int l = 0; l < kPeakLevels; l++) free(pk->mm[l]);
+    delete pk;
+}
 
-                if (avcodec_send_frame(enc_ctx, filt_frame) < 0) { OutputDebugStringA("Error sending frame to video encoder.\n"); break; }
-                while (avcodec_receive_packet(enc_ctx, enc_pkt) == 0) {
-                    enc_pkt->stream_index = video_out_stream->index;
-                    av_packet_rescale_ts(enc_pkt, enc_ctx->time_base, video_out_stream->time_base);
-                    av_interleaved_write_frame(out_fmt_ctx, enc_pkt);
-                    av_packet_unref(enc_pkt);
-                }
-                av_frame_unref(frame);
-            }
+static void PeakReduceF32(const float* s, int n, float& lo, float& hi) {
+    int i = 0;
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+    if (n >= 8) {
+        __m128 vlo = _mm_set1_ps(lo), vhi = _mm_set1_ps(hi);
+        for (; i + 8 <= n; i += 8) {
+            __m128 a = _mm_loadu_ps(s + i), b = _mm_loadu_ps(s + i + 4);
+            vlo = _mm_min_ps(vlo, _mm_min_ps(a, b));
+            vhi = _mm_max_ps(vhi, _mm_max_ps(a, b));
         }
+        alignas(16) float l4[4], h4[4];
+        _mm_store_ps(l4, vlo);
+        _mm_store_ps(h4, vhi);
+        lo = min(min(l4[0], l4[1]), min(l4[2], l4[3]));
+        hi = max(max(h4[0], h4[1]), max(h4[2], h4[3]));
+    }
+#endif
+    for (; i < n; i++) {
+        if (s[i] < lo) lo = s[i];
+        if (s[i] > hi) hi = s[i];
+    }
+}
 
-        else if (audio_in_stream && pkt->stream_index == audioStreamIndex
-                 && aDec_ctx && aEnc_ctx && aSwrCtx) {
-            AVRational in_tb = audio_in_stream->time_base;
-            int64_t aud_in_pts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts
-                                : (pkt->dts != AV_NOPTS_VALUE) ? pkt->dts : aud_stream_start;
-            double aud_time = (aud_in_pts - aud_stream_start) * av_q2d(in_tb);
-            if (aud_time < start_seconds || aud_time > end_seconds) { av_packet_unref(pkt); continue; }
-
-            if (avcodec_send_packet(aDec_ctx, pkt) >= 0) {
-                while (avcodec_receive_frame(aDec_ctx, aFrame) == 0) {
-                    // Feed decoded samples into swr (no output pull yet)
-                    swr_convert(aSwrCtx, nullptr, 0,
-                                (const uint8_t**)aFrame->extended_data, aFrame->nb_samples);
-                    av_frame_unref(aFrame);
-
-                    // Pull complete AAC frames (frame_size = 1024 samples)
-                    while (swr_get_out_samples(aSwrCtx, 0) >= aEnc_ctx->frame_size) {
-                        av_frame_make_writable(aEncFrame);
-                        swr_convert(aSwrCtx, aEncFrame->data, aEnc_ctx->frame_size, nullptr, 0);
-                        aEncFrame->pts = aOutPts;
-                        aOutPts += aEnc_ctx->frame_size;
-                        avcodec_send_frame(aEnc_ctx, aEncFrame);
-                        while (avcodec_receive_packet(aEnc_ctx, aEncPkt) == 0) {
-                            aEncPkt->stream_index = audio_out_stream->index;
-                            av_packet_rescale_ts(aEncPkt, aEnc_ctx->time_base, audio_out_stream->time_base);
-                            av_interleaved_write_frame(out_fmt_ctx, aEncPkt);
-                            av_packet_unref(aEncPkt);
-                        }
-                    }
-                }
-            }
+static void PeakReduceS16(const int16_t* s, int n, int& lo, int& hi) {
+    int i = 0;
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+    if (n >= 16) {
+        __m128i vlo = _mm_set1_epi16((short)lo), vhi = _mm_set1_epi16((short)hi);
+        for (; i + 16 <= n; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(s + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(s + i + 8));
+            vlo = _mm_min_epi16(vlo, _mm_min_epi16(a, b));
+            vhi = _mm_max_epi16(vhi, _mm_max_epi16(a, b));
         }
+        alignas(16) int16_t l8[8], h8[8];
+        _mm_store_si128((__m128i*)l8, vlo);
+        _mm_store_si128((__m128i*)h8, vhi);
+        for (int k = 0; k < 8; k++) {
+            if (l8[k] < lo) lo = l8[k];
+            if (h8[k] > hi) hi = h8[k];
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (s[i] < lo) lo = s[i];
+        if (s[i] > hi) hi = s[i];
+    }
+}
 
-        av_packet_unref(pkt);
+static inline int16_t PeakQuantize(float v) {
+    int q = (int)lrintf(v * 32767.0f);
+    return (int16_t)max(-32767, min(q, 32767));
+}
+
+// Folds the samples of f that fall inside [S0, S1) (timeline samples; f starts
+// at s0) into the base buckets.  Planar and packed float/S16 are reduced in
+// place; anything else is converted to packed float first.
+static void PeakAccumulate(PeakIndex& pk, const AVFrame* f, int64_t s0, int64_t S0, int64_t S1,
+                           SwrContext*& swr, std::vector<float>& conv) {
+    const int rate = pk.rate;
+    const int ch   = max(1, f->ch_layout.nb_channels);
+    AVSampleFormat fmt = (AVSampleFormat)f->format;
+    const float* packedF = nullptr;
+    if (fmt != AV_SAMPLE_FMT_FLTP && fmt != AV_SAMPLE_FMT_FLT &&
+        fmt != AV_SAMPLE_FMT_S16P && fmt != AV_SAMPLE_FMT_S16) {
+        if (!swr && swr_alloc_set_opts2(&swr, &f->ch_layout, AV_SAMPLE_FMT_FLT, f->sample_rate,
+                                        &f->ch_layout, fmt, f->sample_rate, 0, nullptr) < 0)
+            return;
+        if (!swr_is_initialized(swr) && swr_init(swr) < 0) return;
+        conv.resize((size_t)f->nb_samples * ch);
+        uint8_t* out = (uint8_t*)conv.data();
+        if (swr_convert(swr, &out, f->nb_samples, (const uint8_t**)f->extended_data, f->nb_samples) < 0)
+            return;
+        packedF = conv.data();
+        fmt = AV_SAMPLE_FMT_FLT;
     }
 
-flush_encoder:
-    avcodec_send_frame(enc_ctx, nullptr);
-    while (avcodec_receive_packet(enc_ctx, enc_pkt) == 0) {
-        enc_pkt->stream_index = video_out_stream->index;
-        av_packet_rescale_ts(enc_pkt, enc_ctx->time_base, video_out_stream->time_base);
-        av_interleaved_write_frame(out_fmt_ctx, enc_pkt);
-        av_packet_unref(enc_pkt);
-    }
-    av_packet_unref(enc_pkt);
-
-    // Flush audio: drain swr remainder (partial frame), then flush encoder
-    if (aEnc_ctx && aSwrCtx && audio_out_stream && aEncFrame && aEncPkt) {
-        int remaining = swr_get_out_samples(aSwrCtx, 0);
-        if (remaining > 0) {
-            av_frame_make_writable(aEncFrame);
-            int got = swr_convert(aSwrCtx, aEncFrame->data, aEnc_ctx->frame_size, nullptr, 0);
-            // zero-pad the rest of the frame so the encoder sees a complete frame
-            if (got < aEnc_ctx->frame_size) {
-                int ch = aEncFrame->ch_layout.nb_channels;
+    int64_t s = max(s0, S0), e = min(s0 + f->nb_samples, S1);
+    while (s < e) {
+        int64_t b  = s * 1000 / ((int64_t)rate * kPeakBaseMs);
+        int64_t be = min(e, PeakBucketStart(b + 1, rate));
+        int off = (int)(s - s0), n = (int)(be - s);
+        int16_t lo16, hi16;
+        if (fmt == AV_SAMPLE_FMT_S16 || fmt == AV_SAMPLE_FMT_S16P) {
+            int lo = INT16_MAX, hi = INT16_MIN;
+            if (fmt == AV_SAMPLE_FMT_S16)
+                PeakReduceS16((const int16_t*)f->data[0] + (size_t)off * ch, n * ch, lo, hi);
+            else
                 for (int c = 0; c < ch; c++)
-                    memset(aEncFrame->data[c] + got * sizeof(float), 0,
-                           (aEnc_ctx->frame_size - got) * sizeof(float));
-            }
-            aEncFrame->pts = aOutPts;
-            aOutPts += aEnc_ctx->frame_size;
-            avcodec_send_frame(aEnc_ctx, aEncFrame);
+                    PeakReduceS16((const int16_t*)f->extended_data[c] + off, n, lo, hi);
+            lo16 = (int16_t)max(lo, -32767);
+            hi16 = (int16_t)hi;
+        } else {
+            float lo = FLT_MAX, hi = -FLT_MAX;
+            if (fmt == AV_SAMPLE_FMT_FLT)
+                PeakReduceF32((packedF ? packedF : (const float*)f->data[0]) + (size_t)off * ch, n * ch, lo, hi);
+            else
+                for (int c = 0; c < ch; c++)
+                    PeakReduceF32((const float*)f->extended_data[c] + off, n, lo, hi);
+            lo16 = PeakQuantize(lo);
+            hi16 = PeakQuantize(hi);
         }
-        avcodec_send_frame(aEnc_ctx, nullptr);
-        while (avcodec_receive_packet(aEnc_ctx, aEncPkt) == 0) {
-            aEncPkt->stream_index = audio_out_stream->index;
-            av_packet_rescale_ts(aEncPkt, aEnc_ctx->time_base, audio_out_stream->time_base);
-            av_interleaved_write_frame(out_fmt_ctx, aEncPkt);
-            av_packet_unref(aEncPkt);
+        if (b < pk.count[0]) {
+            int16_t* m = pk.mm[0] + b * 2;
+            if (m[0] > m[1]) { m[0] = lo16; m[1] = hi16; }
+            else { m[0] = min(m[0], lo16); m[1] = max(m[1], hi16); }
         }
+        s = be;
     }
+}
 
-    av_write_trailer(out_fmt_ctx);
-    success = true;
+// Decodes base buckets [first, last) of the selected stream on a private
+// demuxer.  Ranges are disjoint, so workers write pk->mm[0] without locking.
+static void PeakWorker(PeakIndex* pk, int first, int last) {
+    const int rate = pk->rate;
+    const int64_t S0 = PeakBucketStart(first, rate), S1 = PeakBucketStart(last, rate);
+    AVFormatContext* fmt   = nullptr;
+    AVCodecContext*  dec   = nullptr;
+    AVPacket*        pkt   = av_packet_alloc();
+    AVFrame*         frame = av_frame_alloc();
+    SwrContext*      swr   = nullptr;
+    std::vector<float> conv;
+
+    do {
+        if (!pkt || !frame) break;
+        if (avformat_open_input(&fmt, pk->path, nullptr, nullptr) < 0) break;
+        if (avformat_find_stream_info(fmt, nullptr) < 0) break;
+        if (pk->stream >= (int)fmt->nb_streams) break;
+        for (unsigned i = 0; i < fmt->nb_streams; i++)
+            fmt->streams[i]->discard = ((int)i == pk->stream) ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+        AVStream* st = fmt->streams[pk->stream];
+        const AVCodec* codec = avcodec_find_decoder(st->codecpar->codec_id);
+        dec = codec ? avcodec_alloc_context3(codec) : nullptr;
+        if (!dec || avcodec_parameters_to_context(dec, st->codecpar) < 0 ||
+            avcodec_open2(dec, codec, nullptr) < 0) break;
+
+        if (first > 0) {
+            int64_t ts = av_rescale_q(S0 + pk->startSamples, AVRational{ 1, rate }, st->time_base);
+            av_seek_frame(fmt, pk->stream, ts, AVSEEK_FLAG_BACKWARD);
+        }
+        int64_t next = 0;
+        bool done = false;
+        while (!done && !pk->stop) {
+            int ret = av_read_frame(fmt, pkt);
+            if (ret >= 0 && pkt->stream_index != pk->stream) { av_packet_unref(pkt); continue; }
+            avcodec_send_packet(dec, ret >= 0 ? pkt : nullptr);
+            av_packet_unref(pkt);
+            while (!done && avcodec_receive_frame(dec, frame) == 0) {
+                int64_t s0 = (frame->best_effort_timestamp != AV_NOPTS_VALUE)
+                    ? av_rescale_q(frame->best_effort_timestamp, st->time_base, AVRational{ 1, rate })
+                      - pk->startSamples
+                    : next;
+                next = s0 + frame->nb_samples;
+                if (s0 >= S1)     done = true;
+                else if (next > S0) PeakAccumulate(*pk, frame, s0, S0, S1, swr, conv);
+                av_frame_unref(frame);
+            }
+            if (ret < 0) break;
+        }
+    } while (false);
 
+    swr_free(&swr);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&dec);
+    if (fmt) avformat_close_input(&fmt);
+}
 
+static void PeaksBuildLevels(PeakIndex& pk) {
+    for (int l = 1; l < kPeakLevels; l++) {
+        int n = (pk.count[l - 1] + kPeakFanout - 1) / kPeakFanout;
+        int16_t* dst = (int16_t*)malloc((size_t)n * 2 * sizeof(int16_t));
+        if (!dst) break;
+        const int16_t* src = pk.mm[l - 1];
+        for (int i = 0; i < n; i++) {
+            int16_t lo = INT16_MAX, hi = INT16_MIN;
+            int j1 = min((i + 1) * kPeakFanout, pk.count[l - 1]);
+            for (int j = i * kPeakFanout; j < j1; j++) {
+                if (src[j * 2] > src[j * 2 + 1]) continue;
+                lo = min(lo, src[j * 2]);
+                hi = max(hi, src[j * 2 + 1]);
+            }
+            dst[i * 2] = lo; dst[i * 2 + 1] = hi;
+        }
+        pk.mm[l]    = dst;
+        pk.count[l] = n;
+    }
+}
 
-cleanup:
-    if (ext_sub_tmp[0]) DeleteFileA(ext_sub_tmp);
-    if (pre_filter_frame) av_frame_free(&pre_filter_frame);
-    if (pre_filter_sws)   sws_freeContext(pre_filter_sws);
-    if (trans_bsf_pkt) av_packet_free(&trans_bsf_pkt);
-    if (trans_bsf_ctx) av_bsf_free(&trans_bsf_ctx);
-    if (deint_graph)  avfilter_graph_free(&deint_graph);
-    if (filter_graph) avfilter_graph_free(&filter_graph);
-    if (sws_ctx) sws_freeContext(sws_ctx);
-    if (sws_hdr2rgb) sws_freeContext(sws_hdr2rgb);
-    if (sws_rgb2yuv) sws_freeContext(sws_rgb2yuv);
-    if (hdr_rgb48_buf) av_free(hdr_rgb48_buf);
-    if (hdr_bgr24_buf) av_free(hdr_bgr24_buf);
-    if (cpu_frame) av_frame_free(&cpu_frame);
-    if (frame) av_frame_free(&frame);
-    if (filt_frame) av_frame_free(&filt_frame);
-    if (pkt) av_packet_free(&pkt);
-    if (enc_pkt) av_packet_free(&enc_pkt);
-    if (dec_ctx)  avcodec_free_context(&dec_ctx);
-    if (enc_ctx)  avcodec_free_context(&enc_ctx);
-    if (aDec_ctx) avcodec_free_context(&aDec_ctx);
-    if (aEnc_ctx) avcodec_free_context(&aEnc_ctx);
-    if (aSwrCtx)  swr_free(&aSwrCtx);
-    if (aFrame)    av_frame_free(&aFrame);
-    if (aEncFrame) av_frame_free(&aEncFrame);
-    if (aEncPkt)   av_packet_free(&aEncPkt);
-    if (in_fmt_ctx) avformat_close_input(&in_fmt_ctx);
-    if (out_fmt_ctx) {
-        if (!(out_fmt_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&out_fmt_ctx->pb);
-        avformat_free_context(out_fmt_ctx);
-    }
-    return success;
+static void PeakCachePath(const char* path, char* out, size_t outLen) {
+    StringCchPrintfA(out, outLen, "%s.peaks", path);
 }
 
-// ------------------------------ Filmstrip Thumbnail Extraction ------------------------------
-// All 21 thumbnails share one persistent format/codec context opened once.
-// The seek is skipped for thumbnails whose target time is already past the last
-// decoded position — the same "skip the GOP seek" trick as StepForward.
-// A pre-drain step at the start of each thumbnail's loop flushes any frames
-// left in the decoder from the previous thumbnail, preventing avcodec_send_packet
-// from returning EAGAIN and silently dropping packets.
-
-static unsigned __stdcall ThumbExtractThreadProc(void* /*param*/) {
-    int tlW = 0;
-    if (g_hTimeline) { RECT rc; GetClientRect(g_hTimeline, &rc); tlW = rc.right; }
-    const int N = 21;
+static bool PeakCacheLoad(PeakIndex& pk, const PeakFileHeader& want) {
+    char cachePath[MAX_PATH + 8];
+    PeakCachePath(pk.path, cachePath, ARRAYSIZE(cachePath));
+    FILE* f = nullptr;
+    if (fopen_s(&f, cachePath, "rb") != 0 || !f) return false;
+    PeakFileHeader h = {};
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 &&
+              h.magic == want.magic && h.version == want.version &&
+              h.fileSize == want.fileSize && h.fileMtime == want.fileMtime &&
+              h.stream == want.stream && h.rate > 0 && h.count > 0 && h.count < (1 << 28);
+    if (ok) {
+        pk.mm[0] = (int16_t*)malloc((size_t)h.count * 2 * sizeof(int16_t));
+        ok = pk.mm[0] &&
+             fread(pk.mm[0], sizeof(int16_t) * 2, h.count, f) == (size_t)h.count;
+        if (ok) {
+            pk.stream       = h.stream;
+            pk.rate         = h.rate;
+            pk.startSamples = h.startSamples;
+            pk.count[0]     = h.count;
+        } else {
+            free(pk.mm[0]);
+            pk.mm[0] = nullptr;
+        }
+    }
+    fclose(f);
+    return ok;
+}
 
-    // Persistent state — opened once, reused across all N thumbnails.
-    AVFormatContext* fmt_ctx   = nullptr;
-    AVCodecContext*  dec_ctx   = nullptr;
-    SwsContext*      sws_ctx   = nullptr;  // SDR: lazy-init, kept alive across thumbnails
-    AVPacket*        pkt       = nullptr;
-    AVFrame*         frame     = nullptr;
-    AVFrame*         rgbFrame  = nullptr;
-    uint8_t*         rgbBuffer = nullptr;
-    int              videoIdx  = -1;
-    int              dstW = 0, dstH = 90;
-    int              srcW = 0, srcH = 0;
-
-    if (avformat_open_input(&fmt_ctx, g_inputPath, nullptr, nullptr) < 0) goto tf_done;
-    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) goto tf_done;
-    for (unsigned i = 0; i < fmt_ctx->nb_streams; i++) {
-        if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-            videoIdx = (int)i; break;
-        }
-    }
-    if (videoIdx < 0) goto tf_done;
-    {
-        AVStream* vs = fmt_ctx->streams[videoIdx];
-        const AVCodec* dec = avcodec_find_decoder(vs->codecpar->codec_id);
-        if (!dec) goto tf_done;
-        dec_ctx = avcodec_alloc_context3(dec);
-        if (!dec_ctx) goto tf_done;
-        if (avcodec_parameters_to_context(dec_ctx, vs->codecpar) < 0) goto tf_done;
-        if (avcodec_open2(dec_ctx, dec, nullptr) < 0) goto tf_done;
-
-        srcW = dec_ctx->width; srcH = dec_ctx->height;
-        dstW = (srcH > 0) ? (int)((double)srcW / srcH * dstH) : 160;
-        if (dstW < 1) dstW = 1;
-        if (g_thumbW == 0) { g_thumbW = dstW; g_thumbH = dstH; }
-
-        // sws_ctx created after first frame so frame->format is used rather than
-        // dec_ctx->pix_fmt, which can be wrong for 10-bit HEVC before decoding.
-        int bufSize = av_image_get_buffer_size(AV_PIX_FMT_BGR24, dstW, dstH, 1);
-        rgbBuffer = (uint8_t*)av_malloc(bufSize);
-        frame    = av_frame_alloc();
-        rgbFrame = av_frame_alloc();
-        pkt      = av_packet_alloc();
-        if (!rgbBuffer || !frame || !rgbFrame || !pkt) goto tf_done;
-        av_image_fill_arrays(rgbFrame->data, rgbFrame->linesize, rgbBuffer,
-            AV_PIX_FMT_BGR24, dstW, dstH, 1);
-    }
-
-    for (int i = 0; i < N && !g_thumbThreadStop; i++) {
-        // Use the left edge of each slot so the thumbnail shows the first frame
-        // of that section — more intuitive than the centre when browsing.
-        double t = (double)i / N * g_duration;
-        g_thumbTimes[i] = t;
-
-        AVStream* vs    = fmt_ctx->streams[videoIdx];
-        double    tbase = av_q2d(vs->time_base);
-        bool      gotFrame = false;
-
-        // Seek to the keyframe before t and flush the decoder for a clean state.
-        // Using the same seek+flush per thumbnail as the original per-call code
-        // is the most reliable approach; the open/close savings (×20) are already
-        // the dominant win and this keeps the decode logic straightforward.
-        av_seek_frame(fmt_ctx, -1, (int64_t)(t * AV_TIME_BASE), AVSEEK_FLAG_BACKWARD);
-        avcodec_flush_buffers(dec_ctx);
+// Best effort: a read-only folder just means the next open decodes again.
+// The cache is hidden, and Windows refuses to truncate a hidden file opened
+// without that attribute, so clear it before rewriting.
+static void PeakCacheSave(const PeakIndex& pk, PeakFileHeader h) {
+    char cachePath[MAX_PATH + 8];
+    PeakCachePath(pk.path, cachePath, ARRAYSIZE(cachePath));
+    SetFileAttributesA(cachePath, FILE_ATTRIBUTE_NORMAL);
+    FILE* f = nullptr;
+    if (fopen_s(&f, cachePath, "wb") != 0 || !f) return;
+    h.rate         = pk.rate;
+    h.startSamples = pk.startSamples;
+    h.count        = pk.count[0];
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+              fwrite(pk.mm[0], sizeof(int16_t) * 2, h.count, f) == (size_t)h.count;
+    fclose(f);
+    if (ok) SetFileAttributesA(cachePath, FILE_ATTRIBUTE_HIDDEN);
+    else    DeleteFileA(cachePath);
+}
 
-        // Original proven send-then-drain pattern.
-        while (!g_thumbThreadStop && !gotFrame && av_read_frame(fmt_ctx, pkt) >= 0) {
-            if (pkt->stream_index == videoIdx && avcodec_send_packet(dec_ctx, pkt) == 0) {
-                while (!gotFrame && avcodec_receive_frame(dec_ctx, frame) == 0) {
-                    int64_t pts = frame->best_effort_timestamp;
-                    if (pts == AV_NOPTS_VALUE) pts = frame->pts;
-                    double fSecs = (pts != AV_NOPTS_VALUE) ? (double)pts * tbase : t;
-
-                    if (fSecs + 0.001 >= t) {
-                        gotFrame = true;
-                        AVPixelFormat srcFmt = (AVPixelFormat)frame->format;
-                        bool isPQ  = (frame->color_trc == AVCOL_TRC_SMPTE2084);
-                        bool isHLG = (frame->color_trc == AVCOL_TRC_ARIB_STD_B67);
-                        if (isPQ || isHLG) {
-                            int srcCs    = (frame->colorspace == AVCOL_SPC_BT2020_NCL ||
-                                           frame->colorspace == AVCOL_SPC_BT2020_CL)
-                                           ? SWS_CS_BT2020 : SWS_CS_ITU709;
-                            int srcRange = (frame->color_range == AVCOL_RANGE_JPEG) ? 1 : 0;
-                            SwsContext* hdr_sws = sws_getContext(
-                                srcW, srcH, srcFmt, dstW, dstH, AV_PIX_FMT_RGB48LE,
-                                SWS_BILINEAR, nullptr, nullptr, nullptr);
-                            if (hdr_sws) {
-                                sws_setColorspaceDetails(hdr_sws,
-                                    sws_getCoefficients(srcCs),    srcRange,
-                                    sws_getCoefficients(SWS_CS_ITU709), 1, 0, 1<<16, 1<<16);
-                                int      rgb48Stride = dstW * 6;
-                                uint8_t* rgb48       = (uint8_t*)av_malloc(dstH * rgb48Stride);
-                                if (rgb48) {
-                                    uint8_t* d[1]={rgb48}; int s[1]={rgb48Stride};
-                                    sws_scale(hdr_sws, frame->data, frame->linesize, 0, srcH, d, s);
-                                    const double refW = isPQ ? 0.0203 : 0.25;
-                                    for (int y = 0; y < dstH; y++) {
-                                        const uint16_t* src16 = (const uint16_t*)(rgb48 + y*rgb48Stride);
-                                        uint8_t* dst8 = rgbFrame->data[0] + y*rgbFrame->linesize[0];
-                                        for (int x = 0; x < dstW; x++) {
-                                            double R=src16[x*3+0]/65535.0, G=src16[x*3+1]/65535.0, B=src16[x*3+2]/65535.0;
-                                            if (isPQ){R=pq_eotf(R);G=pq_eotf(G);B=pq_eotf(B);}
-                                            else     {R=hlg_eotf(R);G=hlg_eotf(G);B=hlg_eotf(B);}
-                                            double Ro=k_bt2020_to_bt709[0][0]*R+k_bt2020_to_bt709[0][1]*G+k_bt2020_to_bt709[0][2]*B;
-                                            double Go=k_bt2020_to_bt709[1][0]*R+k_bt2020_to_bt709[1][1]*G+k_bt2020_to_bt709[1][2]*B;
-                                            double Bo=k_bt2020_to_bt709[2][0]*R+k_bt2020_to_bt709[2][1]*G+k_bt2020_to_bt709[2][2]*B;
-                                            if(Ro<0)Ro=0; if(Go<0)Go=0; if(Bo<0)Bo=0;
-                                            Ro=reinhard_tm(Ro,refW); Go=reinhard_tm(Go,refW); Bo=reinhard_tm(Bo,refW);
-                                            dst8[x*3+0]=srgb_pack(Bo); dst8[x*3+1]=srgb_pack(Go); dst8[x*3+2]=srgb_pack(Ro);
-                                        }
-                                    }
-                                    av_free(rgb48);
-                                } else { gotFrame = false; }
-                                sws_freeContext(hdr_sws);
-                            } else { gotFrame = false; }
-                        } else {
-                            // SDR — lazy-init sws_ctx once, reuse across thumbnails.
-                            if (!sws_ctx)
-                                sws_ctx = sws_getContext(srcW, srcH, srcFmt, dstW, dstH,
-                                    AV_PIX_FMT_BGR24, SWS_BILINEAR, nullptr, nullptr, nullptr);
-                            if (sws_ctx)
-                                sws_scale(sws_ctx, frame->data, frame->linesize, 0, srcH,
-                                          rgbFrame->data, rgbFrame->linesize);
-                            else
-                                gotFrame = false;
-                        }
-                    }
-                    av_frame_unref(frame);
-                }
-            }
-            av_packet_unref(pkt);
+// Resolves the stream (-1 = best audio), the sample rate and where timeline
+// zero falls in audio samples, and sizes the base level.
+static bool PeaksProbe(PeakIndex& pk) {
+    AVFormatContext* fmt = nullptr;
+    if (avformat_open_input(&fmt, pk.path, nullptr, nullptr) < 0) return false;
+    int stream = pk.stream;
+    bool ok = false;
+    do {
+        if (avformat_find_stream_info(fmt, nullptr) < 0) break;
+        if (stream < 0) stream = av_find_best_stream(fmt, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+        if (stream < 0 || stream >= (int)fmt->nb_streams) break;
+        AVStream* st = fmt->streams[stream];
+        if (st->codecpar->codec_type != AVMEDIA_TYPE_AUDIO || st->codecpar->sample_rate <= 0) break;
+        pk.stream = stream;
+        pk.rate   = st->codecpar->sample_rate;
+        int v = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        if (v >= 0 && fmt->streams[v]->start_time != AV_NOPTS_VALUE)
+            pk.startSamples = av_rescale_q(fmt->streams[v]->start_time, fmt->streams[v]->time_base,
+                                           AVRational{ 1, pk.rate });
+        double dur = (fmt->duration > 0) ? fmt->duration / (double)AV_TIME_BASE : g_duration;
+        pk.count[0] = (int)(dur * 1000.0 / kPeakBaseMs) + 1;
+        pk.mm[0]    = (int16_t*)malloc((size_t)pk.count[0] * 2 * sizeof(int16_t));
+        if (!pk.mm[0]) break;
+        for (int i = 0; i < pk.count[0]; i++) {
+            pk.mm[0][i * 2]     = INT16_MAX;
+            pk.mm[0][i * 2 + 1] = INT16_MIN;
         }
+        ok = true;
+    } while (false);
+    avformat_close_input(&fmt);
+    return ok;
+}
 
-        if (gotFrame && !g_thumbThreadStop) {
-            BITMAPINFO bmi = {};
-            bmi.bmiHeader.biSize        = sizeof(BITMAPINFOHEADER);
-            bmi.bmiHeader.biWidth       = dstW;
-            bmi.bmiHeader.biHeight      = -dstH;
-            bmi.bmiHeader.biPlanes      = 1;
-            bmi.bmiHeader.biBitCount    = 24;
-            bmi.bmiHeader.biCompression = BI_RGB;
-            void* dibBits = nullptr;
-            HDC hdc = GetDC(nullptr);
-            HBITMAP bmp = CreateDIBSection(hdc, &bmi, DIB_RGB_COLORS, &dibBits, nullptr, 0);
-            ReleaseDC(nullptr, hdc);
-            if (bmp && dibBits) {
-                int srcRowBytes = dstW * 3;
-                int dibStride   = (srcRowBytes + 3) & ~3;  // DWORD-align
-                for (int y = 0; y < dstH; y++)
-                    memcpy((uint8_t*)dibBits + y * dibStride,
-                           rgbFrame->data[0] + y * rgbFrame->linesize[0], srcRowBytes);
-                g_thumbs[i] = bmp;
-                PostMessage(g_mainHwnd, WM_APP_THUMBS_READY, 0, 0);
-            } else {
-                if (bmp) DeleteObject(bmp);
+static unsigned __stdcall PeaksThreadProc(void* param) {
+    PeakIndex* pk = (PeakIndex*)param;
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+    LONGLONG t0 = QpcNow();
+
+    PeakFileHeader key = {};
+    key.magic   = kPeakFileMagic;
+    key.version = kPeakFileVer;
+    struct _stat64 st = {};
+    bool haveKey = _stat64(pk->path, &st) == 0;
+    key.fileSize  = st.st_size;
+    key.fileMtime = st.st_mtime;
+
+    bool cached = false, built = false;
+    if (PeaksProbe(*pk)) {
+        key.stream = pk->stream;
+        int16_t* fresh = pk->mm[0];
+        pk->mm[0] = nullptr;
+        cached = haveKey && PeakCacheLoad(*pk, key);
+        if (cached) free(fresh);
+        else        pk->mm[0] = fresh;
+
+        if (!cached) {
+            int n = max(1, min(4, (int)std::thread::hardware_concurrency()));
+            std::vector<std::thread> workers;
+            workers.reserve(n);
+            for (int w = 0; w < n; w++) {
+                int first = (int)((int64_t)pk->count[0] * w / n);
+                int last  = (int)((int64_t)pk->count[0] * (w + 1) / n);
+                workers.emplace_back(PeakWorker, pk, first, last);
             }
+            for (auto& th : workers) th.join();
+        }
+        if (!pk->stop) {
+            if (!cached && haveKey) PeakCacheSave(*pk, key);
+            PeaksBuildLevels(*pk);
+            built = true;
         }
     }
 
-tf_done:
-    if (sws_ctx)  sws_freeContext(sws_ctx);
-    if (frame)    av_frame_free(&frame);
-    if (rgbFrame) { if (rgbBuffer) av_free(rgbBuffer); av_frame_free(&rgbFrame); }
-    if (pkt)      av_packet_free(&pkt);
-    if (dec_ctx)  avcodec_free_context(&dec_ctx);
-    if (fmt_ctx)  avformat_close_input(&fmt_ctx);
+    // The workers have joined: from here on nothing but this thread touches
+    // the index's buckets.  If PeaksStop has already dropped it, it is ours
+    // to free.
+    EnterCriticalSection(&g_csPeaks);
+    bool orphaned = (g_peaks != pk);
+    pk->ready    = built && !orphaned;
+    pk->finished = true;
+    LeaveCriticalSection(&g_csPeaks);
+    if (orphaned) {
+        PeaksFree(pk);
+    } else if (built) {
+        PostMessage(g_mainHwnd, WM_APP_THUMBS_READY, 0, 0);
+        char dbg[160];
+        StringCchPrintfA(dbg, sizeof(dbg), "Peaks: stream %d, %d buckets %s in %.0f ms\n",
+            pk->stream, pk->count[0], cached ? "loaded" : "decoded",
+            (QpcNow() - t0) * 1000.0 / QpcFreq());
+        OutputDebugStringA(dbg);
+    }
     return 0;
 }
 
-static unsigned __stdcall ZoomThumbThreadProc(void* /*param*/) {
-    const int N = 21;
+// Drops the index on screen.  A build still running is told to stop and left
+// to free its index itself, so a track switch never waits on a decode; wait
+// (window teardown) also joins the thread, since g_csPeaks goes away after.
+static void PeaksStop(bool wait) {
+    EnterCriticalSection(&g_csPeaks);
+    PeakIndex* pk = g_peaks;
+    g_peaks = nullptr;
+    bool freeNow = false;
+    if (pk) {
+        pk->stop = true;
+        freeNow  = pk->finished;
+    }
+    LeaveCriticalSection(&g_csPeaks);
+    if (freeNow) PeaksFree(pk);
+    if (g_peaksThread) {
+        if (wait) WaitForSingleObject(g_peaksThread, INFINITE);
+        CloseHandle(g_peaksThread);
+        g_peaksThread = nullptr;
+    }
+}
 
-    // Compute the 21 thumbnail times: center ± 30 s at 3-second intervals.
-    double times[N];
-    for (int i = 0; i < N; i++) {
-        double t = g_zoomCenterMs / 1000.0 + (i - 10) * 3.0;
-        if (t < 0.0)          t = 0.0;
-        if (t > g_duration)   t = g_duration;
-        times[i]             = t;
-        g_zoomThumbTimes[i]  = t;
-    }
-
-    AVFormatContext* fmt_ctx   = nullptr;
-    AVCodecContext*  dec_ctx   = nullptr;
-    SwsContext*      sws_ctx   = nullptr;
-    AVPacket*        pkt       = nullptr;
-    AVFrame*         frame     = nullptr;
-    AVFrame*         rgbFrame  = nullptr;
-    uint8_t*         rgbBuffer = nullptr;
-    int              videoIdx  = -1;
-    int              dstW = 0, dstH = 90;
-    int              srcW = 0, srcH = 0;
-
-    if (avformat_open_input(&fmt_ctx, g_inputPath, nullptr, nullptr) < 0) goto zt_done;
-    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) goto zt_done;
-    for (unsigned i = 0; i < fmt_ctx->nb_streams; i++) {
-        if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-            videoIdx = (int)i; break;
-        }
-    }
-    if (videoIdx < 0) goto zt_done;
-    {
-        AVStream* vs = fmt_ctx->streams[videoIdx];
-        const AVCodec* dec = avcodec_find_decoder(vs->codecpar->codec_id);
-        if (!dec) goto zt_done;
-        dec_ctx = avcodec_alloc_context3(dec);
-        if (!dec_ctx) goto zt_done;
-        if (avcodec_parameters_to_context(dec_ctx, vs->codecpar) < 0) goto zt_done;
-        if (avcodec_open2(dec_ctx, dec, nullptr) < 0) goto zt_done;
-
-        srcW = dec_ctx->width; srcH = dec_ctx->height;
-        dstW = (srcH > 0) ? (int)((double)srcW / srcH * dstH) : 160;
-        if (dstW < 1) dstW = 1;
-
-        int bufSize = av_image_get_buffer_size(AV_PIX_FMT_BGR24, dstW, dstH, 1);
-        rgbBuffer = (uint8_t*)av_malloc(bufSize);
-        frame    = av_frame_alloc();
-        rgbFrame = av_frame_alloc();
-        pkt      = av_packet_alloc();
-        if (!rgbBuffer || !frame || !rgbFrame || !pkt) goto zt_done;
-        av_image_fill_arrays(rgbFrame->data, rgbFrame->linesize, rgbBuffer,
-            AV_PIX_FMT_BGR24, dstW, dstH, 1);
-    }
-
-    for (int i = 0; i < N && !g_zoomThumbStop; i++) {
-        double t     = times[i];
-        AVStream* vs = fmt_ctx->streams[videoIdx];
-        double tbase = av_q2d(vs->time_base);
-        bool gotFrame = false;
-
-        av_seek_frame(fmt_ctx, -1, (int64_t)(t * AV_TIME_BASE), AVSEEK_FLAG_BACKWARD);
-        avcodec_flush_buffers(dec_ctx);
+// Drops the current index and builds (or loads) one for the given audio
+// stream of path; -1 picks the default audio track.
+static void PeaksStart(const char* path, int stream) {
+    PeaksStop();
+    PeakIndex* pk = new PeakIndex();
+    StringCchCopyA(pk->path, MAX_PATH, path);
+    pk->stream = stream;
+    EnterCriticalSection(&g_csPeaks);
+    g_peaks = pk;
+    LeaveCriticalSection(&g_csPeaks);
+    g_peaksThread = (HANDLE)_beginthreadex(nullptr, 0, PeaksThreadProc, pk, 0, nullptr);
+    if (!g_peaksThread) {
+        EnterCriticalSection(&g_csPeaks);
+        g_peaks = nullptr;
+        LeaveCriticalSection(&g_csPeaks);
+        PeaksFree(pk);
+    }
+    InvalidateRect(g_hTimeline, nullptr, FALSE);
+}
 
-        while (!g_zoomThumbStop && !gotFrame && av_read_frame(fmt_ctx, pkt) >= 0) {
-            if (pkt->stream_index == videoIdx && avcodec_send_packet(dec_ctx, pkt) == 0) {
-                while (!gotFrame && avcodec_receive_frame(dec_ctx, frame) == 0) {
-                    int64_t pts = frame->best_effort_timestamp;
-                    if (pts == AV_NOPTS_VALUE) pts = frame->pts;
-                    double fSecs = (pts != AV_NOPTS_VALUE) ? (double)pts * tbase : t;
-                    if (fSecs + 0.001 >= t) {
-                        gotFrame = true;
-                        AVPixelFormat srcFmt = (AVPixelFormat)frame->format;
-                        bool isPQ  = (frame->color_trc == AVCOL_TRC_SMPTE2084);
-                        bool isHLG = (frame->color_trc == AVCOL_TRC_ARIB_STD_B67);
-                        if (isPQ || isHLG) {
-                            int srcCs    = (frame->colorspace == AVCOL_SPC_BT2020_NCL ||
-                                           frame->colorspace == AVCOL_SPC_BT2020_CL)
-                                           ? SWS_CS_BT2020 : SWS_CS_ITU709;
-                            int srcRange = (frame->color_range == AVCOL_RANGE_JPEG) ? 1 : 0;
-                            SwsContext* hdr_sws = sws_getContext(
-                                srcW, srcH, srcFmt, dstW, dstH, AV_PIX_FMT_RGB48LE,
-                                SWS_BILINEAR, nullptr, nullptr, nullptr);
-                            if (hdr_sws) {
-                                sws_setColorspaceDetails(hdr_sws,
-                                    sws_getCoefficients(srcCs), srcRange,
-                                    sws_getCoefficients(SWS_CS_ITU709), 1, 0, 1<<16, 1<<16);
-                                int rgb48Stride = dstW * 6;
-                                uint8_t* rgb48  = (uint8_t*)av_malloc(dstH * rgb48Stride);
-                                if (rgb48) {
-                                    uint8_t* d[1]={rgb48}; int s[1]={rgb48Stride};
-                                    sws_scale(hdr_sws, frame->data, frame->linesize, 0, srcH, d, s);
-                                    const double refW = isPQ ? 0.0203 : 0.25;
-                                    for (int y=0;y<dstH;y++){
-                                        const uint16_t* s16=(const uint16_t*)(rgb48+y*rgb48Stride);
-                                        uint8_t* d8=rgbFrame->data[0]+y*rgbFrame->linesize[0];
-                                        for(int x=0;x<dstW;x++){
-                                            double R=s16[x*3+0]/65535.0,G=s16[x*3+1]/65535.0,B=s16[x*3+2]/65535.0;
-                                            if(isPQ){R=pq_eotf(R);G=pq_eotf(G);B=pq_eotf(B);}
-                                            else    {R=hlg_eotf(R);G=hlg_eotf(G);B=hlg_eotf(B);}
-                                            double Ro=k_bt2020_to_bt709[0][0]*R+k_bt2020_to_bt709[0][1]*G+k_bt2020_to_bt709[0][2]*B;
-                                            double Go=k_bt2020_to_bt709[1][0]*R+k_bt2020_to_bt709[1][1]*G+k_bt2020_to_bt709[1][2]*B;
-                                            double Bo=k_bt2020_to_bt709[2][0]*R+k_bt2020_to_bt709[2][1]*G+k_bt2020_to_bt709[2][2]*B;
-                                            if(Ro<0)Ro=0;if(Go<0)Go=0;if(Bo<0)Bo=0;
-                                            Ro=reinhard_tm(Ro,refW);Go=reinhard_tm(Go,refW);Bo=reinhard_tm(Bo,refW);
-                                            d8[x*3+0]=srgb_pack(Bo);d8[x*3+1]=srgb_pack(Go);d8[x*3+2]=srgb_pack(Ro);
-                                        }
-                                    }
-                                    av_free(rgb48);
-                                } else { gotFrame = false; }
-                                sws_freeContext(hdr_sws);
-                            } else { gotFrame = false; }
-                        } else {
-                            if (!sws_ctx)
-                                sws_ctx = sws_getContext(srcW, srcH, srcFmt, dstW, dstH,
-                                    AV_PIX_FMT_BGR24, SWS_BILINEAR, nullptr, nullptr, nullptr);
-                            if (sws_ctx)
-                                sws_scale(sws_ctx, frame->data, frame->linesize, 0, srcH,
-                                          rgbFrame->data, rgbFrame->linesize);
-                            else
-                                gotFrame = false;
-                        }
-                    }
-                    av_frame_unref(frame);
-                }
-            }
-            av_packet_unref(pkt);
+// Draws the waveform of [ms0, ms1) into the given strip over a darkened band,
+// one vertical min..max line per column.  Returns false until the index is ready.
+static bool PeaksDraw(HDC dc, int x, int y, int w, int h, int64_t ms0, int64_t ms1) {
+    bool drawn = false;
+    EnterCriticalSection(&g_csPeaks);
+    const PeakIndex* pk = g_peaks;
+    if (pk && pk->ready && w > 0 && h > 2 && ms1 > ms0) {
+        double  msPerPx  = (double)(ms1 - ms0) / w;
+        int     l        = 0;
+        int64_t bucketMs = kPeakBaseMs;
+        while (l + 1 < kPeakLevels && pk->mm[l + 1] && bucketMs * kPeakFanout <= msPerPx) {
+            l++;
+            bucketMs *= kPeakFanout;
         }
-
-        if (gotFrame && !g_zoomThumbStop) {
-            BITMAPINFO bmi = {};
-            bmi.bmiHeader.biSize        = sizeof(BITMAPINFOHEADER);
-            bmi.bmiHeader.biWidth       = dstW;
-            bmi.bmiHeader.biHeight      = -dstH;
-            bmi.bmiHeader.biPlanes      = 1;
-            bmi.bmiHeader.biBitCount    = 24;
-            bmi.bmiHeader.biCompression = BI_RGB;
-            void* dibBits = nullptr;
-            HDC hdc = GetDC(nullptr);
-            HBITMAP bmp = CreateDIBSection(hdc, &bmi, DIB_RGB_COLORS, &dibBits, nullptr, 0);
-            ReleaseDC(nullptr, hdc);
-            if (bmp && dibBits) {
-                int srcRowBytes = dstW * 3;
-                int dibStride   = (srcRowBytes + 3) & ~3;
-                for (int y = 0; y < dstH; y++)
-                    memcpy((uint8_t*)dibBits + y * dibStride,
-                           rgbFrame->data[0] + y * rgbFrame->linesize[0], srcRowBytes);
-                g_zoomThumbs[i] = bmp;
-                PostMessage(g_mainHwnd, WM_APP_THUMBS_READY, 0, 0);
-            } else {
-                if (bmp) DeleteObject(bmp);
+        const int16_t* mm  = pk->mm[l];
+        const int      cnt = pk->count[l];
+
+        HDC     bandDC  = CreateCompatibleDC(dc);
+        HBITMAP bandBmp = CreateCompatibleBitmap(dc, 1, 1);
+        HBITMAP bandOld = (HBITMAP)SelectObject(bandDC, bandBmp);
+        SetPixel(bandDC, 0, 0, RGB(0, 0, 0));
+        BLENDFUNCTION bf = { AC_SRC_OVER, 0, 150, 0 };
+        AlphaBlend(dc, x, y, w, h, bandDC, 0, 0, 1, 1, bf);
+        SelectObject(bandDC, bandOld);
+        DeleteObject(bandBmp);
+        DeleteDC(bandDC);
+
+        HPEN wavePen = CreatePen(PS_SOLID, 1, RGB(90, 205, 175));
+        HPEN oldPen  = (HPEN)SelectObject(dc, wavePen);
+        const int mid = y + h / 2, half = h / 2 - 1;
+        for (int px = 0; px < w; px++) {
+            int64_t t0 = ms0 + (int64_t)(px * msPerPx);
+            int64_t t1 = ms0 + (int64_t)((px + 1) * msPerPx);
+            int b0 = (int)(t0 / bucketMs);
+            int b1 = max(b0 + 1, (int)((t1 + bucketMs - 1) / bucketMs));
+            if (b0 < 0 || b0 >= cnt) continue;
+            b1 = min(b1, cnt);
+            int lo = INT16_MAX, hi = INT16_MIN;
+            for (int b = b0; b < b1; b++) {
+                if (mm[b * 2] > mm[b * 2 + 1]) continue;
+                lo = min(lo, (int)mm[b * 2]);
+                hi = max(hi, (int)mm[b * 2 + 1]);
             }
+            if (lo > hi) continue;
+            MoveToEx(dc, x + px, mid - hi * half / 32767, nullptr);
+            LineTo(dc, x + px, mid - lo * half / 32767 + 1);
         }
+        SelectObject(dc, oldPen);
+        DeleteObject(wavePen);
+        drawn = true;
     }
-
-zt_done:
-    if (sws_ctx)  sws_freeContext(sws_ctx);
-    if (frame)    av_frame_free(&frame);
-    if (rgbFrame) { if (rgbBuffer) av_free(rgbBuffer); av_frame_free(&rgbFrame); }
-    if (pkt)      av_packet_free(&pkt);
-    if (dec_ctx)  avcodec_free_context(&dec_ctx);
-    if (fmt_ctx)  avformat_close_input(&fmt_ctx);
-    return 0;
+    LeaveCriticalSection(&g_csPeaks);
+    return drawn;
 }
 
 // ------------------------------ Timeline Window Proc ------------------------------
+// Shows the keyframe under the cursor while the thumb is dragged.  Each call
+// supersedes the last, so the playback thread only decodes toward the newest
+// position and the preview keeps up with the cursor.  When the cursor rests
+// for kScrubSettleMs the exact frame replaces it.
+static const UINT kScrubSettleMs = 120;
+
+static void TimelineScrub() {
+    EnsureThreadRunningPaused(g_mainHwnd);
+    ScrubMs(g_tlPos);
+    SetTimer(g_mainHwnd, IDT_SCRUB_SETTLE, kScrubSettleMs, nullptr);
+}
+
 LRESULT CALLBACK TimelineWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
     switch (msg) {
     case WM_ERASEBKGND:
@@ -4955,9 +5894,8 @@ LRESULT CALLBACK TimelineWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPar
         FillRect(memDC, &rc, bgBrush);
         DeleteObject(bgBrush);
 
-        // In zoom mode use g_zoomThumbs/g_zoomThumbTimes;
+        // In zoom mode slots come from the thumbnail atlas at g_zoomThumbTimes;
         // in normal mode use g_thumbs/g_thumbTimes.
-        HBITMAP* thumbArr  = g_isZoomed ? g_zoomThumbs : g_thumbs;
         double*  timeArr   = g_isZoomed ? g_zoomThumbTimes : g_thumbTimes;
 
         // Coordinate helpers — map ms↔pixels for the active range.
@@ -4977,8 +5915,18 @@ LRESULT CALLBACK TimelineWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPar
         const int thumbH = max(1, H - labelH);
 
         // Draw filmstrip thumbnails (below the label strip).
-        if (g_thumbW > 0 && W > 0) {
+        // g_csThumbs keeps the refinement pass from deleting a slot mid-blit.
+        if (g_isZoomed && W > 0) {
+            float slotW = (float)W / 21.0f;
+            for (int i = 0; i <= 20; i++) {
+                int x0 = (int)(i * slotW);
+                int x1 = (int)((i + 1) * slotW);
+                AtlasDraw(memDC, x0, thumbY, max(1, x1 - x0), thumbH, timeArr[i], kAtlasLevels - 1);
+            }
+        } else if (g_thumbW > 0 && W > 0) {
+            EnterCriticalSection(&g_csThumbs);
             float slotW = (float)W / 21.0f;
+            HBITMAP* thumbArr = g_thumbs;
             for (int i = 0; i <= 20; i++) {
                 if (!thumbArr[i]) continue;
                 int x0 = (int)(i * slotW);
@@ -4992,6 +5940,7 @@ LRESULT CALLBACK TimelineWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPar
                 SelectObject(srcDC, old);
                 DeleteDC(srcDC);
             }
+            LeaveCriticalSection(&g_csThumbs);
         }
 
         // Time labels — draw above each thumbnail slot.
@@ -5024,7 +5973,7 @@ LRESULT CALLBACK TimelineWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPar
         }
 
         // Thin separator lines between thumbnail slots.
-        if (g_thumbW > 0 && W > 0) {
+        if ((g_thumbW > 0 || g_isZoomed) && W > 0) {
             HPEN sepPen = CreatePen(PS_SOLID, 1, RGB(0, 0, 0));
             HPEN oldPen = (HPEN)SelectObject(memDC, sepPen);
             float slotW = (float)W / 21.0f;
@@ -5037,6 +5986,13 @@ LRESULT CALLBACK TimelineWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPar
             DeleteObject(sepPen);
         }
 
+        // Audio waveform along the bottom of the filmstrip.
+        if (g_tlMax > 0 && W > 0) {
+            int waveH = thumbH * 2 / 5;
+            if (g_isZoomed) PeaksDraw(memDC, 0, H - waveH, W, waveH, g_zoomStartMs, g_zoomEndMs);
+            else            PeaksDraw(memDC, 0, H - waveH, W, waveH, 0, g_tlMax);
+        }
+
         // Mark-in / mark-out overlays (darken excluded ranges).
         if (g_tlMax > 0 && W > 0 && (g_markInMs >= 0 || g_markOutMs >= 0)) {
             HDC overDC      = CreateCompatibleDC(memDC);
@@ -5074,6 +6030,19 @@ LRESULT CALLBACK TimelineWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPar
             }
         }
 
+        // Listed ranges: a violet band along the top of the filmstrip each.
+        if (g_tlMax > 0 && W > 0 && !g_ranges.empty()) {
+            HBRUSH bandBrush = CreateSolidBrush(RGB(155, 95, 255));
+            for (const TranscodeRange& r : g_ranges) {
+                int x0 = max(0, msToPixel((int64_t)(r.start_seconds * 1000.0)));
+                int x1 = min(W - 1, msToPixel((int64_t)(r.end_seconds * 1000.0)));
+                if (x1 <= x0) continue;
+                RECT band = { x0, thumbY, x1 + 1, thumbY + 4 };
+                FillRect(memDC, &band, bandBrush);
+            }
+            DeleteObject(bandBrush);
+        }
+
         // Playhead line.
         if (g_tlMax > 0 && W > 0) {
             int px = msToPixel(g_tlPos);
@@ -5114,6 +6083,7 @@ LRESULT CALLBACK TimelineWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPar
 
     case WM_LBUTTONDOWN: {
         if (!g_tlEnabled || !g_playerReady) break;
+        if (g_hHoverWnd) ShowWindow(g_hHoverWnd, SW_HIDE);
         SetCapture(hwnd);
         g_isDragging = true;
         RECT rc; GetClientRect(hwnd, &rc);
@@ -5126,11 +6096,22 @@ LRESULT CALLBACK TimelineWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPar
         }
         g_tlPos = max(0, min(g_tlPos, g_tlMax));
         InvalidateRect(hwnd, nullptr, FALSE);
+        // Scrub paused; playback picks up from the release point.
+        if (g_isPlaying) {
+            g_isPlaying   = false;
+            g_scrubResume = true;
+            InvalidateRect(g_hBtnPlayPause, nullptr, TRUE);
+        }
+        TimelineScrub();
         break;
     }
 
     case WM_MOUSEMOVE: {
-        if (!g_isDragging) break;
+        if (!g_isDragging) {
+            if (g_tlEnabled && g_playerReady) TimelineHover(hwnd, GET_X_LPARAM(lParam));
+            break;
+        }
+        int prevPos = g_tlPos;
         RECT rc; GetClientRect(hwnd, &rc);
         int x = GET_X_LPARAM(lParam);
         if (g_isZoomed) {
@@ -5141,6 +6122,7 @@ LRESULT CALLBACK TimelineWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPar
         }
         g_tlPos = max(0, min(g_tlPos, g_tlMax));
         InvalidateRect(hwnd, nullptr, FALSE);
+        if (g_tlPos != prevPos) TimelineScrub();
         break;
     }
 
@@ -5148,6 +6130,7 @@ LRESULT CALLBACK TimelineWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPar
         if (!g_isDragging) break;
         ReleaseCapture();
         g_isDragging = false;
+        KillTimer(g_mainHwnd, IDT_SCRUB_SETTLE);
         RECT rc; GetClientRect(hwnd, &rc);
         int x = GET_X_LPARAM(lParam);
         if (g_isZoomed) {
@@ -5158,15 +6141,110 @@ LRESULT CALLBACK TimelineWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPar
         }
         g_tlPos = max(0, min(g_tlPos, g_tlMax));
         InvalidateRect(hwnd, nullptr, FALSE);
-        // Seek to final position
+        // Seek to final position.  The scrub already has the preview close by,
+        // so there is no "generating" placeholder here.
         if (g_playerReady) {
-            g_isGenerating = true;
             EnsureThreadRunningPaused(g_mainHwnd);
-            SeekMs(g_tlPos, !g_isPlaying);
+            if (g_scrubResume) {
+                g_scrubResume  = false;
+                g_currentPosMs = g_tlPos;
+                SeekMs(g_tlPos, false);
+                g_isPlaying = true;
+                InvalidateRect(g_hBtnPlayPause, nullptr, TRUE);
+            } else {
+                SeekMs(g_tlPos, true);
+            }
             InvalidateRect(g_mainHwnd, nullptr, FALSE);
         }
         break;
     }
+
+    case WM_MOUSELEAVE: {
+        g_hoverTracking = false;
+        if (g_hHoverWnd) ShowWindow(g_hHoverWnd, SW_HIDE);
+        if (g_tlEnabled) AtlasFocusView(-1.0);
+        break;
+    }
+    }
+    return DefWindowProc(hwnd, msg, wParam, lParam);
+}
+
+// ------------------------------ Hover Preview ------------------------------
+// Small popup above the timeline showing the atlas tile under the cursor.
+// It never activates, so keyboard focus and the timeline capture are unaffected.
+
+static const int kHoverScale  = 2;   // popup shows atlas tiles at 2x
+static const int kHoverLabelH = 16;
+
+LRESULT CALLBACK HoverPreviewWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
+    switch (msg) {
+    case WM_ERASEBKGND:
+        return 1;
+
+    case WM_PAINT: {
+        PAINTSTRUCT ps;
+        HDC hdc = BeginPaint(hwnd, &ps);
+        RECT rc; GetClientRect(hwnd, &rc);
+        int W = rc.right, H = rc.bottom;
+
+        HBRUSH bgBrush = CreateSolidBrush(RGB(18, 18, 22));
+        FillRect(hdc, &rc, bgBrush);
+        DeleteObject(bgBrush);
+        AtlasDraw(hdc, 0, 0, W, H - kHoverLabelH, g_hoverSec,
+                  g_isZoomed ? kAtlasLevels - 1 : 1);
+
+        int tTot = (int)g_hoverSec;
+        int hh = tTot / 3600, mm = (tTot % 3600) / 60, ss = tTot % 60;
+        wchar_t wbuf[16];
+        if (hh > 0) swprintf(wbuf, 16, L"%d:%02d:%02d", hh, mm, ss);
+        else        swprintf(wbuf, 16, L"%d:%02d", mm, ss);
+        HFONT hLbl = CreateFontA(-11, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE,
+            DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS,
+            CLEARTYPE_QUALITY, DEFAULT_PITCH | FF_SWISS, "Segoe UI");
+        HFONT oldFont = (HFONT)SelectObject(hdc, hLbl ? hLbl : GetStockObject(DEFAULT_GUI_FONT));
+        SetBkMode(hdc, TRANSPARENT);
+        SetTextColor(hdc, RGB(210, 210, 210));
+        RECT tr = { 0, H - kHoverLabelH, W, H };
+        DrawTextW(hdc, wbuf, -1, &tr, DT_CENTER | DT_VCENTER | DT_SINGLELINE);
+        SelectObject(hdc, oldFont);
+        if (hLbl) DeleteObject(hLbl);
+
+        EndPaint(hwnd, &ps);
+        return 0;
+    }
     }
     return DefWindowProc(hwnd, msg, wParam, lParam);
 }
+
+// Updates the hover popup for client x on the timeline and points the atlas
+// generator at the hovered time on the level the popup shows.
+static void TimelineHover(HWND hwnd, int x) {
+    if (!g_hoverTracking) {
+        TRACKMOUSEEVENT tme = { sizeof(tme), TME_LEAVE, hwnd, 0 };
+        g_hoverTracking = TrackMouseEvent(&tme) != FALSE;
+    }
+
+    RECT rc; GetClientRect(hwnd, &rc);
+    double ms;
+    if (g_isZoomed)
+        ms = g_zoomStartMs + (double)x / max(1, rc.right) * (g_zoomEndMs - g_zoomStartMs);
+    else
+        ms = (double)x / max(1, rc.right) * g_tlMax;
+    g_hoverSec = max(0.0, min(ms / 1000.0, g_duration));
+    AtlasFocusView(g_hoverSec);
+
+    if (g_atlasTileW <= 0) return;
+    int popW = g_atlasTileW * kHoverScale;
+    int popH = kAtlasTileH * kHoverScale + kHoverLabelH;
+    if (!g_hHoverWnd) {
+        g_hHoverWnd = CreateWindowEx(WS_EX_TOOLWINDOW | WS_EX_TOPMOST | WS_EX_NOACTIVATE,
+            L"ResizerHoverPreview", L"", WS_POPUP | WS_BORDER,
+            0, 0, popW, popH, g_mainHwnd, nullptr, GetModuleHandle(nullptr), nullptr);
+        if (!g_hHoverWnd) return;
+    }
+    POINT pt = { x, 0 };
+    ClientToScreen(hwnd, &pt);
+    SetWindowPos(g_hHoverWnd, nullptr, pt.x - popW / 2, pt.y - popH - 6, popW, popH,
+                 SWP_NOZORDER | SWP_NOACTIVATE | SWP_SHOWWINDOW);
+    InvalidateRect(g_hHoverWnd, nullptr, FALSE);
+}
@@ -0,0 +1,57 @@
+﻿// media.cpp
+// Container probing: one avformat_open_input + find_stream_info per file,
+// reduced to a MediaInfo.
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include "media.h"
+#include "hdr.h"
+
+bool ProbeMedia(const char* path, MediaInfo& info) {
+    info = MediaInfo();
+    AVFormatContext* fmt_ctx = nullptr;
+    if (avformat_open_input(&fmt_ctx, path, nullptr, nullptr) < 0) return false;
+    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) { avformat_close_input(&fmt_ctx); return false; }
+
+    for (unsigned i = 0; i < fmt_ctx->nb_streams; i++) {
+        const AVStream*          st  = fmt_ctx->streams[i];
+        const AVCodecParameters* par = st->codecpar;
+        MediaStream ms;
+        ms.index = (int)i;
+        ms.type  = par->codec_type;
+        ms.codec = avcodec_get_name(par->codec_id);
+        const AVDictionaryEntry* lang  = av_dict_get(st->metadata, "language", nullptr, 0);
+        const AVDictionaryEntry* title = av_dict_get(st->metadata, "title",    nullptr, 0);
+        if (lang)  ms.language = lang->value;
+        if (title) ms.title    = title->value;
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+            ms.width  = par->width;
+            ms.height = par->height;
+        } else if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
+            ms.channels   = par->ch_layout.nb_channels;
+            ms.sampleRate = par->sample_rate;
+        }
+        info.streams.push_back(ms);
+
+        if (par->codec_type != AVMEDIA_TYPE_VIDEO || info.videoStream >= 0) continue;
+        info.videoStream = (int)i;
+        info.width       = par->width;
+        info.height      = par->height;
+        if (st->avg_frame_rate.num && st->avg_frame_rate.den)
+            info.fps = av_q2d(st->avg_frame_rate);
+        else if (st->r_frame_rate.num && st->r_frame_rate.den)
+            info.fps = av_q2d(st->r_frame_rate);
+        info.hdrTrc = (int)par->color_trc;
+        if (par->color_trc == AVCOL_TRC_SMPTE2084 || par->color_trc == AVCOL_TRC_ARIB_STD_B67)
+            info.isHdr = true;
+        else if (par->color_primaries == AVCOL_PRI_BT2020)
+            info.isHdr = true;  // BT.2020 primaries without explicit TRC tag
+    }
+    if (fmt_ctx->duration != AV_NOPTS_VALUE) info.duration = fmt_ctx->duration / (double)AV_TIME_BASE;
+    avformat_close_input(&fmt_ctx);
+
+    if (info.isHdr) GetToneMapLuts(info.hdrTrc == AVCOL_TRC_SMPTE2084);
+    return info.videoStream >= 0;
+}
@@ -0,0 +1,34 @@
+﻿// media.h
+// Container probing shared by the window, the C API and resizer-cli: the
+// video geometry, duration, frame rate and HDR tagging the transcode needs,
+// plus a flat list of every stream for track pickers.
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+struct MediaStream {
+    int         index      = -1;     // global stream index, as the transcode takes it
+    int         type       = -1;     // AVMediaType
+    std::string codec;
+    std::string language;            // empty if untagged
+    std::string title;
+    int         width      = 0, height = 0;       // video
+    int         channels   = 0, sampleRate = 0;   // audio
+};
+
+struct MediaInfo {
+    int    width       = 0, height = 0;
+    double duration    = 0.0;        // seconds; 0 if the container doesn't say
+    double fps         = 30.0;       // avg, else r_frame_rate, else 30
+    int    videoStream = -1;
+    bool   isHdr       = false;      // PQ/HLG tagged, or BT.2020 primaries without a TRC
+    int    hdrTrc      = 0;          // AVColorTransferCharacteristic of the video stream
+    std::vector<MediaStream> streams;
+};
+
+// Opens and probes path.  False if it can't be opened or has no video stream;
+// info is reset either way.  Builds the tone-mapping LUTs for HDR sources so
+// the first converted frame doesn't pay for them.
+bool ProbeMedia(const char* path, MediaInfo& info);
@@ -0,0 +1,129 @@
+﻿// platform.h
+// The handful of Win32 helpers the engine files lean on, so they build
+// unchanged on Linux, and the engine's log sink.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <mutex>
+#include <string>
+
+#ifdef _WIN32
+
+#include <windows.h>
+#include <strsafe.h>
+
+// Paths cross the engine boundary as UTF-8 (resizer.h); the Win32 calls
+// take them as UTF-16 so names outside the ANSI code page still open.  A
+// string that is not valid UTF-8 is read as ANSI instead, which is also what
+// FFmpeg's file protocol does with it.
+static inline std::wstring Utf8ToWide(const char* s) {
+    UINT cp = CP_UTF8;
+    int  n  = MultiByteToWideChar(cp, MB_ERR_INVALID_CHARS, s, -1, nullptr, 0);
+    if (n <= 0) { cp = CP_ACP; n = MultiByteToWideChar(cp, 0, s, -1, nullptr, 0); }
+    if (n <= 1) return std::wstring();
+    std::wstring w((size_t)n - 1, L'\0');
+    MultiByteToWideChar(cp, 0, s, -1, &w[0], n);
+    return w;
+}
+static inline std::string WideToUtf8(const wchar_t* s, int len = -1) {
+    int n = WideCharToMultiByte(CP_UTF8, 0, s, len, nullptr, 0, nullptr, nullptr);
+    if (n <= 0) return std::string();
+    std::string u((size_t)n, '\0');
+    WideCharToMultiByte(CP_UTF8, 0, s, len, &u[0], n, nullptr, nullptr);
+    if (len < 0) u.pop_back();          // the converted terminator
+    return u;
+}
+
+static inline FILE* FileOpenUtf8(const char* path, const char* mode) {
+    FILE* f = nullptr;
+    return _wfopen_s(&f, Utf8ToWide(path).c_str(), Utf8ToWide(mode).c_str()) == 0 ? f : nullptr;
+}
+static inline bool DeleteFileUtf8(const char* path) {
+    return DeleteFileW(Utf8ToWide(path).c_str()) != 0;
+}
+// Renames from over to, replacing it.
+static inline bool ReplaceFileUtf8(const char* from, const char* to) {
+    return MoveFileExW(Utf8ToWide(from).c_str(), Utf8ToWide(to).c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+static inline int64_t QpcNow() {
+    LARGE_INTEGER t; QueryPerformanceCounter(&t);
+    return t.QuadPart;
+}
+static inline int64_t QpcFreq() {
+    static int64_t f = 0;
+    if (!f) { LARGE_INTEGER t; QueryPerformanceFrequency(&t); f = t.QuadPart; }
+    return f;
+}
+
+#else
+
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+
+#ifndef MAX_PATH
+#define MAX_PATH 4096
+#endif
+
+using std::min;
+using std::max;
+
+#define StringCchPrintfA snprintf
+static inline int StringCchCopyA(char* dst, size_t size, const char* src) {
+    if (!size) return -1;
+    snprintf(dst, size, "%s", src);
+    return 0;
+}
+
+static inline FILE* FileOpenUtf8(const char* path, const char* mode) { return fopen(path, mode); }
+static inline bool DeleteFileUtf8(const char* path) { return unlink(path) == 0; }
+static inline bool ReplaceFileUtf8(const char* from, const char* to) { return rename(from, to) == 0; }
+
+static inline int64_t QpcNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+static inline int64_t QpcFreq() { return 1000000000; }
+
+#endif
+
+// Engine diagnostics.  They go to the debugger on Windows and to stderr
+// elsewhere unless a sink is installed (rz_set_log_callback); stdout is left
+// to the CLI's progress stream.
+typedef void (*EngineLogFn)(void* opaque, const char* msg);
+struct EngineLogSink {
+    EngineLogFn fn     = nullptr;
+    void*       opaque = nullptr;
+};
+// fn and opaque change together under the lock; EngineLog calls a copy, so
+// a sink swapped meanwhile never sees the other one's opaque.
+inline std::mutex& EngineLogMutex() {
+    static std::mutex m;
+    return m;
+}
+inline EngineLogSink& EngineLogHook() {
+    static EngineLogSink sink;
+    return sink;
+}
+inline void SetEngineLogSink(EngineLogFn fn, void* opaque) {
+    std::lock_guard<std::mutex> lock(EngineLogMutex());
+    EngineLogHook().fn     = fn;
+    EngineLogHook().opaque = opaque;
+}
+inline void EngineLog(const char* msg) {
+    EngineLogSink sink;
+    {
+        std::lock_guard<std::mutex> lock(EngineLogMutex());
+        sink = EngineLogHook();
+    }
+    if (sink.fn) { sink.fn(sink.opaque, msg); return; }
+#ifdef _WIN32
+    OutputDebugStringA(msg);
+#else
+    fputs(msg, stderr);
+#endif
+}
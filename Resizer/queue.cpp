@@ -0,0 +1,487 @@
+﻿// queue.cpp
+// EncodeQueue: job bookkeeping, the slot scheduler and the state file.
+// Scheduling runs whenever something changes (a job added, finished,
+// reprioritised, the queue unpaused) on whichever thread made the change;
+// there is no scheduler thread of its own.
+
+#include "queue.h"
+#include "platform.h"
+#include "hwaccel.h"
+
+#include <string>
+#include <thread>
+#include <stdlib.h>
+#include <string.h>
+
+// Cores per libx264 job when sizing the software slots.  x264 stops scaling
+// long before a whole workstation's worth of threads at 1080p, so several
+// narrower jobs finish a batch sooner than one wide one.
+static const int kCoresPerSwJob = 4;
+
+EncodeQueue::EncodeQueue(const char* statePath) {
+    if (statePath) statePath_ = statePath;
+    int cores = max(1, (int)std::thread::hardware_concurrency());
+    SetSlots(HwEncodeAvailable() ? 1 : 0, max(1, cores / kCoresPerSwJob));
+}
+
+// Running jobs are cancelled (their partial outputs deleted) and saved as
+// queued, so the next Load picks them up from the start.
+EncodeQueue::~EncodeQueue() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    closing_ = true;
+    for (auto& j : jobs_)
+        if (j->session) j->session->Cancel();
+    idle_.wait(lock, [this] {
+        for (auto& j : jobs_) if (j->session) return false;
+        return true;
+    });
+    SaveLocked();
+}
+
+void EncodeQueue::SetChangeCallback(ChangeFn fn, void* opaque) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    changeFn_     = fn;
+    changeOpaque_ = opaque;
+}
+
+void EncodeQueue::SetSlots(int hwSlots, int swSlots) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int cores  = max(1, (int)std::thread::hardware_concurrency());
+    if (hwSlots >= 0) hwSlots_ = hwSlots;
+    if (swSlots >= 0) swSlots_ = swSlots;
+    swThreads_ = max(1, cores / max(1, swSlots_));
+    ScheduleLocked();
+}
+
+// ------------------------------ Jobs ------------------------------
+EncodeQueue::Job* EncodeQueue::FindLocked(int id) const {
+    for (auto& j : jobs_)
+        if (j->info.id == id) return j.get();
+    return nullptr;
+}
+
+int EncodeQueue::Add(const TranscodeParams& params, int priority) {
+    int id;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::unique_ptr<Job> job(new Job());
+        job->info.id       = id = nextId_++;
+        job->info.priority = priority;
+        job->info.params   = params;
+        // Jobs run on worker threads and outlive the caller's callback state.
+        job->info.params.progress        = nullptr;
+        job->info.params.progress_opaque = nullptr;
+        jobs_.push_back(std::move(job));
+        ScheduleLocked();
+        SaveLocked();
+    }
+    NotifyChanged();
+    return id;
+}
+
+bool EncodeQueue::Cancel(int id) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Job* j = FindLocked(id);
+        if (!j) return false;
+        if (j->session) {
+            j->session->Cancel();       // OnJobDone records the outcome
+            return true;
+        }
+        if (j->info.state != JOB_QUEUED) return false;
+        j->info.state = JOB_CANCELLED;
+        SaveLocked();
+        idle_.notify_all();
+    }
+    NotifyChanged();
+    return true;
+}
+
+bool EncodeQueue::Remove(int id) {
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < jobs_.size() && !found; i++) {
+            if (jobs_[i]->info.id != id) continue;
+            if (jobs_[i]->session) return false;
+            jobs_.erase(jobs_.begin() + i);
+            found = true;
+        }
+        if (found) { SaveLocked(); idle_.notify_all(); }
+    }
+    if (found) NotifyChanged();
+    return found;
+}
+
+bool EncodeQueue::SetPriority(int id, int priority) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Job* j = FindLocked(id);
+        if (!j) return false;
+        j->info.priority = priority;
+        ScheduleLocked();
+        SaveLocked();
+    }
+    NotifyChanged();
+    return true;
+}
+
+bool EncodeQueue::Retry(int id) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Job* j = FindLocked(id);
+        if (!j || (j->info.state != JOB_FAILED && j->info.state != JOB_CANCELLED)) return false;
+        j->info.state    = JOB_QUEUED;
+        j->info.progress = 0.0;
+        j->info.stats    = TranscodeStats();
+        ScheduleLocked();
+        SaveLocked();
+    }
+    NotifyChanged();
+    return true;
+}
+
+void EncodeQueue::ClearFinished() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < jobs_.size();) {
+            JobState st = jobs_[i]->info.state;
+            if (st == JOB_DONE || st == JOB_FAILED || st == JOB_CANCELLED) jobs_.erase(jobs_.begin() + i);
+            else                                                         i++;
+        }
+        SaveLocked();
+    }
+    NotifyChanged();
+}
+
+void EncodeQueue::Pause(bool paused) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        paused_ = paused;
+        ScheduleLocked();
+        SaveLocked();
+        idle_.notify_all();
+    }
+    NotifyChanged();
+}
+
+bool EncodeQueue::Paused() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return paused_;
+}
+
+bool EncodeQueue::Idle() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& j : jobs_) {
+        if (j->session) return false;
+        if (j->info.state == JOB_QUEUED && !paused_) return false;
+    }
+    return true;
+}
+
+void EncodeQueue::WaitIdle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] {
+        for (auto& j : jobs_) {
+            if (j->session) return false;
+            if (j->info.state == JOB_QUEUED && !paused_) return false;
+        }
+        return true;
+    });
+}
+
+std::vector<QueueJob> EncodeQueue::Snapshot() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<QueueJob> out;
+    out.reserve(jobs_.size());
+    for (auto& j : jobs_) {
+        out.push_back(j->info);
+        if (j->session) out.back().progress = j->session->Progress();
+    }
+    return out;
+}
+
+bool EncodeQueue::HasOutput(const char* path) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& j : jobs_)
+        if (j->info.state == JOB_QUEUED || j->info.state == JOB_RUNNING) {
+            if (j->info.params.out_path == path) return true;
+            for (auto& r : j->info.params.renditions)
+                if (r.out_path == path) return true;
+            for (auto& r : j->info.params.ranges)
+                if (r.out_path == path) return true;
+        }
+    return false;
+}
+
+bool EncodeQueue::HasInput(const char* path) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& j : jobs_)
+        if ((j->info.state == JOB_QUEUED || j->info.state == JOB_RUNNING) &&
+            j->info.params.in_path == path) return true;
+    return false;
+}
+
+void EncodeQueue::NotifyChanged() {
+    ChangeFn fn; void* opaque;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fn = changeFn_; opaque = changeOpaque_;
+    }
+    if (fn) fn(opaque);
+}
+
+// ------------------------------ Scheduler ------------------------------
+// Fills free slots with the best queued jobs: highest priority, then oldest.
+// The hardware slot is filled first; every job is capped at the software
+// slots' share of the cores so decode and scaling don't oversubscribe either.
+// A job with renditions opens an encoder (an NVENC session) for each output at
+// once, so on the hardware side it takes that many slots, or every slot when
+// it is the only hardware job; its threads are shared between its outputs.
+void EncodeQueue::ScheduleLocked() {
+    if (paused_ || closing_) return;
+    auto encoders = [](const QueueJob& q) {
+        return 1 + (q.params.split_ranges ? 0 : (int)q.params.renditions.size());
+    };
+    int hwRunning = 0, swRunning = 0;
+    for (auto& j : jobs_) {
+        if (!j->session) continue;
+        if (j->info.hardware) hwRunning += encoders(j->info);
+        else                  swRunning++;
+    }
+
+    for (;;) {
+        Job* next = nullptr;
+        for (auto& j : jobs_) {
+            if (j->info.state != JOB_QUEUED) continue;
+            if (!next || j->info.priority > next->info.priority) next = j.get();
+        }
+        if (!next) return;
+        int  need = encoders(next->info);
+        bool hw;
+        if      (hwSlots_ > 0 && (hwRunning + need <= hwSlots_ || hwRunning == 0)) hw = true;
+        else if (swRunning < swSlots_) hw = false;
+        else return;
+
+        TranscodeParams p = next->info.params;
+        p.software_encode = !hw;
+        p.threads         = swThreads_;
+        next->session.reset(new TranscodeSession(p));
+        next->info.state    = JOB_RUNNING;
+        next->info.hardware = hw;
+        next->info.progress = 0.0;
+        if (hw) hwRunning += need;
+        else    swRunning++;
+        next->session->Start(OnJobDone, this);
+    }
+}
+
+// Runs on the finished job's own encoding thread.  Nothing of the queue is
+// touched after the lock is released, since the destructor may be waiting
+// for exactly this job.
+void EncodeQueue::OnJobDone(void* opaque, TranscodeSession* session) {
+    EncodeQueue* q = (EncodeQueue*)opaque;
+    ChangeFn fn; void* fnOpaque;
+    {
+        std::lock_guard<std::mutex> lock(q->mutex_);
+        for (auto& j : q->jobs_) {
+            if (j->session.get() != session) continue;
+            j->info.stats = session->Stats();
+            if (session->Succeeded())              j->info.state = JOB_DONE;
+            else if (!session->Stats().cancelled)  j->info.state = JOB_FAILED;
+            else j->info.state = q->closing_ ? JOB_QUEUED : JOB_CANCELLED;
+            j->info.progress = (j->info.state == JOB_DONE) ? 1.0 : 0.0;
+            j->session.reset();         // we are its thread: it detaches, not joins
+            break;
+        }
+        q->ScheduleLocked();
+        q->SaveLocked();
+        fn = q->changeFn_; fnOpaque = q->changeOpaque_;
+        q->idle_.notify_all();
+    }
+    if (fn) fn(fnOpaque);
+}
+
+// ------------------------------ State File ------------------------------
+// Plain text, one "key=value" per line, a job per "job" ... "end" block.
+// Values escape backslash and newline, so any path round-trips.
+
+static std::string Escape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+        if      (c == '\\') out += "\\\\";
+        else if (c == '\n') out += "\\n";
+        else if (c == '\r') out += "\\r";
+        else                out += c;
+    }
+    return out;
+}
+
+static std::string Unescape(const char* s) {
+    std::string out;
+    for (; *s; s++) {
+        if (*s != '\\' || !s[1]) { out += *s; continue; }
+        s++;
+        out += (*s == 'n') ? '\n' : (*s == 'r') ? '\r' : *s;
+    }
+    return out;
+}
+
+// The checks rz_transcode* make on their arguments, for a job read back from
+// a state file that may have been edited by hand or cut short.
+static bool LoadedParamsValid(const TranscodeParams& p) {
+    auto validScale = [](int s) { return s == 1 || s == 2 || s == 4; };
+    if (p.target_size_mb <= 0.0 || !validScale(p.scale_factor)) return false;
+    if (p.mp4_layout < MP4_FASTSTART || p.mp4_layout > MP4_FRAGMENTED) return false;
+    if (p.start_seconds < 0.0 || p.end_seconds <= p.start_seconds) return false;
+    for (const TranscodeRendition& r : p.renditions)
+        if (r.out_path.empty() || r.target_size_mb <= 0.0 || !validScale(r.scale_factor)) return false;
+    for (size_t i = 0; i < p.ranges.size(); i++) {
+        const TranscodeRange& r = p.ranges[i];
+        if (r.start_seconds < 0.0 || r.end_seconds <= r.start_seconds || r.end_seconds > p.end_seconds)
+            return false;
+        if (!p.split_ranges) continue;
+        if (r.out_path.empty() || r.target_size_mb <= 0.0) return false;
+        for (size_t k = 0; k < i; k++)
+            if (r.out_path == p.ranges[k].out_path) return false;
+    }
+    return true;
+}
+
+// Writes to path.tmp and renames over path, so a crash mid-save leaves the
+// previous state intact.
+bool EncodeQueue::SaveLocked() const {
+    if (statePath_.empty()) return true;
+    std::string tmp = statePath_ + ".tmp";
+    FILE* f = FileOpenUtf8(tmp.c_str(), "wb");
+    if (!f) return false;
+    fprintf(f, "resizer-queue 1\npaused=%d\n", paused_ ? 1 : 0);
+    for (auto& j : jobs_) {
+        const QueueJob&        q = j->info;
+        const TranscodeParams& p = q.params;
+        // An interrupted job starts over next time.
+        int state = (q.state == JOB_RUNNING) ? JOB_QUEUED : q.state;
+        fprintf(f, "job\nid=%d\npriority=%d\nstate=%d\n", q.id, q.priority, state);
+        fprintf(f, "in=%s\nout=%s\nsubs_file=%s\n", Escape(p.in_path).c_str(),
+                Escape(p.out_path).c_str(), Escape(p.ext_subtitle_path).c_str());
+        fprintf(f, "size_mb=%.17g\nscale=%d\nwidth=%d\nheight=%d\nfrom=%.17g\nto=%.17g\n",
+                p.target_size_mb, p.scale_factor, p.orig_w, p.orig_h, p.start_seconds, p.end_seconds);
+        fprintf(f, "audio=%d\nsubs=%d\nhdr_to_sdr=%d\nlayout=%d\nunbuffered=%d\nsplit_ranges=%d\n",
+                p.audio_stream_index, p.subtitle_stream_index, p.convert_hdr_to_sdr ? 1 : 0,
+                p.mp4_layout, p.unbuffered_output ? 1 : 0, p.split_ranges ? 1 : 0);
+        // "rendition=<size_mb> <scale> <path>", one line each.
+        for (auto& r : p.renditions)
+            fprintf(f, "rendition=%.17g %d %s\n", r.target_size_mb, r.scale_factor, Escape(r.out_path).c_str());
+        // "range=<from> <to> <size_mb> <path>"; the path may be empty.
+        for (auto& r : p.ranges)
+            fprintf(f, "range=%.17g %.17g %.17g %s\n", r.start_seconds, r.end_seconds,
+                    r.target_size_mb, Escape(r.out_path).c_str());
+        fputs("end\n", f);
+    }
+    bool ok = fflush(f) == 0;
+    fclose(f);
+    if (!ok) { DeleteFileUtf8(tmp.c_str()); return false; }
+    return ReplaceFileUtf8(tmp.c_str(), statePath_.c_str());
+}
+
+bool EncodeQueue::Save() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return SaveLocked();
+}
+
+bool EncodeQueue::Load(bool startPaused) {
+    if (statePath_.empty()) return false;
+    FILE* f = FileOpenUtf8(statePath_.c_str(), "rb");
+    if (!f) return false;
+
+    std::vector<std::unique_ptr<Job>> loaded;
+    std::unique_ptr<Job> cur;
+    bool paused = false, ok = false;
+    int  maxId  = 0;
+    char line[8192];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (!ok) { ok = strcmp(line, "resizer-queue 1") == 0; if (!ok) break; continue; }
+        if (!strcmp(line, "job")) { cur.reset(new Job()); continue; }
+        if (!strcmp(line, "end")) {
+            if (cur && !cur->info.params.in_path.empty() && !cur->info.params.out_path.empty()) {
+                // Kept in the list, so the user sees what was dropped, but never run.
+                if (!LoadedParamsValid(cur->info.params) &&
+                    (cur->info.state == JOB_QUEUED || cur->info.state == JOB_RUNNING)) {
+                    char msg[MAX_PATH + 64];
+                    StringCchPrintfA(msg, sizeof(msg), "EncodeQueue: job %d (%s) has invalid settings; not run.\n",
+                                     cur->info.id, cur->info.params.in_path.c_str());
+                    EngineLog(msg);
+                    cur->info.state = JOB_FAILED;
+                }
+                maxId = max(maxId, cur->info.id);
+                loaded.push_back(std::move(cur));
+            }
+            cur.reset();
+            continue;
+        }
+        char* eq = strchr(line, '=');
+        if (!eq) continue;
+        *eq = 0;
+        const char* k = line;
+        const char* v = eq + 1;
+        if (!cur) { if (!strcmp(k, "paused")) paused = atoi(v) != 0; continue; }
+        QueueJob&        q = cur->info;
+        TranscodeParams& p = q.params;
+        if      (!strcmp(k, "id"))         q.id = atoi(v);
+        else if (!strcmp(k, "priority"))   q.priority = atoi(v);
+        else if (!strcmp(k, "state"))      q.state = (JobState)min(max(atoi(v), (int)JOB_QUEUED), (int)JOB_CANCELLED);
+        else if (!strcmp(k, "in"))         p.in_path = Unescape(v);
+        else if (!strcmp(k, "out"))        p.out_path = Unescape(v);
+        else if (!strcmp(k, "subs_file"))  p.ext_subtitle_path = Unescape(v);
+        else if (!strcmp(k, "size_mb"))    p.target_size_mb = atof(v);
+        else if (!strcmp(k, "scale"))      p.scale_factor = atoi(v);
+        else if (!strcmp(k, "width"))      p.orig_w = atoi(v);
+        else if (!strcmp(k, "height"))     p.orig_h = atoi(v);
+        else if (!strcmp(k, "from"))       p.start_seconds = atof(v);
+        else if (!strcmp(k, "to"))         p.end_seconds = atof(v);
+        else if (!strcmp(k, "audio"))      p.audio_stream_index = atoi(v);
+        else if (!strcmp(k, "subs"))       p.subtitle_stream_index = atoi(v);
+        else if (!strcmp(k, "hdr_to_sdr")) p.convert_hdr_to_sdr = atoi(v) != 0;
+        else if (!strcmp(k, "layout"))     p.mp4_layout = atoi(v);
+        else if (!strcmp(k, "unbuffered")) p.unbuffered_output = atoi(v) != 0;
+        else if (!strcmp(k, "split_ranges")) p.split_ranges = atoi(v) != 0;
+        else if (!strcmp(k, "rendition")) {
+            TranscodeRendition r;
+            char* e = nullptr;
+            r.target_size_mb = strtod(v, &e);
+            r.scale_factor   = (int)strtol(e, &e, 10);
+            if (*e == ' ' && e[1]) {
+                r.out_path = Unescape(e + 1);
+                p.renditions.push_back(r);
+            }
+        }
+        else if (!strcmp(k, "range")) {
+            TranscodeRange r;
+            char* e = nullptr;
+            r.start_seconds  = strtod(v, &e);
+            r.end_seconds    = strtod(e, &e);
+            r.target_size_mb = strtod(e, &e);
+            if (*e == ' ') {
+                r.out_path = Unescape(e + 1);
+                p.ranges.push_back(r);
+            }
+        }
+    }
+    fclose(f);
+    if (!ok) return false;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& j : jobs_)
+            if (j->session) return false;   // never swap out a running queue
+        for (auto& j : loaded)
+            if (j->info.state == JOB_RUNNING) j->info.state = JOB_QUEUED;
+        jobs_    = std::move(loaded);
+        nextId_  = maxId + 1;
+        paused_  = paused || startPaused;
+        ScheduleLocked();
+    }
+    NotifyChanged();
+    return true;
+}
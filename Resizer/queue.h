@@ -0,0 +1,103 @@
+﻿// queue.h
+// Batch encoding: a queue of transcode jobs run by a scheduler that keeps
+// the machine busy without oversubscribing it — one job on NVENC (when the
+// GPU has it) plus as many libx264 jobs as the core count supports, each
+// given its share of the cores.  Jobs run highest priority first, then in
+// the order they were added.  The queue can be saved and restored, so an
+// overnight batch survives a restart.
+
+#pragma once
+
+#include "transcode.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+enum JobState {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+    JOB_CANCELLED,
+};
+
+// A job as the queue reports it; a copy, safe to keep.
+struct QueueJob {
+    int             id       = 0;
+    int             priority = 0;       // higher runs first
+    JobState        state    = JOB_QUEUED;
+    double          progress = 0.0;     // 0..1
+    bool            hardware = false;   // running (or ran) on the NVENC slot
+    TranscodeParams params;
+    TranscodeStats  stats;              // once finished
+};
+
+class EncodeQueue {
+public:
+    // Called from a worker thread whenever a job starts or finishes, with the
+    // queue unlocked.  Poll Snapshot for progress in between.
+    typedef void (*ChangeFn)(void* opaque);
+
+    // statePath (may be null) is where Save/Load keep the queue; every state
+    // change is written there.
+    explicit EncodeQueue(const char* statePath = nullptr);
+    ~EncodeQueue();                      // cancels running jobs, which stay queued
+
+    void SetChangeCallback(ChangeFn fn, void* opaque);
+
+    // Slot sizing; by default 1 hardware slot when NVENC opens and
+    // max(1, cores / 4) software slots sharing the cores.  A negative count
+    // leaves that one as it is.
+    void SetSlots(int hwSlots, int swSlots);
+
+    int  Add(const TranscodeParams& params, int priority = 0);  // returns the job id
+    bool Cancel(int id);                 // queued or running → cancelled
+    bool Remove(int id);                 // any job that isn't running
+    bool SetPriority(int id, int priority);
+    bool Retry(int id);                  // failed or cancelled → queued
+    void ClearFinished();
+
+    void Pause(bool paused);             // paused = start nothing new; running jobs carry on
+    bool Paused() const;
+    bool Idle() const;                   // nothing running, nothing runnable
+    void WaitIdle();
+
+    std::vector<QueueJob> Snapshot() const;
+    bool HasOutput(const char* path) const;   // a queued/running job will write path
+    bool HasInput(const char* path) const;    // a queued/running job reads path
+
+    bool Save() const;
+    // Replaces the queue; interrupted jobs come back queued.  startPaused
+    // holds them until Pause(false), whatever the file says.
+    bool Load(bool startPaused = false);
+
+private:
+    struct Job {
+        QueueJob                          info;
+        std::unique_ptr<TranscodeSession> session;
+    };
+
+    EncodeQueue(const EncodeQueue&) = delete;
+    EncodeQueue& operator=(const EncodeQueue&) = delete;
+
+    void ScheduleLocked();
+    bool SaveLocked() const;
+    void NotifyChanged();
+    Job* FindLocked(int id) const;
+    static void OnJobDone(void* opaque, TranscodeSession* session);
+
+    mutable std::mutex                 mutex_;
+    std::condition_variable            idle_;
+    std::vector<std::unique_ptr<Job>>  jobs_;
+    std::string                        statePath_;
+    ChangeFn                           changeFn_     = nullptr;
+    void*                              changeOpaque_ = nullptr;
+    int                                nextId_       = 1;
+    int                                hwSlots_      = 0;
+    int                                swSlots_      = 1;
+    int                                swThreads_    = 0;
+    bool                               paused_       = false;
+    bool                               closing_      = false;
+};
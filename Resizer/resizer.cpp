@@ -0,0 +1,394 @@
+﻿// resizer.cpp
+// The C API in resizer.h, over ProbeMedia, ExtractFrameBgr, TranscodeSession,
+// EncodeQueue and FolderWatcher.
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include "resizer.h"
+#include "platform.h"
+#include "hwaccel.h"
+#include "media.h"
+#include "queue.h"
+#include "thumbnail.h"
+#include "transcode.h"
+#include "watch.h"
+
+#include <new>
+#include <string>
+#include <vector>
+#include <string.h>
+
+struct rz_media {
+    std::string path;
+    MediaInfo   info;
+};
+
+const char* rz_error_string(int err) {
+    switch (err) {
+    case RZ_OK:            return "success";
+    case RZ_ERR_INVALID:   return "invalid argument";
+    case RZ_ERR_OPEN:      return "cannot open input or no video stream";
+    case RZ_ERR_NOMEM:     return "out of memory";
+    case RZ_ERR_DECODE:    return "no frame could be decoded";
+    case RZ_ERR_TRANSCODE: return "transcode failed";
+    case RZ_ERR_CANCELLED: return "cancelled";
+    default:               return "unknown error";
+    }
+}
+
+// ------------------------------ Lifecycle ------------------------------
+int rz_init(unsigned flags) {
+    if (flags & RZ_INIT_HWACCEL) TryInitHWDevice();
+    return RZ_OK;
+}
+
+void rz_shutdown(void) {
+    ReleaseHWDevice();
+}
+
+void rz_set_log_callback(rz_log_fn fn, void* opaque) {
+    SetEngineLogSink(fn, opaque);
+}
+
+// ------------------------------ Media ------------------------------
+int rz_open(const char* path, rz_media** out) {
+    if (!path || !out) return RZ_ERR_INVALID;
+    *out = nullptr;
+    rz_media* m = new (std::nothrow) rz_media();
+    if (!m) return RZ_ERR_NOMEM;
+    m->path = path;
+    if (!ProbeMedia(path, m->info)) { delete m; return RZ_ERR_OPEN; }
+    *out = m;
+    return RZ_OK;
+}
+
+void rz_close(rz_media* media) {
+    delete media;
+}
+
+int rz_probe(const rz_media* media, rz_media_info* info) {
+    if (!media || !info) return RZ_ERR_INVALID;
+    const MediaInfo& mi = media->info;
+    info->width        = mi.width;
+    info->height       = mi.height;
+    info->duration     = mi.duration;
+    info->fps          = mi.fps;
+    info->video_stream = mi.videoStream;
+    info->is_hdr       = mi.isHdr;
+    info->stream_count = (int)mi.streams.size();
+    return RZ_OK;
+}
+
+int rz_stream_info_get(const rz_media* media, int i, rz_stream_info* info) {
+    if (!media || !info || i < 0 || i >= (int)media->info.streams.size()) return RZ_ERR_INVALID;
+    const MediaStream& ms = media->info.streams[i];
+    info->index       = ms.index;
+    info->type        = ms.type == AVMEDIA_TYPE_VIDEO    ? RZ_STREAM_VIDEO
+                      : ms.type == AVMEDIA_TYPE_AUDIO    ? RZ_STREAM_AUDIO
+                      : ms.type == AVMEDIA_TYPE_SUBTITLE ? RZ_STREAM_SUBTITLE : RZ_STREAM_OTHER;
+    info->codec       = ms.codec.c_str();
+    info->language    = ms.language.c_str();
+    info->title       = ms.title.c_str();
+    info->width       = ms.width;
+    info->height      = ms.height;
+    info->channels    = ms.channels;
+    info->sample_rate = ms.sampleRate;
+    return RZ_OK;
+}
+
+// ------------------------------ Thumbnails ------------------------------
+int rz_thumbnail(rz_media* media, double seconds, int w, int h,
+                 uint8_t* bgr, int stride, double* actual) {
+    if (!media || !bgr || w <= 0 || h <= 0 || stride < w * 3) return RZ_ERR_INVALID;
+    if (!ExtractFrameBgr(media->path.c_str(), seconds, media->info.isHdr, media->info.hdrTrc,
+                         w, h, bgr, stride, actual))
+        return RZ_ERR_DECODE;
+    return RZ_OK;
+}
+
+// ------------------------------ Transcode ------------------------------
+void rz_transcode_params_default(rz_transcode_params* params) {
+    if (!params) return;
+    *params = rz_transcode_params();
+    params->scale           = 1;
+    params->end             = -1.0;
+    params->audio_stream    = -1;
+    params->subtitle_stream = -1;
+    params->layout          = RZ_LAYOUT_RESERVE_MOOV;
+    params->threads         = 0;
+}
+
+// rz_transcode_params → TranscodeParams, with the range resolved against
+// the probed duration.
+static int ToTranscodeParams(const rz_media* media, const char* out_path,
+                             const rz_transcode_params* params, TranscodeParams& tp) {
+    if (!media || !out_path || !params || params->target_mb <= 0.0) return RZ_ERR_INVALID;
+    if (params->scale != 1 && params->scale != 2 && params->scale != 4) return RZ_ERR_INVALID;
+    if (params->layout < RZ_LAYOUT_FASTSTART || params->layout > RZ_LAYOUT_FRAGMENTED) return RZ_ERR_INVALID;
+
+    const MediaInfo& mi = media->info;
+    double end   = (params->end < 0.0) ? mi.duration : params->end;
+    if (mi.duration > 0.0 && end > mi.duration) end = mi.duration;
+    double start = params->start > 0.0 ? params->start : 0.0;
+    if (end <= start) return RZ_ERR_INVALID;
+
+    tp.in_path               = media->path;
+    tp.out_path              = out_path;
+    tp.ext_subtitle_path     = params->ext_subtitles ? params->ext_subtitles : "";
+    tp.target_size_mb        = params->target_mb;
+    tp.scale_factor          = params->scale;
+    tp.orig_w                = mi.width;
+    tp.orig_h                = mi.height;
+    tp.start_seconds         = start;
+    tp.end_seconds           = end;
+    tp.audio_stream_index    = params->audio_stream;
+    tp.subtitle_stream_index = params->subtitle_stream;
+    tp.convert_hdr_to_sdr    = params->hdr_to_sdr && mi.isHdr;
+    tp.mp4_layout            = params->layout;
+    tp.unbuffered_output     = params->unbuffered != 0;
+    tp.threads               = params->threads;
+    return RZ_OK;
+}
+
+static void ToRzStats(const TranscodeStats& ts, rz_transcode_stats* stats) {
+    stats->frames        = ts.frames;
+    stats->output_bytes  = ts.output_bytes;
+    stats->video_bitrate = ts.video_bitrate;
+    stats->duration      = ts.duration;
+    stats->elapsed       = ts.elapsed;
+    stats->hw_decode     = ts.hw_decode;
+    stats->hdr_to_sdr    = ts.hdr_to_sdr;
+    stats->subtitles     = ts.subtitles;
+    StringCchCopyA(stats->decoder, sizeof(stats->decoder), ts.decoder);
+    StringCchCopyA(stats->encoder, sizeof(stats->encoder), ts.encoder);
+    stats->write_mb_per_s   = ts.write_mb_per_s;
+    stats->write_blocked    = ts.write_blocked;
+    stats->write_blocked_ms = ts.write_blocked_ms;
+    stats->write_peak_queue = ts.write_peak_queue;
+    stats->read_mb_per_s    = ts.read_mb_per_s;
+    stats->read_stalls      = ts.read_stalls;
+    stats->read_stall_ms    = ts.read_stall_ms;
+}
+
+struct ProgressThunk {
+    rz_progress_fn fn;
+    void*          opaque;
+};
+
+static bool OnTranscodeProgress(void* opaque, double fraction) {
+    const ProgressThunk* t = (const ProgressThunk*)opaque;
+    return t->fn(t->opaque, fraction) != 0;
+}
+
+// Runs tp on the calling thread; stats (optional) has a slot for out_path
+// and one for each rendition, or one for each range when they are split.
+static int RunTranscode(TranscodeParams& tp, const rz_transcode_params* params, rz_transcode_stats* stats) {
+    ProgressThunk thunk = { params->progress, params->opaque };
+    tp.progress        = params->progress ? OnTranscodeProgress : nullptr;
+    tp.progress_opaque = &thunk;
+
+    TranscodeSession session(tp);
+    bool ok = session.Run();
+    const TranscodeStats& ts = session.Stats();
+    if (stats && tp.split_ranges) {
+        for (size_t i = 0; i < session.RangeStats().size(); i++)
+            ToRzStats(session.RangeStats()[i], &stats[i]);
+    } else if (stats) {
+        ToRzStats(ts, &stats[0]);
+        for (size_t i = 0; i < session.RenditionStats().size(); i++)
+            ToRzStats(session.RenditionStats()[i], &stats[i + 1]);
+    }
+    if (ts.cancelled) return RZ_ERR_CANCELLED;
+    return ok ? RZ_OK : RZ_ERR_TRANSCODE;
+}
+
+int rz_transcode(rz_media* media, const char* out_path,
+                 const rz_transcode_params* params, rz_transcode_stats* stats) {
+    if (stats) *stats = rz_transcode_stats();
+    TranscodeParams tp;
+    int err = ToTranscodeParams(media, out_path, params, tp);
+    if (err != RZ_OK) return err;
+    return RunTranscode(tp, params, stats);
+}
+
+int rz_transcode_renditions(rz_media* media, const rz_rendition* renditions, int count,
+                            const rz_transcode_params* params, rz_transcode_stats* stats) {
+    if (!renditions || count < 1 || !params) return RZ_ERR_INVALID;
+    if (stats)
+        for (int i = 0; i < count; i++) stats[i] = rz_transcode_stats();
+
+    // The first rendition is the session's own output; the rest ride along.
+    rz_transcode_params first = *params;
+    first.target_mb = renditions[0].target_mb;
+    first.scale     = renditions[0].scale;
+    TranscodeParams tp;
+    int err = ToTranscodeParams(media, renditions[0].out_path, &first, tp);
+    if (err != RZ_OK) return err;
+    for (int i = 1; i < count; i++) {
+        const rz_rendition& r = renditions[i];
+        if (!r.out_path || r.target_mb <= 0.0) return RZ_ERR_INVALID;
+        if (r.scale != 1 && r.scale != 2 && r.scale != 4) return RZ_ERR_INVALID;
+        // Two outputs on one path would truncate and interleave each other.
+        for (int k = 0; k < i; k++)
+            if (!strcmp(r.out_path, renditions[k].out_path)) return RZ_ERR_INVALID;
+        TranscodeRendition tr;
+        tr.out_path       = r.out_path;
+        tr.target_size_mb = r.target_mb;
+        tr.scale_factor   = r.scale;
+        tp.renditions.push_back(tr);
+    }
+    return RunTranscode(tp, params, stats);
+}
+
+int rz_transcode_ranges(rz_media* media, const char* out_path, const rz_range* ranges, int count,
+                        int mode, const rz_transcode_params* params, rz_transcode_stats* stats) {
+    if (!media || !ranges || count < 1 || !params) return RZ_ERR_INVALID;
+    if (mode != RZ_RANGES_JOIN && mode != RZ_RANGES_SPLIT) return RZ_ERR_INVALID;
+    bool split = mode == RZ_RANGES_SPLIT;
+    if (stats)
+        for (int i = 0; i < (split ? count : 1); i++) stats[i] = rz_transcode_stats();
+
+    // Split, the first range stands in for out_path and target_mb, which
+    // the session then ignores.
+    rz_transcode_params whole = *params;
+    whole.start = 0.0;
+    whole.end   = -1.0;
+    if (split) whole.target_mb = ranges[0].target_mb;
+    TranscodeParams tp;
+    int err = ToTranscodeParams(media, split ? ranges[0].out_path : out_path, &whole, tp);
+    if (err != RZ_OK) return err;
+    for (int i = 0; i < count; i++) {
+        const rz_range& r = ranges[i];
+        TranscodeRange tr;
+        tr.start_seconds = r.start > 0.0 ? r.start : 0.0;
+        tr.end_seconds   = (r.end < 0.0 || r.end > tp.end_seconds) ? tp.end_seconds : r.end;
+        if (tr.end_seconds <= tr.start_seconds) return RZ_ERR_INVALID;
+        if (split) {
+            if (!r.out_path || r.target_mb <= 0.0) return RZ_ERR_INVALID;
+            // Two clips on one path would truncate and interleave each other.
+            for (int k = 0; k < i; k++)
+                if (!strcmp(r.out_path, ranges[k].out_path)) return RZ_ERR_INVALID;
+            tr.out_path       = r.out_path;
+            tr.target_size_mb = r.target_mb;
+        }
+        tp.ranges.push_back(tr);
+    }
+    tp.split_ranges = split;
+    return RunTranscode(tp, params, stats);
+}
+
+// ------------------------------ Queue ------------------------------
+struct rz_queue {
+    EncodeQueue q;
+    explicit rz_queue(const char* statePath) : q(statePath) {}
+};
+
+int rz_queue_create(const char* state_path, rz_queue** out) {
+    if (!out) return RZ_ERR_INVALID;
+    *out = new (std::nothrow) rz_queue(state_path);
+    if (!*out) return RZ_ERR_NOMEM;
+    if (state_path) (*out)->q.Load();
+    return RZ_OK;
+}
+
+void rz_queue_destroy(rz_queue* queue) {
+    delete queue;
+}
+
+int rz_queue_add(rz_queue* queue, const rz_media* media, const char* out_path,
+                 const rz_transcode_params* params, int priority, int* job_id) {
+    if (!queue) return RZ_ERR_INVALID;
+    TranscodeParams tp;
+    int err = ToTranscodeParams(media, out_path, params, tp);
+    if (err != RZ_OK) return err;
+    int id = queue->q.Add(tp, priority);
+    if (job_id) *job_id = id;
+    return RZ_OK;
+}
+
+int rz_queue_cancel(rz_queue* queue, int job_id) {
+    return queue && queue->q.Cancel(job_id) ? RZ_OK : RZ_ERR_INVALID;
+}
+
+int rz_queue_remove(rz_queue* queue, int job_id) {
+    return queue && queue->q.Remove(job_id) ? RZ_OK : RZ_ERR_INVALID;
+}
+
+int rz_queue_set_priority(rz_queue* queue, int job_id, int priority) {
+    return queue && queue->q.SetPriority(job_id, priority) ? RZ_OK : RZ_ERR_INVALID;
+}
+
+void rz_queue_pause(rz_queue* queue, int paused) {
+    if (queue) queue->q.Pause(paused != 0);
+}
+
+int rz_queue_get_job(rz_queue* queue, int job_id, rz_job_info* info) {
+    if (!queue || !info) return RZ_ERR_INVALID;
+    for (const QueueJob& j : queue->q.Snapshot()) {
+        if (j.id != job_id) continue;
+        *info = rz_job_info();
+        info->id       = j.id;
+        info->priority = j.priority;
+        info->state    = (rz_job_state)j.state;
+        info->progress = j.progress;
+        info->hardware = j.hardware;
+        ToRzStats(j.stats, &info->stats);
+        return RZ_OK;
+    }
+    return RZ_ERR_INVALID;
+}
+
+void rz_queue_wait(rz_queue* queue) {
+    if (queue) queue->q.WaitIdle();
+}
+
+int rz_queue_set_slots(rz_queue* queue, int hw_slots, int sw_slots) {
+    if (!queue || (hw_slots == 0 && sw_slots == 0)) return RZ_ERR_INVALID;
+    queue->q.SetSlots(hw_slots, sw_slots);
+    return RZ_OK;
+}
+
+// ------------------------------ Watch Folder ------------------------------
+struct rz_watch {
+    FolderWatcher w;
+    rz_watch(EncodeQueue& q, const char* dir, const std::vector<WatchRule>& rules) : w(q, dir, rules) {}
+};
+
+int rz_watch_start(rz_queue* queue, const char* dir, const rz_watch_rule* rules, int rule_count,
+                   const rz_watch_options* options, rz_watch** out) {
+    if (!queue || !dir || !rules || rule_count <= 0 || !out) return RZ_ERR_INVALID;
+    *out = nullptr;
+    std::vector<WatchRule> wr(rule_count);
+    for (int i = 0; i < rule_count; i++) {
+        const rz_watch_rule& r = rules[i];
+        if (r.target_mb <= 0.0 || (r.scale != 1 && r.scale != 2 && r.scale != 4)) return RZ_ERR_INVALID;
+        if (r.layout < RZ_LAYOUT_FASTSTART || r.layout > RZ_LAYOUT_FRAGMENTED) return RZ_ERR_INVALID;
+        if (r.match)   wr[i].match   = r.match;
+        if (r.suffix)  wr[i].suffix  = r.suffix;
+        if (r.out_dir) wr[i].out_dir = r.out_dir;
+        wr[i].target_size_mb     = r.target_mb;
+        wr[i].scale_factor       = r.scale;
+        wr[i].convert_hdr_to_sdr = r.hdr_to_sdr != 0;
+        wr[i].mp4_layout         = r.layout;
+        wr[i].priority           = r.priority;
+    }
+
+    rz_watch* w = new (std::nothrow) rz_watch(queue->q, dir, wr);
+    if (!w) return RZ_ERR_NOMEM;
+    if (options) {
+        if (options->stable_seconds > 0.0) w->w.SetStableSeconds(options->stable_seconds);
+        w->w.SetQueuedCallback(options->on_queued, options->opaque);
+    }
+    if (!w->w.Start(options && options->include_existing)) {
+        delete w;
+        return RZ_ERR_OPEN;
+    }
+    *out = w;
+    return RZ_OK;
+}
+
+void rz_watch_stop(rz_watch* watch) {
+    delete watch;
+}
@@ -0,0 +1,263 @@
+﻿/* resizer.h
+ * C API to the Resizer engine: probe a file, grab a frame, and run the
+ * size-targeted MP4 transcode with progress and cancellation.  The window
+ * and resizer-cli sit on the same code; this header is what other programs
+ * link against (libresizer_engine).
+ *
+ * Strings are UTF-8.  Calls on different rz_media handles may run on
+ * different threads; one handle is not to be shared between threads.
+ */
+
+#ifndef RESIZER_H
+#define RESIZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------ Errors ------------------------------ */
+enum {
+    RZ_OK            =  0,
+    RZ_ERR_INVALID   = -1,   /* bad argument */
+    RZ_ERR_OPEN      = -2,   /* can't open the file, or it has no video */
+    RZ_ERR_NOMEM     = -3,
+    RZ_ERR_DECODE    = -4,   /* no frame could be decoded */
+    RZ_ERR_TRANSCODE = -5,   /* the encode failed; see the log */
+    RZ_ERR_CANCELLED = -6    /* the progress callback asked to stop */
+};
+
+const char* rz_error_string(int err);
+
+/* ------------------------------ Lifecycle ------------------------------ */
+#define RZ_INIT_HWACCEL  0x1   /* decode with NVDEC where a CUDA device exists */
+
+/* Call once before anything else; rz_shutdown releases the hardware device. */
+int  rz_init(unsigned flags);
+void rz_shutdown(void);
+
+/* Engine diagnostics; by default they go to stderr (the debugger on Windows).
+ * Pass NULL to restore that.  May be called from any engine thread, always
+ * with the opaque it was installed with; a message already being delivered
+ * when the callback is replaced still goes to the old one. */
+typedef void (*rz_log_fn)(void* opaque, const char* msg);
+void rz_set_log_callback(rz_log_fn fn, void* opaque);
+
+/* ------------------------------ Media ------------------------------ */
+typedef struct rz_media rz_media;
+
+int  rz_open(const char* path, rz_media** out);
+void rz_close(rz_media* media);
+
+typedef struct rz_media_info {
+    int    width, height;
+    double duration;         /* seconds; 0 if unknown */
+    double fps;
+    int    video_stream;     /* global stream index */
+    int    is_hdr;           /* PQ/HLG (or untagged BT.2020) source */
+    int    stream_count;
+} rz_media_info;
+
+typedef enum rz_stream_type {
+    RZ_STREAM_OTHER,
+    RZ_STREAM_VIDEO,
+    RZ_STREAM_AUDIO,
+    RZ_STREAM_SUBTITLE
+} rz_stream_type;
+
+/* String members point into the rz_media and live until rz_close. */
+typedef struct rz_stream_info {
+    int            index;
+    rz_stream_type type;
+    const char*    codec;
+    const char*    language;  /* "" if untagged */
+    const char*    title;
+    int            width, height;          /* video */
+    int            channels, sample_rate;  /* audio */
+} rz_stream_info;
+
+int rz_probe(const rz_media* media, rz_media_info* info);
+int rz_stream_info_get(const rz_media* media, int i, rz_stream_info* info);
+
+/* ------------------------------ Thumbnails ------------------------------ */
+/* Decodes the first frame at or after `seconds` as BGR24 at w x h into bgr
+ * (rows `stride` bytes apart).  HDR sources are tone-mapped to SDR.
+ * *actual (optional) receives the frame's time. */
+int rz_thumbnail(rz_media* media, double seconds, int w, int h,
+                 uint8_t* bgr, int stride, double* actual);
+
+/* ------------------------------ Transcode ------------------------------ */
+enum {
+    RZ_LAYOUT_FASTSTART    = 0,   /* moov moved to the front after encoding */
+    RZ_LAYOUT_RESERVE_MOOV = 1,   /* space for moov reserved up front (default) */
+    RZ_LAYOUT_FRAGMENTED   = 2
+};
+
+/* Called from the encoding thread with the fraction done (0..1).  Return
+ * non-zero to continue, 0 to cancel; the partial output is deleted. */
+typedef int (*rz_progress_fn)(void* opaque, double fraction);
+
+typedef struct rz_transcode_params {
+    double         target_mb;      /* required */
+    int            scale;          /* 1, 2 or 4 */
+    double         start, end;     /* seconds; end < 0 = end of file */
+    int            audio_stream;   /* -1 = first audio stream */
+    int            subtitle_stream;/* -1 = none; burned in */
+    const char*    ext_subtitles;  /* .srt/.ass/.ssa to burn in, or NULL */
+    int            hdr_to_sdr;
+    int            layout;         /* RZ_LAYOUT_* */
+    int            unbuffered;     /* bypass the OS cache for output writes */
+    int            threads;        /* codec threads; 0 = all cores.  Set when
+                                      running several transcodes at once. */
+    rz_progress_fn progress;       /* optional */
+    void*          opaque;
+} rz_transcode_params;
+
+typedef struct rz_transcode_stats {
+    int64_t frames;
+    int64_t output_bytes;
+    int64_t video_bitrate;   /* target, bits/s */
+    double  duration;        /* encoded range, seconds */
+    double  elapsed;         /* wall time, seconds */
+    int     hw_decode;
+    int     hdr_to_sdr;
+    int     subtitles;
+    char    decoder[32];
+    char    encoder[32];
+    double  write_mb_per_s;    /* output MB over time inside the write calls; 0 for faststart */
+    int64_t write_blocked;     /* times the encoder found the write queue full */
+    double  write_blocked_ms;  /* ... and how long it waited on it */
+    int     write_peak_queue;  /* deepest the write queue got, in 4 MB blocks */
+    double  read_mb_per_s;     /* input MB over time inside the read calls; 0 without read-ahead */
+    int64_t read_stalls;       /* times the demuxer waited for a block not yet read */
+    double  read_stall_ms;     /* ... and how long it waited in all */
+} rz_transcode_stats;
+
+void rz_transcode_params_default(rz_transcode_params* params);
+
+/* Blocks until done.  stats (optional) is filled in whatever the outcome.
+ * Transcodes on different rz_media handles may run concurrently. */
+int rz_transcode(rz_media* media, const char* out_path,
+                 const rz_transcode_params* params, rz_transcode_stats* stats);
+
+/* One output of rz_transcode_renditions. */
+typedef struct rz_rendition {
+    const char* out_path;
+    double      target_mb;   /* required */
+    int         scale;       /* 1, 2 or 4 */
+} rz_rendition;
+
+/* Like rz_transcode, but writes `count` outputs from a single pass over the
+ * input: decoding, deinterlacing, tone mapping and subtitle burn-in happen
+ * once, the downscale and the encode once per rendition.  params' target_mb
+ * and scale are ignored.  Every out_path must differ (RZ_ERR_INVALID
+ * otherwise).  stats (optional) is an array of count. */
+int rz_transcode_renditions(rz_media* media, const rz_rendition* renditions, int count,
+                            const rz_transcode_params* params, rz_transcode_stats* stats);
+
+/* One stretch of rz_transcode_ranges. */
+typedef struct rz_range {
+    double      start, end;  /* seconds; end < 0 = end of file */
+    const char* out_path;    /* RZ_RANGES_SPLIT only; each range's must differ */
+    double      target_mb;   /* RZ_RANGES_SPLIT only; required there */
+} rz_range;
+
+enum {
+    RZ_RANGES_JOIN,          /* one file, the ranges in time order, sharing params' target_mb */
+    RZ_RANGES_SPLIT,         /* a file per range, each with its own target_mb */
+};
+
+/* Exports `count` ranges of the input in one forward pass, seeking only
+ * across gaps too long to decode through.  params' start and end are
+ * ignored.  Joined, overlapping ranges are merged, out_path is the output
+ * and stats (optional) is one; split, out_path is ignored and stats is an
+ * array of count, in the order of ranges. */
+int rz_transcode_ranges(rz_media* media, const char* out_path, const rz_range* ranges, int count,
+                        int mode, const rz_transcode_params* params, rz_transcode_stats* stats);
+
+/* ------------------------------ Queue ------------------------------ */
+/* Runs many transcodes concurrently: one on NVENC where the GPU has it, the
+ * rest on libx264 sized to the core count, highest priority first.  With a
+ * state_path the queue is restored from it on creation and rewritten on
+ * every change, so a batch carries on (from the start of whatever was
+ * running) after a restart.  Queued jobs take no progress callback; poll
+ * rz_queue_get_job instead. */
+typedef struct rz_queue rz_queue;
+
+typedef enum rz_job_state {
+    RZ_JOB_QUEUED,
+    RZ_JOB_RUNNING,
+    RZ_JOB_DONE,
+    RZ_JOB_FAILED,
+    RZ_JOB_CANCELLED
+} rz_job_state;
+
+typedef struct rz_job_info {
+    int                id;
+    int                priority;
+    rz_job_state       state;
+    double             progress;   /* 0..1 */
+    int                hardware;   /* on the NVENC slot */
+    rz_transcode_stats stats;      /* once finished */
+} rz_job_info;
+
+int  rz_queue_create(const char* state_path, rz_queue** out);
+/* Cancels running jobs; with a state file they stay queued in it. */
+void rz_queue_destroy(rz_queue* queue);
+int  rz_queue_add(rz_queue* queue, const rz_media* media, const char* out_path,
+                  const rz_transcode_params* params, int priority, int* job_id);
+int  rz_queue_cancel(rz_queue* queue, int job_id);
+int  rz_queue_set_priority(rz_queue* queue, int job_id, int priority);
+void rz_queue_pause(rz_queue* queue, int paused);
+int  rz_queue_get_job(rz_queue* queue, int job_id, rz_job_info* info);
+/* Drops a job that isn't running, such as a finished one whose result has
+ * been read; a long-lived queue otherwise keeps every job it ever ran. */
+int  rz_queue_remove(rz_queue* queue, int job_id);
+/* Blocks until nothing is running and nothing runnable is left. */
+void rz_queue_wait(rz_queue* queue);
+/* How many jobs may run at once on NVENC and on libx264.  The defaults are
+ * 1 (0 without NVENC) and max(1, cores / 4); a negative count keeps the
+ * current one. */
+int  rz_queue_set_slots(rz_queue* queue, int hw_slots, int sw_slots);
+
+/* ------------------------------ Watch Folder ------------------------------ */
+/* Queues each file that lands in `dir` once it has stopped growing, encoded
+ * by the first rule whose glob matches its name; the queue's slots bound how
+ * many run at once.  Uses inotify on Linux, ReadDirectoryChangesW on Windows.
+ * Outputs written into the watched folder are recognised and left alone. */
+typedef struct rz_watch rz_watch;
+
+typedef struct rz_watch_rule {
+    const char* match;       /* file-name glob (* and ?); NULL = every file */
+    double      target_mb;   /* required */
+    int         scale;       /* 1, 2 or 4 */
+    const char* suffix;      /* <name>_<suffix>.mp4; NULL = "RESIZED" */
+    const char* out_dir;     /* NULL = the watched folder */
+    int         hdr_to_sdr;  /* HDR inputs only */
+    int         layout;      /* RZ_LAYOUT_* */
+    int         priority;
+} rz_watch_rule;
+
+/* Called on the watcher's thread for each file it queues. */
+typedef void (*rz_watch_fn)(void* opaque, const char* input, const char* output, int job_id);
+
+typedef struct rz_watch_options {
+    double      stable_seconds;    /* unchanged this long = finished; <= 0 = 5 */
+    int         include_existing;  /* also queue what is in the folder already */
+    rz_watch_fn on_queued;         /* optional */
+    void*       opaque;
+} rz_watch_options;
+
+/* RZ_ERR_OPEN if dir can't be watched.  options may be NULL. */
+int  rz_watch_start(rz_queue* queue, const char* dir, const rz_watch_rule* rules, int rule_count,
+                    const rz_watch_options* options, rz_watch** out);
+/* Stops watching; what it queued stays queued.  Call before rz_queue_destroy. */
+void rz_watch_stop(rz_watch* watch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RESIZER_H */
@@ -0,0 +1,106 @@
+﻿// thumbnail.cpp
+// Frame → BGR24 conversion and the standalone frame grab behind rz_thumbnail.
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+}
+
+#include "thumbnail.h"
+#include "hwaccel.h"
+
+void BgrConverterFree(BgrConverter& conv) {
+    if (conv.sws) sws_freeContext(conv.sws);
+    conv.sws = nullptr;
+    HdrDisplayConvFree(conv.hdr);
+}
+
+bool FrameToBgr(BgrConverter& conv, const AVFrame* f, int hdrTrc,
+                int dstW, int dstH, uint8_t* dst, int dstStride) {
+    if (hdrTrc)
+        return HdrFrameToBgr(conv.hdr, f, hdrTrc, dstW, dstH, dst, dstStride);
+    // Cached on the real pixel format (known only after the NVDEC transfer).
+    conv.sws = sws_getCachedContext(conv.sws,
+        f->width, f->height, (AVPixelFormat)f->format,
+        dstW, dstH, AV_PIX_FMT_BGR24, SWS_BILINEAR, nullptr, nullptr, nullptr);
+    if (!conv.sws) return false;
+    uint8_t* d[1] = { dst }; int s[1] = { dstStride };
+    sws_scale(conv.sws, f->data, f->linesize, 0, f->height, d, s);
+    return true;
+}
+
+bool ExtractFrameBgr(const char* path, double t, bool srcIsHdr, int srcTrc,
+                     int dstW, int dstH, uint8_t* dst, int dstStride, double* outSecs) {
+    AVFormatContext* fmt_ctx   = nullptr;
+    AVCodecContext*  dec_ctx   = nullptr;
+    const AVCodec*   dec       = nullptr;
+    AVPacket*        pkt       = nullptr;
+    AVFrame*         frame     = nullptr;
+    AVFrame*         cpu_frame = nullptr;   // for NVDEC hw→cpu transfer
+    BgrConverter     conv;
+    AVStream*        vs        = nullptr;
+    double           tbase     = 0.0;
+    int              videoIdx  = -1;
+    bool             using_hw  = false;
+    bool             gotFrame  = false;
+    bool             eof       = false;
+
+    if (avformat_open_input(&fmt_ctx, path, nullptr, nullptr) < 0) goto cleanup;
+    if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) goto cleanup;
+    videoIdx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (videoIdx < 0) goto cleanup;
+    vs    = fmt_ctx->streams[videoIdx];
+    tbase = av_q2d(vs->time_base);
+    for (unsigned i = 0; i < fmt_ctx->nb_streams; i++)
+        if ((int)i != videoIdx) fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+
+    dec = find_best_decoder(vs->codecpar->codec_id, using_hw);
+    if (!dec) goto cleanup;
+    dec_ctx = avcodec_alloc_context3(dec);
+    if (!dec_ctx) goto cleanup;
+    if (avcodec_parameters_to_context(dec_ctx, vs->codecpar) < 0) goto cleanup;
+    if (using_hw) AttachHwDevice(dec_ctx);
+    if (avcodec_open2(dec_ctx, dec, nullptr) < 0) goto cleanup;
+
+    pkt   = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!pkt || !frame) goto cleanup;
+
+    if (t > 0.0) av_seek_frame(fmt_ctx, -1, (int64_t)(t * AV_TIME_BASE), AVSEEK_FLAG_BACKWARD);
+
+    while (!gotFrame) {
+        while (!gotFrame && avcodec_receive_frame(dec_ctx, frame) == 0) {
+            int64_t pts = frame->best_effort_timestamp;
+            if (pts == AV_NOPTS_VALUE) pts = frame->pts;
+            double fSecs = (pts != AV_NOPTS_VALUE) ? (double)pts * tbase : t;
+            if (eof || fSecs + 0.001 >= t) {
+                AVFrame* sw_frame = HwFrameToCpu(frame, &cpu_frame);
+                gotFrame = FrameToBgr(conv, sw_frame, HdrTrcOf(sw_frame, srcIsHdr, srcTrc),
+                                      dstW, dstH, dst, dstStride);
+                if (outSecs) *outSecs = fSecs;
+            }
+            av_frame_unref(frame);
+        }
+        if (gotFrame || eof) break;
+
+        if (av_read_frame(fmt_ctx, pkt) < 0) {
+            // Drain so reorder-delayed frames near the end still come out; with t
+            // past the last frame, the first one drained is taken.
+            avcodec_send_packet(dec_ctx, nullptr);
+            eof = true;
+            continue;
+        }
+        if (pkt->stream_index == videoIdx) avcodec_send_packet(dec_ctx, pkt);
+        av_packet_unref(pkt);
+    }
+
+cleanup:
+    BgrConverterFree(conv);
+    if (cpu_frame) av_frame_free(&cpu_frame);
+    if (frame)     av_frame_free(&frame);
+    if (pkt)       av_packet_free(&pkt);
+    if (dec_ctx)   avcodec_free_context(&dec_ctx);
+    if (fmt_ctx)   avformat_close_input(&fmt_ctx);
+    return gotFrame;
+}
@@ -0,0 +1,34 @@
+﻿// thumbnail.h
+// Decoded frame → BGR24 at a target size, and a one-shot "frame at t" grab
+// built on it.  The preview, playback, thumbnail strip and rz_thumbnail all
+// convert through FrameToBgr so SDR and PQ/HLG sources look the same
+// everywhere.
+
+#pragma once
+
+#include <stdint.h>
+#include "hdr.h"
+
+struct AVFrame;
+struct SwsContext;
+
+// Per-consumer conversion state: the SDR scaler and the HDR path, each cached
+// across frames (and source size / pixel format changes).
+struct BgrConverter {
+    SwsContext*    sws = nullptr;
+    HdrDisplayConv hdr;
+};
+
+void BgrConverterFree(BgrConverter& conv);
+
+// Converts a CPU frame to BGR24 at dstW x dstH into dst (stride dstStride).
+// hdrTrc comes from HdrTrcOf; non-zero routes through the tone-mapping kernel.
+bool FrameToBgr(BgrConverter& conv, const AVFrame* f, int hdrTrc,
+                int dstW, int dstH, uint8_t* dst, int dstStride);
+
+// Opens path, seeks to t (seconds) and decodes forward to the first frame at
+// or after it, converted into dst.  srcIsHdr/srcTrc are the probe's HDR
+// tagging (MediaInfo).  *outSecs receives the frame's time.  Uses NVDEC when
+// TryInitHWDevice has found it.
+bool ExtractFrameBgr(const char* path, double t, bool srcIsHdr, int srcTrc,
+                     int dstW, int dstH, uint8_t* dst, int dstStride, double* outSecs);
@@ -0,0 +1,1833 @@
+﻿// transcode.cpp
+// The size-targeted transcode: decode (NVDEC when available), deinterlace,
+// optional HDR→SDR tone mapping, subtitle burn-in, scale, H.264 + AAC encode
+// into MP4.  No UI state and no shared mutable state: everything lives in
+// the TranscodeSession, so sessions can run side by side.
+
+#include "transcode.h"
+#include "platform.h"
+#include "hdr.h"
+#include "hwaccel.h"
+#include "fileio.h"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdlib.h>
+#include <string.h>
+
+extern "C" {
+#include <libavcodec/bsf.h>
+#include <libavutil/opt.h>
+#include <libavutil/hwcontext.h>
+#include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+}
+
+// Bitmap subtitle types (PGS, VOBSUB) are pre-decoded to these structs and
+// alpha-blended directly onto YUV frames; text-based subs go through libavfilter/libass.
+// x/y/w/h are at OUTPUT (encoder) resolution; yuva holds [Y,Cb,Cr,A] per pixel,
+// pre-converted at load time so the per-frame blend loop needs no float math or
+// colour conversion.
+struct PgsRect  { int x, y, w, h; std::vector<uint8_t> yuva; };
+struct PgsEvent { int64_t pts_ms;  std::vector<PgsRect> rects; }; // rects.empty() = clear screen
+// Text subtitle event decoded from SUBTITLE_ASS / SUBTITLE_TEXT rects (fallback path)
+struct TextSubEvent { double start_s, end_s; std::string ass_text; };
+
+// Upper bound on the moov atom for MP4_RESERVE_MOOV.  The mov muxer fails the
+// trailer if the index outgrows the reservation, so every sample is costed as
+// if it were a keyframe with its own duration, composition offset and chunk:
+// stsz 4 + stts 8 + ctts 8 + stss 4 + co64 8 + stsc 12.  Codec headers, edit
+// lists and the per-track boxes fit in the fixed allowance.
+static int64_t EstimateMoovBytes(double secs, AVRational fps, int audioRate, int audioFrameSize) {
+    const int64_t kPerSample = 44, kFixed = 64 << 10;
+    int64_t video = (int64_t)ceil((secs + 1.0) * av_q2d(fps));
+    int64_t audio = (audioRate > 0 && audioFrameSize > 0)
+                        ? (int64_t)ceil((secs + 1.0) * audioRate / audioFrameSize) : 0;
+    return kFixed + (video + audio) * kPerSample * 11 / 10;
+}
+
+// Copies src to a fresh temp file with the same extension (see the external
+// subtitle setup below).  Leaves out empty on failure.
+static void CopyToTempPath(const char* src, char* out, size_t outSize) {
+    out[0] = 0;
+    const char* orig_dot = strrchr(src, '.');
+    const char* ext      = orig_dot ? orig_dot : ".srt";
+#ifdef _WIN32
+    wchar_t tmp_dir[MAX_PATH] = {}, tmp_base[MAX_PATH] = {};
+    GetTempPathW(MAX_PATH, tmp_dir);
+    if (!GetTempFileNameW(tmp_dir, L"sub", 0, tmp_base)) return;
+    DeleteFileW(tmp_base); // GetTempFileName creates a placeholder; replace it
+    snprintf(out, outSize, "%s%s", WideToUtf8(tmp_base).c_str(), ext);
+#else
+    const char* tmp_dir = getenv("TMPDIR");
+    snprintf(out, outSize, "%s/subXXXXXX%s", tmp_dir && tmp_dir[0] ? tmp_dir : "/tmp", ext);
+    int fd = mkstemps(out, (int)strlen(ext));
+    if (fd < 0) { out[0] = 0; return; }
+    close(fd);
+#endif
+    FILE* fi = FileOpenUtf8(src, "rb");
+    FILE* fo = FileOpenUtf8(out, "wb");
+    if (fi && fo) {
+        char chunk[65536]; size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), fi)) > 0) fwrite(chunk, 1, n, fo);
+    }
+    if (fo) fclose(fo);
+    if (fi) fclose(fi);
+    if (!fi || !fo) { DeleteFileUtf8(out); out[0] = 0; }
+}
+
+// Fonts directory for the subtitles filter.  Elsewhere libass finds fonts
+// through fontconfig, so there is nothing to pass.
+static bool GetFontsDir(char* out, size_t outSize) {
+#ifdef _WIN32
+    wchar_t windir[MAX_PATH] = {};
+    if (!GetWindowsDirectoryW(windir, MAX_PATH)) return false;
+    snprintf(out, outSize, "%s\\Fonts", WideToUtf8(windir).c_str());
+    return true;
+#else
+    (void)out; (void)outSize;
+    return false;
+#endif
+}
+
+// Text subtitles when the subtitles filter (libass) is unavailable: each event
+// is drawn with GDI at output resolution, keyed to YUVA and appended to
+// pgs_events as a start/clear pair so it goes through the bitmap blend.
+#ifdef _WIN32
+static void RenderTextSubEvents(const std::vector<TextSubEvent>& text_sub_events,
+                                int frame_w, int frame_h, std::vector<PgsEvent>& pgs_events) {
+    int font_h   = max(14, frame_h / 20);
+    int margin_v = max(12, frame_h / 18);
+    int max_tw   = frame_w * 85 / 100;
+
+    HDC screen_dc = GetDC(nullptr);
+    HDC mem_dc    = CreateCompatibleDC(screen_dc);
+    BITMAPINFO bmi = {};
+    bmi.bmiHeader.biSize        = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth       = frame_w;
+    bmi.bmiHeader.biHeight      = -frame_h; // top-down
+    bmi.bmiHeader.biPlanes      = 1;
+    bmi.bmiHeader.biBitCount    = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+    uint32_t* pixels = nullptr;
+    HBITMAP hbm = CreateDIBSection(screen_dc, &bmi, DIB_RGB_COLORS,
+                                   (void**)&pixels, nullptr, 0);
+    ReleaseDC(nullptr, screen_dc);
+
+    if (hbm && pixels && mem_dc) {
+        HBITMAP old_bm = (HBITMAP)SelectObject(mem_dc, hbm);
+        // NONANTIALIASED_QUALITY ensures pixels are exactly the text
+        // colour or the background key with no blended intermediates.
+        HFONT hfont = CreateFontA(
+            -font_h, 0, 0, 0, FW_BOLD, FALSE, FALSE, FALSE,
+            DEFAULT_CHARSET, OUT_TT_PRECIS, CLIP_DEFAULT_PRECIS,
+            NONANTIALIASED_QUALITY, DEFAULT_PITCH | FF_SWISS, "Arial");
+        HFONT old_font = (HFONT)SelectObject(mem_dc, hfont);
+        SetBkMode(mem_dc, TRANSPARENT);
+
+        // Strip ASS override tags; convert \N / \n to newline, \h to space.
+        auto strip_ass = [](const std::string& s) -> std::wstring {
+            std::string out;
+            bool in_tag = false;
+            for (size_t i = 0; i < s.size(); i++) {
+                if (s[i] == '{') { in_tag = true;  continue; }
+                if (s[i] == '}') { in_tag = false; continue; }
+                if (in_tag) continue;
+                if (s[i] == '\\' && i + 1 < s.size()) {
+                    char n = s[i + 1];
+                    if (n == 'N' || n == 'n') { out += '\n'; i++; continue; }
+                    if (n == 'h')             { out += ' ';  i++; continue; }
+                }
+                out += s[i];
+            }
+            while (!out.empty() && (out.back() == '\n' || out.back() == '\r' || out.back() == ' '))
+                out.pop_back();
+            int wlen = MultiByteToWideChar(CP_UTF8, 0, out.c_str(), -1, nullptr, 0);
+            std::wstring w(wlen, 0);
+            MultiByteToWideChar(CP_UTF8, 0, out.c_str(), -1, &w[0], wlen);
+            if (!w.empty() && w.back() == 0) w.pop_back();
+            return w;
+        };
+
+        // Magenta (R=255,G=0,B=255) used as background transparency key.
+        // In a 32-bpp top-down DIB the DWORD layout is 0x00RRGGBB.
+        const uint32_t MAGENTA = 0x00FF00FFu;
+
+        for (const auto& ev : text_sub_events) {
+            std::wstring wtxt = strip_ass(ev.ass_text);
+            if (wtxt.empty()) continue;
+
+            // Measure wrapped text dimensions.
+            RECT measure = {0, 0, (LONG)max_tw, 0};
+            DrawTextW(mem_dc, wtxt.c_str(), -1, &measure,
+                      DT_CALCRECT | DT_CENTER | DT_WORDBREAK);
+            int tw = measure.right  - measure.left;
+            int th = measure.bottom - measure.top;
+            if (tw <= 0 || th <= 0) continue;
+
+            // Position: centred horizontally, above bottom margin.
+            const int outline = 2;
+            const int pad     = outline + 1;
+            int tx = (frame_w - tw) / 2;
+            int ty = frame_h - margin_v - th;
+            if (tx < pad) tx = pad;
+            if (ty < pad) ty = pad;
+
+            // Bounding rect including outline padding.
+            int rx = tx - pad, ry = ty - pad;
+            int rw = tw + pad * 2, rh = th + pad * 2;
+            if (rx + rw > frame_w) rw = frame_w - rx;
+            if (ry + rh > frame_h) rh = frame_h - ry;
+            if (rw <= 0 || rh <= 0) continue;
+
+            // Fill bounding area with magenta key colour.
+            for (int dy = 0; dy < rh; dy++)
+                for (int dx = 0; dx < rw; dx++)
+                    pixels[(ry + dy) * frame_w + (rx + dx)] = MAGENTA;
+
+            RECT draw_rect = {(LONG)tx, (LONG)ty,
+                              (LONG)(tx + tw), (LONG)(ty + th)};
+
+            // Draw black outline at all surrounding offsets.
+            SetTextColor(mem_dc, RGB(0, 0, 0));
+            for (int oy = -outline; oy <= outline; oy++) {
+                for (int ox = -outline; ox <= outline; ox++) {
+                    if (ox == 0 && oy == 0) continue;
+                    RECT r2 = {draw_rect.left + ox, draw_rect.top + oy,
+                               draw_rect.right + ox, draw_rect.bottom + oy};
+                    DrawTextW(mem_dc, wtxt.c_str(), -1, &r2,
+                              DT_CENTER | DT_WORDBREAK);
+                }
+            }
+
+            // Draw white main text on top.
+            SetTextColor(mem_dc, RGB(255, 255, 255));
+            DrawTextW(mem_dc, wtxt.c_str(), -1, &draw_rect,
+                      DT_CENTER | DT_WORDBREAK);
+
+            // Convert bounding rect pixels to YUVA (BT.709 limited range).
+            PgsRect pg;
+            pg.x = rx; pg.y = ry; pg.w = rw; pg.h = rh;
+            pg.yuva.resize((size_t)rw * rh * 4);
+            for (int dy = 0; dy < rh; dy++) {
+                for (int dx = 0; dx < rw; dx++) {
+                    uint32_t pv = pixels[(ry + dy) * frame_w + (rx + dx)];
+                    uint8_t r = (uint8_t)((pv >> 16) & 0xFF);
+                    uint8_t g = (uint8_t)((pv >>  8) & 0xFF);
+                    uint8_t b = (uint8_t)( pv        & 0xFF);
+                    bool is_bg = (r > 200 && g < 30 && b > 200);
+                    uint8_t Y, Cb, Cr, A;
+                    if (is_bg) {
+                        Y = 16; Cb = 128; Cr = 128; A = 0;
+                    } else {
+                        Y  = (uint8_t)(16  + ( 65*r + 129*g +  25*b + 128) / 256);
+                        Cb = (uint8_t)(128 + (-38*r -  74*g + 112*b + 128) / 256);
+                        Cr = (uint8_t)(128 + (112*r -  94*g -  18*b + 128) / 256);
+                        A  = 255;
+                    }
+                    size_t idx = ((size_t)dy * rw + dx) * 4;
+                    pg.yuva[idx]   = Y;
+                    pg.yuva[idx+1] = Cb;
+                    pg.yuva[idx+2] = Cr;
+                    pg.yuva[idx+3] = A;
+                }
+            }
+
+            // Add start event (rect visible) and end event (clear screen).
+            PgsEvent start_ev;
+            start_ev.pts_ms = (int64_t)(ev.start_s * 1000.0);
+            start_ev.rects.push_back(std::move(pg));
+            pgs_events.push_back(std::move(start_ev));
+
+            PgsEvent end_ev;
+            end_ev.pts_ms = (int64_t)(ev.end_s * 1000.0);
+            pgs_events.push_back(std::move(end_ev));
+        }
+
+        SelectObject(mem_dc, old_font);
+        DeleteObject(hfont);
+        SelectObject(mem_dc, old_bm);
+    }
+    if (hbm)    DeleteObject(hbm);
+    if (mem_dc) DeleteDC(mem_dc);
+}
+#else
+static void RenderTextSubEvents(const std::vector<TextSubEvent>&, int, int, std::vector<PgsEvent>&) {
+    EngineLog("No text subtitle renderer without libass; subtitles not burned in.\n");
+}
+#endif
+
+// ------------------------------ Session ------------------------------
+TranscodeSession::TranscodeSession(const TranscodeParams& params) : params_(params) {}
+
+TranscodeSession::~TranscodeSession() {
+    Cancel();
+    Wait();
+}
+
+bool TranscodeSession::Run() {
+    running_   = true;
+    progress_  = 0.0;
+    succeeded_ = Execute();
+    if (succeeded_) progress_ = 1.0;
+    running_   = false;
+    return succeeded_;
+}
+
+bool TranscodeSession::Start(DoneFn done, void* opaque) {
+    if (running_ || thread_.joinable()) return false;
+    running_ = true;
+    thread_ = std::thread([this, done, opaque] {
+        Run();
+        if (done) done(opaque, this);
+    });
+    return true;
+}
+
+// From the done callback (the session's own thread) there is nothing to wait
+// for; the thread is let go so the session can be deleted there.
+void TranscodeSession::Wait() {
+    if (!thread_.joinable()) return;
+    if (thread_.get_id() == std::this_thread::get_id()) thread_.detach();
+    else                                                thread_.join();
+}
+
+// Publishes progress and reports whether to carry on.
+bool TranscodeSession::ReportProgress(double fraction) {
+    progress_ = fraction;
+    if (params_.progress && !params_.progress(params_.progress_opaque, fraction)) cancel_ = true;
+    return !cancel_;
+}
+
+// ------------------------------ Transcode ------------------------------
+// Decoding through a gap between ranges shorter than this beats seeking:
+// a seek lands on the keyframe before the next range and decodes up from
+// there anyway.
+static const double kSeekGapSeconds = 5.0;
+// How far past a range's end the pass goes before finishing its file (split)
+// or seeking on to the next range (joined), so audio packets interleaved
+// behind the last frame still make it in.
+static const double kRangeTailSeconds = 1.0;
+
+// One output of a session: its own encoder and muxer, fed from the shared
+// decode.
+struct OutputBranch {
+    std::string      path;
+    double           target_size_mb = 0.0;
+    int              scale_factor   = 1;
+    int64_t          bitrate        = 0;
+    const char*      encoder        = nullptr;   // the codec it opened with
+    AVFormatContext* fmt_ctx        = nullptr;
+    AVCodecContext*  enc_ctx        = nullptr;
+    AVStream*        video_stream   = nullptr;
+    AVStream*        audio_stream   = nullptr;
+    SwsContext*      sws_ctx        = nullptr;   // shared frame → this size; null at the shared size
+    AVFrame*         frame          = nullptr;   // this size, when sws_ctx is set
+    int64_t          frames         = 0;
+    int64_t          bytes          = 0;
+    OutputIoStats    io;                          // once closed
+};
+
+// A stretch of the source, [start, end), and where it begins on the output's
+// own timeline.
+struct OutputSpan {
+    double  start = 0.0, end = 0.0, offset = 0.0;   // seconds
+    int64_t start_pts  = 0;                         // start, in the video stream's time base
+    int64_t offset_pts = 0;                         // offset, likewise
+};
+
+// Outputs that take the same stretches of the source and so share an audio
+// encode: out_path and its renditions, or one range of a split export.
+// Opened when the pass reaches their first span, finished once it is past
+// their last.
+struct OutputTimeline {
+    std::vector<OutputSpan>   spans;            // sorted, non-overlapping
+    double                    duration   = 0.0; // of the output
+    std::vector<OutputBranch> branches;
+    bool                      opened     = false;
+    bool                      finished   = false;
+    SwrContext*               swr_ctx    = nullptr;
+    AVCodecContext*           aenc_ctx   = nullptr;
+    AVFrame*                  aenc_frame = nullptr;
+    int64_t                   aout_pts   = 0;
+    double                    aout_time  = -1.0;    // source time of the last audio packet taken
+};
+
+// What a timeline needs from the pass to open its outputs.
+struct OutputSetup {
+    const AVCodec*        video_encoder      = nullptr;
+    const AVCodecContext* dec_ctx            = nullptr;
+    const AVCodecContext* adec_ctx           = nullptr;   // null = no audio
+    const AVStream*       video_in_stream    = nullptr;
+    int                   orig_w = 0, orig_h = 0;
+    int                   base_w = 0, base_h = 0;         // the shared frame
+    bool                  convert_hdr_to_sdr = false;
+    int                   mp4_layout         = MP4_RESERVE_MOOV;
+    bool                  unbuffered_output  = false;
+    int                   threads            = 0;
+};
+
+// ranges sorted, overlapping ones merged, and laid end to end from offset 0.
+// tb and stream_start are the video stream's.
+static std::vector<OutputSpan> JoinRanges(std::vector<TranscodeRange> ranges, AVRational tb, int64_t stream_start) {
+    std::sort(ranges.begin(), ranges.end(),
+              [](const TranscodeRange& a, const TranscodeRange& b) { return a.start_seconds < b.start_seconds; });
+    std::vector<OutputSpan> spans;
+    double offset = 0.0;
+    for (const TranscodeRange& r : ranges) {
+        if (!spans.empty() && r.start_seconds <= spans.back().end) {
+            if (r.end_seconds > spans.back().end) {
+                offset += r.end_seconds - spans.back().end;
+                spans.back().end = r.end_seconds;
+            }
+            continue;
+        }
+        OutputSpan sp;
+        sp.start      = r.start_seconds;
+        sp.end        = r.end_seconds;
+        sp.offset     = offset;
+        sp.start_pts  = av_rescale_q((int64_t)llround(sp.start * AV_TIME_BASE), AV_TIME_BASE_Q, tb) + stream_start;
+        sp.offset_pts = av_rescale_q((int64_t)llround(sp.offset * AV_TIME_BASE), AV_TIME_BASE_Q, tb);
+        offset += sp.end - sp.start;
+        spans.push_back(sp);
+    }
+    return spans;
+}
+
+static const OutputSpan* SpanAt(const std::vector<OutputSpan>& spans, double t) {
+    for (const OutputSpan& sp : spans)
+        if (t >= sp.start && t < sp.end) return &sp;
+    return nullptr;
+}
+
+// Bitrate calculation: subtract audio and a safety margin so the encoder's CBR
+// overshoot and container overhead never push the file over the target size.
+// 5% overhead absorbs: ~1-2% MP4 container (moov/stbl index tables) + 3-4%
+// NVENC CBR overshoot, which is content-dependent and causes occasional oversize.
+static int64_t VideoBitrateFor(double target_size_mb, bool has_audio, double duration) {
+    int64_t total_bits    = (int64_t)(target_size_mb * 8.0 * 1024.0 * 1024.0);
+    int64_t audio_bitrate = has_audio ? 192000 : 0; // always encode stereo AAC @ 192 kbps
+    int64_t audio_bits  = (int64_t)(audio_bitrate * duration);
+    int64_t overhead    = (int64_t)(total_bits * 0.05); // 5% covers container + encoder overshoot
+    int64_t video_bits  = total_bits - audio_bits - overhead;
+    if (video_bits <= 0) video_bits = total_bits / 2;  // audio alone exceeds budget; give video 50%
+    return (int64_t)(video_bits / duration);
+}
+
+// Creates b's muxer and video stream and opens its encoder at orig / b.scale_factor.
+static bool OpenBranchVideo(OutputBranch& b, const AVCodec* video_encoder, const AVCodecContext* dec_ctx,
+                            const AVStream* video_in_stream, int orig_w, int orig_h,
+                            bool convert_hdr_to_sdr, int threads) {
+    avformat_alloc_output_context2(&b.fmt_ctx, nullptr, nullptr, b.path.c_str());
+    if (!b.fmt_ctx) { EngineLog("Could not create output format context.\n"); return false; }
+
+    b.video_stream = avformat_new_stream(b.fmt_ctx, video_encoder);
+    if (!b.video_stream) { EngineLog("Could not create video output stream.\n"); return false; }
+    AVCodecContext* enc_ctx = b.enc_ctx = avcodec_alloc_context3(video_encoder);
+    if (!enc_ctx) { EngineLog("Failed to allocate video encoder context.\n"); return false; }
+    enc_ctx->height = orig_h / b.scale_factor;
+    enc_ctx->width = orig_w / b.scale_factor;
+    enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
+    // Use YUV420P for both h264_nvenc and libx264.  h264_nvenc accepts YUV420P
+    // and converts to NV12 internally; this avoids semi-planar UV confusion when
+    // the decoded frame (NV12 from NVDEC) is scaled or filtered.
+    enc_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    if (strcmp(video_encoder->name, "h264_nvenc") == 0) {
+        av_opt_set(enc_ctx->priv_data, "preset", "p4",  0);
+        // vbr + explicit maxrate enforces the ceiling more accurately than cbr
+        // across all NVENC driver versions; cbr can overshoot by 3-8% on
+        // complex content because the driver-side rate controller isn't HRD-exact.
+        av_opt_set(enc_ctx->priv_data, "rc", "vbr", 0);
+        // h264_nvenc ignores enc_ctx->max_b_frames; force B-frames off via its own option.
+        // Without this the encoder adds a ~3-frame DTS offset that shifts the output
+        // video start by ~0.1 s relative to the input, causing AV/timestamp drift.
+        av_opt_set(enc_ctx->priv_data, "bf", "0", 0);
+    } else {
+        av_opt_set(enc_ctx->priv_data, "preset",  "medium", 0);
+        av_opt_set(enc_ctx->priv_data, "nal-hrd", "cbr",    0);
+    }
+    // Propagate input colour-space metadata so players decode with the right matrix/range.
+    if (!convert_hdr_to_sdr) {
+        enc_ctx->color_range     = video_in_stream->codecpar->color_range;
+        enc_ctx->color_primaries = video_in_stream->codecpar->color_primaries;
+        enc_ctx->color_trc       = video_in_stream->codecpar->color_trc;
+        enc_ctx->colorspace      = video_in_stream->codecpar->color_space;
+    }
+    {
+        // Prefer codec framerate, fall back to stream's avg_frame_rate, then 30 fps
+        AVRational fps = dec_ctx->framerate;
+        if (fps.num <= 0 || fps.den <= 0) fps = video_in_stream->avg_frame_rate;
+        if (fps.num <= 0 || fps.den <= 0) fps = { 30, 1 };
+        enc_ctx->time_base    = av_inv_q(fps);
+        enc_ctx->max_b_frames = 0;  // no B-frames → DTS always == PTS → clean seeking
+        enc_ctx->gop_size     = max(1, (int)(av_q2d(fps) * 2.0)); // keyframe every ~2 s
+    }
+    enc_ctx->bit_rate       = b.bitrate;
+    enc_ctx->rc_max_rate    = b.bitrate;
+    enc_ctx->rc_buffer_size = b.bitrate * 2; // 2-second VBV window for smoother rate control
+    if (b.fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (threads > 0) enc_ctx->thread_count = threads;
+    if (avcodec_open2(enc_ctx, video_encoder, nullptr) < 0) { EngineLog("Could not open video encoder.\n"); return false; }
+    if (avcodec_parameters_from_context(b.video_stream->codecpar, enc_ctx) < 0) { EngineLog("Failed to copy encoder params to output.\n"); return false; }
+    b.video_stream->time_base = enc_ctx->time_base;
+    b.encoder = video_encoder->name;
+    return true;
+}
+
+// Drains whatever the encoder has ready into one output stream.
+static void WriteEncodedPackets(AVCodecContext* enc_ctx, AVStream* st, AVFormatContext* fmt_ctx, AVPacket* pkt) {
+    while (avcodec_receive_packet(enc_ctx, pkt) == 0) {
+        pkt->stream_index = st->index;
+        av_packet_rescale_ts(pkt, enc_ctx->time_base, st->time_base);
+        av_interleaved_write_frame(fmt_ctx, pkt);
+        av_packet_unref(pkt);
+    }
+}
+
+// Audio is encoded once; every output muxes its own reference to each packet.
+static void WriteAudioPacket(std::vector<OutputBranch>& branches, AVPacket* pkt, AVRational tb, AVPacket* mux_pkt) {
+    for (OutputBranch& b : branches) {
+        if (!b.audio_stream || av_packet_ref(mux_pkt, pkt) < 0) continue;
+        mux_pkt->stream_index = b.audio_stream->index;
+        av_packet_rescale_ts(mux_pkt, tb, b.audio_stream->time_base);
+        av_interleaved_write_frame(b.fmt_ctx, mux_pkt);
+        av_packet_unref(mux_pkt);
+    }
+    av_packet_unref(pkt);
+}
+
+static void FreeAudioEncoder(OutputTimeline& t) {
+    if (t.swr_ctx)    swr_free(&t.swr_ctx);
+    if (t.aenc_ctx)   avcodec_free_context(&t.aenc_ctx);
+    if (t.aenc_frame) av_frame_free(&t.aenc_frame);
+}
+
+// t's resampler and AAC encoder: stereo, at most 48 kHz, 192 kbps.
+static bool OpenAudioEncoder(OutputTimeline& t, const AVCodecContext* adec_ctx, bool global_header) {
+    const AVCodec* aEnc = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    AVCodecContext* enc = t.aenc_ctx = aEnc ? avcodec_alloc_context3(aEnc) : nullptr;
+    if (!enc) return false;
+    int outRate = adec_ctx->sample_rate > 48000 ? 48000 : adec_ctx->sample_rate;
+    enc->sample_fmt  = AV_SAMPLE_FMT_FLTP;
+    enc->sample_rate = outRate;
+    enc->bit_rate    = 192000;
+    enc->time_base   = { 1, outRate };
+    AVChannelLayout stereoLayout = AV_CHANNEL_LAYOUT_STEREO;
+    av_channel_layout_copy(&enc->ch_layout, &stereoLayout);
+    if (global_header) enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (avcodec_open2(enc, aEnc, nullptr) < 0) return false;
+
+    t.swr_ctx = swr_alloc();
+    if (!t.swr_ctx) return false;
+    av_opt_set_chlayout  (t.swr_ctx, "in_chlayout",    &adec_ctx->ch_layout, 0);
+    av_opt_set_int       (t.swr_ctx, "in_sample_rate",  adec_ctx->sample_rate, 0);
+    av_opt_set_sample_fmt(t.swr_ctx, "in_sample_fmt",   adec_ctx->sample_fmt,  0);
+    av_opt_set_chlayout  (t.swr_ctx, "out_chlayout",   &stereoLayout,         0);
+    av_opt_set_int       (t.swr_ctx, "out_sample_rate", outRate,               0);
+    av_opt_set_sample_fmt(t.swr_ctx, "out_sample_fmt",  AV_SAMPLE_FMT_FLTP,   0);
+    if (swr_init(t.swr_ctx) < 0) return false;
+
+    t.aenc_frame = av_frame_alloc();
+    if (!t.aenc_frame) return false;
+    t.aenc_frame->nb_samples  = enc->frame_size;
+    t.aenc_frame->format      = AV_SAMPLE_FMT_FLTP;
+    t.aenc_frame->sample_rate = outRate;
+    av_channel_layout_copy(&t.aenc_frame->ch_layout, &enc->ch_layout);
+    return av_frame_get_buffer(t.aenc_frame, 0) >= 0;
+}
+
+// Feeds one decoded audio frame through t's resampler and encoder and muxes
+// the packets.  in == null drains the resampler and flushes the encoder.
+static void EncodeAudio(OutputTimeline& t, const AVFrame* in, AVPacket* pkt, AVPacket* mux_pkt) {
+    AVCodecContext* enc = t.aenc_ctx;
+    AVFrame*        out = t.aenc_frame;
+    if (!enc) return;
+    if (in) {
+        // Feed decoded samples into swr (no output pull yet)
+        swr_convert(t.swr_ctx, nullptr, 0, (const uint8_t**)in->extended_data, in->nb_samples);
+        // Pull complete AAC frames (frame_size = 1024 samples)
+        while (swr_get_out_samples(t.swr_ctx, 0) >= enc->frame_size) {
+            av_frame_make_writable(out);
+            swr_convert(t.swr_ctx, out->data, enc->frame_size, nullptr, 0);
+            out->pts = t.aout_pts;
+            t.aout_pts += enc->frame_size;
+            avcodec_send_frame(enc, out);
+            while (avcodec_receive_packet(enc, pkt) == 0)
+                WriteAudioPacket(t.branches, pkt, enc->time_base, mux_pkt);
+        }
+        return;
+    }
+    // Drain swr remainder (partial frame), then flush encoder
+    int remaining = swr_get_out_samples(t.swr_ctx, 0);
+    if (remaining > 0) {
+        av_frame_make_writable(out);
+        int got = swr_convert(t.swr_ctx, out->data, enc->frame_size, nullptr, 0);
+        // zero-pad the rest of the frame so the encoder sees a complete frame
+        if (got < enc->frame_size) {
+            int ch = out->ch_layout.nb_channels;
+            for (int c = 0; c < ch; c++)
+                memset(out->data[c] + got * sizeof(float), 0, (enc->frame_size - got) * sizeof(float));
+        }
+        out->pts = t.aout_pts;
+        t.aout_pts += enc->frame_size;
+        avcodec_send_frame(enc, out);
+    }
+    avcodec_send_frame(enc, nullptr);
+    while (avcodec_receive_packet(enc, pkt) == 0)
+        WriteAudioPacket(t.branches, pkt, enc->time_base, mux_pkt);
+}
+
+// Opens t's encoders and files and writes their headers.  Put off until the
+// pass reaches t, so a split export holds one range's encoders (and NVENC
+// session) at a time rather than every range's.
+//
+// Every output has an encoder of its own, so the thread budget is shared out
+// between them, and an output after the first that NVENC turns away (it caps
+// sessions per GPU) is encoded with libx264 rather than failing the pass.
+static bool OpenTimeline(OutputTimeline& t, const OutputSetup& s) {
+    t.opened = true;
+    int threads = s.threads;
+    if (t.branches.size() > 1) {
+        int budget = threads > 0 ? threads : max(1, (int)std::thread::hardware_concurrency());
+        threads = max(1, budget / (int)t.branches.size());
+    }
+    for (size_t i = 0; i < t.branches.size(); i++) {
+        OutputBranch& b = t.branches[i];
+        if (OpenBranchVideo(b, s.video_encoder, s.dec_ctx, s.video_in_stream, s.orig_w, s.orig_h,
+                            s.convert_hdr_to_sdr, threads)) continue;
+        const AVCodec* x264 = avcodec_find_encoder_by_name("libx264");
+        if (i == 0 || !x264 || x264 == s.video_encoder) return false;
+        EngineLog("Rendition encoder did not open; using libx264 for it.\n");
+        avcodec_free_context(&b.enc_ctx);
+        avformat_free_context(b.fmt_ctx);       // nothing opened on it yet
+        b.fmt_ctx      = nullptr;
+        b.video_stream = nullptr;
+        if (!OpenBranchVideo(b, x264, s.dec_ctx, s.video_in_stream, s.orig_w, s.orig_h,
+                             s.convert_hdr_to_sdr, threads)) return false;
+    }
+    if (s.adec_ctx && !OpenAudioEncoder(t, s.adec_ctx, t.branches[0].fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)) {
+        EngineLog("Audio encode setup failed; output will have no audio.\n");
+        FreeAudioEncoder(t);
+    }
+
+    for (OutputBranch& b : t.branches) {
+        if (t.aenc_ctx) {
+            b.audio_stream = avformat_new_stream(b.fmt_ctx, nullptr);
+            if (!b.audio_stream || avcodec_parameters_from_context(b.audio_stream->codecpar, t.aenc_ctx) < 0) {
+                EngineLog("Could not create audio output stream.\n");
+                return false;
+            }
+            b.audio_stream->time_base = t.aenc_ctx->time_base;
+        }
+        // Tag output as BT.709 so players know it's been tone-mapped
+        if (s.convert_hdr_to_sdr) {
+            b.video_stream->codecpar->color_primaries = AVCOL_PRI_BT709;
+            b.video_stream->codecpar->color_trc       = AVCOL_TRC_BT709;
+            b.video_stream->codecpar->color_space     = AVCOL_SPC_BT709;
+        }
+        if (!(b.fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+            int oret = (s.mp4_layout == MP4_FASTSTART)
+                           ? avio_open(&b.fmt_ctx->pb, b.path.c_str(), AVIO_FLAG_WRITE)
+                           : OpenOutputAsync(&b.fmt_ctx->pb, b.path.c_str(), s.unbuffered_output);
+            if (oret < 0) { EngineLog("Could not open output file.\n"); return false; }
+        }
+        // All three layouts put the index ahead of the media, so the output
+        // plays and seeks while it is still downloading or being copied.
+        AVDictionary* mux_opts = nullptr;
+        if (s.mp4_layout == MP4_FRAGMENTED) {
+            av_dict_set(&mux_opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        } else if (s.mp4_layout == MP4_RESERVE_MOOV) {
+            int64_t moov = EstimateMoovBytes(t.duration, av_inv_q(b.enc_ctx->time_base),
+                               t.aenc_ctx ? t.aenc_ctx->sample_rate : 0, t.aenc_ctx ? t.aenc_ctx->frame_size : 0);
+            av_dict_set_int(&mux_opts, "moov_size", moov, 0);
+            char dbg[96];
+            StringCchPrintfA(dbg, sizeof(dbg), "Reserving %lld KB for moov.\n", (long long)(moov >> 10));
+            EngineLog(dbg);
+        } else {
+            av_dict_set(&mux_opts, "movflags", "faststart", 0); // moov moved to the front in the trailer
+        }
+        int wh = avformat_write_header(b.fmt_ctx, &mux_opts);
+        av_dict_free(&mux_opts);
+        if (wh < 0) { EngineLog("Error writing header to output.\n"); return false; }
+
+        // Outputs smaller than the shared frame each get their own downscale of it.
+        if (b.enc_ctx->width == s.base_w && b.enc_ctx->height == s.base_h) continue;
+        b.sws_ctx = sws_getContext(s.base_w, s.base_h, AV_PIX_FMT_YUV420P,
+            b.enc_ctx->width, b.enc_ctx->height, b.enc_ctx->pix_fmt,
+            SWS_BILINEAR, nullptr, nullptr, nullptr);
+        b.frame = av_frame_alloc();
+        if (!b.sws_ctx || !b.frame) { EngineLog("Could not set up rendition downscale.\n"); return false; }
+        b.frame->format = b.enc_ctx->pix_fmt;
+        b.frame->width  = b.enc_ctx->width;
+        b.frame->height = b.enc_ctx->height;
+        if (av_frame_get_buffer(b.frame, 32) < 0) { EngineLog("Could not allocate buffer for scaled frame.\n"); return false; }
+    }
+    return true;
+}
+
+// Flushes t's encoders and writes its trailers.  False if t never got a frame
+// or a trailer failed.
+static bool FinishTimeline(OutputTimeline& t, AVPacket* enc_pkt, AVPacket* aenc_pkt, AVPacket* mux_pkt) {
+    t.finished = true;
+    if (!t.opened) { EngineLog("No frames decoded in range.\n"); return false; }
+    for (OutputBranch& b : t.branches) {
+        avcodec_send_frame(b.enc_ctx, nullptr);
+        WriteEncodedPackets(b.enc_ctx, b.video_stream, b.fmt_ctx, enc_pkt);
+    }
+    av_packet_unref(enc_pkt);
+    if (aenc_pkt && mux_pkt) EncodeAudio(t, nullptr, aenc_pkt, mux_pkt);
+
+    // With a reserved moov the trailer fails if the index outgrew the estimate.
+    bool ok = true;
+    for (OutputBranch& b : t.branches) {
+        if (av_write_trailer(b.fmt_ctx) < 0) { EngineLog("Error writing trailer to output.\n"); ok = false; continue; }
+        b.bytes = b.fmt_ctx->pb ? avio_size(b.fmt_ctx->pb) : 0;
+    }
+    return ok;
+}
+
+// Frees t's encoders and closes its files; safe to call again.  False if a
+// write the async writer could not complete failed.
+static bool CloseTimeline(OutputTimeline& t) {
+    bool ok = true;
+    FreeAudioEncoder(t);
+    for (OutputBranch& b : t.branches) {
+        if (b.sws_ctx) { sws_freeContext(b.sws_ctx); b.sws_ctx = nullptr; }
+        if (b.frame)   av_frame_free(&b.frame);
+        if (b.enc_ctx) avcodec_free_context(&b.enc_ctx);
+        if (b.fmt_ctx) {
+            if (!(b.fmt_ctx->oformat->flags & AVFMT_NOFILE) && !CloseOutput(&b.fmt_ctx->pb, &b.io)) ok = false;
+            avformat_free_context(b.fmt_ctx);
+            b.fmt_ctx = nullptr;
+        }
+    }
+    return ok;
+}
+
+static void SetWriteStats(TranscodeStats& st, const OutputIoStats& io) {
+    st.write_mb_per_s   = io.write_seconds > 0.0 ? io.bytes / (1024.0 * 1024.0) / io.write_seconds : 0.0;
+    st.write_blocked    = io.blocked;
+    st.write_blocked_ms = io.blocked_seconds * 1000.0;
+    st.write_peak_queue = io.peak_depth;
+}
+
+// The stats every output of the pass shares, with b's own frames, size,
+// bitrate and writer stats.  b must be closed.
+static TranscodeStats BranchStats(const TranscodeStats& pass, const OutputBranch& b, double duration) {
+    TranscodeStats st = pass;
+    st.frames        = b.frames;
+    st.output_bytes  = b.bytes;
+    st.video_bitrate = b.bitrate;
+    st.duration      = duration;
+    if (b.encoder) StringCchCopyA(st.encoder, sizeof(st.encoder), b.encoder);
+    SetWriteStats(st, b.io);
+    return st;
+}
+
+// Several outputs may come from the one pass (params.renditions, split
+// params.ranges).  Decoding, deinterlacing, tone mapping and subtitle burn-in
+// run once, at the largest output's size; each smaller output downscales that
+// frame for its encoder.  The ranges are visited in one forward pass, seeking
+// only across gaps too long to decode through.
+bool TranscodeSession::Execute() {
+    const char*       in_filename      = params_.in_path.c_str();
+    const char*       ext_subtitle_path = params_.ext_subtitle_path.empty() ? nullptr : params_.ext_subtitle_path.c_str();
+    int               orig_w           = params_.orig_w;
+    int               orig_h           = params_.orig_h;
+    double            start_seconds    = params_.start_seconds;
+    double            end_seconds      = params_.end_seconds;
+    int               audio_stream_index    = params_.audio_stream_index;
+    int               subtitle_stream_index = params_.subtitle_stream_index;
+    bool              convert_hdr_to_sdr    = params_.convert_hdr_to_sdr;
+    int               mp4_layout       = params_.mp4_layout;
+    bool              unbuffered_output = params_.unbuffered_output;
+    bool              split_ranges     = params_.split_ranges && !params_.ranges.empty();
+    std::vector<OutputTimeline> timelines;    // [0] = out_path + renditions, or one per split range
+    std::vector<OutputSpan> visits;           // what the pass decodes: every timeline's spans, merged
+    size_t            visit            = 0;   // the visit the pass is in or heading for
+    double            pass_duration    = 0.0; // of all visits
+    double            pass_done        = 0.0; // of the visits before `visit`
+    double            left_at          = -1.0; // end of the last visit the pass left
+    bool              outputs_ok       = true;   // no range finished early has failed
+    OutputSetup       setup;
+    int               base_w           = 0;   // size the shared stages work at: the largest output's
+    int               base_h           = 0;
+    AVFormatContext*  in_fmt_ctx       = nullptr;
+    AVCodecContext*   dec_ctx          = nullptr;
+    AVStream*         video_in_stream  = nullptr;
+    AVStream*         audio_in_stream  = nullptr;
+    const AVCodec*    video_decoder    = nullptr;
+    const AVCodec*    video_encoder    = nullptr;
+    SwsContext*       sws_ctx          = nullptr;   // decoded → shared frame
+    SwsContext*       sws_hdr2rgb      = nullptr;   // HDR→SDR: native → RGB48LE
+    SwsContext*       sws_rgb2yuv      = nullptr;   // HDR→SDR: BGR24 → encoder YUV
+    uint8_t*          hdr_rgb48_buf    = nullptr;   // intermediate RGB48LE plane
+    uint8_t*          hdr_bgr24_buf    = nullptr;   // intermediate BGR24 plane
+    AVFilterGraph*    filter_graph     = nullptr;
+    AVFilterContext*  buffersrc_ctx    = nullptr;
+    AVFilterContext*  buffersink_ctx   = nullptr;
+    bool              use_filter       = false;
+    bool              use_bitmap_subs  = false;
+    char              ext_sub_tmp[MAX_PATH]        = {}; // temp copy of the subtitle file at a plain ASCII path
+    char              ext_sub_filter_path[MAX_PATH] = {}; // path used in filter (for lazy format-mismatch reinit)
+    AVFrame*          pre_filter_frame              = nullptr; // YUV420P staging frame for subtitle filter
+    SwsContext*       pre_filter_sws                = nullptr; // NV12/P010/etc → YUV420P for filter input
+    AVFilterGraph*    deint_graph                   = nullptr; // yadif deinterlace filter graph
+    AVFilterContext*  deint_src_ctx                 = nullptr;
+    AVFilterContext*  deint_sink_ctx                = nullptr;
+    bool              needs_deint                   = false;
+    bool              deint_tried                   = false;
+
+    int               pgs_plane_w      = 0;   // subtitle coordinate space (may differ from video for 4K)
+    int               pgs_plane_h      = 0;
+    std::vector<PgsEvent>    pgs_events;
+    std::vector<TextSubEvent> text_sub_events;
+    int               videoStreamIndex = -1;
+    int               audioStreamIndex = -1;
+    AVFrame*          frame            = nullptr;
+    AVFrame*          filt_frame       = nullptr;   // the shared frame, base_w x base_h
+    AVFrame*          cpu_frame        = nullptr;   // for NVDEC hw→cpu transfer
+    AVPacket*         pkt              = nullptr;
+    AVPacket*         enc_pkt          = nullptr;
+    bool              success          = false;
+    bool              cancelled        = false;   // Cancel() or the progress callback
+    bool              using_hw         = false;
+    int64_t           vid_stream_start = 0;  // stream->start_time for video (AVI/Xvid offset)
+    int64_t           aud_stream_start = 0;  // stream->start_time for audio
+    int64_t           last_vid_pkt_dts = AV_NOPTS_VALUE; // most-recent valid video packet DTS
+    AVBSFContext*     trans_bsf_ctx    = nullptr; // mpeg4_unpack_bframes for packed-B AVIs
+    AVPacket*         trans_bsf_pkt    = nullptr;
+    AVCodecContext*   aDec_ctx         = nullptr;
+    AVFrame*          aFrame           = nullptr;
+    AVPacket*         aEncPkt          = nullptr;
+    AVPacket*         aMuxPkt          = nullptr;   // an output's reference to aEncPkt
+    bool              hdr_is_pq        = false; // tone-map with PQ (else HLG) when convert_hdr_to_sdr
+    const ToneMapLuts* tone_luts       = nullptr; // this session's (shared, read-only) tables
+    int64_t           frames_encoded   = 0;
+    int64_t           t_start          = QpcNow();
+
+    if (params_.ranges.empty() && end_seconds <= start_seconds) { EngineLog("End time must be greater than start time.\n"); return false; }
+    for (const TranscodeRange& r : params_.ranges)
+        if (r.end_seconds <= r.start_seconds || r.start_seconds < 0.0) { EngineLog("Range end must be greater than its start.\n"); return false; }
+
+    if (OpenInputReadAhead(&in_fmt_ctx, in_filename) < 0) { EngineLog("Could not open input file.\n"); goto cleanup; }
+    if (avformat_find_stream_info(in_fmt_ctx, nullptr) < 0) { EngineLog("Could not find stream info.\n"); goto cleanup; }
+    for (unsigned int i = 0; i < in_fmt_ctx->nb_streams; i++) {
+        AVStream* st = in_fmt_ctx->streams[i];
+        if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && videoStreamIndex < 0) { videoStreamIndex = (int)i; }
+        else if (st->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && audioStreamIndex < 0) { audioStreamIndex = (int)i; }
+    }
+    // Use user-selected audio stream if valid
+    if (audio_stream_index >= 0 && (unsigned int)audio_stream_index < in_fmt_ctx->nb_streams &&
+        in_fmt_ctx->streams[audio_stream_index]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+        audioStreamIndex = audio_stream_index;
+
+    if (videoStreamIndex < 0) { EngineLog("No video stream found.\n"); goto cleanup; }
+    video_in_stream = in_fmt_ctx->streams[videoStreamIndex];
+    if (audioStreamIndex >= 0) audio_in_stream = in_fmt_ctx->streams[audioStreamIndex];
+    // Same rule as DetectHdr: anything not tagged PQ is tone-mapped as HLG.
+    hdr_is_pq = video_in_stream->codecpar->color_trc == AVCOL_TRC_SMPTE2084;
+
+    // Detect interlaced content from the stream's field_order.
+    // AV_FIELD_PROGRESSIVE and AV_FIELD_UNKNOWN indicate progressive content.
+    needs_deint = (video_in_stream->codecpar->field_order != AV_FIELD_PROGRESSIVE &&
+                   video_in_stream->codecpar->field_order != AV_FIELD_UNKNOWN);
+
+    // Stream start_time offsets: AVI/Xvid (and some other containers) can have a
+    // non-zero start_time so that the first frame's PTS is not 0.  All timestamp
+    // arithmetic must subtract this offset to get elapsed-seconds-from-file-start.
+    vid_stream_start = (video_in_stream->start_time != AV_NOPTS_VALUE)
+                        ? video_in_stream->start_time : 0;
+    aud_stream_start = (audio_in_stream && audio_in_stream->start_time != AV_NOPTS_VALUE)
+                        ? audio_in_stream->start_time : 0;
+
+    {
+        // Joined, the ranges (or start..end) make one timeline for out_path and
+        // its renditions; split, each range is its own file and its own budget.
+        std::vector<TranscodeRange> ranges = params_.ranges;
+        if (ranges.empty()) {
+            ranges.resize(1);
+            ranges[0].start_seconds = start_seconds;
+            ranges[0].end_seconds   = end_seconds;
+        }
+        AVRational tb = video_in_stream->time_base;
+        if (split_ranges) {
+            timelines.resize(ranges.size());
+            for (size_t i = 0; i < ranges.size(); i++) {
+                timelines[i].spans = JoinRanges(std::vector<TranscodeRange>(1, ranges[i]), tb, vid_stream_start);
+                timelines[i].branches.resize(1);
+                timelines[i].branches[0].path           = ranges[i].out_path;
+                timelines[i].branches[0].target_size_mb = ranges[i].target_size_mb;
+                timelines[i].branches[0].scale_factor   = params_.scale_factor;
+            }
+        } else {
+            timelines.resize(1);
+            timelines[0].spans = JoinRanges(ranges, tb, vid_stream_start);
+            std::vector<OutputBranch>& branches = timelines[0].branches;
+            branches.resize(1 + params_.renditions.size());
+            branches[0].path           = params_.out_path;
+            branches[0].target_size_mb = params_.target_size_mb;
+            branches[0].scale_factor   = params_.scale_factor;
+            for (size_t i = 0; i < params_.renditions.size(); i++) {
+                branches[i + 1].path           = params_.renditions[i].out_path;
+                branches[i + 1].target_size_mb = params_.renditions[i].target_size_mb;
+                branches[i + 1].scale_factor   = params_.renditions[i].scale_factor;
+            }
+        }
+        for (OutputTimeline& t : timelines)
+            t.duration = t.spans.back().offset + t.spans.back().end - t.spans.back().start;
+        visits = JoinRanges(ranges, tb, vid_stream_start);
+        pass_duration = visits.back().offset + visits.back().end - visits.back().start;
+    }
+
+    video_decoder = find_best_decoder(video_in_stream->codecpar->codec_id, using_hw);
+    if (!video_decoder) { EngineLog("Video decoder not found.\n"); goto cleanup; }
+    dec_ctx = avcodec_alloc_context3(video_decoder);
+    if (!dec_ctx) { EngineLog("Failed to allocate video decoder context.\n"); goto cleanup; }
+    if (avcodec_parameters_to_context(dec_ctx, video_in_stream->codecpar) < 0) { EngineLog("Failed to copy video params to decoder.\n"); goto cleanup; }
+    if (using_hw) AttachHwDevice(dec_ctx);
+    if (params_.threads > 0) dec_ctx->thread_count = params_.threads;
+    if (avcodec_open2(dec_ctx, video_decoder, nullptr) < 0) { EngineLog("Failed to open video decoder.\n"); goto cleanup; }
+
+    // Apply mpeg4_unpack_bframes BSF for packed-B-frame Xvid/DivX AVIs.
+    if (video_in_stream->codecpar->codec_id == AV_CODEC_ID_MPEG4) {
+        const AVBitStreamFilter* tbsf = av_bsf_get_by_name("mpeg4_unpack_bframes");
+        if (tbsf && av_bsf_alloc(tbsf, &trans_bsf_ctx) >= 0) {
+            avcodec_parameters_copy(trans_bsf_ctx->par_in, video_in_stream->codecpar);
+            trans_bsf_ctx->time_base_in = video_in_stream->time_base;
+            if (av_bsf_init(trans_bsf_ctx) < 0) {
+                av_bsf_free(&trans_bsf_ctx); trans_bsf_ctx = nullptr;
+            }
+        }
+    }
+    trans_bsf_pkt = trans_bsf_ctx ? av_packet_alloc() : nullptr;
+
+    // The encode queue pins all but one job to libx264 so NVENC sessions aren't oversubscribed.
+    video_encoder = avcodec_find_encoder_by_name(params_.software_encode ? "libx264" : "h264_nvenc");
+    if (!video_encoder) { video_encoder = avcodec_find_encoder(AV_CODEC_ID_H264); if (!video_encoder) { EngineLog("H.264 encoder not found.\n"); goto cleanup; } }
+
+    if (audio_in_stream) {
+        // Decoded once; each timeline resamples and encodes its own stretches.
+        const AVCodec* aDec = avcodec_find_decoder(audio_in_stream->codecpar->codec_id);
+        aDec_ctx = aDec ? avcodec_alloc_context3(aDec) : nullptr;
+        bool audioOk = aDec_ctx && avcodec_parameters_to_context(aDec_ctx, audio_in_stream->codecpar) >= 0
+                                && avcodec_open2(aDec_ctx, aDec, nullptr) >= 0;
+        if (audioOk) {
+            aFrame  = av_frame_alloc();
+            aEncPkt = av_packet_alloc();
+            aMuxPkt = av_packet_alloc();
+            audioOk = aFrame && aEncPkt && aMuxPkt;
+        }
+        if (!audioOk) {
+            EngineLog("Audio encode setup failed; output will have no audio.\n");
+            if (aDec_ctx) { avcodec_free_context(&aDec_ctx); aDec_ctx = nullptr; }
+            if (aFrame)   { av_frame_free(&aFrame);           aFrame   = nullptr; }
+            if (aEncPkt)  { av_packet_free(&aEncPkt);         aEncPkt  = nullptr; }
+            if (aMuxPkt)  { av_packet_free(&aMuxPkt);         aMuxPkt  = nullptr; }
+            audio_in_stream  = nullptr;
+        }
+    }
+
+    // Each output has its own size target and scale.
+    for (OutputTimeline& t : timelines)
+        for (OutputBranch& b : t.branches) {
+            b.bitrate = VideoBitrateFor(b.target_size_mb, audio_in_stream != nullptr, t.duration);
+            if (b.bitrate <= 0 || b.scale_factor < 1) { EngineLog("Invalid target bitrate calculated.\n"); goto cleanup; }
+            base_w = max(base_w, orig_w / b.scale_factor);
+            base_h = max(base_h, orig_h / b.scale_factor);
+        }
+
+    // Seek the demuxer to (or just before) the first range on the video stream.
+    if (av_seek_frame(in_fmt_ctx, videoStreamIndex, visits[0].start_pts, AVSEEK_FLAG_BACKWARD) < 0) {
+        EngineLog("Warning: could not seek exactly to start time (video).\n");
+    }
+    avcodec_flush_buffers(dec_ctx);
+
+
+    frame = av_frame_alloc();
+    filt_frame = av_frame_alloc();
+    pkt = av_packet_alloc();
+    enc_pkt = av_packet_alloc();
+    if (!frame || !filt_frame || !pkt || !enc_pkt) { EngineLog("Could not allocate frame/packet.\n"); goto cleanup; }
+    // sws_ctx is created lazily on the first decoded frame because with NVDEC the
+    // pixel format (dec_ctx->pix_fmt) is AV_PIX_FMT_CUDA until hw→cpu transfer reveals it.
+    filt_frame->format = AV_PIX_FMT_YUV420P;
+    filt_frame->width = base_w;
+    filt_frame->height = base_h;
+    if (av_frame_get_buffer(filt_frame, 32) < 0) { EngineLog("Could not allocate buffer for scaled frame.\n"); goto cleanup; }
+
+    if (convert_hdr_to_sdr) {
+        // Stage 1 (sws_hdr2rgb) is created lazily on first frame — input pixel format
+        // is not known until after hw→cpu transfer.
+        // Stage 3: BGR24 (BT.709 full-range) → encoder YUV (BT.709 limited-range)
+        sws_rgb2yuv = sws_getContext(base_w, base_h, AV_PIX_FMT_BGR24,
+            base_w, base_h, AV_PIX_FMT_YUV420P,
+            SWS_BILINEAR, nullptr, nullptr, nullptr);
+        if (sws_rgb2yuv) {
+            sws_setColorspaceDetails(sws_rgb2yuv,
+                sws_getCoefficients(SWS_CS_ITU709), 1,   // src: BT.709, full range (sRGB 0-255)
+                sws_getCoefficients(SWS_CS_ITU709), 0,   // dst: BT.709, limited range (H.264)
+                0, 1 << 16, 1 << 16);
+        }
+        hdr_rgb48_buf = (uint8_t*)av_malloc((size_t)base_h * base_w * 6);
+        hdr_bgr24_buf = (uint8_t*)av_malloc((size_t)base_h * base_w * 3);
+        if (!sws_rgb2yuv || !hdr_rgb48_buf || !hdr_bgr24_buf) {
+            EngineLog("HDR→SDR pre-setup failed; falling back to direct encode.\n");
+            convert_hdr_to_sdr = false;
+        } else {
+            // EOTF + sRGB LUTs so Stage 2 uses table lookups instead of pow().
+            // OpenTimeline tags the outputs BT.709.
+            tone_luts = GetToneMapLuts(hdr_is_pq);
+        }
+    }
+
+    // Pre-load bitmap subtitle events (PGS/VOBSUB) using a separate format context.
+    // Text-based subtitles fall through to the libavfilter/libass path below.
+    if (subtitle_stream_index >= 0 &&
+        (unsigned)subtitle_stream_index < in_fmt_ctx->nb_streams) {
+        AVCodecID cid = in_fmt_ctx->streams[subtitle_stream_index]->codecpar->codec_id;
+        bool is_bitmap = (cid == AV_CODEC_ID_HDMV_PGS_SUBTITLE ||
+                          cid == AV_CODEC_ID_DVD_SUBTITLE ||
+                          cid == AV_CODEC_ID_XSUB ||
+                          cid == AV_CODEC_ID_DVB_SUBTITLE);
+        if (is_bitmap) {
+            const AVCodec* sub_codec = avcodec_find_decoder(cid);
+            AVCodecContext* sub_dec = sub_codec ? avcodec_alloc_context3(sub_codec) : nullptr;
+            if (sub_dec) {
+                avcodec_parameters_to_context(sub_dec, in_fmt_ctx->streams[subtitle_stream_index]->codecpar);
+                if (avcodec_open2(sub_dec, sub_codec, nullptr) >= 0) {
+                    // Record the subtitle plane dimensions so we can scale coords correctly.
+                    // 4K Blu-ray PGS subtitles are typically authored at 1920×1080 even
+                    // when the video track is 3840×2160.
+                    pgs_plane_w = sub_dec->width;
+                    pgs_plane_h = sub_dec->height;
+                    AVFormatContext* sub_fmt = nullptr;
+                    if (OpenInputReadAhead(&sub_fmt, in_filename) >= 0 &&
+                        avformat_find_stream_info(sub_fmt, nullptr) >= 0) {
+                        AVPacket* sub_pkt = av_packet_alloc();
+                        while (sub_pkt && av_read_frame(sub_fmt, sub_pkt) >= 0) {
+                            if (sub_pkt->stream_index == subtitle_stream_index) {
+                                AVSubtitle sub = {};
+                                int got_sub = 0;
+                                avcodec_decode_subtitle2(sub_dec, &sub, &got_sub, sub_pkt);
+                                if (got_sub) {
+                                    // PGS codec sets sub_dec->width/height from the PCS segment
+                                    // during avcodec_decode_subtitle2, not before. Refresh here
+                                    // so the scaling below uses the correct authored plane size
+                                    // (e.g. 1920×1080 for 4K Blu-ray with 1080p PGS track).
+                                    if (sub_dec->width  > 0) pgs_plane_w = sub_dec->width;
+                                    if (sub_dec->height > 0) pgs_plane_h = sub_dec->height;
+
+                                    // AVSubtitle.pts is in microseconds (AV_TIME_BASE)
+                                    int64_t s_ms = (sub.pts != AV_NOPTS_VALUE)
+                                        ? sub.pts / 1000
+                                        : (int64_t)(sub_pkt->pts * av_q2d(in_fmt_ctx->streams[subtitle_stream_index]->time_base) * 1000.0);
+                                    PgsEvent ev;
+                                    ev.pts_ms = s_ms;
+                                    for (unsigned ri = 0; ri < sub.num_rects; ri++) {
+                                        AVSubtitleRect* rect = sub.rects[ri];
+                                        if (rect->type == SUBTITLE_BITMAP && rect->w > 0 && rect->h > 0) {
+                                            // Pre-scale to the shared frame's size and pre-convert
+                                            // palette → [Y, Cb, Cr, A].  Doing this once at load
+                                            // time removes all float coordinate math and per-pixel
+                                            // colour conversion from the per-frame blend loop.
+                                            int srcRefW = (pgs_plane_w > 0) ? pgs_plane_w : dec_ctx->width;
+                                            int srcRefH = (pgs_plane_h > 0) ? pgs_plane_h : dec_ctx->height;
+                                            double psx = (srcRefW > 0) ? (double)base_w / srcRefW : 1.0;
+                                            double psy = (srcRefH > 0) ? (double)base_h / srcRefH : 1.0;
+                                            PgsRect pr;
+                                            pr.x = (int)(rect->x * psx);
+                                            pr.y = (int)(rect->y * psy);
+                                            pr.w = max(1, (int)(rect->w * psx + 0.5));
+                                            pr.h = max(1, (int)(rect->h * psy + 0.5));
+                                            pr.yuva.resize((size_t)pr.w * pr.h * 4);
+                                            uint8_t* pal = rect->data[1]; // BGRA palette (256 × 4 bytes)
+                                            for (int dy = 0; dy < pr.h; dy++) {
+                                                int sy_s = min(rect->h - 1, (int)((dy + 0.5) * rect->h / pr.h));
+                                                for (int dx = 0; dx < pr.w; dx++) {
+                                                    int sx_s = min(rect->w - 1, (int)((dx + 0.5) * rect->w / pr.w));
+                                                    uint8_t idx = rect->data[0][sy_s * rect->linesize[0] + sx_s];
+                                                    uint8_t b = pal[idx * 4 + 0];
+                                                    uint8_t g = pal[idx * 4 + 1];
+                                                    uint8_t r = pal[idx * 4 + 2];
+                                                    uint8_t a = pal[idx * 4 + 3];
+                                                    uint8_t* dst = pr.yuva.data() + ((size_t)dy * pr.w + dx) * 4;
+                                                    dst[0] = (uint8_t)max(16, min(235, (( 66*r + 129*g +  25*b + 128) >> 8) + 16));
+                                                    dst[1] = (uint8_t)max(16, min(240, ((-38*r -  74*g + 112*b + 128) >> 8) + 128));
+                                                    dst[2] = (uint8_t)max(16, min(240, ((112*r -  94*g -  18*b + 128) >> 8) + 128));
+                                                    dst[3] = a;
+                                                }
+                                            }
+                                            ev.rects.push_back(std::move(pr));
+                                        }
+                                    }
+                                    pgs_events.push_back(std::move(ev));
+                                    avsubtitle_free(&sub);
+                                }
+                            }
+                            av_packet_unref(sub_pkt);
+                        }
+                        av_packet_free(&sub_pkt);
+                        std::sort(pgs_events.begin(), pgs_events.end(),
+                            [](const PgsEvent& a, const PgsEvent& b){ return a.pts_ms < b.pts_ms; });
+                        use_bitmap_subs = !pgs_events.empty();
+                    }
+                    CloseInput(&sub_fmt);
+                }
+                avcodec_free_context(&sub_dec);
+            }
+        }
+    }
+
+    // External subtitle file (.srt/.ass/.ssa alongside the video).
+    // libass silently fails to open files whose paths contain special characters
+    // (spaces, !!, non-ASCII).  Fix: copy the file into a temp path with a plain
+    // ASCII name before passing it to the filter.  This preserves all styling
+    // (ASS overrides, fonts, etc.) because libass reads the actual file content.
+    if (ext_subtitle_path && ext_subtitle_path[0] && !use_bitmap_subs) {
+        CopyToTempPath(ext_subtitle_path, ext_sub_tmp, MAX_PATH);
+        // Use the temp copy if it was created, otherwise fall back to the original path.
+        const char* sub_path_for_filter = ext_sub_tmp[0] ? ext_sub_tmp : ext_subtitle_path;
+        // Store for the lazy format-mismatch reinit in the encode loop.
+        StringCchCopyA(ext_sub_filter_path, MAX_PATH, sub_path_for_filter);
+
+        const AVFilter* buffersrc  = avfilter_get_by_name("buffer");
+        const AVFilter* buffersink = avfilter_get_by_name("buffersink");
+        if (buffersrc && buffersink) {
+            filter_graph = avfilter_graph_alloc();
+            if (filter_graph) {
+                char src_args[256];
+                AVRational tb  = video_in_stream->time_base;
+                AVRational sar = dec_ctx->sample_aspect_ratio;
+                // The buffersrc is configured for YUV420P.  Frames that arrive in a
+                // different format (e.g. NV12 from NVDEC) are converted to YUV420P
+                // explicitly in the encode loop before being pushed to the filter.
+                AVPixelFormat filter_fmt;
+                if (using_hw && dec_ctx->hw_frames_ctx)
+                    filter_fmt = ((AVHWFramesContext*)dec_ctx->hw_frames_ctx->data)->sw_format;
+                else
+                    filter_fmt = AV_PIX_FMT_YUV420P;
+                snprintf(src_args, sizeof(src_args),
+                    "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+                    dec_ctx->width, dec_ctx->height, (int)filter_fmt,
+                    tb.num, tb.den, sar.num ? sar.num : 1, sar.den ? sar.den : 1);
+                int ret = avfilter_graph_create_filter(&buffersrc_ctx,  buffersrc,  "in",  src_args, nullptr, filter_graph);
+                if (ret >= 0)
+                    ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out", nullptr,  nullptr, filter_graph);
+                if (ret >= 0) {
+                    // Build the subtitle filter directly (no avfilter_graph_parse_ptr).
+                    // avfilter_graph_parse_ptr consistently returns EINVAL when the path
+                    // contains colons (drive letters) even inside single quotes.
+                    // Using av_opt_set bypasses all string-escaping issues entirely.
+                    char fontspath_raw[MAX_PATH + 8];
+                    bool have_fontsdir = GetFontsDir(fontspath_raw, sizeof(fontspath_raw));
+
+                    const AVFilter* sub_filt = avfilter_get_by_name("subtitles");
+                    // avfilter_graph_create_filter calls init() immediately (before we can
+                    // set options), so filename is null and init rejects it.
+                    // Use alloc_filter + av_opt_set + avfilter_init_str instead:
+                    // alloc_filter creates the context without calling init().
+                    AVFilterContext* sub_ctx = sub_filt
+                        ? avfilter_graph_alloc_filter(filter_graph, sub_filt, "sub")
+                        : nullptr;
+                    if (sub_ctx) {
+                        av_opt_set(sub_ctx->priv, "filename", sub_path_for_filter, 0);
+                        if (have_fontsdir) av_opt_set(sub_ctx->priv, "fontsdir", fontspath_raw, 0);
+                        int init_ret = avfilter_init_str(sub_ctx, nullptr);
+                        if (init_ret >= 0 &&
+                            avfilter_link(buffersrc_ctx, 0, sub_ctx, 0) == 0 &&
+                            avfilter_link(sub_ctx, 0, buffersink_ctx, 0) == 0) {
+                            ret = avfilter_graph_config(filter_graph, nullptr);
+                        } else { ret = (init_ret < 0) ? init_ret : AVERROR(EINVAL); }
+                    } else { ret = AVERROR(ENOSYS); }
+                    if (ret >= 0) {
+                        use_filter = true;
+                    } else {
+                        // subtitles filter failed (likely no libass) — open the external
+                        // subtitle file with avformat, decode events, and render via GDI.
+                        avfilter_graph_free(&filter_graph); filter_graph = nullptr;
+                        buffersrc_ctx = nullptr; buffersink_ctx = nullptr;
+
+                        AVFormatContext* ext_fmt = nullptr;
+                        if (avformat_open_input(&ext_fmt, ext_subtitle_path, nullptr, nullptr) >= 0 &&
+                            avformat_find_stream_info(ext_fmt, nullptr) >= 0) {
+                            int ext_sub_idx = -1;
+                            for (unsigned si = 0; si < ext_fmt->nb_streams; si++) {
+                                if (ext_fmt->streams[si]->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE) {
+                                    ext_sub_idx = (int)si; break;
+                                }
+                            }
+                            if (ext_sub_idx >= 0) {
+                                AVCodecID ext_cid = ext_fmt->streams[ext_sub_idx]->codecpar->codec_id;
+                                const AVCodec* ext_codec = avcodec_find_decoder(ext_cid);
+                                AVCodecContext* ext_dec = ext_codec ? avcodec_alloc_context3(ext_codec) : nullptr;
+                                if (ext_dec) {
+                                    avcodec_parameters_to_context(ext_dec, ext_fmt->streams[ext_sub_idx]->codecpar);
+                                    if (avcodec_open2(ext_dec, ext_codec, nullptr) >= 0) {
+                                        AVPacket* ext_pkt = av_packet_alloc();
+                                        while (ext_pkt && av_read_frame(ext_fmt, ext_pkt) >= 0) {
+                                            if (ext_pkt->stream_index == ext_sub_idx) {
+                                                AVSubtitle ext_sub2 = {}; int got2 = 0;
+                                                avcodec_decode_subtitle2(ext_dec, &ext_sub2, &got2, ext_pkt);
+                                                if (got2) {
+                                                    double s2_start = (ext_sub2.pts != AV_NOPTS_VALUE)
+                                                        ? ext_sub2.pts * 1e-6
+                                                        : ext_pkt->pts * av_q2d(ext_fmt->streams[ext_sub_idx]->time_base);
+                                                    double s2_end = s2_start + ext_sub2.end_display_time * 1e-3;
+                                                    for (unsigned ri = 0; ri < ext_sub2.num_rects; ri++) {
+                                                        AVSubtitleRect* r2 = ext_sub2.rects[ri];
+                                                        std::string txt2;
+                                                        if (r2->type == SUBTITLE_ASS && r2->ass) {
+                                                            const char* p2 = r2->ass;
+                                                            // FFmpeg ≥6 omits "Dialogue: " prefix from r->ass; the text field is
+// then the 9th field (8 commas) instead of the 10th (9 commas).
+{ int _skip = (p2[0]=='D'&&p2[1]=='i'&&p2[2]=='a') ? 9 : 8;
+  for (int nc = 0; *p2 && nc < _skip; p2++) if (*p2 == ',') nc++; }
+                                                            txt2 = p2;
+                                                        } else if (r2->type == SUBTITLE_TEXT && r2->text) {
+                                                            for (const char* p2 = r2->text; *p2; p2++) {
+                                                                if      (*p2 == '{')  txt2 += "\\{";
+                                                                else if (*p2 == '\n') txt2 += "\\N";
+                                                                else if (*p2 != '\r') txt2 += *p2;
+                                                            }
+                                                        }
+                                                        if (!txt2.empty())
+                                                            text_sub_events.push_back({s2_start, s2_end, std::move(txt2)});
+                                                    }
+                                                    avsubtitle_free(&ext_sub2);
+                                                }
+                                            }
+                                            av_packet_unref(ext_pkt);
+                                        }
+                                        if (ext_pkt) av_packet_free(&ext_pkt);
+                                    }
+                                    avcodec_free_context(&ext_dec);
+                                }
+                            }
+                            avformat_close_input(&ext_fmt);
+                        }
+
+                        // Render collected text events into pgs_events.
+                        if (!text_sub_events.empty()) {
+                            RenderTextSubEvents(text_sub_events, base_w, base_h, pgs_events);
+                            std::sort(pgs_events.begin(), pgs_events.end(),
+                                [](const PgsEvent& a, const PgsEvent& b){ return a.pts_ms < b.pts_ms; });
+                            use_bitmap_subs = !pgs_events.empty();
+                        }
+                    }
+                } else {
+                    avfilter_graph_free(&filter_graph); filter_graph = nullptr;
+                }
+            }
+        }
+    }
+
+    // Set up subtitle burn-in filter graph if a subtitle stream was selected
+    // (text-based subtitles only — bitmap types handled by use_bitmap_subs above)
+    if (subtitle_stream_index >= 0 && !use_bitmap_subs && !use_filter) {
+        const AVFilter* buffersrc  = avfilter_get_by_name("buffer");
+        const AVFilter* buffersink = avfilter_get_by_name("buffersink");
+        if (buffersrc && buffersink) {
+            filter_graph = avfilter_graph_alloc();
+            if (filter_graph) {
+                // Describe the input video stream for the buffer source
+                char src_args[256];
+                AVRational tb  = video_in_stream->time_base;
+                AVRational sar = dec_ctx->sample_aspect_ratio;
+                // With NVDEC, dec_ctx->pix_fmt == AV_PIX_FMT_CUDA.  Use the actual
+                // software transfer format from the hw_frames_ctx (e.g. NV12) so the
+                // buffersrc matches the frames we will actually feed it.  Falling back
+                // to the codecpar format (YUV420P) caused a semi-planar / planar
+                // mismatch that corrupted chroma and produced a green tint.
+                AVPixelFormat filter_fmt;
+                if (using_hw && dec_ctx->hw_frames_ctx) {
+                    filter_fmt = ((AVHWFramesContext*)dec_ctx->hw_frames_ctx->data)->sw_format;
+                } else if (using_hw) {
+                    filter_fmt = (AVPixelFormat)video_in_stream->codecpar->format;
+                } else {
+                    filter_fmt = dec_ctx->pix_fmt;
+                }
+                snprintf(src_args, sizeof(src_args),
+                    "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+                    dec_ctx->width, dec_ctx->height, (int)filter_fmt,
+                    tb.num, tb.den, sar.num ? sar.num : 1, sar.den ? sar.den : 1);
+
+                int ret = avfilter_graph_create_filter(&buffersrc_ctx,  buffersrc,  "in",  src_args, nullptr, filter_graph);
+                if (ret >= 0)
+                    ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out", nullptr,  nullptr, filter_graph);
+
+                if (ret >= 0) {
+                    // The subtitles filter si= takes 0-based index among subtitle streams,
+                    // not the global stream index stored in the combo box item data.
+                    int subtitle_si = 0;
+                    for (unsigned int j = 0; j < in_fmt_ctx->nb_streams && (int)j < subtitle_stream_index; j++)
+                        if (in_fmt_ctx->streams[j]->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE)
+                            subtitle_si++;
+
+                    // Windows Fonts dir so libass can initialize its font engine
+                    char fontspath_raw[MAX_PATH + 8];
+                    bool have_fontsdir = GetFontsDir(fontspath_raw, sizeof(fontspath_raw));
+
+                    // Use avfilter_graph_alloc_filter + av_opt_set instead of
+                    // avfilter_graph_parse_ptr: the parse path consistently returns
+                    // EINVAL on Windows when the file path contains a drive-letter
+                    // colon (e.g. "C:/..."), even inside single quotes.
+                    const AVFilter* sub_filt = avfilter_get_by_name("subtitles");
+                    AVFilterContext* sub_ctx = sub_filt
+                        ? avfilter_graph_alloc_filter(filter_graph, sub_filt, "sub")
+                        : nullptr;
+                    if (sub_ctx) {
+                        av_opt_set    (sub_ctx->priv, "filename",     in_filename,  0);
+                        av_opt_set_int(sub_ctx->priv, "stream_index", subtitle_si,  0);
+                        if (have_fontsdir)
+                            av_opt_set(sub_ctx->priv, "fontsdir", fontspath_raw, 0);
+                        int init_ret = avfilter_init_str(sub_ctx, nullptr);
+                        if (init_ret >= 0 &&
+                            avfilter_link(buffersrc_ctx, 0, sub_ctx, 0) == 0 &&
+                            avfilter_link(sub_ctx, 0, buffersink_ctx, 0) == 0) {
+                            ret = avfilter_graph_config(filter_graph, nullptr);
+                        } else { ret = (init_ret < 0) ? init_ret : AVERROR(EINVAL); }
+                    } else { ret = AVERROR(ENOSYS); }
+                    if (ret >= 0) {
+                        use_filter = true;
+                    } else {
+                        // Primary subtitles filter failed — pre-decode subtitle events via
+                        // avcodec_decode_subtitle2, write a temp ASS file, and retry.
+                        // This handles formats that libass/subtitles-filter doesn't open
+                        // directly (e.g. MOV_TEXT in MP4, unusual codec wrappings).
+                        avfilter_graph_free(&filter_graph); filter_graph = nullptr;
+                        buffersrc_ctx = nullptr; buffersink_ctx = nullptr;
+
+                        // --- decode all subtitle events from the stream ---
+                        {
+                            AVCodecID sub_cid2 = in_fmt_ctx->streams[subtitle_stream_index]->codecpar->codec_id;
+                            const AVCodec* sub_codec2 = avcodec_find_decoder(sub_cid2);
+                            AVCodecContext* sub_dec2 = sub_codec2 ? avcodec_alloc_context3(sub_codec2) : nullptr;
+                            if (sub_dec2) {
+                                avcodec_parameters_to_context(sub_dec2, in_fmt_ctx->streams[subtitle_stream_index]->codecpar);
+                                if (avcodec_open2(sub_dec2, sub_codec2, nullptr) >= 0) {
+                                    AVFormatContext* sub_fmt2 = nullptr;
+                                    if (OpenInputReadAhead(&sub_fmt2, in_filename) >= 0 &&
+                                        avformat_find_stream_info(sub_fmt2, nullptr) >= 0) {
+                                        AVPacket* sub_pkt2 = av_packet_alloc();
+                                        while (sub_pkt2 && av_read_frame(sub_fmt2, sub_pkt2) >= 0) {
+                                            if (sub_pkt2->stream_index == subtitle_stream_index) {
+                                                AVSubtitle sub2 = {};
+                                                int got2 = 0;
+                                                avcodec_decode_subtitle2(sub_dec2, &sub2, &got2, sub_pkt2);
+                                                if (got2) {
+                                                    double s2_start = (sub2.pts != AV_NOPTS_VALUE)
+                                                        ? sub2.pts * 1e-6
+                                                        : sub_pkt2->pts * av_q2d(sub_fmt2->streams[subtitle_stream_index]->time_base);
+                                                    double s2_end = s2_start + sub2.end_display_time * 1e-3;
+                                                    for (unsigned ri = 0; ri < sub2.num_rects; ri++) {
+                                                        AVSubtitleRect* r2 = sub2.rects[ri];
+                                                        std::string txt2;
+                                                        if (r2->type == SUBTITLE_ASS && r2->ass) {
+                                                            // Skip commas to reach the Text field (8 for new FFmpeg, 9 for old).
+                                                            const char* p2 = r2->ass;
+                                                            // FFmpeg ≥6 omits "Dialogue: " prefix from r->ass; the text field is
+// then the 9th field (8 commas) instead of the 10th (9 commas).
+{ int _skip = (p2[0]=='D'&&p2[1]=='i'&&p2[2]=='a') ? 9 : 8;
+  for (int nc = 0; *p2 && nc < _skip; p2++) if (*p2 == ',') nc++; }
+                                                            txt2 = p2;
+                                                        } else if (r2->type == SUBTITLE_TEXT && r2->text) {
+                                                            for (const char* p2 = r2->text; *p2; p2++) {
+                                                                if      (*p2 == '{')  txt2 += "\\{";
+                                                                else if (*p2 == '\n') txt2 += "\\N";
+                                                                else if (*p2 != '\r') txt2 += *p2;
+                                                            }
+                                                        }
+                                                        if (!txt2.empty())
+                                                            text_sub_events.push_back({s2_start, s2_end, std::move(txt2)});
+                                                    }
+                                                    avsubtitle_free(&sub2);
+                                                }
+                                            }
+                                            av_packet_unref(sub_pkt2);
+                                        }
+                                        if (sub_pkt2) av_packet_free(&sub_pkt2);
+                                    }
+                                    CloseInput(&sub_fmt2);
+                                }
+                                avcodec_free_context(&sub_dec2);
+                            }
+                        }
+
+                        // --- text rendering fallback (no libass required) ---
+                        // Render decoded text events as YUVA bitmaps and feed into the
+                        // existing pgs_events / use_bitmap_subs blending path.
+                        if (!text_sub_events.empty()) {
+                            RenderTextSubEvents(text_sub_events, base_w, base_h, pgs_events);
+                            std::sort(pgs_events.begin(), pgs_events.end(),
+                                [](const PgsEvent& a, const PgsEvent& b){ return a.pts_ms < b.pts_ms; });
+                            use_bitmap_subs = !pgs_events.empty();
+                        }
+                    }
+                } else {
+                    avfilter_graph_free(&filter_graph); filter_graph = nullptr;
+                }
+            }
+        }
+    }
+
+    setup.video_encoder      = video_encoder;
+    setup.dec_ctx            = dec_ctx;
+    setup.adec_ctx           = aDec_ctx;
+    setup.video_in_stream    = video_in_stream;
+    setup.orig_w             = orig_w;
+    setup.orig_h             = orig_h;
+    setup.base_w             = base_w;
+    setup.base_h             = base_h;
+    setup.convert_hdr_to_sdr = convert_hdr_to_sdr;
+    setup.mp4_layout         = mp4_layout;
+    setup.unbuffered_output  = unbuffered_output;
+    setup.threads            = params_.threads;
+
+    while (av_read_frame(in_fmt_ctx, pkt) >= 0) {
+        if (pkt->stream_index == videoStreamIndex) {
+            if (pkt->dts != AV_NOPTS_VALUE) last_vid_pkt_dts = pkt->dts;
+            if (trans_bsf_ctx) {
+                if (av_bsf_send_packet(trans_bsf_ctx, pkt) >= 0) {
+                    while (av_bsf_receive_packet(trans_bsf_ctx, trans_bsf_pkt) >= 0) {
+                        if (trans_bsf_pkt->dts != AV_NOPTS_VALUE) last_vid_pkt_dts = trans_bsf_pkt->dts;
+                        avcodec_send_packet(dec_ctx, trans_bsf_pkt);
+                        av_packet_unref(trans_bsf_pkt);
+                    }
+                }
+                av_packet_unref(pkt);
+            } else {
+                if (avcodec_send_packet(dec_ctx, pkt) < 0) { av_packet_unref(pkt); break; }
+            }
+            while (avcodec_receive_frame(dec_ctx, frame) == 0) {
+                int64_t in_pts = (frame->best_effort_timestamp != AV_NOPTS_VALUE)
+                                    ? frame->best_effort_timestamp
+                                    : (frame->pts != AV_NOPTS_VALUE ? frame->pts : vid_stream_start);
+                // Subtract stream start_time so in_time is elapsed seconds from the
+                // beginning of the file regardless of container offset (AVI/Xvid fix).
+                double in_time = (in_pts - vid_stream_start) * av_q2d(video_in_stream->time_base);
+                // Guard against stale VOP timestamps (e.g. Xvid clip cut from a long recording).
+                if (in_time < -1.0 || in_time > visits.back().end + pass_duration) {
+                    int64_t dts_fb = (last_vid_pkt_dts != AV_NOPTS_VALUE) ? last_vid_pkt_dts : vid_stream_start;
+                    in_pts  = dts_fb;
+                    in_time = (in_pts - vid_stream_start) * av_q2d(video_in_stream->time_base);
+                }
+
+                // Past the visit: on to the next, seeking there unless the gap
+                // is short enough to decode through.  The pass first stays
+                // kRangeTailSeconds past the visit's end (as split ranges do) so
+                // the audio interleaved behind its last frame still makes it in.
+                if (visit < visits.size() && in_time >= visits[visit].end) {
+                    while (visit < visits.size() && in_time >= visits[visit].end) {
+                        pass_done += visits[visit].end - visits[visit].start;
+                        left_at    = visits[visit].end;
+                        visit++;
+                    }
+                }
+                if (visit == visits.size()) {
+                    av_frame_unref(frame);
+                    if (in_time >= left_at + kRangeTailSeconds) goto flush_encoder;
+                    continue;
+                }
+                if (left_at >= 0.0 && in_time >= left_at + kRangeTailSeconds) {
+                    left_at = -1.0;     // one try; a failed seek decodes through
+                    if (visits[visit].start - in_time > kSeekGapSeconds &&
+                        av_seek_frame(in_fmt_ctx, videoStreamIndex, visits[visit].start_pts, AVSEEK_FLAG_BACKWARD) >= 0) {
+                        // Split ranges the seek skips past are done; finish them now
+                        // rather than hold their encoders to the end.
+                        for (OutputTimeline& t : timelines) {
+                            if (t.finished || t.spans.back().end > visits[visit].start) continue;
+                            if (!FinishTimeline(t, enc_pkt, aEncPkt, aMuxPkt)) outputs_ok = false;
+                            if (!CloseTimeline(t)) outputs_ok = false;
+                        }
+                        avcodec_flush_buffers(dec_ctx);
+                        if (aDec_ctx) avcodec_flush_buffers(aDec_ctx);
+                        if (trans_bsf_ctx) av_bsf_flush(trans_bsf_ctx);
+                        // yadif's field history would blend across the cut; start it afresh.
+                        if (deint_graph) {
+                            avfilter_graph_free(&deint_graph);
+                            deint_src_ctx = deint_sink_ctx = nullptr;
+                            deint_tried   = false;
+                        }
+                        last_vid_pkt_dts = AV_NOPTS_VALUE;
+                        av_frame_unref(frame);
+                        break;
+                    }
+                }
+
+                // Drop frames that still decode before the visit's start
+                if (in_time < visits[visit].start) { av_frame_unref(frame); continue; }
+
+                // Split ranges the pass is well past get their files finished.
+                for (OutputTimeline& t : timelines) {
+                    if (t.finished || !t.opened || in_time < t.spans.back().end + kRangeTailSeconds) continue;
+                    if (!FinishTimeline(t, enc_pkt, aEncPkt, aMuxPkt)) outputs_ok = false;
+                    if (!CloseTimeline(t)) outputs_ok = false;
+                }
+
+                // Report encode progress (the button's progress bar, the CLI's progress
+                // lines); a cancel abandons the encode.
+                if (!ReportProgress((pass_done + in_time - visits[visit].start) / pass_duration)) {
+                    EngineLog("Transcode cancelled.\n");
+                    cancelled = true;
+                    av_frame_unref(frame);
+                    goto cleanup;
+                }
+
+                // Transfer NVDEC hardware frame to CPU memory if needed.
+                AVFrame* sw_frame = HwFrameToCpu(frame, &cpu_frame);
+
+                // Lazy-init yadif deinterlace filter graph on first decoded frame.
+                // yadif runs on CPU frames; sw_frame is already CPU here (post-NVDEC transfer),
+                // so this path is fully NVDEC-compatible without any extra hw→cpu steps.
+                if (needs_deint && !deint_tried) {
+                    deint_tried = true;
+                    const AVFilter* yd_src  = avfilter_get_by_name("buffer");
+                    const AVFilter* yd_sink = avfilter_get_by_name("buffersink");
+                    const AVFilter* yd_filt = avfilter_get_by_name("yadif");
+                    if (yd_src && yd_sink && yd_filt) {
+                        deint_graph = avfilter_graph_alloc();
+                        if (deint_graph) {
+                            char yd_args[256];
+                            AVRational yd_tb  = video_in_stream->time_base;
+                            AVRational yd_sar = dec_ctx->sample_aspect_ratio;
+                            snprintf(yd_args, sizeof(yd_args),
+                                "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+                                sw_frame->width, sw_frame->height, sw_frame->format,
+                                yd_tb.num, yd_tb.den,
+                                yd_sar.num ? yd_sar.num : 1, yd_sar.den ? yd_sar.den : 1);
+                            int yd_ret = avfilter_graph_create_filter(&deint_src_ctx,  yd_src,  "in",  yd_args, nullptr, deint_graph);
+                            if (yd_ret >= 0)
+                                yd_ret = avfilter_graph_create_filter(&deint_sink_ctx, yd_sink, "out", nullptr, nullptr, deint_graph);
+                            if (yd_ret >= 0) {
+                                AVFilterContext* yd_ctx = nullptr;
+                                // mode=0: one output frame per interlaced input (preserves frame rate)
+                                // parity=-1: auto-detect top/bottom field from frame flags
+                                // deint=0: deinterlace all frames
+                                yd_ret = avfilter_graph_create_filter(&yd_ctx, yd_filt, "yadif",
+                                    "mode=0:parity=-1:deint=0", nullptr, deint_graph);
+                                if (yd_ret >= 0) yd_ret = avfilter_link(deint_src_ctx, 0, yd_ctx, 0);
+                                if (yd_ret >= 0) yd_ret = avfilter_link(yd_ctx, 0, deint_sink_ctx, 0);
+                                if (yd_ret >= 0) yd_ret = avfilter_graph_config(deint_graph, nullptr);
+                            }
+                            if (yd_ret < 0) {
+                                EngineLog("yadif init failed; skipping deinterlace.\n");
+                                avfilter_graph_free(&deint_graph);
+                                deint_graph = nullptr; deint_src_ctx = nullptr; deint_sink_ctx = nullptr;
+                                needs_deint = false;
+                            }
+                        } else { needs_deint = false; }
+                    } else { needs_deint = false; }
+                }
+
+                // Apply yadif deinterlace to sw_frame if active.
+                AVFrame* deint_out_frame = nullptr;
+                if (needs_deint && deint_graph) {
+                    sw_frame->pts = in_pts; // yadif uses pts for temporal ordering
+                    if (av_buffersrc_add_frame_flags(deint_src_ctx, sw_frame, AV_BUFFERSRC_FLAG_KEEP_REF) >= 0) {
+                        deint_out_frame = av_frame_alloc();
+                        if (deint_out_frame) {
+                            if (av_buffersink_get_frame(deint_sink_ctx, deint_out_frame) >= 0) {
+                                deint_out_frame->pts = sw_frame->pts;
+                                sw_frame = deint_out_frame;
+                            } else {
+                                av_frame_free(&deint_out_frame);
+                                deint_out_frame = nullptr;
+                            }
+                        }
+                    }
+                }
+
+                // Lazy-init sws_hdr2rgb (HDR→SDR Stage 1) on first decoded frame.
+                if (convert_hdr_to_sdr && !sws_hdr2rgb) {
+                    int srcCs    = (dec_ctx->colorspace == AVCOL_SPC_BT2020_NCL ||
+                                    dec_ctx->colorspace == AVCOL_SPC_BT2020_CL)
+                                   ? SWS_CS_BT2020 : SWS_CS_ITU709;
+                    int srcRange = (dec_ctx->color_range == AVCOL_RANGE_JPEG) ? 1 : 0;
+                    sws_hdr2rgb = sws_getContext(
+                        dec_ctx->width, dec_ctx->height, (AVPixelFormat)sw_frame->format,
+                        base_w, base_h, AV_PIX_FMT_RGB48LE,
+                        SWS_BILINEAR, nullptr, nullptr, nullptr);
+                    if (sws_hdr2rgb) {
+                        sws_setColorspaceDetails(sws_hdr2rgb,
+                            sws_getCoefficients(srcCs),         srcRange,
+                            sws_getCoefficients(SWS_CS_ITU709), 1,
+                            0, 1 << 16, 1 << 16);
+                    } else {
+                        EngineLog("HDR→SDR sws_hdr2rgb init failed; falling back.\n");
+                        convert_hdr_to_sdr = setup.convert_hdr_to_sdr = false;
+                    }
+                }
+
+                // Route through subtitle filter graph if active, otherwise scale directly
+                AVFrame* src_frame = sw_frame;
+                AVFrame* filter_out = nullptr;
+                if (use_filter) {
+                    sw_frame->pts = in_pts; // filter needs original pts for subtitle timing
+
+                    // The subtitles filter only accepts planar YUV.  NVDEC gives NV12 (semi-planar),
+                    // so convert to YUV420P with a dedicated sws context before pushing to the filter.
+                    AVFrame* filt_input = sw_frame;
+                    if ((AVPixelFormat)sw_frame->format != AV_PIX_FMT_YUV420P) {
+                        if (!pre_filter_sws)
+                            pre_filter_sws = sws_getContext(
+                                sw_frame->width, sw_frame->height, (AVPixelFormat)sw_frame->format,
+                                sw_frame->width, sw_frame->height, AV_PIX_FMT_YUV420P,
+                                SWS_BILINEAR, nullptr, nullptr, nullptr);
+                        if (!pre_filter_frame) {
+                            pre_filter_frame = av_frame_alloc();
+                            if (pre_filter_frame) {
+                                pre_filter_frame->format = AV_PIX_FMT_YUV420P;
+                                pre_filter_frame->width  = sw_frame->width;
+                                pre_filter_frame->height = sw_frame->height;
+                                av_frame_get_buffer(pre_filter_frame, 32);
+                            }
+                        }
+                        if (pre_filter_sws && pre_filter_frame) {
+                            sws_scale(pre_filter_sws,
+                                (const uint8_t* const*)sw_frame->data, sw_frame->linesize,
+                                0, sw_frame->height,
+                                pre_filter_frame->data, pre_filter_frame->linesize);
+                            pre_filter_frame->pts = sw_frame->pts;
+                            filt_input = pre_filter_frame;
+                        }
+                    }
+
+                    if (av_buffersrc_add_frame_flags(buffersrc_ctx, filt_input, AV_BUFFERSRC_FLAG_KEEP_REF) >= 0) {
+                        filter_out = av_frame_alloc();
+                        int fret = filter_out ? av_buffersink_get_frame(buffersink_ctx, filter_out) : AVERROR(ENOMEM);
+                        if (fret < 0) { av_frame_free(&filter_out); filter_out = nullptr; }
+                        else { src_frame = filter_out; }
+                    }
+                }
+                // Lazy-init sws_ctx (non-HDR path) using the ACTUAL source frame format
+                // (post-filter).  Initialising from sw_frame before the filter ran could
+                // produce a format mismatch when NVDEC outputs NV12 but the filter graph
+                // was configured for YUV420P — causing incorrect chroma (green tint).
+                if (!sws_ctx) {
+                    sws_ctx = sws_getContext(
+                        src_frame->width, src_frame->height, (AVPixelFormat)src_frame->format,
+                        base_w,           base_h,            AV_PIX_FMT_YUV420P,
+                        SWS_BILINEAR, nullptr, nullptr, nullptr);
+                }
+                if (convert_hdr_to_sdr && sws_hdr2rgb && sws_rgb2yuv && hdr_rgb48_buf && hdr_bgr24_buf) {
+                    // Stage 1: native → RGB48LE
+                    int rgb48W     = base_w;
+                    int rgb48H     = base_h;
+                    int rgb48Stride = rgb48W * 6;
+                    uint8_t* r48data[8] = { hdr_rgb48_buf, nullptr };
+                    int      r48stride[8] = { rgb48Stride, 0 };
+                    sws_scale(sws_hdr2rgb, src_frame->data, src_frame->linesize, 0, src_frame->height,
+                        r48data, r48stride);
+                    // Stage 2: EOTF (LUT) + BT.2020→BT.709 matrix + Reinhard TM + sRGB (LUT),
+                    // the same SSE2 kernel the preview and thumbnails use.
+                    HdrRgb48ToBgr(hdr_rgb48_buf, rgb48Stride, hdr_bgr24_buf, rgb48W * 3,
+                                  rgb48W, rgb48H, tone_luts);
+                    // Stage 3: BGR24 → encoder YUV
+                    uint8_t* b24data[8]  = { hdr_bgr24_buf, nullptr };
+                    int      b24stride[8] = { rgb48W * 3, 0 };
+                    sws_scale(sws_rgb2yuv, (const uint8_t* const*)b24data, b24stride, 0, rgb48H,
+                        filt_frame->data, filt_frame->linesize);
+                } else {
+                    sws_scale(sws_ctx, src_frame->data, src_frame->linesize, 0, src_frame->height,
+                        filt_frame->data, filt_frame->linesize);
+                }
+                if (filter_out)      av_frame_free(&filter_out);
+                if (deint_out_frame) av_frame_free(&deint_out_frame);
+
+                // Alpha-blend PGS bitmap subtitle onto the shared YUV frame.
+                // Rects are already at its resolution with pre-converted YCbCr values,
+                // so this loop contains no float math or colour conversion.
+                if (use_bitmap_subs) {
+                    int64_t cur_ms = (int64_t)(in_time * 1000.0);
+                    const PgsEvent* active = nullptr;
+                    for (const auto& ev : pgs_events) {
+                        if (ev.pts_ms <= cur_ms) active = &ev;
+                        else break;
+                    }
+                    if (active && !active->rects.empty()) {
+                        for (const auto& rect : active->rects) {
+                            const uint8_t* yuva = rect.yuva.data();
+                            for (int dy = 0; dy < rect.h; dy++) {
+                                int fy = rect.y + dy;
+                                if (fy < 0 || fy >= base_h) continue;
+                                uint8_t* Yrow = filt_frame->data[0] + fy * filt_frame->linesize[0];
+                                for (int dx = 0; dx < rect.w; dx++) {
+                                    int fx = rect.x + dx;
+                                    if (fx < 0 || fx >= base_w) continue;
+                                    const uint8_t* px = yuva + ((size_t)dy * rect.w + dx) * 4;
+                                    uint8_t a = px[3];
+                                    if (a == 0) continue;
+                                    int inv_a = 255 - a;
+                                    Yrow[fx] = (uint8_t)((px[0] * a + Yrow[fx] * inv_a) >> 8);
+                                    if ((fx & 1) == 0 && (fy & 1) == 0) {
+                                        int cy = fy >> 1, cx = fx >> 1;
+                                        if (filt_frame->format == AV_PIX_FMT_YUV420P) {
+                                            uint8_t* Up = filt_frame->data[1] + cy * filt_frame->linesize[1] + cx;
+                                            uint8_t* Vp = filt_frame->data[2] + cy * filt_frame->linesize[2] + cx;
+                                            *Up = (uint8_t)((px[1] * a + *Up * inv_a) >> 8);
+                                            *Vp = (uint8_t)((px[2] * a + *Vp * inv_a) >> 8);
+                                        } else if (filt_frame->format == AV_PIX_FMT_NV12) {
+                                            uint8_t* UVp = filt_frame->data[1] + cy * filt_frame->linesize[1] + cx * 2;
+                                            UVp[0] = (uint8_t)((px[1] * a + UVp[0] * inv_a) >> 8);
+                                            UVp[1] = (uint8_t)((px[2] * a + UVp[1] * inv_a) >> 8);
+                                        }
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+
+                // Every output whose range holds this picture encodes it: the
+                // largest as is, the rest after their own downscale.
+                for (OutputTimeline& t : timelines) {
+                    const OutputSpan* sp = t.finished ? nullptr : SpanAt(t.spans, in_time);
+                    if (!sp) continue;
+                    if (!t.opened && !OpenTimeline(t, setup)) { av_frame_unref(frame); goto cleanup; }
+                    // Rebase video PTS onto the output's own timeline, then convert to encoder time_base
+                    int64_t rel_vid_pts = in_pts - sp->start_pts;
+                    if (rel_vid_pts < 0) rel_vid_pts = 0;
+                    for (OutputBranch& b : t.branches) {
+                        AVFrame* enc_frame = filt_frame;
+                        if (b.sws_ctx) {
+                            sws_scale(b.sws_ctx, filt_frame->data, filt_frame->linesize, 0, filt_frame->height,
+                                b.frame->data, b.frame->linesize);
+                            enc_frame = b.frame;
+                        }
+                        enc_frame->pts = av_rescale_q(rel_vid_pts + sp->offset_pts, video_in_stream->time_base, b.enc_ctx->time_base);
+                        if (avcodec_send_frame(b.enc_ctx, enc_frame) < 0) { EngineLog("Error sending frame to video encoder.\n"); continue; }
+                        WriteEncodedPackets(b.enc_ctx, b.video_stream, b.fmt_ctx, enc_pkt);
+                        b.frames++;
+                    }
+                }
+                frames_encoded++;
+                av_frame_unref(frame);
+            }
+        }
+
+        else if (audio_in_stream && pkt->stream_index == audioStreamIndex && aDec_ctx) {
+            AVRational in_tb = audio_in_stream->time_base;
+            int64_t aud_in_pts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts
+                                : (pkt->dts != AV_NOPTS_VALUE) ? pkt->dts : aud_stream_start;
+            double aud_time = (aud_in_pts - aud_stream_start) * av_q2d(in_tb);
+            // Only audio some output's range holds is decoded.  A backward
+            // seek can land inside a span already passed; what a timeline has
+            // taken once is not taken again, since its audio clock only counts
+            // samples and would drift from the video by the repeat.
+            auto takes = [&](const OutputTimeline& t) {
+                return !t.finished && aud_time > t.aout_time && SpanAt(t.spans, aud_time);
+            };
+            bool wanted = false;
+            for (OutputTimeline& t : timelines) {
+                if (!takes(t)) continue;
+                if (!t.opened && !OpenTimeline(t, setup)) { av_packet_unref(pkt); goto cleanup; }
+                wanted = true;
+            }
+            if (!wanted) { av_packet_unref(pkt); continue; }
+
+            if (avcodec_send_packet(aDec_ctx, pkt) >= 0) {
+                while (avcodec_receive_frame(aDec_ctx, aFrame) == 0) {
+                    for (OutputTimeline& t : timelines)
+                        if (takes(t)) EncodeAudio(t, aFrame, aEncPkt, aMuxPkt);
+                    av_frame_unref(aFrame);
+                }
+            }
+            for (OutputTimeline& t : timelines)
+                if (takes(t)) t.aout_time = aud_time;
+        }
+
+        av_packet_unref(pkt);
+    }
+
+flush_encoder:
+    // Whatever the pass has not finished yet ends here.
+    success = outputs_ok;
+    for (OutputTimeline& t : timelines)
+        if (!t.finished && !FinishTimeline(t, enc_pkt, aEncPkt, aMuxPkt)) success = false;
+
+
+
+cleanup:
+    if (ext_sub_tmp[0]) DeleteFileUtf8(ext_sub_tmp);
+    if (pre_filter_frame) av_frame_free(&pre_filter_frame);
+    if (pre_filter_sws)   sws_freeContext(pre_filter_sws);
+    if (trans_bsf_pkt) av_packet_free(&trans_bsf_pkt);
+    if (trans_bsf_ctx) av_bsf_free(&trans_bsf_ctx);
+    if (deint_graph)  avfilter_graph_free(&deint_graph);
+    if (filter_graph) avfilter_graph_free(&filter_graph);
+    if (sws_ctx) sws_freeContext(sws_ctx);
+    if (sws_hdr2rgb) sws_freeContext(sws_hdr2rgb);
+    if (sws_rgb2yuv) sws_freeContext(sws_rgb2yuv);
+    if (hdr_rgb48_buf) av_free(hdr_rgb48_buf);
+    if (hdr_bgr24_buf) av_free(hdr_bgr24_buf);
+    if (cpu_frame) av_frame_free(&cpu_frame);
+    if (frame) av_frame_free(&frame);
+    if (filt_frame) av_frame_free(&filt_frame);
+    if (pkt) av_packet_free(&pkt);
+    if (enc_pkt) av_packet_free(&enc_pkt);
+    if (dec_ctx)  avcodec_free_context(&dec_ctx);
+    if (aDec_ctx) avcodec_free_context(&aDec_ctx);
+    if (aFrame)    av_frame_free(&aFrame);
+    if (aEncPkt)   av_packet_free(&aEncPkt);
+    if (aMuxPkt)   av_packet_free(&aMuxPkt);
+    InputIoStats read_io;
+    CloseInput(&in_fmt_ctx, &read_io);
+    stats_.frames        = frames_encoded;
+    stats_.output_bytes  = 0;
+    stats_.video_bitrate = 0;
+    stats_.duration      = 0.0;
+    stats_.elapsed       = (QpcNow() - t_start) / (double)QpcFreq();
+    stats_.hw_decode     = using_hw;
+    stats_.hdr_to_sdr    = convert_hdr_to_sdr;
+    stats_.subtitles     = use_filter || use_bitmap_subs;
+    stats_.cancelled     = cancelled;
+    stats_.read_mb_per_s = read_io.read_seconds > 0.0 ? read_io.bytes / (1024.0 * 1024.0) / read_io.read_seconds : 0.0;
+    stats_.read_stalls   = read_io.stalls;
+    stats_.read_stall_ms = read_io.stall_seconds * 1000.0;
+    StringCchCopyA(stats_.decoder, sizeof(stats_.decoder), video_decoder ? video_decoder->name : "");
+    StringCchCopyA(stats_.encoder, sizeof(stats_.encoder), video_encoder ? video_encoder->name : "");
+    // Closed first: the writer stats are only final once the queue is drained.
+    for (OutputTimeline& t : timelines) {
+        if (!CloseTimeline(t)) success = false;
+        // A cancelled encode leaves no half-written file behind.  Clips a
+        // split export already finished are kept, and one it never reached
+        // was never created (a file already at that path is not ours).
+        if (cancelled && t.opened && !t.finished)
+            for (const OutputBranch& b : t.branches) DeleteFileUtf8(b.path.c_str());
+    }
+    // The outputs share the pass; only their frames, size, bitrate and writes differ.
+    renditionStats_.assign(split_ranges ? 0 : params_.renditions.size(), stats_);
+    rangeStats_.clear();
+    if (split_ranges) {
+        // Stats() totals the ranges; the bitrate is their duration-weighted mean.
+        double bits = 0.0;
+        OutputIoStats io;
+        for (const OutputTimeline& t : timelines) {
+            const OutputBranch& b = t.branches[0];
+            rangeStats_.push_back(BranchStats(stats_, b, t.duration));
+            stats_.output_bytes += b.bytes;
+            stats_.duration     += t.duration;
+            bits                += b.bitrate * t.duration;
+            io.bytes            += b.io.bytes;
+            io.write_seconds    += b.io.write_seconds;
+            io.blocked_seconds  += b.io.blocked_seconds;
+            io.blocked          += b.io.blocked;
+            io.peak_depth        = max(io.peak_depth, b.io.peak_depth);
+        }
+        if (stats_.duration > 0.0) stats_.video_bitrate = (int64_t)(bits / stats_.duration);
+        SetWriteStats(stats_, io);
+    } else if (!timelines.empty()) {
+        const std::vector<OutputBranch>& branches = timelines[0].branches;
+        for (size_t i = 1; i < branches.size(); i++)
+            renditionStats_[i - 1] = BranchStats(stats_, branches[i], timelines[0].duration);
+        stats_ = BranchStats(stats_, branches[0], timelines[0].duration);
+    }
+    return success;
+}
+
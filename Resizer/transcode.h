@@ -0,0 +1,131 @@
+﻿// transcode.h
+// Size-targeted H.264/AAC MP4 transcode, shared by the window and resizer-cli.
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+// How the MP4 index (moov) is placed.  Faststart moves it to the front after
+// encoding by rewriting the whole file; the other two never reread the output.
+enum Mp4Layout {
+    MP4_FASTSTART,       // moov written last, then the file is rewritten with it up front
+    MP4_RESERVE_MOOV,    // space for moov reserved after ftyp from an up-front estimate
+    MP4_FRAGMENTED,      // empty moov + one moof/mdat fragment per GOP
+};
+
+// Called from the encoding thread with the fraction of the range done (0..1).
+// Returning false cancels, as TranscodeSession::Cancel does.
+typedef bool (*TranscodeProgressFn)(void* opaque, double fraction);
+
+// A further output encoded in the same pass as TranscodeParams::out_path.
+// Decoding, deinterlacing, tone mapping and subtitle burn-in are shared;
+// only the downscale and the encode are its own.
+struct TranscodeRendition {
+    std::string out_path;
+    double      target_size_mb = 0.0;
+    int         scale_factor   = 1;          // 1, 2 or 4
+};
+
+// A stretch of the source to export.  Joined, the ranges are sorted, merged
+// where they overlap and concatenated into out_path under its one size
+// target; split, each is its own file with its own.
+struct TranscodeRange {
+    double      start_seconds  = 0.0, end_seconds = 0.0;
+    std::string out_path;                    // split only
+    double      target_size_mb = 0.0;        // split only
+};
+
+// Everything one encode needs; copied into the session, so the caller's
+// strings need not outlive Start.
+struct TranscodeParams {
+    std::string in_path;
+    std::string out_path;
+    std::string ext_subtitle_path;           // .srt/.ass/.ssa to burn in; empty = none
+    double      target_size_mb      = 0.0;
+    int         scale_factor        = 1;
+    int         orig_w              = 0, orig_h = 0;
+    double      start_seconds       = 0.0, end_seconds = 0.0;
+    int         audio_stream_index  = -1;    // -1 = first audio stream
+    int         subtitle_stream_index = -1;  // -1 = none
+    bool        convert_hdr_to_sdr  = false;
+    int         mp4_layout          = MP4_RESERVE_MOOV;
+    bool        unbuffered_output   = false;
+    int         threads             = 0;     // codec threads; 0 = the codecs' own default (all cores)
+    bool        software_encode     = false; // libx264 even if h264_nvenc is available
+    std::vector<TranscodeRendition> renditions;  // more outputs from the same decode; usually none
+    std::vector<TranscodeRange> ranges;      // replaces start/end_seconds when not empty
+    bool        split_ranges        = false; // one file per range (renditions are then ignored)
+    TranscodeProgressFn progress    = nullptr;  // optional, on top of Progress()
+    void*       progress_opaque     = nullptr;
+};
+
+// Filled in when the encode finishes, whether or not it succeeded.
+struct TranscodeStats {
+    int64_t frames        = 0;      // video frames sent to the encoder
+    int64_t output_bytes  = 0;      // size of the finished file; 0 on failure
+    int64_t video_bitrate = 0;      // target video bitrate, bits/s
+    double  duration      = 0.0;    // length of the encoded range, seconds
+    double  elapsed       = 0.0;    // wall time, seconds
+    bool    hw_decode     = false;  // decoded with NVDEC
+    bool    hdr_to_sdr    = false;  // tone mapping actually applied
+    bool    subtitles     = false;  // subtitles burned in
+    bool    cancelled     = false;  // stopped by Cancel or the progress callback
+    double  write_mb_per_s   = 0.0; // output bytes over time inside the write calls; 0 for faststart
+    int64_t write_blocked    = 0;   // times the encoder found the write queue full
+    double  write_blocked_ms = 0.0; // ... and how long it waited on it
+    int     write_peak_queue = 0;   // deepest the write queue got, in 4 MB blocks (of 8)
+    double  read_mb_per_s    = 0.0; // input bytes over time inside the read calls; 0 without read-ahead
+    int64_t read_stalls      = 0;   // times the demuxer waited for a block not yet read
+    double  read_stall_ms    = 0.0; // ... and how long it waited in all
+    char    decoder[32]   = {};
+    char    encoder[32]   = {};
+};
+
+// One encode and all of its state.  Sessions share nothing mutable (the
+// tone-mapping tables they read are immutable), so any number can run at
+// once; how many is the caller's call, by cores.  A cancelled encode stops
+// at the next frame and deletes its partial output.
+class TranscodeSession {
+public:
+    // Called on the encoding thread when Start's encode finishes.
+    typedef void (*DoneFn)(void* opaque, TranscodeSession* session);
+
+    explicit TranscodeSession(const TranscodeParams& params);
+    ~TranscodeSession();                 // cancels and waits for a running encode
+
+    bool Run();                          // encodes on the calling thread
+    bool Start(DoneFn done = nullptr, void* opaque = nullptr);  // encodes on a new thread
+    void Wait();
+
+    void   Cancel()            { cancel_ = true; }
+    bool   Running()   const   { return running_; }
+    double Progress()  const   { return progress_; }   // 0..1; 1 once succeeded
+    bool   Succeeded() const   { return succeeded_; }
+    const TranscodeParams& Params() const { return params_; }
+    const TranscodeStats&  Stats()  const { return stats_; }   // once finished
+    // One per params.renditions, once finished.
+    const std::vector<TranscodeStats>& RenditionStats() const { return renditionStats_; }
+    // One per params.ranges when split, once finished; Stats() then totals them.
+    const std::vector<TranscodeStats>& RangeStats() const { return rangeStats_; }
+
+private:
+    TranscodeSession(const TranscodeSession&) = delete;
+    TranscodeSession& operator=(const TranscodeSession&) = delete;
+
+    bool Execute();
+    bool ReportProgress(double fraction);
+
+    TranscodeParams     params_;
+    TranscodeStats      stats_;
+    std::vector<TranscodeStats> renditionStats_;
+    std::vector<TranscodeStats> rangeStats_;
+    std::atomic<double> progress_{0.0};
+    std::atomic<bool>   cancel_{false};
+    std::atomic<bool>   running_{false};
+    std::atomic<bool>   succeeded_{false};
+    std::thread         thread_;
+};
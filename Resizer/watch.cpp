@@ -0,0 +1,414 @@
+﻿// watch.cpp
+// FolderWatcher: the change notifications, the size-stability check and the
+// hand-off to the EncodeQueue.  Notifications only say "look at this name";
+// whether a file is finished is decided by polling its size once a second,
+// since neither inotify's IN_CLOSE_WRITE nor ReadDirectoryChangesW can tell
+// a copy that has finished from one that paused (SMB writers in particular).
+
+#include "watch.h"
+#include "platform.h"
+#include "media.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#ifdef _WIN32
+static const char kSep = '\\';
+#else
+static const char kSep = '/';
+#endif
+
+// ------------------------------ Files ------------------------------
+static std::string JoinPath(const std::string& dir, const std::string& name) {
+    if (dir.empty() || dir.back() == '/' || dir.back() == '\\') return dir + name;
+    return dir + kSep + name;
+}
+
+// Size and modification time; false if the path is gone.
+static bool FileStat(const std::string& path, int64_t& size, int64_t& mtime, bool& isDir) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA fa;
+    if (!GetFileAttributesExW(Utf8ToWide(path.c_str()).c_str(), GetFileExInfoStandard, &fa)) return false;
+    size  = ((int64_t)fa.nFileSizeHigh << 32) | fa.nFileSizeLow;
+    mtime = ((int64_t)fa.ftLastWriteTime.dwHighDateTime << 32) | fa.ftLastWriteTime.dwLowDateTime;
+    isDir = (fa.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    size  = st.st_size;
+    mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    isDir = S_ISDIR(st.st_mode);
+#endif
+    return true;
+}
+
+// When the file arrived here: its write time, or its creation time if later,
+// since a copy keeps the source's write time.  Not the POSIX status-change
+// time: a chmod or chown on the input would make it look newly arrived.
+// Filesystems without a birth time fall back to the write time alone.  0 if
+// the path is gone.
+static int64_t ArrivalTime(const std::string& path) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA fa;
+    if (!GetFileAttributesExW(Utf8ToWide(path.c_str()).c_str(), GetFileExInfoStandard, &fa)) return 0;
+    int64_t created = ((int64_t)fa.ftCreationTime.dwHighDateTime << 32) | fa.ftCreationTime.dwLowDateTime;
+    int64_t written = ((int64_t)fa.ftLastWriteTime.dwHighDateTime << 32) | fa.ftLastWriteTime.dwLowDateTime;
+    return max(created, written);
+#else
+    struct statx stx;
+    if (statx(AT_FDCWD, path.c_str(), 0, STATX_MTIME | STATX_BTIME, &stx) != 0) return 0;
+    int64_t written = (int64_t)stx.stx_mtime.tv_sec * 1000000000 + stx.stx_mtime.tv_nsec;
+    if (!(stx.stx_mask & STATX_BTIME)) return written;
+    return max((int64_t)stx.stx_btime.tv_sec * 1000000000 + stx.stx_btime.tv_nsec, written);
+#endif
+}
+
+static bool FileExists(const std::string& path) {
+    int64_t size, mtime; bool isDir;
+    return FileStat(path, size, mtime, isDir);
+}
+
+// Windows can say outright whether a writer still has the file open: opening
+// it while refusing to share write access fails.  POSIX has no such check;
+// there the stability window does all the work.
+static bool OpenForWriting(const std::string& path) {
+#ifdef _WIN32
+    HANDLE h = CreateFileW(Utf8ToWide(path.c_str()).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (h == INVALID_HANDLE_VALUE) return GetLastError() == ERROR_SHARING_VIOLATION;
+    CloseHandle(h);
+#else
+    (void)path;
+#endif
+    return false;
+}
+
+template <class Fn>
+static void ForEachName(const std::string& dir, Fn fn) {
+#ifdef _WIN32
+    WIN32_FIND_DATAW fd;
+    HANDLE h = FindFirstFileW(Utf8ToWide(JoinPath(dir, "*").c_str()).c_str(), &fd);
+    if (h == INVALID_HANDLE_VALUE) return;
+    do {
+        if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) fn(WideToUtf8(fd.cFileName));
+    } while (FindNextFileW(h, &fd));
+    FindClose(h);
+#else
+    DIR* d = opendir(dir.c_str());
+    if (!d) return;
+    while (const dirent* e = readdir(d))
+        if (e->d_name[0] != '.') fn(std::string(e->d_name));
+    closedir(d);
+#endif
+}
+
+// ------------------------------ Names ------------------------------
+static bool GlobMatch(const char* pat, const char* s) {
+    for (; *pat; pat++, s++) {
+        if (*pat == '*') {
+            for (pat++; *s; s++)
+                if (GlobMatch(pat, s)) return true;
+            return GlobMatch(pat, s);
+        }
+        if (!*s || (*pat != '?' && tolower((unsigned char)*pat) != tolower((unsigned char)*s))) return false;
+    }
+    return !*s;
+}
+
+static bool EndsWithNoCase(const std::string& s, const char* tail) {
+    size_t n = strlen(tail);
+    if (s.size() < n) return false;
+    for (size_t i = 0; i < n; i++)
+        if (tolower((unsigned char)s[s.size() - n + i]) != tolower((unsigned char)tail[i])) return false;
+    return true;
+}
+
+// Hidden files and the partial files copy tools and browsers write before
+// renaming into place.
+static bool IsTemporaryName(const std::string& name) {
+    return name.empty() || name[0] == '.' || name[0] == '~' ||
+           EndsWithNoCase(name, ".tmp") || EndsWithNoCase(name, ".part") ||
+           EndsWithNoCase(name, ".partial") || EndsWithNoCase(name, ".crdownload");
+}
+
+// ------------------------------ Watcher ------------------------------
+FolderWatcher::FolderWatcher(EncodeQueue& queue, const char* dir, const std::vector<WatchRule>& rules)
+    : queue_(queue), dir_(dir ? dir : ""), rules_(rules) {
+    while (dir_.size() > 1 && (dir_.back() == '/' || dir_.back() == '\\')) dir_.pop_back();
+}
+
+FolderWatcher::~FolderWatcher() {
+    Stop();
+}
+
+bool FolderWatcher::Start(bool includeExisting) {
+    int64_t size, mtime; bool isDir = false;
+    if (thread_.joinable() || rules_.empty()) return false;
+    if (!FileStat(dir_, size, mtime, isDir) || !isDir) return false;
+
+#ifdef _WIN32
+    HANDLE h = CreateFileW(Utf8ToWide(dir_.c_str()).c_str(), FILE_LIST_DIRECTORY,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                           OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+    if (h == INVALID_HANDLE_VALUE) return false;
+    dirHandle_ = h;
+    wake_      = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+#else
+    inotify_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_ < 0) return false;
+    // IN_MODIFY restarts the stability clock while a copy is still growing;
+    // IN_CLOSE_WRITE and IN_MOVED_TO catch writers that rename into place.
+    if (inotify_add_watch(inotify_, dir_.c_str(),
+                          IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ||
+        pipe(wake_) != 0) {
+        close(inotify_);
+        inotify_ = -1;
+        return false;
+    }
+#endif
+
+    // What is already there is either queued with the rest or remembered as
+    // seen, so a later rescan doesn't pick it up.
+    if (includeExisting) {
+        ScanFolder();
+    } else {
+        ForEachName(dir_, [this](const std::string& name) {
+            int64_t s, t; bool d;
+            if (FileStat(JoinPath(dir_, name), s, t, d)) handled_[name] = t;
+        });
+    }
+
+    stop_   = false;
+    thread_ = std::thread(&FolderWatcher::Run, this);
+    return true;
+}
+
+void FolderWatcher::Stop() {
+    if (thread_.joinable()) {
+        stop_ = true;
+#ifdef _WIN32
+        SetEvent((HANDLE)wake_);
+#else
+        char c = 0;
+        if (write(wake_[1], &c, 1) < 0) {}   // the 1 s poll timeout catches it regardless
+#endif
+        thread_.join();
+    }
+#ifdef _WIN32
+    if (dirHandle_) { CloseHandle((HANDLE)dirHandle_); dirHandle_ = nullptr; }
+    if (wake_)      { CloseHandle((HANDLE)wake_);      wake_      = nullptr; }
+#else
+    if (inotify_ >= 0) { close(inotify_); inotify_ = -1; }
+    for (int& fd : wake_)
+        if (fd >= 0) { close(fd); fd = -1; }
+#endif
+}
+
+// Waits for change notifications with a 1 s timeout, so pending files are
+// re-checked even when the folder is quiet.
+void FolderWatcher::Run() {
+#ifdef _WIN32
+    alignas(DWORD) char buf[32768];
+    OVERLAPPED ov = {};
+    ov.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    bool armed = false;
+    while (!stop_) {
+        if (!armed) {
+            ResetEvent(ov.hEvent);
+            armed = ReadDirectoryChangesW((HANDLE)dirHandle_, buf, sizeof(buf), FALSE,
+                                          FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE |
+                                          FILE_NOTIFY_CHANGE_LAST_WRITE, nullptr, &ov, nullptr) != 0;
+        }
+        HANDLE waits[2] = { ov.hEvent, (HANDLE)wake_ };
+        DWORD  w = armed ? WaitForMultipleObjects(2, waits, FALSE, 1000)
+                         : WaitForSingleObject((HANDLE)wake_, 1000);
+        if (stop_) break;
+        if (!armed) {
+            ScanFolder();                       // no notifications: poll the folder instead
+        } else if (w == WAIT_OBJECT_0) {
+            armed = false;
+            DWORD bytes = 0;
+            if (GetOverlappedResult((HANDLE)dirHandle_, &ov, &bytes, FALSE) && bytes) {
+                for (const char* p = buf;;) {
+                    const FILE_NOTIFY_INFORMATION* fi = (const FILE_NOTIFY_INFORMATION*)p;
+                    if (fi->Action == FILE_ACTION_ADDED || fi->Action == FILE_ACTION_MODIFIED ||
+                        fi->Action == FILE_ACTION_RENAMED_NEW_NAME) {
+                        std::string name = WideToUtf8(fi->FileName,
+                                                      (int)(fi->FileNameLength / sizeof(WCHAR)));
+                        if (!name.empty()) Touch(name);
+                    }
+                    if (!fi->NextEntryOffset) break;
+                    p += fi->NextEntryOffset;
+                }
+            } else {
+                ScanFolder();                   // buffer overflowed and the changes were dropped
+            }
+        }
+        CheckPending();
+    }
+    if (armed) {
+        DWORD bytes;
+        CancelIoEx((HANDLE)dirHandle_, &ov);
+        GetOverlappedResult((HANDLE)dirHandle_, &ov, &bytes, TRUE);
+    }
+    CloseHandle(ov.hEvent);
+#else
+    alignas(inotify_event) char buf[16384];
+    while (!stop_) {
+        pollfd fds[2] = { { inotify_, POLLIN, 0 }, { wake_[0], POLLIN, 0 } };
+        int n = poll(fds, 2, 1000);
+        if (stop_) break;
+        if (n > 0 && (fds[0].revents & POLLIN)) {
+            ssize_t len;
+            while ((len = read(inotify_, buf, sizeof(buf))) > 0) {
+                for (const char* p = buf; p < buf + len;) {
+                    const inotify_event* ev = (const inotify_event*)p;
+                    if (ev->mask & IN_Q_OVERFLOW)                    ScanFolder();
+                    else if (ev->len && !(ev->mask & IN_ISDIR))      Touch(ev->name);
+                    p += sizeof(inotify_event) + ev->len;
+                }
+            }
+        }
+        CheckPending();
+    }
+#endif
+}
+
+void FolderWatcher::ScanFolder() {
+    ForEachName(dir_, [this](const std::string& name) { Touch(name); });
+}
+
+void FolderWatcher::Touch(const std::string& name) {
+    if (IsTemporaryName(name) || IsOutputName(name) || !RuleFor(name)) return;
+    pending_.emplace(name, Pending());
+}
+
+// A file is taken once it has been non-empty with the same size and mtime
+// for stableSecs_ and no writer holds it open.  A name that was queued (or
+// rejected) before comes round again only if it was rewritten since.
+void FolderWatcher::CheckPending() {
+    int64_t now    = QpcNow();
+    int64_t window = (int64_t)(stableSecs_ * QpcFreq());
+    for (auto it = pending_.begin(); it != pending_.end();) {
+        std::string path = JoinPath(dir_, it->first);
+        int64_t size, mtime; bool isDir;
+        if (!FileStat(path, size, mtime, isDir) || isDir) { it = pending_.erase(it); continue; }
+
+        Pending& p = it->second;
+        if (size != p.size || mtime != p.mtime) {
+            p.size     = size;
+            p.mtime    = mtime;
+            p.stableAt = now;
+            ++it;
+            continue;
+        }
+        if (size == 0 || now - p.stableAt < window || OpenForWriting(path)) { ++it; continue; }
+
+        auto seen = handled_.find(it->first);
+        if (seen == handled_.end() || seen->second != mtime) Ingest(it->first, size, mtime);
+        it = pending_.erase(it);
+    }
+}
+
+void FolderWatcher::Ingest(const std::string& name, int64_t size, int64_t mtime) {
+    handled_[name] = mtime;
+    std::string path = JoinPath(dir_, name);
+    const WatchRule* rule = RuleFor(name);
+    if (!rule || queue_.HasInput(path.c_str())) return;
+
+    char msg[MAX_PATH + 96];
+    MediaInfo mi;
+    if (!ProbeMedia(path.c_str(), mi) || mi.duration <= 0.0) {
+        StringCchPrintfA(msg, sizeof(msg), "Watch: skipping %s (not a readable video)\n", path.c_str());
+        EngineLog(msg);
+        return;
+    }
+    if (EncodedBefore(*rule, name, mi.duration)) {
+        StringCchPrintfA(msg, sizeof(msg), "Watch: skipping %s (already encoded)\n", path.c_str());
+        EngineLog(msg);
+        return;
+    }
+
+    TranscodeParams tp;
+    tp.in_path            = path;
+    tp.out_path           = OutputPathFor(*rule, name);
+    tp.target_size_mb     = rule->target_size_mb;
+    tp.scale_factor       = rule->scale_factor;
+    tp.orig_w             = mi.width;
+    tp.orig_h             = mi.height;
+    tp.start_seconds      = 0.0;
+    tp.end_seconds        = mi.duration;
+    tp.convert_hdr_to_sdr = rule->convert_hdr_to_sdr && mi.isHdr;
+    tp.mp4_layout         = rule->mp4_layout;
+    outputs_.insert(tp.out_path);
+    int id = queue_.Add(tp, rule->priority);
+
+    StringCchPrintfA(msg, sizeof(msg), "Watch: queued %s (%.1f MB) as job %d\n",
+                     path.c_str(), size / (1024.0 * 1024.0), id);
+    EngineLog(msg);
+    if (queuedFn_) queuedFn_(queuedOpaque_, tp.in_path.c_str(), tp.out_path.c_str(), id);
+}
+
+const WatchRule* FolderWatcher::RuleFor(const std::string& name) const {
+    for (const WatchRule& r : rules_)
+        if (GlobMatch(r.match.c_str(), name.c_str())) return &r;
+    return nullptr;
+}
+
+// Outputs written into the watched folder itself must not be fed back in:
+// <name>_<suffix>.mp4 and <name>_<suffix>-N.mp4 for every rule.
+bool FolderWatcher::IsOutputName(const std::string& name) const {
+    if (outputs_.count(JoinPath(dir_, name))) return true;
+    for (const WatchRule& r : rules_) {
+        std::string tail = "_" + r.suffix;
+        if (EndsWithNoCase(name, (tail + ".mp4").c_str())) return true;
+        std::string pat = "*" + tail + "-*.mp4";
+        if (GlobMatch(pat.c_str(), name.c_str())) return true;
+    }
+    return false;
+}
+
+// <out_dir><name>_<suffix>, to which OutputPathFor adds [-N].mp4.
+std::string FolderWatcher::OutputStemFor(const WatchRule& rule, const std::string& name) const {
+    size_t dot = name.find_last_of('.');
+    std::string base = (dot != std::string::npos && dot > 0) ? name.substr(0, dot) : name;
+    return JoinPath(rule.out_dir.empty() ? dir_ : rule.out_dir, base + "_" + rule.suffix);
+}
+
+// handled_ is forgotten on restart, and with includeExisting the whole folder
+// comes round again.  An input with an output written after it arrived was
+// encoded by an earlier run, provided that output is finished: a failed or
+// killed encode leaves a file too, with no moov (faststart, reserved moov) or
+// only the fragments written so far, so the output must probe and cover the
+// input's duration to within a second.
+bool FolderWatcher::EncodedBefore(const WatchRule& rule, const std::string& name, double duration) const {
+    int64_t arrived = ArrivalTime(JoinPath(dir_, name));
+    std::string stem = OutputStemFor(rule, name);
+    std::string candidate = stem + ".mp4";
+    int64_t size, outMtime; bool isDir;
+    for (int i = 1; FileStat(candidate, size, outMtime, isDir); i++) {
+        MediaInfo out;
+        if (!isDir && size > 0 && outMtime >= arrived &&
+            ProbeMedia(candidate.c_str(), out) && out.duration >= duration - 1.0)
+            return true;
+        candidate = stem + "-" + std::to_string(i) + ".mp4";
+    }
+    return false;
+}
+
+// <out_dir><name>_<suffix>.mp4, or -N if that exists or is already spoken for.
+std::string FolderWatcher::OutputPathFor(const WatchRule& rule, const std::string& name) const {
+    std::string stem = OutputStemFor(rule, name);
+    std::string candidate = stem + ".mp4";
+    for (int i = 1; FileExists(candidate) || outputs_.count(candidate) || queue_.HasOutput(candidate.c_str()); i++)
+        candidate = stem + "-" + std::to_string(i) + ".mp4";
+    return candidate;
+}
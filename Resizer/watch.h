@@ -0,0 +1,93 @@
+﻿// watch.h
+// Watch-folder ingestion: files that land in a folder are matched against
+// preset rules and handed to an EncodeQueue, which bounds how many encode at
+// once.  New files are noticed with inotify (Linux) or ReadDirectoryChangesW
+// (Windows); a file is only queued once its size and modification time have
+// held still for a while (and, on Windows, nothing has it open for writing),
+// so a recording that is still being copied in is left alone.
+
+#pragma once
+
+#include "queue.h"
+
+#include <atomic>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A preset.  The first rule whose glob matches the file name is used;
+// files no rule matches are ignored.
+struct WatchRule {
+    std::string match              = "*";        // file-name glob (* and ?), case-insensitive
+    double      target_size_mb     = 0.0;
+    int         scale_factor       = 1;          // 1, 2 or 4
+    std::string suffix             = "RESIZED";  // <name>_<suffix>[-N].mp4
+    std::string out_dir;                         // empty = the watched folder
+    bool        convert_hdr_to_sdr = false;      // HDR inputs only
+    int         mp4_layout         = MP4_RESERVE_MOOV;
+    int         priority           = 0;
+};
+
+class FolderWatcher {
+public:
+    // Called on the watcher's thread for every file it queues.
+    typedef void (*QueuedFn)(void* opaque, const char* input, const char* output, int jobId);
+
+    // The queue must outlive the watcher.
+    FolderWatcher(EncodeQueue& queue, const char* dir, const std::vector<WatchRule>& rules);
+    ~FolderWatcher();                    // Stop()
+
+    void SetStableSeconds(double s) { stableSecs_ = s; }    // before Start; default 5
+    void SetQueuedCallback(QueuedFn fn, void* opaque) { queuedFn_ = fn; queuedOpaque_ = opaque; }
+
+    // includeExisting also queues what is in the folder already (outputs
+    // aside).  False if the folder can't be watched.
+    bool Start(bool includeExisting);
+    void Stop();
+
+private:
+    // A file seen changing, waiting for its size to settle.
+    struct Pending {
+        int64_t size     = -1;
+        int64_t mtime    = 0;
+        int64_t stableAt = 0;            // QpcNow() when size/mtime last changed
+    };
+
+    FolderWatcher(const FolderWatcher&) = delete;
+    FolderWatcher& operator=(const FolderWatcher&) = delete;
+
+    void Run();
+    void ScanFolder();
+    void Touch(const std::string& name);
+    void CheckPending();
+    void Ingest(const std::string& name, int64_t size, int64_t mtime);
+    const WatchRule* RuleFor(const std::string& name) const;
+    bool IsOutputName(const std::string& name) const;
+    bool EncodedBefore(const WatchRule& rule, const std::string& name, double duration) const;
+    std::string OutputStemFor(const WatchRule& rule, const std::string& name) const;
+    std::string OutputPathFor(const WatchRule& rule, const std::string& name) const;
+
+    EncodeQueue&                        queue_;
+    std::string                         dir_;
+    std::vector<WatchRule>              rules_;
+    double                              stableSecs_   = 5.0;
+    QueuedFn                            queuedFn_     = nullptr;
+    void*                               queuedOpaque_ = nullptr;
+
+    // Watcher-thread state.
+    std::map<std::string, Pending>      pending_;
+    std::map<std::string, int64_t>      handled_;    // name -> mtime when queued or rejected (this run)
+    std::set<std::string>               outputs_;    // paths this watcher will write
+
+    std::thread                         thread_;
+    std::atomic<bool>                   stop_{ false };
+#ifdef _WIN32
+    void*                               dirHandle_ = nullptr;   // overlapped directory handle
+    void*                               wake_      = nullptr;   // event Stop() signals
+#else
+    int                                 inotify_   = -1;
+    int                                 wake_[2]   = { -1, -1 };  // pipe Stop() writes to
+#endif
+};